@@ -0,0 +1,426 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "analyze.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_probe.h"
+#include "elf_traits.h"
+#include "file_util.h"
+#include "packer.h"
+#include "relr_stub.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+bool ReadAt(int fd, uint64_t offset, size_t size, void* out) {
+  uint8_t* cursor = static_cast<uint8_t*>(out);
+  while (size > 0) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(pread(fd, cursor, size, offset));
+    if (bytes <= 0)
+      return false;
+    cursor += bytes;
+    offset += bytes;
+    size -= bytes;
+  }
+  return true;
+}
+
+// Reads words at link-time addresses through the PT_LOAD segments, keeping
+// a window of the file so that ascending addresses cost few reads.
+template <typename ELF>
+class WordReader {
+ public:
+  explicit WordReader(int fd) : fd_(fd), window_offset_(0) {}
+
+  bool Init() {
+    typename ELF::Ehdr elf_header;
+    if (!ReadAt(fd_, 0, sizeof(elf_header), &elf_header))
+      return false;
+    if (elf_header.e_phentsize != sizeof(typename ELF::Phdr))
+      return true;
+    std::vector<typename ELF::Phdr> program_headers(elf_header.e_phnum);
+    if (!program_headers.empty() &&
+        !ReadAt(fd_, elf_header.e_phoff,
+                program_headers.size() * sizeof(program_headers[0]),
+                &program_headers[0])) {
+      return false;
+    }
+    for (size_t i = 0; i < program_headers.size(); ++i) {
+      if (program_headers[i].p_type == PT_LOAD)
+        loads_.push_back(program_headers[i]);
+    }
+    return true;
+  }
+
+  // Word at |vaddr|, or zero if it is not backed by the file.
+  typename ELF::Addr Read(typename ELF::Addr vaddr) {
+    static const size_t kWindowSize = 64 * 1024;
+    for (size_t i = 0; i < loads_.size(); ++i) {
+      const typename ELF::Phdr& load = loads_[i];
+      if (vaddr < load.p_vaddr ||
+          vaddr + sizeof(typename ELF::Addr) > load.p_vaddr + load.p_filesz) {
+        continue;
+      }
+      const uint64_t offset = load.p_offset + (vaddr - load.p_vaddr);
+      if (offset < window_offset_ ||
+          offset + sizeof(typename ELF::Addr) >
+              window_offset_ + window_.size()) {
+        window_offset_ = offset;
+        window_.resize(kWindowSize);
+        const ssize_t bytes = TEMP_FAILURE_RETRY(
+            pread(fd_, window_.data(), window_.size(), offset));
+        window_.resize(bytes > 0 ? bytes : 0);
+        if (window_.size() < sizeof(typename ELF::Addr))
+          return 0;
+      }
+      typename ELF::Addr value;
+      memcpy(&value, &window_[offset - window_offset_], sizeof(value));
+      return value;
+    }
+    return 0;
+  }
+
+ private:
+  int fd_;
+  std::vector<typename ELF::Phdr> loads_;
+  std::vector<uint8_t> window_;
+  uint64_t window_offset_;
+};
+
+size_t StubSize(unsigned machine) {
+  std::vector<uint8_t> stub;
+  RelrStubParams params;
+  memset(&params, 0, sizeof(params));
+  return BuildRelrStub(machine, params, &stub) ? stub.size() : 0;
+}
+
+template <typename ELF>
+bool AnalyzeTyped(int fd, const ElfProbe& probe, RelrAnalysis* analysis) {
+  std::vector<typename ELF::Relr> packed(
+      probe.relr_size / sizeof(typename ELF::Relr));
+  if (!packed.empty() &&
+      !ReadAt(fd, probe.relr_offset, packed.size() * sizeof(packed[0]),
+              &packed[0])) {
+    return false;
+  }
+
+  const bool is_rela = probe.relocations_type == SHT_RELA;
+  const size_t entry_size =
+      is_rela ? sizeof(typename ELF::Rela) : sizeof(typename ELF::Rel);
+  // APS2 .rel.dyn or .rela.dyn is not a table of entries; analysis covers
+  // only what .relr.dyn adds.
+  const bool is_table = probe.relocations_type == SHT_REL || is_rela;
+  std::vector<uint8_t> table(is_table ? probe.relocations_size -
+                                        probe.relocations_size % entry_size
+                                      : 0);
+  if (!table.empty() &&
+      !ReadAt(fd, probe.relocations_offset, table.size(), &table[0])) {
+    return false;
+  }
+
+  // Packed words.
+  analysis->relr_words = packed.size();
+  for (size_t i = 0; i < packed.size(); ++i) {
+    if ((packed[i] & 1) == 0) {
+      ++analysis->address_words;
+    } else {
+      ++analysis->bitmap_words;
+      ++analysis->fill_histogram[__builtin_popcountll(packed[i] >> 1)];
+    }
+  }
+
+  // Relative relocations, streamed into the APS2 encoder.  With RELA the
+  // addend is the word the relocation would otherwise find in place.
+  const unsigned relative_type = RelativeRelocationType(probe.machine);
+  Aps2Encoder<ELF> encoder(relative_type,
+                           IrelativeRelocationType(probe.machine), is_rela);
+  WordReader<ELF> reader(fd);
+  if (is_rela && !reader.Init())
+    return false;
+  DecodeRelr(packed.data(), packed.size(),
+             [&](typename ELF::Addr offset) {
+    encoder.AddRelative(offset, is_rela ? reader.Read(offset) : 0);
+    ++analysis->relr_relocations;
+  });
+
+  // Relocations already in .rel(a).dyn.
+  const size_t table_count = table.size() / entry_size;
+  for (size_t i = 0; i < table_count; ++i) {
+    typename ELF::Rela relocation;
+    if (is_rela) {
+      memcpy(&relocation, &table[i * entry_size], sizeof(relocation));
+    } else {
+      typename ELF::Rel rel;
+      memcpy(&rel, &table[i * entry_size], sizeof(rel));
+      relocation.r_offset = rel.r_offset;
+      relocation.r_info = rel.r_info;
+      relocation.r_addend = 0;
+    }
+
+    if (ELF::elf_r_sym(relocation.r_info) != 0)
+      ++analysis->table_symbolic;
+    else if (relative_type &&
+             ELF::elf_r_type(relocation.r_info) == relative_type)
+      ++analysis->table_relative;
+    else
+      ++analysis->table_other;
+    encoder.AddOther(relocation);
+  }
+
+  std::vector<uint8_t> aps2;
+  encoder.GetEncoding(&aps2);
+
+  const uint64_t total = analysis->relr_relocations + table_count;
+  analysis->relr_bytes = probe.relr_size + table.size();
+  analysis->rela_bytes = total * sizeof(typename ELF::Rela);
+  analysis->rel_bytes = total * sizeof(typename ELF::Rel);
+  analysis->aps2_bytes = aps2.size();
+  if (HasRelrStub(probe.machine, probe.file_class)) {
+    analysis->stub_bytes = analysis->relr_bytes + StubSize(probe.machine);
+    analysis->stub_files = 1;
+  }
+  return true;
+}
+
+std::string JsonString(const std::string& value) {
+  std::ostringstream stream;
+  stream << '"';
+  for (size_t i = 0; i < value.size(); ++i) {
+    const unsigned char c = value[i];
+    if (c == '"' || c == '\\') {
+      stream << '\\' << c;
+    } else if (c < 0x20) {
+      stream << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << static_cast<unsigned>(c) << std::dec;
+    } else {
+      stream << c;
+    }
+  }
+  stream << '"';
+  return stream.str();
+}
+
+std::string CsvString(const std::string& value) {
+  if (value.find_first_of(",\"\n") == std::string::npos)
+    return value;
+  std::string quoted = "\"";
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '"')
+      quoted += '"';
+    quoted += value[i];
+  }
+  return quoted + "\"";
+}
+
+double AddressRatio(const RelrAnalysis& analysis) {
+  return analysis.relr_words
+      ? static_cast<double>(analysis.address_words) / analysis.relr_words
+      : 0;
+}
+
+void WriteCsvHeader(std::ostream* out) {
+  *out << "path,class,machine,file_size,relr_words,address_words,"
+       << "bitmap_words,address_ratio,relr_relocations,table_relative,"
+       << "table_symbolic,table_other,relr_bytes,rela_bytes,rel_bytes,"
+       << "aps2_bytes,stub_bytes";
+  for (size_t i = 0; i < kFillHistogramSize; ++i)
+    *out << ",fill_" << i;
+  *out << '\n';
+}
+
+void WriteCsvRow(const RelrAnalysis& analysis, bool is_total,
+                 std::ostream* out) {
+  *out << (is_total ? "TOTAL" : CsvString(analysis.path)) << ',';
+  if (!is_total)
+    *out << (analysis.file_class == ELFCLASS64 ? 64 : 32) << ','
+         << analysis.machine;
+  else
+    *out << ',';
+  *out << ',' << analysis.file_size << ',' << analysis.relr_words << ','
+       << analysis.address_words << ',' << analysis.bitmap_words << ','
+       << std::fixed << std::setprecision(4) << AddressRatio(analysis) << ','
+       << analysis.relr_relocations << ',' << analysis.table_relative << ','
+       << analysis.table_symbolic << ',' << analysis.table_other << ','
+       << analysis.relr_bytes << ',' << analysis.rela_bytes << ','
+       << analysis.rel_bytes << ',' << analysis.aps2_bytes << ',';
+  if (analysis.stub_files)
+    *out << analysis.stub_bytes;
+  for (size_t i = 0; i < kFillHistogramSize; ++i)
+    *out << ',' << analysis.fill_histogram[i];
+  *out << '\n';
+}
+
+void WriteJsonObject(const RelrAnalysis& analysis, bool is_total,
+                     const char* indent, std::ostream* out) {
+  *out << indent << "{";
+  if (!is_total) {
+    *out << "\"path\": " << JsonString(analysis.path) << ", \"class\": "
+         << (analysis.file_class == ELFCLASS64 ? 64 : 32)
+         << ", \"machine\": " << analysis.machine << ", ";
+  }
+  *out << "\"file_size\": " << analysis.file_size
+       << ", \"relr_words\": " << analysis.relr_words
+       << ", \"address_words\": " << analysis.address_words
+       << ", \"bitmap_words\": " << analysis.bitmap_words
+       << ", \"address_ratio\": " << std::fixed << std::setprecision(4)
+       << AddressRatio(analysis)
+       << ", \"relr_relocations\": " << analysis.relr_relocations
+       << ", \"table_relative\": " << analysis.table_relative
+       << ", \"table_symbolic\": " << analysis.table_symbolic
+       << ", \"table_other\": " << analysis.table_other
+       << ", \"relr_bytes\": " << analysis.relr_bytes
+       << ", \"rela_bytes\": " << analysis.rela_bytes
+       << ", \"rel_bytes\": " << analysis.rel_bytes
+       << ", \"aps2_bytes\": " << analysis.aps2_bytes << ", \"stub_bytes\": ";
+  if (analysis.stub_files)
+    *out << analysis.stub_bytes;
+  else
+    *out << "null";
+  if (is_total)
+    *out << ", \"stub_files\": " << analysis.stub_files;
+  *out << ", \"fill_histogram\": [";
+  for (size_t i = 0; i < kFillHistogramSize; ++i)
+    *out << (i ? ", " : "") << analysis.fill_histogram[i];
+  *out << "]}";
+}
+
+}  // namespace
+
+RelrAnalysis::RelrAnalysis()
+    : file_class(0), machine(0), file_size(0), relr_words(0),
+      address_words(0), bitmap_words(0), relr_relocations(0),
+      table_relative(0), table_symbolic(0), table_other(0), relr_bytes(0),
+      rela_bytes(0), rel_bytes(0), aps2_bytes(0), stub_bytes(0),
+      stub_files(0) {
+  memset(fill_histogram, 0, sizeof(fill_histogram));
+}
+
+void RelrAnalysis::Accumulate(const RelrAnalysis& other) {
+  file_size += other.file_size;
+  relr_words += other.relr_words;
+  address_words += other.address_words;
+  bitmap_words += other.bitmap_words;
+  for (size_t i = 0; i < kFillHistogramSize; ++i)
+    fill_histogram[i] += other.fill_histogram[i];
+  relr_relocations += other.relr_relocations;
+  table_relative += other.table_relative;
+  table_symbolic += other.table_symbolic;
+  table_other += other.table_other;
+  relr_bytes += other.relr_bytes;
+  rela_bytes += other.rela_bytes;
+  rel_bytes += other.rel_bytes;
+  aps2_bytes += other.aps2_bytes;
+  stub_bytes += other.stub_bytes;
+  stub_files += other.stub_files;
+}
+
+bool AnalyzeFile(const std::string& path,
+                 RelrAnalysis* analysis,
+                 bool* has_relr) {
+  *has_relr = false;
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+
+  ElfProbe probe;
+  struct stat status;
+  bool ok = fstat(fd, &status) == 0;
+  if (ok && ProbeElfFile(fd, &probe) && HasPackedRelocations(probe) &&
+      probe.has_dt_relr) {
+    *has_relr = true;
+    analysis->path = path;
+    analysis->file_class = probe.file_class;
+    analysis->machine = probe.machine;
+    analysis->file_size = status.st_size;
+    ok = probe.file_class == ELFCLASS32
+        ? AnalyzeTyped<ELF32_traits>(fd, probe, analysis)
+        : AnalyzeTyped<ELF64_traits>(fd, probe, analysis);
+  }
+  if (!ok)
+    LOG(ERROR) << path << ": read failed: " << strerror(errno);
+  close(fd);
+  return ok;
+}
+
+bool AnalyzeCorpus(const std::vector<BatchInput>& inputs,
+                   size_t jobs,
+                   analysis_format_t format,
+                   int out_fd) {
+  // Map: analyze each file into its own slot.
+  std::vector<RelrAnalysis> analyses(inputs.size());
+  std::vector<char> has_relr(inputs.size());
+  std::vector<char> ok(inputs.size());
+  {
+    WorkerPool pool(jobs);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      pool.Post([&inputs, &analyses, &has_relr, &ok, i] {
+        bool file_has_relr = false;
+        ok[i] = AnalyzeFile(inputs[i].path, &analyses[i], &file_has_relr);
+        has_relr[i] = file_has_relr;
+      });
+    }
+  }
+
+  // Reduce, in input order so that output is deterministic.
+  RelrAnalysis total;
+  size_t files = 0;
+  size_t errors = 0;
+  std::ostringstream out;
+  if (format == ANALYSIS_CSV)
+    WriteCsvHeader(&out);
+  else
+    out << "{\n  \"files\": [";
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    errors += !ok[i];
+    if (!has_relr[i] || !ok[i])
+      continue;
+    total.Accumulate(analyses[i]);
+    if (format == ANALYSIS_CSV) {
+      WriteCsvRow(analyses[i], false, &out);
+    } else {
+      out << (files ? ",\n" : "\n");
+      WriteJsonObject(analyses[i], false, "    ", &out);
+    }
+    ++files;
+  }
+  if (format == ANALYSIS_CSV) {
+    WriteCsvRow(total, true, &out);
+  } else {
+    out << "\n  ],\n  \"files_scanned\": " << inputs.size()
+        << ",\n  \"files_with_relr\": " << files
+        << ",\n  \"errors\": " << errors << ",\n  \"total\": ";
+    WriteJsonObject(total, true, "", &out);
+    out << "\n}\n";
+  }
+
+  LOG(INFO) << "Scanned          : " << inputs.size() << " files";
+  LOG(INFO) << "With RELR        : " << files << " files";
+  LOG_IF(ERROR, errors > 0) << "Unreadable       : " << errors << " files";
+
+  const std::string text = out.str();
+  if (!WriteFully(out_fd, text.data(), text.size())) {
+    LOG(ERROR) << "write failed: " << strerror(errno);
+    return false;
+  }
+  return errors == 0;
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,90 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// RELR statistics over a corpus of shared objects.
+//
+// Files are analyzed in parallel without libelf: the header probe locates
+// .relr.dyn and .rel(a).dyn, and DecodeRelr() walks the packed words without
+// building relocation vectors.  Only .rela.dyn files read any more than
+// that, fetching the words at relocated addresses to encode APS2 addends.
+//
+// For each file with packed relocations, and in total, this reports:
+//
+//   - SHT_RELR words, split into address and bitmap words, and a histogram
+//     of bitmap words by the number of relocations each encodes;
+//   - relative relocations encoded by RELR, and the relative, symbolic and
+//     other relocations already in .rel(a).dyn;
+//   - dynamic relocation bytes as the file is now (relr_bytes) and as it
+//     would be expanded to RELA, to REL, packed as APS2, or kept as RELR
+//     plus the self-relocating stub (empty where no stub is available).
+//
+// Results are written as CSV, one row per file and a final TOTAL row, or
+// as a JSON object holding a "files" array and a "total" object.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_ANALYZE_H_
+#define TOOLS_RELOCATION_PACKER_SRC_ANALYZE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+
+namespace relocation_packer {
+
+enum analysis_format_t { ANALYSIS_CSV = 0, ANALYSIS_JSON };
+
+// Bitmap words hold at most 63 relocations.
+static const size_t kFillHistogramSize = 64;
+
+struct RelrAnalysis {
+  RelrAnalysis();
+
+  // Add |other|'s counts into this one.
+  void Accumulate(const RelrAnalysis& other);
+
+  std::string path;
+  unsigned file_class;
+  unsigned machine;
+  uint64_t file_size;
+
+  uint64_t relr_words;
+  uint64_t address_words;
+  uint64_t bitmap_words;
+  uint64_t fill_histogram[kFillHistogramSize];
+
+  uint64_t relr_relocations;
+  uint64_t table_relative;
+  uint64_t table_symbolic;
+  uint64_t table_other;
+
+  uint64_t relr_bytes;
+  uint64_t rela_bytes;
+  uint64_t rel_bytes;
+  uint64_t aps2_bytes;
+  uint64_t stub_bytes;
+
+  // Number of files counted in stub_bytes; zero or one for a single file.
+  uint64_t stub_files;
+};
+
+// Analyze the file at |path|.  Returns false on read error.  Sets
+// |has_relr| to whether the file has packed relocations; |analysis| is
+// filled in only if so.
+bool AnalyzeFile(const std::string& path,
+                 RelrAnalysis* analysis,
+                 bool* has_relr);
+
+// Analyze all of |inputs| with |jobs| threads, zero for one per CPU, and
+// write the results to |out_fd| in |format|.  Returns false if any file
+// could not be read or the output could not be written.
+bool AnalyzeCorpus(const std::vector<BatchInput>& inputs,
+                   size_t jobs,
+                   analysis_format_t format,
+                   int out_fd);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_ANALYZE_H_
@@ -0,0 +1,463 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "batch_journal.h"
+#include "debug.h"
+#include "elf_probe.h"
+#include "file_util.h"
+#include "unpack.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+const char* const kBatchStatusNames[] = {"skipped", "converted", "failed"};
+
+bool StatSize(const std::string& path, uint64_t* size) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+  *size = status.st_size;
+  return true;
+}
+
+bool WalkDirectory(const std::string& directory,
+                   std::vector<BatchInput>* inputs) {
+  DIR* dir = opendir(directory.c_str());
+  if (!dir) {
+    LOG(ERROR) << directory << ": " << strerror(errno);
+    return false;
+  }
+
+  std::vector<std::string> names;
+  errno = 0;
+  while (const dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      names.push_back(entry->d_name);
+  }
+  if (errno != 0) {
+    LOG(ERROR) << directory << ": " << strerror(errno);
+    closedir(dir);
+    return false;
+  }
+  std::sort(names.begin(), names.end());
+
+  bool status = true;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::string path = directory + "/" + names[i];
+    struct stat entry_status;
+    if (fstatat(dirfd(dir), names[i].c_str(), &entry_status,
+                AT_SYMLINK_NOFOLLOW) != 0) {
+      LOG(ERROR) << path << ": " << strerror(errno);
+      status = false;
+      continue;
+    }
+    if (S_ISDIR(entry_status.st_mode)) {
+      status = WalkDirectory(path, inputs) && status;
+    } else if (S_ISREG(entry_status.st_mode)) {
+      inputs->push_back(BatchInput(path, entry_status.st_size));
+    }
+  }
+  closedir(dir);
+  return status;
+}
+
+// True if |path| still has the identity |journal| recorded for it.
+bool IsJournaled(const std::string& path,
+                 const BatchJournal& journal,
+                 uint64_t* size_before,
+                 FileIdentity* identity) {
+  if (!journal.Find(path, size_before, identity))
+    return false;
+
+  // Size and mtime are cheap to check; only then read the file.
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  struct stat status;
+  FileIdentity current;
+  const bool matches =
+      fstat(fd, &status) == 0 &&
+      static_cast<uint64_t>(status.st_size) == identity->size &&
+      static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 +
+              status.st_mtim.tv_nsec == identity->mtime_ns &&
+      ComputeFileIdentity(fd, &current) && current.crc == identity->crc;
+  close(fd);
+  return matches;
+}
+
+// Convert |path| in a temporary copy in the same directory, sync it, and
+// rename it over the original.  On success fill in |identity| for the
+// converted file.
+bool ConvertAndPublish(const std::string& path,
+                       const UnpackOptions& options,
+                       FileIdentity* identity) {
+  const int in_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in_fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+  struct stat original;
+  if (fstat(in_fd, &original) != 0) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    close(in_fd);
+    return false;
+  }
+
+  std::string temporary = path + ".XXXXXX";
+  const int fd = mkostemp(&temporary[0], O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    close(in_fd);
+    return false;
+  }
+
+  // Ownership is kept where permitted; mode always.
+  if (fchown(fd, original.st_uid, original.st_gid) != 0)
+    VLOG(1) << path << ": cannot keep ownership: " << strerror(errno);
+  bool status = fchmod(fd, original.st_mode & 07777) == 0 &&
+                CopyFileRange(in_fd, 0, fd, 0, original.st_size) &&
+                UnpackFile(fd, path, options) &&
+                fsync(fd) == 0 &&
+                ComputeFileIdentity(fd, identity);
+  status = close(fd) == 0 && status;
+  close(in_fd);
+  if (!status || rename(temporary.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << path << ": failed to publish: " << strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Bytes admitted to the conversion stage and not yet converted.
+class ByteBudget {
+ public:
+  explicit ByteBudget(uint64_t limit) : limit_(limit), used_(0) {}
+
+  // Block until |bytes| fit in the limit, or nothing else is admitted.
+  void Acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [this, bytes] {
+      return used_ == 0 || used_ + bytes <= limit_;
+    });
+    used_ += bytes;
+  }
+
+  void Release(uint64_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      used_ -= bytes;
+    }
+    released_.notify_all();
+  }
+
+ private:
+  const uint64_t limit_;
+  uint64_t used_;
+  std::mutex mutex_;
+  std::condition_variable released_;
+};
+
+// First stage of UnpackBatchFile(): check |journal| and probe |path|.
+// Returns true if the file is to be converted, with |result| holding its
+// size; otherwise |result| is final.
+bool ProbeBatchFile(const std::string& path,
+                    BatchJournal* journal,
+                    BatchResult* result) {
+  uint64_t size_before = 0;
+  FileIdentity identity;
+  if (journal && IsJournaled(path, *journal, &size_before, &identity)) {
+    VLOG(1) << path << ": converted by an earlier run";
+    result->status = BATCH_CONVERTED;
+    result->size_before = size_before;
+    result->size_after = identity.size;
+    result->resumed = true;
+    return false;
+  }
+
+  // Probe read-only first, so that files we skip need not be writable.
+  ElfProbe probe;
+  const int probe_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (probe_fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+  struct stat status;
+  const bool is_candidate = fstat(probe_fd, &status) == 0 &&
+                            ProbeElfFile(probe_fd, &probe) &&
+                            HasPackedRelocations(probe);
+  close(probe_fd);
+  if (!is_candidate) {
+    VLOG(1) << path << ": no packed relocations, skipped";
+    result->status = BATCH_SKIPPED;
+    return false;
+  }
+  result->size_before = status.st_size;
+  return true;
+}
+
+// Start reading all of |path| into the page cache, without waiting for it.
+void ReadAhead(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  const int error = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  VLOG_IF(1, error != 0) << path << ": read-ahead: " << strerror(error);
+  close(fd);
+}
+
+// Second stage of UnpackBatchFile(): convert |path|, already probed into
+// |result|, and record it in |journal|.
+void ConvertBatchFile(const std::string& path,
+                      const UnpackOptions& options,
+                      BatchJournal* journal,
+                      bool atomic,
+                      BatchResult* result) {
+  if (atomic) {
+    FileIdentity identity;
+    if (ConvertAndPublish(path, options, &identity) &&
+        (!journal || journal->Record(path, result->size_before, identity))) {
+      result->status = BATCH_CONVERTED;
+      result->size_after = identity.size;
+    }
+    return;
+  }
+
+  const int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return;
+  }
+  struct stat status;
+  if (UnpackFile(fd, path, options) && fstat(fd, &status) == 0) {
+    result->status = BATCH_CONVERTED;
+    result->size_after = status.st_size;
+  }
+  close(fd);
+}
+
+}  // namespace
+
+BatchResult UnpackBatchFile(const std::string& path,
+                            const UnpackOptions& options,
+                            BatchJournal* journal,
+                            bool atomic) {
+  BatchResult result;
+  if (ProbeBatchFile(path, journal, &result))
+    ConvertBatchFile(path, options, journal, atomic, &result);
+  return result;
+}
+
+bool AddBatchFiles(const std::vector<std::string>& paths,
+                   std::vector<BatchInput>* inputs) {
+  bool status = true;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    uint64_t size = 0;
+    if (StatSize(paths[i], &size))
+      inputs->push_back(BatchInput(paths[i], size));
+    else
+      status = false;
+  }
+  return status;
+}
+
+bool AddBatchManifest(int fd,
+                      const std::string& name,
+                      std::vector<BatchInput>* inputs) {
+  std::vector<uint8_t> contents;
+  if (!ReadToEnd(fd, &contents)) {
+    LOG(ERROR) << name << ": " << strerror(errno);
+    return false;
+  }
+
+  std::istringstream stream(std::string(contents.begin(), contents.end()));
+  std::string line;
+  size_t line_number = 0;
+  bool status = true;
+  while (std::getline(stream, line)) {
+    ++line_number;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    BatchInput input;
+    const size_t tab = line.rfind('\t');
+    if (tab == std::string::npos) {
+      input.path = line;
+      if (!StatSize(input.path, &input.size)) {
+        status = false;
+        continue;
+      }
+    } else {
+      char* end = NULL;
+      const char* size = line.c_str() + tab + 1;
+      input.path = line.substr(0, tab);
+      input.size = strtoull(size, &end, 10);
+      if (end == size || *end != '\0') {
+        LOG(ERROR) << name << ":" << line_number << ": invalid size";
+        status = false;
+        continue;
+      }
+    }
+    inputs->push_back(input);
+  }
+  return status;
+}
+
+bool AddBatchDirectory(const std::string& directory,
+                       std::vector<BatchInput>* inputs) {
+  return WalkDirectory(directory, inputs);
+}
+
+std::vector<size_t> AssignShards(const std::vector<BatchInput>& inputs,
+                                 size_t shard_count) {
+  std::vector<size_t> order(inputs.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&inputs](size_t a, size_t b) {
+    if (inputs[a].size != inputs[b].size)
+      return inputs[a].size > inputs[b].size;
+    return inputs[a].path < inputs[b].path;
+  });
+
+  // Min-heap of (bytes assigned, shard index).
+  typedef std::pair<uint64_t, size_t> Load;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load> > loads;
+  for (size_t shard = 0; shard < shard_count; ++shard)
+    loads.push(Load(0, shard));
+
+  std::vector<size_t> shards(inputs.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    Load lightest = loads.top();
+    loads.pop();
+    shards[order[i]] = lightest.second;
+    lightest.first += inputs[order[i]].size;
+    loads.push(lightest);
+  }
+  return shards;
+}
+
+bool UnpackBatch(const std::vector<BatchInput>& inputs,
+                 const UnpackOptions& unpack_options,
+                 const BatchOptions& batch_options) {
+  CHECK(batch_options.shard_index < batch_options.shard_count);
+
+  const std::vector<size_t> shards =
+      AssignShards(inputs, batch_options.shard_count);
+  std::vector<size_t> selected;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (shards[i] == batch_options.shard_index)
+      selected.push_back(i);
+  }
+
+  BatchJournal journal_storage;
+  BatchJournal* journal = NULL;
+  if (!batch_options.journal_path.empty()) {
+    if (!journal_storage.Open(batch_options.journal_path))
+      return false;
+    journal = &journal_storage;
+  }
+
+  // Probe tasks post conversions, so the probe pool is drained before the
+  // conversion pool.  Conversions never wait on probes, so a probe blocked
+  // on the budget always makes progress.
+  std::vector<BatchResult> results(selected.size());
+  {
+    WorkerPool convert_pool(batch_options.jobs);
+    const size_t probe_jobs = batch_options.probe_jobs
+                                  ? batch_options.probe_jobs
+                                  : 4 * convert_pool.size();
+    ByteBudget budget(batch_options.prefetch_bytes);
+    WorkerPool probe_pool(probe_jobs);
+    for (size_t i = 0; i < selected.size(); ++i) {
+      BatchResult* result = &results[i];
+      const std::string& path = inputs[selected[i]].path;
+      probe_pool.Post([result, &path, &unpack_options, journal, &budget,
+                       &convert_pool] {
+        if (!ProbeBatchFile(path, journal, result))
+          return;
+        const uint64_t size = result->size_before;
+        budget.Acquire(size);
+        ReadAhead(path);
+        convert_pool.Post([result, &path, &unpack_options, journal, &budget,
+                           size] {
+          ConvertBatchFile(path, unpack_options, journal, journal != NULL,
+                           result);
+          budget.Release(size);
+        });
+      });
+    }
+    probe_pool.Wait();
+    convert_pool.Wait();
+  }
+  bool status = !journal || journal->Flush();
+
+  size_t counts[3] = {0, 0, 0};
+  size_t resumed = 0;
+  uint64_t bytes_before = 0;
+  uint64_t bytes_after = 0;
+  std::ostringstream stats;
+  for (size_t i = 0; i < selected.size(); ++i) {
+    const BatchInput& input = inputs[selected[i]];
+    const BatchResult& result = results[i];
+    const bool converted = result.status == BATCH_CONVERTED;
+    const uint64_t size_before = converted ? result.size_before : input.size;
+    const uint64_t size_after = converted ? result.size_after : input.size;
+    ++counts[result.status];
+    resumed += result.resumed;
+    if (converted) {
+      bytes_before += size_before;
+      bytes_after += size_after;
+    }
+    stats << kBatchStatusNames[result.status] << '\t' << size_before << '\t'
+          << size_after << '\t' << input.path << '\n';
+  }
+  stats << "# shard " << batch_options.shard_index << "/"
+        << batch_options.shard_count << ": files " << selected.size()
+        << " converted " << counts[BATCH_CONVERTED]
+        << " skipped " << counts[BATCH_SKIPPED]
+        << " failed " << counts[BATCH_FAILED]
+        << " bytes " << bytes_before << " -> " << bytes_after << '\n';
+
+  LOG(INFO) << "Shard            : " << batch_options.shard_index << "/"
+            << batch_options.shard_count << ", " << selected.size() << " of "
+            << inputs.size() << " files";
+  LOG(INFO) << "Converted        : " << counts[BATCH_CONVERTED];
+  LOG_IF(INFO, journal) << "Resumed          : " << resumed;
+  LOG(INFO) << "Skipped          : " << counts[BATCH_SKIPPED];
+  LOG_IF(ERROR, counts[BATCH_FAILED] > 0)
+      << "Failed           : " << counts[BATCH_FAILED];
+
+  status = counts[BATCH_FAILED] == 0 && status;
+  if (!batch_options.stats_path.empty())
+    status = WriteFileAtomically(batch_options.stats_path, stats.str()) &&
+             status;
+  return status;
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,153 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Batch conversion of many shared objects in place.
+//
+// Inputs come from the command line, from a manifest, or from a walk of a
+// directory tree.  Directory walks visit entries in byte-wise sorted order
+// and take sizes from fstatat, without following symbolic links; only
+// regular files are considered.  Files without packed relocations are
+// skipped, not treated as errors.
+//
+// Inputs can be split across independent processes or machines with a
+// shard index and count.  Every shard computes the same assignment from the
+// same input list: files are taken largest first (ties by path) and each is
+// given to the currently lightest shard (ties by lowest index), so shards
+// receive similar byte totals with no coordination.  A manifest line may
+// carry the file size after a tab, so that shards agree even when they
+// cannot stat the same files.
+//
+// Each shard can write a stats file.  Records are one per line,
+//
+//   <status>\t<size before>\t<size after>\t<path>
+//
+// with status one of converted, skipped or failed, followed by a summary
+// line starting with '#'.  Stats files from all shards merge by simple
+// concatenation; records never depend on other lines.
+//
+// With a journal (see batch_journal.h) a batch can be stopped at any point
+// and restarted, converting only what was not finished.  Files are then
+// converted in a temporary copy next to the original and renamed over it,
+// so an interrupted conversion never leaves a partially written file.
+// Conversion changes file sizes, so a sharded batch that is to be resumed
+// should list its inputs in a manifest with sizes, keeping the assignment
+// stable across runs.
+//
+// A batch runs as a two-stage pipeline.  Probe threads check the journal,
+// read each file's headers and, for files to convert, ask the kernel to
+// read the rest ahead; conversion threads then run the CPU-bound decode and
+// relayout on data already in the page cache.  Probes block on I/O without
+// holding a conversion thread, and skipped files never reach one.  Files
+// admitted past the probe stage but not yet converted are bounded by a byte
+// budget, so probes cannot run arbitrarily far ahead of conversion and
+// evict what they read before it is used.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_BATCH_H_
+#define TOOLS_RELOCATION_PACKER_SRC_BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "unpack.h"
+
+namespace relocation_packer {
+
+class BatchJournal;
+
+struct BatchInput {
+  BatchInput() : size(0) {}
+  BatchInput(const std::string& path, uint64_t size)
+      : path(path), size(size) {}
+
+  std::string path;
+  uint64_t size;
+};
+
+struct BatchOptions {
+  BatchOptions()
+      : jobs(0),
+        probe_jobs(0),
+        prefetch_bytes(256 << 20),
+        shard_index(0),
+        shard_count(1) {}
+
+  // Conversion threads, zero for one per CPU.
+  size_t jobs;
+
+  // Probe and read-ahead threads, zero for four per conversion thread.
+  // These spend most of their time waiting on I/O.
+  size_t probe_jobs;
+
+  // Bytes of files probed and read ahead but not yet converted.  A single
+  // file larger than this is still admitted, alone.
+  uint64_t prefetch_bytes;
+
+  // This process converts shard |shard_index| of |shard_count|.
+  size_t shard_index;
+  size_t shard_count;
+
+  // If not empty, where to write this shard's stats.
+  std::string stats_path;
+
+  // If not empty, the progress journal to resume from and append to.
+  std::string journal_path;
+};
+
+enum BatchStatus { BATCH_SKIPPED = 0, BATCH_CONVERTED, BATCH_FAILED };
+
+struct BatchResult {
+  BatchResult()
+      : status(BATCH_FAILED), size_before(0), size_after(0), resumed(false) {}
+
+  BatchStatus status;
+  uint64_t size_before;
+  uint64_t size_after;
+
+  // True if converted by an earlier run, according to the journal.
+  bool resumed;
+};
+
+// Convert the file at |path| if it has packed relocations.  If |journal| is
+// not NULL, files it records as converted are skipped and new conversions
+// are recorded.  If |atomic|, the file is converted in a temporary copy and
+// renamed over the original, else it is rewritten in place.
+BatchResult UnpackBatchFile(const std::string& path,
+                            const UnpackOptions& options,
+                            BatchJournal* journal,
+                            bool atomic);
+
+// Add each path in |paths| to |inputs|, with its size from stat.  Returns
+// false if any path cannot be stat'ed.
+bool AddBatchFiles(const std::vector<std::string>& paths,
+                   std::vector<BatchInput>* inputs);
+
+// Add the files listed in the manifest open on |fd| to |inputs|.  Lines are
+// a path, optionally followed by a tab and the file size in bytes; blank
+// lines and lines starting with '#' are ignored.  Sizes not given are taken
+// from stat.  Returns false on read, parse or stat error.
+bool AddBatchManifest(int fd,
+                      const std::string& name,
+                      std::vector<BatchInput>* inputs);
+
+// Add every regular file under |directory| to |inputs|, in sorted order.
+// Returns false if any directory cannot be read.
+bool AddBatchDirectory(const std::string& directory,
+                       std::vector<BatchInput>* inputs);
+
+// Return the shard, in [0, |shard_count|), to which each of |inputs| is
+// assigned.  Deterministic for a given list, independent of its order.
+std::vector<size_t> AssignShards(const std::vector<BatchInput>& inputs,
+                                 size_t shard_count);
+
+// Convert this shard's share of |inputs| in place.  Returns false if any
+// file failed to convert or the stats file could not be written.
+bool UnpackBatch(const std::vector<BatchInput>& inputs,
+                 const UnpackOptions& unpack_options,
+                 const BatchOptions& batch_options);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_BATCH_H_
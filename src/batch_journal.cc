@@ -0,0 +1,180 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "batch_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "crc32.h"
+#include "debug.h"
+#include "file_util.h"
+
+namespace relocation_packer {
+
+static const char kJournalHeader[] = "# relr-unpack journal 1\n";
+static const char kConvertedRecord[] = "converted";
+
+// Out-of-class definitions: std::chrono::milliseconds takes the delay by
+// reference, which needs one without optimization.
+const size_t BatchJournal::kJournalGroupSize;
+const int BatchJournal::kJournalGroupDelayMs;
+
+bool ComputeFileIdentity(int fd, FileIdentity* identity) {
+  struct stat status;
+  if (fstat(fd, &status) != 0)
+    return false;
+
+  static const size_t kChunkSize = 256 * 1024;
+  std::vector<uint8_t> buffer(kChunkSize);
+  uint32_t crc = 0;
+  off_t offset = 0;
+  while (offset < status.st_size) {
+    const ssize_t bytes =
+        TEMP_FAILURE_RETRY(pread(fd, buffer.data(), kChunkSize, offset));
+    if (bytes <= 0)
+      return false;
+    crc = Crc32(crc, buffer.data(), bytes);
+    offset += bytes;
+  }
+
+  identity->size = status.st_size;
+  identity->mtime_ns =
+      static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 +
+      status.st_mtim.tv_nsec;
+  identity->crc = crc;
+  return true;
+}
+
+BatchJournal::BatchJournal() : fd_(-1), pending_records_(0) {}
+
+BatchJournal::~BatchJournal() {
+  if (fd_ != -1) {
+    Flush();
+    close(fd_);
+  }
+}
+
+bool BatchJournal::Open(const std::string& path) {
+  path_ = path;
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+
+  std::vector<uint8_t> contents;
+  if (!ReadWholeFile(fd_, &contents)) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+
+  // Cut off a torn final record, so that the next one starts a line.
+  size_t complete = contents.size();
+  while (complete > 0 && contents[complete - 1] != '\n')
+    --complete;
+  if (complete != contents.size()) {
+    LOG(WARNING) << path << ": dropping incomplete final record";
+    if (ftruncate(fd_, complete) != 0) {
+      LOG(ERROR) << path << ": " << strerror(errno);
+      return false;
+    }
+  }
+  if (contents.empty())
+    pending_ = kJournalHeader;
+
+  std::istringstream stream(
+      std::string(contents.begin(), contents.begin() + complete));
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(stream, line)) {
+    ++line_number;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    char record[16];
+    Entry entry;
+    int path_offset = 0;
+    if (sscanf(line.c_str(),
+               "%15[^\t]\t%" SCNu64 "\t%" SCNu64 "\t%" SCNd64 "\t%" SCNx32
+               "%n",
+               record, &entry.size_before, &entry.identity.size,
+               &entry.identity.mtime_ns, &entry.identity.crc,
+               &path_offset) != 5 ||
+        line[path_offset] != '\t' ||
+        strcmp(record, kConvertedRecord) != 0) {
+      LOG(WARNING) << path << ":" << line_number << ": ignoring bad record";
+      continue;
+    }
+    entries_[line.substr(path_offset + 1)] = entry;
+  }
+  if (!entries_.empty())
+    LOG(INFO) << "Journal          : " << entries_.size() << " records";
+  return true;
+}
+
+bool BatchJournal::Find(const std::string& path,
+                        uint64_t* size_before,
+                        FileIdentity* identity) const {
+  std::map<std::string, Entry>::const_iterator it = entries_.find(path);
+  if (it == entries_.end())
+    return false;
+  *size_before = it->second.size_before;
+  *identity = it->second.identity;
+  return true;
+}
+
+bool BatchJournal::Record(const std::string& path,
+                          uint64_t size_before,
+                          const FileIdentity& identity) {
+  char fields[96];
+  snprintf(fields, sizeof(fields),
+           "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRId64 "\t%08" PRIx32 "\t",
+           kConvertedRecord, size_before, identity.size, identity.mtime_ns,
+           identity.crc);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_records_ == 0)
+    first_pending_ = std::chrono::steady_clock::now();
+  pending_ += fields;
+  pending_ += path;
+  pending_ += '\n';
+  ++pending_records_;
+
+  if (pending_records_ >= kJournalGroupSize ||
+      std::chrono::steady_clock::now() - first_pending_ >=
+          std::chrono::milliseconds(kJournalGroupDelayMs)) {
+    return FlushLocked();
+  }
+  return true;
+}
+
+bool BatchJournal::Flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return FlushLocked();
+}
+
+bool BatchJournal::FlushLocked() {
+  if (pending_.empty())
+    return true;
+  // Records are appended whole, so a crash can tear only the last one.
+  const bool status = WriteFully(fd_, pending_.data(), pending_.size()) &&
+                      fdatasync(fd_) == 0;
+  if (!status)
+    LOG(ERROR) << path_ << ": " << strerror(errno);
+  pending_.clear();
+  pending_records_ = 0;
+  return status;
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,98 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Append-only progress journal for resumable batch conversion.
+//
+// Each completed conversion appends one line,
+//
+//   converted\t<size before>\t<size>\t<mtime ns>\t<crc32>\t<path>
+//
+// where size, mtime and CRC-32 identify the converted file.  A later run
+// with the same journal skips a path whose current file still matches that
+// identity, and converts everything else again, including files that were
+// in flight when the previous run stopped.  Files without packed
+// relocations are not journaled; probing them again is cheap.
+//
+// Records are buffered and made durable with fdatasync in groups, after
+// kJournalGroupSize records or kJournalGroupDelayMs since the first
+// unsynced one, and on Flush().  Losing unsynced records after a crash only
+// means those files are checked and found converted again.  A torn final
+// line is cut off when the journal is loaded.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_BATCH_JOURNAL_H_
+#define TOOLS_RELOCATION_PACKER_SRC_BATCH_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace relocation_packer {
+
+// Identity of a file's contents, as recorded in the journal.
+struct FileIdentity {
+  FileIdentity() : size(0), mtime_ns(0), crc(0) {}
+
+  uint64_t size;
+  int64_t mtime_ns;
+  uint32_t crc;
+};
+
+// Compute the identity of the file open on |fd|, reading all of it.
+// Returns false on error.
+bool ComputeFileIdentity(int fd, FileIdentity* identity);
+
+class BatchJournal {
+ public:
+  BatchJournal();
+  ~BatchJournal();
+
+  // Load any records already in the journal at |path| and open it for
+  // appending, creating it if necessary.  Returns false on error.
+  bool Open(const std::string& path);
+
+  // Look up the last conversion recorded for |path| when the journal was
+  // opened; records made since are not seen.  Returns false if there is
+  // none.  Thread-safe, and safe to call concurrently with Record(), which
+  // only appends to the pending records.
+  bool Find(const std::string& path,
+            uint64_t* size_before,
+            FileIdentity* identity) const;
+
+  // Append a conversion record.  Thread-safe.  Returns false if a group
+  // write or sync failed.
+  bool Record(const std::string& path,
+              uint64_t size_before,
+              const FileIdentity& identity);
+
+  // Write and sync any buffered records.  Returns false on error.
+  bool Flush();
+
+ private:
+  struct Entry {
+    uint64_t size_before;
+    FileIdentity identity;
+  };
+
+  bool FlushLocked();
+
+  static const size_t kJournalGroupSize = 64;
+  static const int kJournalGroupDelayMs = 1000;
+
+  std::string path_;
+  int fd_;
+  // Records loaded by Open(), read-only afterwards.
+  std::map<std::string, Entry> entries_;
+
+  std::mutex mutex_;
+  std::string pending_;
+  size_t pending_records_;
+  std::chrono::steady_clock::time_point first_pending_;
+};
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_BATCH_JOURNAL_H_
@@ -0,0 +1,203 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "crc32.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_PCLMUL_CRC32 1
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace relocation_packer {
+
+namespace {
+
+// Reflected IEEE polynomial.
+static const uint32_t kPolynomial = 0xedb88320;
+
+// Slice-by-8 tables, built on first use.
+struct Crc32Tables {
+  Crc32Tables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int slice = 1; slice < 8; ++slice) {
+        const uint32_t previous = table[slice - 1][i];
+        table[slice][i] = (previous >> 8) ^ table[0][previous & 0xff];
+      }
+    }
+  }
+
+  uint32_t table[8][256];
+};
+
+// |crc| here and below is the working (inverted) register value.
+uint32_t Crc32Tabular(uint32_t crc, const uint8_t* data, size_t size) {
+  static const Crc32Tables tables;
+  const uint32_t (*t)[256] = tables.table;
+
+  while (size >= 8) {
+    uint32_t low, high;
+    memcpy(&low, data, 4);
+    memcpy(&high, data + 4, 4);
+    low ^= crc;
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+          t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+          t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^
+          t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    data += 8;
+    size -= 8;
+  }
+  while (size--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+  return crc;
+}
+
+#if defined(HAVE_PCLMUL_CRC32)
+
+// Fold 64-byte blocks with carry-less multiplication, then reduce to 32
+// bits with Barrett reduction.  Constants are powers of x modulo the
+// polynomial, bit-reflected, as in "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).  Requires
+// |size| >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* data, size_t size) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+  x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+  x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+  x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+  data += 64;
+  size -= 64;
+
+  // Fold four 128-bit lanes in parallel.
+  while (size >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+    y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+    y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+    y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    data += 64;
+    size -= 64;
+  }
+
+  // Fold the four lanes into one.
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold any remaining 16-byte blocks.
+  while (size >= 16) {
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    data += 16;
+    size -= 16;
+  }
+
+  // Fold 128 bits to 64.
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduce to 32 bits.
+  x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+bool HasPclmul() {
+  static const bool has_pclmul =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+  return has_pclmul;
+}
+
+#endif  // HAVE_PCLMUL_CRC32
+
+#if defined(__ARM_FEATURE_CRC32)
+
+uint32_t Crc32Arm(uint32_t crc, const uint8_t* data, size_t size) {
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32d(crc, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size--)
+    crc = __crc32b(crc, *data++);
+  return crc;
+}
+
+#endif  // __ARM_FEATURE_CRC32
+
+}  // namespace
+
+uint32_t Crc32(uint32_t crc, const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+
+#if defined(__ARM_FEATURE_CRC32)
+  return ~Crc32Arm(crc, bytes, size);
+#else
+#if defined(HAVE_PCLMUL_CRC32)
+  if (size >= 64 && HasPclmul()) {
+    const size_t folded = size & ~static_cast<size_t>(15);
+    crc = Crc32Pclmul(crc, bytes, folded);
+    bytes += folded;
+    size -= folded;
+  }
+#endif
+  return ~Crc32Tabular(crc, bytes, size);
+#endif
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,26 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// CRC-32 (IEEE 802.3, as used by ZIP and .gnu_debuglink).
+//
+// Uses carry-less multiply folding on x86 CPUs with PCLMULQDQ, the CRC32
+// instructions on ARMv8 builds that enable them, and slice-by-8 tables
+// otherwise.  The SSE4.2 crc32 instruction is not used: it computes the
+// Castagnoli polynomial, not this one.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_CRC32_H_
+#define TOOLS_RELOCATION_PACKER_SRC_CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace relocation_packer {
+
+// Extend |crc| with |size| bytes of |data|.  Start with a |crc| of zero;
+// the result is the conventional (finalized) CRC-32 value.
+uint32_t Crc32(uint32_t crc, const void* data, size_t size);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_CRC32_H_
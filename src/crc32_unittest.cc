@@ -0,0 +1,64 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "crc32.h"
+
+#include <stdint.h>
+#include <zlib.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+// Bytes that no short period repeats in.
+std::vector<uint8_t> MakeData(size_t size) {
+  std::vector<uint8_t> data(size);
+  uint32_t state = 0x12345678;
+  for (size_t i = 0; i < size; ++i) {
+    state = state * 1103515245 + 12345;
+    data[i] = state >> 16;
+  }
+  return data;
+}
+
+uint32_t ZlibCrc32(const uint8_t* data, size_t size) {
+  return crc32(crc32(0, Z_NULL, 0), data, size);
+}
+
+}  // namespace
+
+// Below 64 bytes only the tables are used; from there, PCLMUL where the
+// CPU has it, with the tables for the last 15 bytes or fewer.
+TEST(Crc32, MatchesZlibForEverySize) {
+  const std::vector<uint8_t> data = MakeData(100003);
+  for (size_t size = 0; size <= data.size(); ++size) {
+    ASSERT_EQ(ZlibCrc32(data.data(), size), Crc32(0, data.data(), size))
+        << size;
+  }
+}
+
+TEST(Crc32, MatchesZlibAtEveryAlignment) {
+  const std::vector<uint8_t> data = MakeData(1024 + 16);
+  for (size_t offset = 0; offset < 16; ++offset) {
+    EXPECT_EQ(ZlibCrc32(data.data() + offset, 1024),
+              Crc32(0, data.data() + offset, 1024))
+        << offset;
+  }
+}
+
+TEST(Crc32, ExtendsAcrossCalls) {
+  const std::vector<uint8_t> data = MakeData(100003);
+  const uint32_t expected = ZlibCrc32(data.data(), data.size());
+  const size_t splits[] = {0, 1, 15, 63, 64, 65, 4097, 100002, 100003};
+  for (size_t i = 0; i < sizeof(splits) / sizeof(splits[0]); ++i) {
+    const uint32_t head = Crc32(0, data.data(), splits[i]);
+    EXPECT_EQ(expected, Crc32(head, data.data() + splits[i],
+                              data.size() - splits[i]))
+        << splits[i];
+  }
+}
+
+}  // namespace relocation_packer
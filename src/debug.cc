@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <iostream>
+#include <mutex>
 #include <string>
 
 namespace relocation_packer {
@@ -31,6 +32,10 @@ Logger::~Logger() {
         case FATAL: tag = "FATAL"; break;
       }
       stream_.flush();
+      // Serialize whole lines so that messages from worker threads do not
+      // interleave.
+      static std::mutex mutex;
+      std::lock_guard<std::mutex> lock(mutex);
       *log << tag << ": " << stream_.str() << std::endl;
     }
     if (severity_ == FATAL)
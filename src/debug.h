@@ -17,7 +17,8 @@
 //
 // CHECK(predicate) logs a FATAL error if predicate is false.
 // NOTREACHED() always aborts.
-// Log streams can be changed with SetStreams().  Logging is not thread-safe.
+// Log streams can be changed with SetStreams().  Messages may be logged from
+// several threads; SetVerbose() and SetStreams() are not thread-safe.
 //
 
 #ifndef TOOLS_RELOCATION_PACKER_SRC_DEBUG_H_
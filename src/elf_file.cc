@@ -12,28 +12,31 @@
 
 #include "elf_file.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <algorithm>
+#include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "crc32.h"
 #include "debug.h"
 #include "elf_traits.h"
+#include "extent_writer.h"
+#include "file_util.h"
 #include "libelf.h"
 #include "packer.h"
+#include "relr_stub.h"
 
 namespace relocation_packer {
 
-// Out-of-band dynamic tags used to indicate the offset and size of the
-// android packed relocations section.
-static constexpr int32_t DT_RELRSZ = 35;
-static constexpr int32_t DT_RELR = 36;
-static constexpr int32_t DT_RELRENT = 37;
-
-static constexpr uint32_t SHT_RELR = 19;
-
 static const size_t kPageSize = 4096;
 
 // Alignment to preserve, in bytes.  This must be at least as large as the
@@ -77,23 +80,34 @@ static void VerboseLogElfHeader(const Ehdr* elf_header) {
   VLOG(1) << "e_shstrndx = " << elf_header->e_shstrndx;
 }
 
+// Name a program header type, for logging and layout reports.
+static std::string ProgramHeaderTypeName(unsigned type) {
+  switch (type) {
+    case PT_NULL: return "NULL";
+    case PT_LOAD: return "LOAD";
+    case PT_DYNAMIC: return "DYNAMIC";
+    case PT_INTERP: return "INTERP";
+    case PT_NOTE: return "NOTE";
+    case PT_PHDR: return "PHDR";
+    case PT_TLS: return "TLS";
+    case PT_GNU_EH_FRAME: return "GNU_EH_FRAME";
+    case PT_GNU_RELRO: return "GNU_RELRO";
+    case PT_GNU_STACK: return "GNU_STACK";
+    case PT_ARM_EXIDX: return "EXIDX";
+    default: {
+      std::ostringstream name;
+      name << "0x" << std::hex << type;
+      return name.str();
+    }
+  }
+}
+
 // Verbose ELF program header logging.
 template <typename Phdr>
 static void VerboseLogProgramHeader(size_t program_header_index,
                              const Phdr* program_header) {
-  std::string type;
-  switch (program_header->p_type) {
-    case PT_NULL: type = "NULL"; break;
-    case PT_LOAD: type = "LOAD"; break;
-    case PT_DYNAMIC: type = "DYNAMIC"; break;
-    case PT_INTERP: type = "INTERP"; break;
-    case PT_PHDR: type = "PHDR"; break;
-    case PT_GNU_RELRO: type = "GNU_RELRO"; break;
-    case PT_GNU_STACK: type = "GNU_STACK"; break;
-    case PT_ARM_EXIDX: type = "EXIDX"; break;
-    default: type = "(OTHER)"; break;
-  }
-  VLOG(1) << "phdr[" << program_header_index << "] : " << type;
+  VLOG(1) << "phdr[" << program_header_index << "] : "
+          << ProgramHeaderTypeName(program_header->p_type);
   VLOG(1) << "  p_offset = " << program_header->p_offset;
   VLOG(1) << "  p_vaddr = " << program_header->p_vaddr;
   VLOG(1) << "  p_paddr = " << program_header->p_paddr;
@@ -124,6 +138,22 @@ static void VerboseLogSectionData(const Elf_Data* data) {
   VLOG(1) << "    d_align = " << data->d_align;
 }
 
+// Helper for Load().  True if |dynamic_section| holds an entry tagged |tag|
+// before DT_NULL.
+template <typename ELF>
+static bool HasDynamicEntry(Elf_Scn* dynamic_section, typename ELF::Sword tag) {
+  Elf_Data* data = GetSectionData(dynamic_section);
+  const typename ELF::Dyn* dynamics =
+      reinterpret_cast<const typename ELF::Dyn*>(data->d_buf);
+  for (size_t i = 0; i < data->d_size / sizeof(dynamics[0]); ++i) {
+    if (dynamics[i].d_tag == DT_NULL)
+      break;
+    if (dynamics[i].d_tag == tag)
+      return true;
+  }
+  return false;
+}
+
 // Load the complete ELF file into a memory image in libelf, and identify
 // the .rel.dyn or .rela.dyn, .dynamic, and .android.rel.dyn or
 // .android.rela.dyn sections.  No-op if the ELF file has already been loaded.
@@ -132,8 +162,13 @@ bool ElfFile<ELF>::Load() {
   if (elf_)
     return true;
 
-  Elf* elf = elf_begin(fd_, ELF_C_RDWR, NULL);
-  CHECK(elf);
+  // A dry run modifies only libelf's copy-on-write mapping of the file.
+  Elf* elf = elf_begin(fd_, layout_report_ ? ELF_C_READ_MMAP_PRIVATE
+                                           : ELF_C_RDWR, NULL);
+  if (!elf) {
+    LOG(ERROR) << "Failed to open ELF file: " << elf_errmsg(elf_errno());
+    return false;
+  }
 
   if (elf_kind(elf) != ELF_K_ELF) {
     LOG(ERROR) << "File not in ELF format";
@@ -154,15 +189,22 @@ bool ElfFile<ELF>::Load() {
   // Require that our endianness matches that of the target, and that both
   // are little-endian.  Safe for all current build/target combinations.
   const int endian = elf_header->e_ident[EI_DATA];
-  CHECK(endian == ELFDATA2LSB);
   CHECK(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  if (endian != ELFDATA2LSB) {
+    LOG(ERROR) << "ELF file is not little-endian";
+    return false;
+  }
 
   const int file_class = elf_header->e_ident[EI_CLASS];
   VLOG(1) << "endian = " << endian << ", file class = " << file_class;
   VerboseLogElfHeader(elf_header);
 
   auto elf_program_header = ELF::getphdr(elf);
-  CHECK(elf_program_header != nullptr);
+  if (!elf_program_header) {
+    LOG(ERROR) << "Failed to load program headers: "
+               << elf_errmsg(elf_errno());
+    return false;
+  }
 
   const typename ELF::Phdr* dynamic_program_header = NULL;
   for (size_t i = 0; i < elf_header->e_phnum; ++i) {
@@ -170,14 +212,23 @@ bool ElfFile<ELF>::Load() {
     VerboseLogProgramHeader(i, program_header);
 
     if (program_header->p_type == PT_DYNAMIC) {
-      CHECK(dynamic_program_header == NULL);
+      if (dynamic_program_header) {
+        LOG(ERROR) << "Multiple PT_DYNAMIC program headers";
+        return false;
+      }
       dynamic_program_header = program_header;
     }
   }
-  CHECK(dynamic_program_header != nullptr);
+  if (!dynamic_program_header) {
+    LOG(ERROR) << "Missing PT_DYNAMIC program header";
+    return false;
+  }
 
   size_t string_index;
-  elf_getshdrstrndx(elf, &string_index);
+  if (elf_getshdrstrndx(elf, &string_index) != 0) {
+    LOG(ERROR) << "Failed to find section names: " << elf_errmsg(elf_errno());
+    return false;
+  }
 
   // Notes of the dynamic relocations, packed relocations, and .dynamic
   // sections.  Found while iterating sections, and later stored in class
@@ -193,14 +244,22 @@ bool ElfFile<ELF>::Load() {
   Elf_Scn* section = NULL;
   while ((section = elf_nextscn(elf, section)) != nullptr) {
     auto section_header = ELF::getshdr(section);
-    std::string name = elf_strptr(elf, string_index, section_header->sh_name);
+    const char* section_name =
+        elf_strptr(elf, string_index, section_header->sh_name);
+    if (!section_name) {
+      LOG(ERROR) << "Bad section name: " << elf_errmsg(elf_errno());
+      return false;
+    }
+    std::string name = section_name;
     VerboseLogSectionHeader(name, section_header);
 
-    // Note relocation section types.
-    if (section_header->sh_type == SHT_REL) {
+    // Note relocation section types, APS2 packed or not.
+    if (section_header->sh_type == SHT_REL ||
+        section_header->sh_type == SHT_ANDROID_REL) {
       has_rel_relocations = true;
     }
-    if (section_header->sh_type == SHT_RELA) {
+    if (section_header->sh_type == SHT_RELA ||
+        section_header->sh_type == SHT_ANDROID_RELA) {
       has_rela_relocations = true;
     }
 
@@ -218,11 +277,22 @@ bool ElfFile<ELF>::Load() {
     }
 
     // Ensure we preserve alignment, repeated later for the data block(s).
-    CHECK(section_header->sh_addralign <= kPreserveAlignment);
+    // Moving a section by whole pages would misalign one aligned to more.
+    if (section_header->sh_addralign > kPreserveAlignment) {
+      LOG(ERROR) << "Section " << name << " aligned to "
+                 << section_header->sh_addralign << " bytes, more than "
+                 << kPreserveAlignment << " can be preserved";
+      return false;
+    }
 
     Elf_Data* data = NULL;
     while ((data = elf_getdata(section, data)) != NULL) {
-      CHECK(data->d_align <= kPreserveAlignment);
+      if (data->d_align > kPreserveAlignment) {
+        LOG(ERROR) << "Section " << name << " data aligned to "
+                   << data->d_align << " bytes, more than "
+                   << kPreserveAlignment << " can be preserved";
+        return false;
+      }
       VerboseLogSectionData(data);
     }
   }
@@ -246,18 +316,54 @@ bool ElfFile<ELF>::Load() {
     }
   }
 
-  if (!relr_section_) {
-    LOG(ERROR) << "Missing .relr.dyn section";
+  // A packed section whose dynamic tag is gone was unpacked by an earlier
+  // conversion and is no longer used.
+  if (relr_section_ &&
+      !HasDynamicEntry<ELF>(found_dynamic_section, DT_RELR)) {
+    relr_section_ = NULL;
+  }
+  const bool is_android_packed =
+      found_relocations_section &&
+      (HasDynamicEntry<ELF>(found_dynamic_section, DT_ANDROID_REL) ||
+       HasDynamicEntry<ELF>(found_dynamic_section, DT_ANDROID_RELA)) &&
+      (ELF::getshdr(found_relocations_section)->sh_type == SHT_ANDROID_REL ||
+       ELF::getshdr(found_relocations_section)->sh_type == SHT_ANDROID_RELA);
+  if (!relr_section_ && !is_android_packed) {
+    LOG(ERROR) << "Missing .relr.dyn section or APS2 packed relocations";
     return false;
   }
 
   elf_ = elf;
   relocations_section_ = found_relocations_section;
+  is_android_packed_ = is_android_packed;
   dynamic_section_ = found_dynamic_section;
   relocations_type_ = has_rel_relocations ? REL : RELA;
+
+  // Checksum the original blocks from the file itself: elf_rawfile()
+  // would leave libelf writing from its raw image.
+  if (block_size_) {
+    std::vector<uint8_t> file;
+    if (!ReadWholeFile(fd_, &file)) {
+      LOG(ERROR) << "read failed: " << strerror(errno);
+      return false;
+    }
+    const WriteExtent contents = {0, file.data(), file.size()};
+    ComputeBlockCrcs(std::vector<WriteExtent>(1, contents), file.size(),
+                     block_size_, &original_block_crcs_);
+  }
+
+  if (layout_report_)
+    RecordOriginalLayout();
   return true;
 }
 
+// Round |value| up to a multiple of |alignment|, which must be a power of
+// two.
+template <typename T>
+static T RoundUp(T value, size_t alignment) {
+  return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
+}
+
 // Helper for ResizeSection().  Adjust the main ELF header for the hole.
 template <typename ELF>
 static void AdjustElfHeaderForHole(typename ELF::Ehdr* elf_header,
@@ -458,9 +564,11 @@ void ElfFile<ELF>::AdjustDynamicSectionForHole(Elf_Scn* dynamic_section,
     }
 #endif
 
-    // DT_RELSZ or DT_RELASZ indicate the overall size of relocations.
-    // Only one will be present.  Adjust by hole size.
-    if (tag == DT_RELSZ || tag == DT_RELASZ) {
+    // DT_RELSZ or DT_RELASZ indicate the overall size of relocations, or
+    // DT_ANDROID_RELSZ or DT_ANDROID_RELASZ if they are APS2 packed.  Only
+    // one will be present.  Adjust by hole size.
+    if (tag == DT_RELSZ || tag == DT_RELASZ || tag == DT_ANDROID_RELSZ ||
+        tag == DT_ANDROID_RELASZ) {
       dynamic->d_un.d_val += hole_size;
       VLOG(1) << "dynamic[" << i << "] " << dynamic->d_tag
               << " d_val adjusted to " << dynamic->d_un.d_val;
@@ -489,9 +597,15 @@ void ElfFile<ELF>::AdjustDynamicSectionForHole(Elf_Scn* dynamic_section,
 
 // Resize a section.  If the new size is larger than the current size, open
 // up a hole by increasing file offsets that come after the hole.  If smaller
-// than the current size, remove the hole by decreasing those offsets.
+// than the current size, remove the hole by decreasing those offsets.  With
+// a nonzero |hole_alignment|, a hole opened is rounded up to a multiple of
+// it and a hole removed rounded down, leaving zero padding after the
+// section, so that later content moves only by whole multiples.
 template <typename ELF>
-void ElfFile<ELF>::ResizeSection(Elf* elf, Elf_Scn* section, size_t new_size) {
+void ElfFile<ELF>::ResizeSection(Elf* elf,
+                                 Elf_Scn* section,
+                                 size_t new_size,
+                                 size_t hole_alignment) {
 
   size_t string_index;
   elf_getshdrstrndx(elf, &string_index);
@@ -526,17 +640,27 @@ void ElfFile<ELF>::ResizeSection(Elf* elf, Elf_Scn* section, size_t new_size) {
   // Add the hole size to all offsets in the ELF file that are after the
   // start of the hole.  If the hole size is positive we are expanding the
   // section to create a new hole; if negative, we are closing up a hole.
+  // Content after an aligned hole moves by whole blocks.
+  ssize_t shift = hole_size;
+  if (hole_size > 0 && hole_alignment) {
+    shift = RoundUp(static_cast<size_t>(hole_size), hole_alignment);
+    VLOG(1) << "hole of " << hole_size << " bytes aligned to " << shift;
+  } else if (hole_size < 0 && hole_alignment) {
+    shift = -static_cast<ssize_t>(static_cast<size_t>(-hole_size) &
+                                  ~(hole_alignment - 1));
+    VLOG(1) << "hole of " << hole_size << " bytes aligned to " << shift;
+  }
 
   // Start with the main ELF header.
   typename ELF::Ehdr* elf_header = ELF::getehdr(elf);
-  AdjustElfHeaderForHole<ELF>(elf_header, hole_start, hole_size);
+  AdjustElfHeaderForHole<ELF>(elf_header, hole_start, shift);
 
   // Adjust all section headers.
-  AdjustSectionHeadersForHole<ELF>(elf, hole_start, hole_size);
+  AdjustSectionHeadersForHole<ELF>(elf, hole_start, shift);
 
   // Rewrite the program headers to either split or coalesce segments,
   // and adjust dynamic entries to match.
-  RewriteProgramHeadersForHole<ELF>(elf, hole_start, hole_size);
+  RewriteProgramHeadersForHole<ELF>(elf, hole_start, shift);
 
   Elf_Scn* dynamic_section = GetDynamicSection<ELF>(elf);
   AdjustDynamicSectionForHole(dynamic_section, hole_start, hole_size);
@@ -574,68 +698,425 @@ static void ReplaceDynamicEntry(typename ELF::Sword tag,
   VLOG(1) << "dynamic[" << slot << "] overwritten with " << dyn.d_tag;
 }
 
+// Remove dynamic entry.
+template <typename ELF>
+static void RemoveDynamicEntry(typename ELF::Sword tag,
+                               std::vector<typename ELF::Dyn>* dynamics) {
+  const size_t slot = FindDynamicEntry<ELF>(tag, dynamics);
+  if (slot == dynamics->size()) {
+    LOG(FATAL) << "Dynamic slot is not found for tag=" << tag;
+  }
+
+  dynamics->erase(dynamics->begin() + slot);
+  VLOG(1) << "dynamic[" << slot << "] removed, tag " << tag;
+}
+
 // Find packed relative relocations in the packed android relocations
 // section, unpack them, and rewrite the dynamic relocations section to
 // contain unpacked data.
 template <typename ELF>
 bool ElfFile<ELF>::UnpackRelocations() {
+  phase_start_ = MonotonicSeconds();
+  if (!CheckFileLimits())
+    return false;
+
   // Load the ELF file into libelf.
   if (!Load()) {
     LOG(ERROR) << "Failed to load as ELF";
     return false;
   }
+  EndPhase(PHASE_LOAD);
+
+  if (output_format_ == RELOCATION_STUB) {
+    if (!relr_section_) {
+      LOG(ERROR) << "Relocation stub needs .relr.dyn, not APS2";
+      return false;
+    }
+    return InjectRelocationStub();
+  }
 
   if (relocations_section_ == nullptr) {
-    // There is nothing to do
+    // There is nothing to expand, but debug information may need dropping.
+    if (debug_sections_ != KEEP_DEBUG_SECTIONS) {
+      return StripDebugSections() && Flush();
+    } else if (layout_report_) {
+      RecordLayout();
+    }
     return true;
   }
 
-  // Retrieve the current packed android relocations section data.
-  Elf_Data* data = GetSectionData(relr_section_);
+  // Check what expanding would cost before copying anything, counting
+  // .relr.dyn and any APS2 unless another conversion has already decoded
+  // them.
+  const bool is_decoded = decoded_ && decoded_->is_decoded;
+  const typename ELF::Relr* packed_base = NULL;
+  size_t packed_count = 0;
+  if (relr_section_) {
+    Elf_Data* data = GetSectionData(relr_section_);
+    packed_base = reinterpret_cast<typename ELF::Relr*>(data->d_buf);
+    packed_count = data->d_size / sizeof(packed_base[0]);
+  }
+
+  uint64_t expanded_count = 0;
+  if (is_decoded) {
+    expanded_count = decoded_->relocations.size();
+  } else if (CountExistingRelocations(&expanded_count)) {
+    expanded_count += CountRelr(packed_base, packed_count);
+  } else {
+    LOG(ERROR) << "Malformed APS2 packed relocations";
+    return false;
+  }
+  if (!CheckExpansionLimits(expanded_count) || !CheckTimeLimit("load"))
+    return false;
 
   // Convert data to a vector of bytes.
-  const typename ELF::Relr* packed_base = reinterpret_cast<typename ELF::Relr*>(data->d_buf);
-  std::vector<typename ELF::Relr> packed(
-      packed_base,
-      packed_base + data->d_size / sizeof(packed[0]));
+  std::vector<typename ELF::Relr> packed;
+  if (!is_decoded)
+    packed.assign(packed_base, packed_base + packed_count);
 
-  return UnpackTypedRelocations(packed);
+  return UnpackTypedRelocations(packed, expanded_count);
 }
 
-// Helper for UnpackRelocations().  Rel type is one of ELF::Rel or ELF::Rela.
+// Helper for CountExistingRelocations().  The number of words the PT_LOAD
+// segments of |elf| span in memory, which bounds how many relocations the
+// loader could apply to distinct targets.
 template <typename ELF>
-bool ElfFile<ELF>::UnpackTypedRelocations(const std::vector<typename ELF::Relr>& packed) {
-  // Retrieve the current dynamic relocations section data.
+static uint64_t CountLoadedWords(Elf* elf) {
+  const typename ELF::Ehdr* elf_header = ELF::getehdr(elf);
+  const typename ELF::Phdr* elf_program_header = ELF::getphdr(elf);
+  uint64_t words = 0;
+  for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+    if (elf_program_header[i].p_type == PT_LOAD)
+      words += elf_program_header[i].p_memsz / sizeof(typename ELF::Addr);
+  }
+  return words;
+}
+
+template <typename ELF>
+bool ElfFile<ELF>::CountExistingRelocations(uint64_t* count) {
   Elf_Data* data = GetSectionData(relocations_section_);
+  if (is_android_packed_) {
+    Aps2Decoder<ELF> decoder(static_cast<const uint8_t*>(data->d_buf),
+                             data->d_size, relocations_type_ == RELA);
+    if (!decoder.ReadHeader())
+      return false;
+    // A group sharing every field encodes any number of relocations in a
+    // few bytes, so the header count is bounded by what the file can hold,
+    // before anything is allocated for it.
+    const uint64_t loaded_words = CountLoadedWords<ELF>(elf_);
+    if (decoder.count() > loaded_words) {
+      LOG(ERROR) << "APS2 header counts " << decoder.count()
+                 << " relocations, more than the " << loaded_words
+                 << " loaded words";
+      return false;
+    }
+    *count = decoder.count();
+    return true;
+  }
+  const size_t relocation_entry_size =
+      relocations_type_ == REL ? sizeof(typename ELF::Rel) : sizeof(typename ELF::Rela);
+  *count = data->d_size / relocation_entry_size;
+  return true;
+}
 
-  std::vector<typename ELF::Rela> relocations;
+template <typename ELF>
+bool ElfFile<ELF>::DecodeExistingRelocations(
+    std::vector<typename ELF::Rela>* relocations) {
+  Elf_Data* data = GetSectionData(relocations_section_);
+  if (is_android_packed_) {
+    Aps2Decoder<ELF> decoder(static_cast<const uint8_t*>(data->d_buf),
+                             data->d_size, relocations_type_ == RELA);
+    return decoder.Decode(relocations);
+  }
   if (relocations_type_ == REL) {
     // Convert data to a vector of relocations.
     const typename ELF::Rel* relocations_base = reinterpret_cast<typename ELF::Rel*>(data->d_buf);
     ConvertRelArrayToRelaVector(relocations_base,
-        data->d_size / sizeof(typename ELF::Rel), &relocations);
+        data->d_size / sizeof(typename ELF::Rel), relocations);
   } else if (relocations_type_ == RELA) {
     // Convert data to a vector of relocations with addends.
     const typename ELF::Rela* relocations_base = reinterpret_cast<typename ELF::Rela*>(data->d_buf);
-    relocations = std::vector<typename ELF::Rela>(
-        relocations_base,
-        relocations_base + data->d_size / sizeof(relocations[0]));
+    relocations->insert(
+        relocations->end(), relocations_base,
+        relocations_base + data->d_size / sizeof(typename ELF::Rela));
   } else {
     NOTREACHED();
   }
+  return true;
+}
+
+// Helper for ResolveRelrRelocations() and PrelinkRelocations().  Find the
+// allocated section holding the |size| bytes at |address| in the file, or
+// return NULL.
+template <typename ELF>
+static Elf_Scn* FindSectionForAddress(Elf* elf,
+                                      typename ELF::Addr address,
+                                      size_t size) {
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    if ((section_header->sh_flags & SHF_ALLOC) &&
+        section_header->sh_type != SHT_NOBITS &&
+        address >= section_header->sh_addr &&
+        section_header->sh_size >= size &&
+        address - section_header->sh_addr <= section_header->sh_size - size) {
+      return section;
+    }
+  }
+  return NULL;
+}
+
+// Helper for UnpackTypedRelocations().  Give the relocations from index
+// |relr_first| on, which were expanded from .relr.dyn, the relative type of
+// |machine| and, if |has_addends|, the word at their target as addend, since
+// RELA relocations do not read it in place.  Returns the number of targets
+// not found in the file, whose addends are left zero.
+template <typename ELF>
+static size_t ResolveRelrRelocations(
+    Elf* elf,
+    unsigned machine,
+    bool has_addends,
+    size_t relr_first,
+    std::vector<typename ELF::Rela>* relocations) {
+  const typename ELF::Xword relative_info =
+      ELF::elf_r_info(0, RelativeRelocationType(machine));
+  size_t unresolved = 0;
+  Elf_Scn* target_section = NULL;
+  for (size_t i = relr_first; i < relocations->size(); ++i) {
+    typename ELF::Rela& relocation = relocations->at(i);
+    relocation.r_info = relative_info;
+    relocation.r_addend = 0;
+    if (!has_addends)
+      continue;
+
+    // Consecutive relocations mostly target the same section.
+    typename ELF::Addr value;
+    const typename ELF::Addr target = relocation.r_offset;
+    if (!target_section ||
+        target < ELF::getshdr(target_section)->sh_addr ||
+        target - ELF::getshdr(target_section)->sh_addr >
+            ELF::getshdr(target_section)->sh_size - sizeof(value)) {
+      target_section = FindSectionForAddress<ELF>(elf, target, sizeof(value));
+    }
+    if (!target_section) {
+      ++unresolved;
+      continue;
+    }
+    const typename ELF::Shdr* section_header = ELF::getshdr(target_section);
+    Elf_Data* data = GetSectionData(target_section);
+    if (data->d_off != 0 || data->d_size != section_header->sh_size) {
+      ++unresolved;
+      continue;
+    }
+    memcpy(&value, static_cast<const uint8_t*>(data->d_buf) +
+                       (target - section_header->sh_addr),
+           sizeof(value));
+    relocation.r_addend = value;
+  }
+  return unresolved;
+}
+
+// Helper for UnpackTypedRelocations().  Copy |relocations| to |ordered|
+// with the relative ones first: those from index |existing_count| on, which
+// were expanded from .relr.dyn, and any earlier of type |relative_type|.
+// Returns the number of relative relocations.
+template <typename ELF>
+static size_t OrderRelativeFirst(
+    const std::vector<typename ELF::Rela>& relocations,
+    size_t existing_count,
+    unsigned relative_type,
+    std::vector<typename ELF::Rela>* ordered) {
+  ordered->reserve(relocations.size());
+  for (size_t i = 0; i < existing_count; ++i) {
+    if (ELF::elf_r_type(relocations[i].r_info) == relative_type)
+      ordered->push_back(relocations[i]);
+  }
+  ordered->insert(ordered->end(), relocations.begin() + existing_count,
+                  relocations.end());
+  const size_t relative_count = ordered->size();
+  for (size_t i = 0; i < existing_count; ++i) {
+    if (ELF::elf_r_type(relocations[i].r_info) != relative_type)
+      ordered->push_back(relocations[i]);
+  }
+  return relative_count;
+}
+
+// Helper for UnpackTypedRelocations().  Encode |relocations| as APS2, with
+// those from index |existing_count| on, which were expanded from .relr.dyn
+// in address order, as relative relocations.  The encoding is padded with
+// zeroes, which APS2 decoders never reach, to a multiple of |alignment| so
+// that shrinking the section keeps later sections aligned.
+template <typename ELF>
+static void PackAndroidRelocations(
+    const std::vector<typename ELF::Rela>& relocations,
+    size_t existing_count,
+    unsigned machine,
+    bool has_addends,
+    size_t alignment,
+    std::vector<uint8_t>* packed) {
+  Aps2Encoder<ELF> encoder(
+      ELF::elf_r_info(0, RelativeRelocationType(machine)),
+      ELF::elf_r_info(0, IrelativeRelocationType(machine)), has_addends);
+  for (size_t i = 0; i < existing_count; ++i)
+    encoder.AddOther(relocations[i]);
+  for (size_t i = existing_count; i < relocations.size(); ++i)
+    encoder.AddRelative(relocations[i].r_offset, relocations[i].r_addend);
+  encoder.GetEncoding(packed);
+  if (alignment > 1)
+    packed->resize((packed->size() + alignment - 1) / alignment * alignment);
+}
+
+// Helper for UnpackTypedRelocations().  Set the value of |tag| to |value|,
+// adding it if absent.
+template <typename ELF>
+static void SetDynamicEntry(typename ELF::Sword tag,
+                            size_t value,
+                            std::vector<typename ELF::Dyn>* dynamics) {
+  typename ELF::Dyn dynamic;
+  dynamic.d_tag = tag;
+  dynamic.d_un.d_val = value;
+  if (FindDynamicEntry<ELF>(tag, dynamics) != dynamics->size()) {
+    ReplaceDynamicEntry<ELF>(tag, dynamic, dynamics);
+  } else {
+    dynamics->insert(dynamics->begin(), dynamic);
+    VLOG(1) << "dynamic[0] " << tag << " added";
+  }
+}
+
+// Helper for UnpackTypedRelocations().  Describe a packed relocations
+// section with the Android tags in place of the REL or RELA ones, and drop
+// the entry size and relative count, which no longer apply.
+template <typename ELF>
+static void UseAndroidPackedTags(bool is_rela,
+                                 std::vector<typename ELF::Dyn>* dynamics) {
+  const typename ELF::Sword tags[][2] = {
+    {is_rela ? DT_RELA : DT_REL, is_rela ? DT_ANDROID_RELA : DT_ANDROID_REL},
+    {is_rela ? DT_RELASZ : DT_RELSZ,
+     is_rela ? DT_ANDROID_RELASZ : DT_ANDROID_RELSZ},
+  };
+  for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); ++i) {
+    const size_t slot = FindDynamicEntry<ELF>(tags[i][0], dynamics);
+    if (slot != dynamics->size()) {
+      dynamics->at(slot).d_tag = tags[i][1];
+      VLOG(1) << "dynamic[" << slot << "] retagged " << tags[i][1];
+    }
+  }
+
+  const typename ELF::Sword dropped[] = {
+    is_rela ? DT_RELAENT : DT_RELENT, is_rela ? DT_RELACOUNT : DT_RELCOUNT
+  };
+  for (size_t i = 0; i < sizeof(dropped) / sizeof(dropped[0]); ++i) {
+    if (FindDynamicEntry<ELF>(dropped[i], dynamics) != dynamics->size())
+      RemoveDynamicEntry<ELF>(dropped[i], dynamics);
+  }
+}
+
+// Helper for UnpackTypedRelocations().  Describe an APS2 section expanded
+// in place with the REL or RELA tags in place of the Android ones, adding
+// the entry size |entry_size|.
+template <typename ELF>
+static void UsePlainRelocationTags(bool is_rela,
+                                   size_t entry_size,
+                                   std::vector<typename ELF::Dyn>* dynamics) {
+  const typename ELF::Sword tags[][2] = {
+    {is_rela ? DT_ANDROID_RELA : DT_ANDROID_REL, is_rela ? DT_RELA : DT_REL},
+    {is_rela ? DT_ANDROID_RELASZ : DT_ANDROID_RELSZ,
+     is_rela ? DT_RELASZ : DT_RELSZ},
+  };
+  for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); ++i) {
+    const size_t slot = FindDynamicEntry<ELF>(tags[i][0], dynamics);
+    if (slot != dynamics->size()) {
+      dynamics->at(slot).d_tag = tags[i][1];
+      VLOG(1) << "dynamic[" << slot << "] retagged " << tags[i][1];
+    }
+  }
+  SetDynamicEntry<ELF>(is_rela ? DT_RELAENT : DT_RELENT, entry_size,
+                       dynamics);
+}
+
+// Helper for UnpackRelocations().  Rel type is one of ELF::Rel or ELF::Rela.
+template <typename ELF>
+bool ElfFile<ELF>::UnpackTypedRelocations(const std::vector<typename ELF::Relr>& packed,
+                                          size_t expanded_count) {
+  // Retrieve the current dynamic relocations section data.
+  Elf_Data* data = GetSectionData(relocations_section_);
+
+  // Decode, or take the relocations another conversion decoded.
+  std::vector<typename ELF::Rela> decoded_relocations;
+  const std::vector<typename ELF::Rela>* relocations = &decoded_relocations;
+  size_t existing_count;
+  if (decoded_ && decoded_->is_decoded) {
+    relocations = &decoded_->relocations;
+    existing_count = decoded_->existing_count;
+  } else {
+    decoded_relocations.reserve(expanded_count);
+    if (!DecodeExistingRelocations(&decoded_relocations)) {
+      LOG(ERROR) << "Malformed APS2 packed relocations";
+      return false;
+    }
+    existing_count = decoded_relocations.size();
+
+    RelocationPacker<ELF> packer;
+    packer.UnpackRelocations(packed, &decoded_relocations);
+    const size_t unresolved = ResolveRelrRelocations<ELF>(
+        elf_, ELF::getehdr(elf_)->e_machine, relocations_type_ == RELA,
+        existing_count, &decoded_relocations);
+    if (unresolved) {
+      LOG(WARNING) << unresolved
+                   << " relative relocations target no file data, addend zero";
+    }
+
+    if (decoded_) {
+      decoded_->relocations.swap(decoded_relocations);
+      decoded_->existing_count = existing_count;
+      decoded_->is_decoded = true;
+      relocations = &decoded_->relocations;
+    }
+  }
 
-  LOG(INFO) << "Relocations      : " << relocations.size() << " entries";
+  LOG(INFO) << "Relocations      : " << existing_count << " entries";
 
-  const size_t packed_bytes = (relocations.size() * sizeof(relocations[0])) + data->d_size;
-  RelocationPacker<ELF> packer;
-  packer.UnpackRelocations(packed, &relocations);
+  const size_t packed_bytes = (existing_count * sizeof(typename ELF::Rela)) + data->d_size;
 
   // Unpack the data to re-materialize the relative relocations.
   LOG(INFO) << "Packed           : " << packed_bytes << " bytes";
 
+  // Lay the relocations out as the output format requires.
   const size_t relocation_entry_size =
       relocations_type_ == REL ? sizeof(typename ELF::Rel) : sizeof(typename ELF::Rela);
-  const size_t unpacked_bytes = relocations.size() * relocation_entry_size;
+  const std::vector<typename ELF::Rela>* output = relocations;
+  std::vector<typename ELF::Rela> ordered;
+  size_t relative_count = 0;
+  if (output_format_ == EXPAND_RELATIVE_FIRST) {
+    const unsigned relative_type =
+        RelativeRelocationType(ELF::getehdr(elf_)->e_machine);
+    relative_count = OrderRelativeFirst<ELF>(*relocations, existing_count,
+                                             relative_type, &ordered);
+    output = &ordered;
+  }
+
+  std::vector<uint8_t> android_relocations;
+  std::vector<typename ELF::Rel> rel_relocations;
+  const void* section_data = nullptr;
+  size_t unpacked_bytes = 0;
+  if (output_format_ == ANDROID_PACKED_RELOCATIONS) {
+    PackAndroidRelocations<ELF>(*relocations, existing_count,
+                                ELF::getehdr(elf_)->e_machine,
+                                relocations_type_ == RELA,
+                                ELF::getshdr(relocations_section_)->sh_addralign,
+                                &android_relocations);
+    section_data = &android_relocations[0];
+    unpacked_bytes = android_relocations.size();
+  } else if (relocations_type_ == RELA) {
+    section_data = &output->at(0);
+    unpacked_bytes = output->size() * relocation_entry_size;
+  } else if (relocations_type_ == REL) {
+    ConvertRelaVectorToRelVector(*output, &rel_relocations);
+    section_data = &rel_relocations[0];
+    unpacked_bytes = rel_relocations.size() * relocation_entry_size;
+  } else {
+    NOTREACHED();
+  }
   LOG(INFO) << "Unpacked         : " << unpacked_bytes << " bytes";
 
   // If we found the same number of null relocation entries in the dynamic
@@ -651,21 +1132,28 @@ bool ElfFile<ELF>::UnpackTypedRelocations(const std::vector<typename ELF::Relr>&
     LOG(INFO) << "Expansion     : " << unpacked_bytes - packed_bytes << " bytes";
   }
 
-  // Rewrite the current dynamic relocations section with unpacked version of
-  // relocations.
-  const void* section_data = nullptr;
-  if (relocations_type_ == RELA) {
-    section_data = &relocations[0];
-  } else if (relocations_type_ == REL) {
-    std::vector<typename ELF::Rel> rel_relocations;
-    ConvertRelaVectorToRelVector(relocations, &rel_relocations);
-    section_data = &rel_relocations[0];
-  } else {
-    NOTREACHED();
+  EndPhase(PHASE_DECODE);
+  if (!layout_report_) {
+    Metrics::AddRelocations(relocations->size() - existing_count);
   }
 
-  ResizeSection(elf_, relocations_section_, unpacked_bytes);
+  // Rewrite the current dynamic relocations section with unpacked version of
+  // relocations.
+  ResizeSection(elf_, relocations_section_, unpacked_bytes, block_size_);
   SetSectionData(relocations_section_, section_data, unpacked_bytes);
+  if (output_format_ == ANDROID_PACKED_RELOCATIONS) {
+    typename ELF::Shdr* section_header = ELF::getshdr(relocations_section_);
+    section_header->sh_type =
+        relocations_type_ == RELA ? SHT_ANDROID_RELA : SHT_ANDROID_REL;
+    section_header->sh_entsize = 1;
+    GetSectionData(relocations_section_)->d_type = ELF_T_BYTE;
+  } else if (is_android_packed_) {
+    typename ELF::Shdr* section_header = ELF::getshdr(relocations_section_);
+    section_header->sh_type = relocations_type_ == RELA ? SHT_RELA : SHT_REL;
+    section_header->sh_entsize = relocation_entry_size;
+    GetSectionData(relocations_section_)->d_type =
+        relocations_type_ == RELA ? ELF_T_RELA : ELF_T_REL;
+  }
 
   // Rewrite .dynamic to remove two tags describing packed android relocations.
   data = GetSectionData(dynamic_section_);
@@ -673,66 +1161,1208 @@ bool ElfFile<ELF>::UnpackTypedRelocations(const std::vector<typename ELF::Relr>&
   std::vector<typename ELF::Dyn> dynamics(
       dynamic_base,
       dynamic_base + data->d_size / sizeof(dynamics[0]));
-  {
-    const typename ELF::Sword tag = DT_RELRSZ;
-    const size_t slot = FindDynamicEntry<ELF>(tag, &dynamics);
-    if (slot == dynamics.size()) {
-      LOG(FATAL) << "Dynamic slot is not found for tag=" << tag;
+  if (relr_section_) {
+    RemoveDynamicEntry<ELF>(DT_RELRSZ, &dynamics);
+    RemoveDynamicEntry<ELF>(DT_RELR, &dynamics);
+    RemoveDynamicEntry<ELF>(DT_RELRENT, &dynamics);
+  }
+  if (is_android_packed_ && output_format_ != ANDROID_PACKED_RELOCATIONS) {
+    UsePlainRelocationTags<ELF>(relocations_type_ == RELA,
+                                relocation_entry_size, &dynamics);
+  }
+  if (output_format_ == EXPAND_RELATIVE_FIRST) {
+    SetDynamicEntry<ELF>(relocations_type_ == RELA ? DT_RELACOUNT
+                                                   : DT_RELCOUNT,
+                         relative_count, &dynamics);
+  } else if (output_format_ == ANDROID_PACKED_RELOCATIONS) {
+    UseAndroidPackedTags<ELF>(relocations_type_ == RELA, &dynamics);
+  }
+  if (prelink_scope_ && relocations_type_ == RELA)
+    SetDynamicEntry<ELF>(DT_GNU_PRELINKED, prelink_base_, &dynamics);
+
+  const void* dynamics_data = &dynamics[0];
+  const size_t dynamics_bytes = dynamics.size() * sizeof(dynamics[0]);
+  ResizeSection(elf_, dynamic_section_, dynamics_bytes, block_size_);
+  SetSectionData(dynamic_section_, dynamics_data, dynamics_bytes);
+  PrelinkRelocations(relocations->data(), relocations->size(),
+                     existing_count);
+  EndPhase(PHASE_RELAYOUT);
+
+  return CheckTimeLimit("relayout") && StripDebugSections() && Flush();
+}
+
+static uint64_t MonotonicTimeMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+// Note the file size and start the clock, and reject a file too large to
+// load or to convert into an acceptable output.
+template <typename ELF>
+bool ElfFile<ELF>::CheckFileLimits() {
+  deadline_ms_ = limits_.max_time_ms ? MonotonicTimeMs() + limits_.max_time_ms
+                                     : 0;
+
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    LOG(ERROR) << "fstat failed: " << strerror(errno);
+    return false;
+  }
+  file_size_ = file_stat.st_size;
+
+  // Loading holds an image of the whole file.
+  if (limits_.max_memory_bytes && file_size_ > limits_.max_memory_bytes) {
+    LOG(ERROR) << "File of " << file_size_ << " bytes exceeds memory limit of "
+               << limits_.max_memory_bytes << " bytes";
+    return false;
+  }
+  if (limits_.max_output_bytes && file_size_ > limits_.max_output_bytes) {
+    LOG(ERROR) << "File of " << file_size_ << " bytes exceeds output limit of "
+               << limits_.max_output_bytes << " bytes";
+    return false;
+  }
+  return true;
+}
+
+// Reject an expansion to |expanded_count| relocations that is too large.
+// Memory is the loaded file, the packed copy, the relocations vector and
+// the rewritten section, plus the REL conversion where used.
+template <typename ELF>
+bool ElfFile<ELF>::CheckExpansionLimits(uint64_t expanded_count) {
+  const uint64_t entry_size =
+      relocations_type_ == REL ? sizeof(typename ELF::Rel) : sizeof(typename ELF::Rela);
+  const uint64_t section_size = ELF::getshdr(relocations_section_)->sh_size;
+  const uint64_t expanded_bytes = expanded_count * entry_size;
+  const uint64_t output_bytes = file_size_ + expanded_bytes - section_size;
+  const uint64_t memory_bytes =
+      file_size_ + (relr_section_ ? ELF::getshdr(relr_section_)->sh_size : 0) +
+      expanded_count * sizeof(typename ELF::Rela) +
+      expanded_bytes * (relocations_type_ == REL ? 2 : 1);
+
+  LOG(INFO) << "Expanded         : " << expanded_count << " entries";
+  if (limits_.max_relocations && expanded_count > limits_.max_relocations) {
+    LOG(ERROR) << "Expansion to " << expanded_count
+               << " relocations exceeds limit of " << limits_.max_relocations;
+    return false;
+  }
+  if (limits_.max_output_bytes && output_bytes > limits_.max_output_bytes) {
+    LOG(ERROR) << "Output of " << output_bytes << " bytes exceeds limit of "
+               << limits_.max_output_bytes << " bytes";
+    return false;
+  }
+  if (limits_.max_memory_bytes && memory_bytes > limits_.max_memory_bytes) {
+    LOG(ERROR) << "Expansion needs about " << memory_bytes
+               << " bytes, exceeding memory limit of "
+               << limits_.max_memory_bytes << " bytes";
+    return false;
+  }
+  return true;
+}
+
+// Reject a conversion that has run out of time after |stage|.  Checked only
+// before the file is written, so a rejected file is unchanged.
+template <typename ELF>
+bool ElfFile<ELF>::CheckTimeLimit(const char* stage) {
+  if (deadline_ms_ && MonotonicTimeMs() > deadline_ms_) {
+    LOG(ERROR) << "Time limit of " << limits_.max_time_ms << " ms exceeded"
+               << " after " << stage;
+    return false;
+  }
+  return true;
+}
+
+template <typename ELF>
+void ElfFile<ELF>::EndPhase(conversion_phase_t phase) {
+  const double now = MonotonicSeconds();
+  if (!layout_report_)
+    Metrics::ObservePhase(phase, now - phase_start_);
+  phase_start_ = now;
+}
+
+// Helper for InjectRelocationStub().  Find a PT_NULL program header that
+// can be overwritten with the stub's LOAD segment.  Returns |count| if
+// there is none.
+template <typename ELF>
+static size_t FindProgramHeaderSlotForStub(
+    const typename ELF::Phdr* program_headers, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (program_headers[i].p_type == PT_NULL) {
+      return i;
+    }
+  }
+  return count;
+}
+
+// Helper for InjectRelocationStub().  Loaders expect PT_LOAD entries sorted
+// by p_vaddr.  The stub segment has the highest address, so if its slot
+// precedes another PT_LOAD entry, rotate it to follow the last one.
+template <typename ELF>
+static void MoveProgramHeaderAfterLastLoad(typename ELF::Phdr* program_headers,
+                                           size_t count,
+                                           size_t slot) {
+  size_t last_load = slot;
+  for (size_t i = slot + 1; i < count; ++i) {
+    if (program_headers[i].p_type == PT_LOAD) {
+      last_load = i;
+    }
+  }
+  if (last_load == slot) {
+    return;
+  }
+
+  const typename ELF::Phdr moved = program_headers[slot];
+  memmove(&program_headers[slot], &program_headers[slot + 1],
+          (last_load - slot) * sizeof(moved));
+  program_headers[last_load] = moved;
+  VLOG(1) << "phdr[" << slot << "] moved to phdr[" << last_load << "]";
+}
+
+// Keep .relr.dyn, and append a stub that applies it at startup.  The stub
+// goes in a new executable LOAD segment at the end of the file and address
+// space, followed by the (moved and extended) section name string table and
+// the section header table.  Nothing already in the file moves, except the
+// program header table when it has no PT_NULL entry to spare.
+template <typename ELF>
+bool ElfFile<ELF>::InjectRelocationStub() {
+  typename ELF::Ehdr* elf_header = ELF::getehdr(elf_);
+  CHECK(elf_header);
+
+  if (!HasRelrStub(elf_header->e_machine, elf_header->e_ident[EI_CLASS])) {
+    LOG(ERROR) << "Relocation stub not supported for e_machine "
+               << elf_header->e_machine;
+    return false;
+  }
+
+  typename ELF::Phdr* elf_program_header = ELF::getphdr(elf_);
+  CHECK(elf_program_header);
+  size_t program_header_count = elf_header->e_phnum;
+
+  size_t slot = FindProgramHeaderSlotForStub<ELF>(elf_program_header,
+                                                  program_header_count);
+
+  RelrStubParams params = {};
+  const typename ELF::Shdr* relr_header = ELF::getshdr(relr_section_);
+  params.relr_vaddr = relr_header->sh_addr;
+  params.relr_size = relr_header->sh_size;
+
+  // Find the ends of the file content and of the address space, and the
+  // largest LOAD alignment.  Note the PT_GNU_RELRO range; the loader
+  // protects it before DT_INIT runs.
+  typename ELF::Off content_end =
+      elf_header->e_phoff + program_header_count * sizeof(typename ELF::Phdr);
+  typename ELF::Addr vaddr_end = 0;
+  size_t load_alignment = kPageSize;
+  for (size_t i = 0; i < program_header_count; ++i) {
+    const typename ELF::Phdr* program_header = &elf_program_header[i];
+
+    if (program_header->p_type == PT_LOAD) {
+      content_end = std::max(content_end, static_cast<typename ELF::Off>(
+          program_header->p_offset + program_header->p_filesz));
+      vaddr_end = std::max(vaddr_end, static_cast<typename ELF::Addr>(
+          program_header->p_vaddr + program_header->p_memsz));
+      load_alignment = std::max(load_alignment,
+                                static_cast<size_t>(program_header->p_align));
+    }
+
+    if (program_header->p_type == PT_GNU_RELRO) {
+      // Unprotect whole pages covering the range, but reprotect only whole
+      // pages inside it: the last partial page may be shared with .data.
+      const typename ELF::Addr relro_end =
+          program_header->p_vaddr + program_header->p_memsz;
+      params.relro_vaddr = program_header->p_vaddr & ~(kPageSize - 1);
+      params.relro_size = RoundUp(relro_end, kPageSize) - params.relro_vaddr;
+      params.relro_protect_size =
+          (relro_end & ~(kPageSize - 1)) - params.relro_vaddr;
+    }
+  }
+
+  size_t string_index;
+  elf_getshdrstrndx(elf_, &string_index);
+
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    const typename ELF::Off section_end = section_header->sh_offset +
+        (section_header->sh_type == SHT_NOBITS ? 0 : section_header->sh_size);
+    content_end = std::max(content_end, section_end);
+  }
+
+  // The stub starts a block of its own, so that it leaves the blocks of
+  // the content before it unchanged.
+  const typename ELF::Off stub_offset =
+      RoundUp(content_end, std::max(load_alignment, block_size_));
+  const typename ELF::Addr stub_vaddr = RoundUp(vaddr_end, load_alignment);
+  params.stub_vaddr = stub_vaddr;
+
+  // Rewrite .dynamic to remove the tags describing packed relocations, and
+  // install the stub as DT_INIT, chaining to any existing DT_INIT.  Mark a
+  // prelinked file.  Pad with DT_NULL so that .dynamic keeps its size.
+  Elf_Data* data = GetSectionData(dynamic_section_);
+  const typename ELF::Dyn* dynamic_base =
+      reinterpret_cast<typename ELF::Dyn*>(data->d_buf);
+  std::vector<typename ELF::Dyn> dynamics(
+      dynamic_base,
+      dynamic_base + data->d_size / sizeof(dynamics[0]));
+  const size_t dynamics_count = dynamics.size();
+
+  RemoveDynamicEntry<ELF>(DT_RELRSZ, &dynamics);
+  RemoveDynamicEntry<ELF>(DT_RELR, &dynamics);
+  RemoveDynamicEntry<ELF>(DT_RELRENT, &dynamics);
+
+  const size_t init_slot = FindDynamicEntry<ELF>(DT_INIT, &dynamics);
+  if (init_slot != dynamics.size()) {
+    params.init = dynamics[init_slot].d_un.d_ptr;
+    dynamics[init_slot].d_un.d_ptr = stub_vaddr;
+    VLOG(1) << "dynamic[" << init_slot << "] DT_INIT chained to stub";
+  } else {
+    typename ELF::Dyn init;
+    init.d_tag = DT_INIT;
+    init.d_un.d_ptr = stub_vaddr;
+    dynamics.insert(dynamics.begin(), init);
+    VLOG(1) << "dynamic[0] DT_INIT added for stub";
+  }
+  const bool is_prelinked = prelink_scope_ && relocations_section_ &&
+                            relocations_type_ == RELA && !is_android_packed_;
+  if (is_prelinked)
+    SetDynamicEntry<ELF>(DT_GNU_PRELINKED, prelink_base_, &dynamics);
+
+  typename ELF::Dyn null_dynamic;
+  null_dynamic.d_tag = DT_NULL;
+  null_dynamic.d_un.d_val = 0;
+  dynamics.resize(dynamics_count, null_dynamic);
+  SetSectionData(dynamic_section_, &dynamics[0],
+                 dynamics.size() * sizeof(dynamics[0]));
+
+  std::vector<uint8_t> stub;
+  if (!BuildRelrStub(elf_header->e_machine, params, &stub)) {
+    return false;
+  }
+
+  // Linkers rarely leave a PT_NULL entry spare.  Then move the program
+  // header table into the stub's segment, after the stub, with one entry
+  // more, rather than give up a segment such as PT_GNU_RELRO.  A loader
+  // reads it through e_phoff, and finds it mapped through PT_PHDR.  The
+  // old table is left in place, unreferenced.
+  size_t segment_size = stub.size();
+  if (slot == program_header_count) {
+    const std::vector<typename ELF::Phdr> program_headers(
+        elf_program_header, elf_program_header + program_header_count);
+    const typename ELF::Off table_offset =
+        RoundUp(stub_offset + stub.size(), sizeof(typename ELF::Off));
+    const size_t table_size =
+        (program_header_count + 1) * sizeof(typename ELF::Phdr);
+    elf_program_header = ELF::newphdr(elf_, program_header_count + 1);
+    CHECK(elf_program_header);
+    std::copy(program_headers.begin(), program_headers.end(),
+              elf_program_header);
+    elf_header->e_phoff = table_offset;
+    segment_size = table_offset + table_size - stub_offset;
+    for (size_t i = 0; i < program_header_count; ++i) {
+      typename ELF::Phdr* program_header = &elf_program_header[i];
+      if (program_header->p_type == PT_PHDR) {
+        program_header->p_offset = table_offset;
+        program_header->p_vaddr = stub_vaddr + (table_offset - stub_offset);
+        program_header->p_paddr = program_header->p_vaddr;
+        program_header->p_filesz = table_size;
+        program_header->p_memsz = table_size;
+      }
     }
+    slot = program_header_count++;
+    is_program_header_table_moved_ = true;
+    VLOG(1) << "e_phoff adjusted to " << elf_header->e_phoff
+            << ", e_phnum to " << program_header_count;
+  }
 
-    dynamics.erase(dynamics.begin() + slot);
+  // Extend the section name string table with the stub section name, and
+  // move it to follow the stub, where it cannot overlap anything else.
+  static const char kStubSectionName[] = ".relr.init";
+  Elf_Scn* string_section = elf_getscn(elf_, string_index);
+  CHECK(string_section);
+  typename ELF::Shdr* string_header = ELF::getshdr(string_section);
+  Elf_Data* string_data = GetSectionData(string_section);
+  const uint8_t* string_base = static_cast<uint8_t*>(string_data->d_buf);
+  std::vector<uint8_t> strings(string_base, string_base + string_data->d_size);
+  const size_t name_offset = strings.size();
+  strings.insert(strings.end(), kStubSectionName,
+                 kStubSectionName + sizeof(kStubSectionName));
+  string_data->d_size = strings.size();
+  string_header->sh_size = strings.size();
+  string_header->sh_offset = stub_offset + segment_size;
+  SetSectionData(string_section, &strings[0], strings.size());
+
+  // Add a section describing the stub.
+  Elf_Scn* stub_section = elf_newscn(elf_);
+  CHECK(stub_section);
+  typename ELF::Shdr* stub_header = ELF::getshdr(stub_section);
+  stub_header->sh_name = name_offset;
+  stub_header->sh_type = SHT_PROGBITS;
+  stub_header->sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  stub_header->sh_addr = stub_vaddr;
+  stub_header->sh_offset = stub_offset;
+  stub_header->sh_size = stub.size();
+  stub_header->sh_addralign = RelrStubAlignment();
+
+  Elf_Data* stub_data = elf_newdata(stub_section);
+  CHECK(stub_data);
+  uint8_t* area = new uint8_t[stub.size()];
+  memcpy(area, &stub[0], stub.size());
+  stub_data->d_buf = area;
+  stub_data->d_size = stub.size();
+  stub_data->d_type = ELF_T_BYTE;
+  stub_data->d_off = 0;
+  stub_data->d_align = RelrStubAlignment();
+  stub_data->d_version = EV_CURRENT;
+
+  // The section header table follows the string table.
+  elf_header->e_shoff = RoundUp(string_header->sh_offset +
+                                string_header->sh_size,
+                                sizeof(typename ELF::Off));
+  VLOG(1) << "e_shoff adjusted to " << elf_header->e_shoff;
+
+  // Overwrite the chosen program header with the stub LOAD segment.
+  typename ELF::Phdr* stub_program_header = &elf_program_header[slot];
+  stub_program_header->p_type = PT_LOAD;
+  stub_program_header->p_flags = PF_R | PF_X;
+  stub_program_header->p_offset = stub_offset;
+  stub_program_header->p_vaddr = stub_vaddr;
+  stub_program_header->p_paddr = stub_vaddr;
+  stub_program_header->p_filesz = segment_size;
+  stub_program_header->p_memsz = segment_size;
+  stub_program_header->p_align = load_alignment;
+  VerboseLogProgramHeader(slot, stub_program_header);
+  MoveProgramHeaderAfterLastLoad<ELF>(elf_program_header,
+                                      program_header_count, slot);
+
+  LOG(INFO) << "Relr             : " << params.relr_size << " bytes";
+  LOG(INFO) << "Stub             : " << stub.size() << " bytes at 0x"
+            << std::hex << stub_vaddr << std::dec;
+
+  // The stub adds the load base to .relr.dyn targets at startup, so only
+  // .rela.dyn is prelinked.
+  if (is_prelinked) {
+    Elf_Data* relocations_data = GetSectionData(relocations_section_);
+    const size_t count =
+        relocations_data->d_size / sizeof(typename ELF::Rela);
+    PrelinkRelocations(
+        reinterpret_cast<const typename ELF::Rela*>(relocations_data->d_buf),
+        count, count);
   }
-  {
-    const typename ELF::Sword tag = DT_RELR;
-    const size_t slot = FindDynamicEntry<ELF>(tag, &dynamics);
-    if (slot == dynamics.size()) {
-      LOG(FATAL) << "Dynamic slot is not found for tag=" << tag;
+  EndPhase(PHASE_RELAYOUT);
+
+  return CheckTimeLimit("relayout") && StripDebugSections() && Flush();
+}
+
+template <typename ELF>
+bool ElfFile<ELF>::CheckPrelinkNeeded() {
+  Elf_Data* data = GetSectionData(dynamic_section_);
+  const typename ELF::Dyn* dynamics =
+      reinterpret_cast<const typename ELF::Dyn*>(data->d_buf);
+  const size_t string_index = ELF::getshdr(dynamic_section_)->sh_link;
+  bool is_complete = true;
+  for (size_t i = 0; i < data->d_size / sizeof(dynamics[0]); ++i) {
+    if (dynamics[i].d_tag == DT_NULL)
+      break;
+    if (dynamics[i].d_tag != DT_NEEDED)
+      continue;
+    const char* name = elf_strptr(elf_, string_index, dynamics[i].d_un.d_val);
+    if (!name || !prelink_scope_->HasLibrary(name)) {
+      LOG(WARNING) << "Prelink map lacks needed library "
+                   << (name ? name : "(bad name)")
+                   << ", undefined weak symbols left to the loader";
+      is_complete = false;
     }
+  }
+  return is_complete;
+}
+
+template <typename ELF>
+void ElfFile<ELF>::PrelinkRelocations(const typename ELF::Rela* relocations,
+                                      size_t count,
+                                      size_t relr_first) {
+  if (!prelink_scope_ || count == 0)
+    return;
+  if (relocations_type_ != RELA) {
+    LOG(WARNING) << "Prelinking needs .rela.dyn, not prelinked";
+    return;
+  }
+
+  // Only a map listing every needed library shows that an undefined weak
+  // symbol is defined nowhere, and so resolves to zero.
+  const bool is_weak_zero = CheckPrelinkNeeded();
 
-    dynamics.erase(dynamics.begin() + slot);
+  // Symbol names come from .dynsym and its string table.
+  Elf_Scn* symbol_section = NULL;
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    if (ELF::getshdr(section)->sh_type == SHT_DYNSYM)
+      symbol_section = section;
+  }
+  const typename ELF::Sym* symbols = NULL;
+  size_t symbol_count = 0;
+  size_t string_index = 0;
+  if (symbol_section) {
+    Elf_Data* data = GetSectionData(symbol_section);
+    symbols = reinterpret_cast<const typename ELF::Sym*>(data->d_buf);
+    symbol_count = data->d_size / sizeof(symbols[0]);
+    string_index = ELF::getshdr(symbol_section)->sh_link;
   }
-  {
-    const typename ELF::Sword tag = DT_RELRENT;
-    const size_t slot = FindDynamicEntry<ELF>(tag, &dynamics);
-    if (slot == dynamics.size()) {
-      LOG(FATAL) << "Dynamic slot is not found for tag=" << tag;
+
+  const unsigned machine = ELF::getehdr(elf_)->e_machine;
+  size_t prelinked = 0;
+  size_t weak_zero = 0;
+  size_t unresolved = 0;
+  Elf_Scn* target_section = NULL;
+  for (size_t i = 0; i < count; ++i) {
+    const typename ELF::Rela& relocation = relocations[i];
+    const bool is_relr = i >= relr_first;
+    const prelink_value_t kind =
+        is_relr ? PRELINK_RELATIVE
+                : PrelinkValueKind(machine, ELF::elf_r_type(relocation.r_info));
+    if (kind == PRELINK_NONE) {
+      ++unresolved;
+      continue;
     }
 
-    dynamics.erase(dynamics.begin() + slot);
+    // Consecutive relocations mostly target the same section.
+    typename ELF::Addr value = 0;
+    const typename ELF::Addr target = relocation.r_offset;
+    if (!target_section ||
+        target < ELF::getshdr(target_section)->sh_addr ||
+        target - ELF::getshdr(target_section)->sh_addr >
+            ELF::getshdr(target_section)->sh_size - sizeof(value)) {
+      target_section = FindSectionForAddress<ELF>(elf_, target, sizeof(value));
+    }
+    if (!target_section) {
+      ++unresolved;
+      continue;
+    }
+    const typename ELF::Shdr* section_header = ELF::getshdr(target_section);
+    Elf_Data* data = GetSectionData(target_section);
+    CHECK(data->d_off == 0 && data->d_size == section_header->sh_size);
+    uint8_t* word = static_cast<uint8_t*>(data->d_buf) +
+                    (target - section_header->sh_addr);
+
+    bool is_resolved = true;
+    bool is_weak = false;
+    if (is_relr) {
+      memcpy(&value, word, sizeof(value));
+      value += prelink_base_;
+    } else if (kind == PRELINK_RELATIVE) {
+      value = prelink_base_ + relocation.r_addend;
+    } else {
+      const size_t index = ELF::elf_r_sym(relocation.r_info);
+      uint64_t address = 0;
+      if (index != 0) {
+        if (index >= symbol_count) {
+          is_resolved = false;
+        } else if (ELF32_ST_BIND(symbols[index].st_info) == STB_LOCAL &&
+                   symbols[index].st_shndx != SHN_UNDEF) {
+          address = prelink_base_ + symbols[index].st_value;
+        } else {
+          // An undefined weak symbol that nothing defines is zero.
+          const char* name =
+              elf_strptr(elf_, string_index, symbols[index].st_name);
+          is_resolved = name && prelink_scope_->Lookup(name, &address);
+          is_weak = name && !is_resolved && is_weak_zero &&
+                    symbols[index].st_shndx == SHN_UNDEF &&
+                    ELF32_ST_BIND(symbols[index].st_info) == STB_WEAK;
+          is_resolved = is_resolved || is_weak;
+          VLOG_IF(1, !is_resolved) << "Prelink: unresolved "
+                                   << (name ? name : "(bad name)");
+        }
+      }
+      value = address;
+      if (kind == PRELINK_SYMBOL)
+        value += relocation.r_addend;
+    }
+    if (!is_resolved) {
+      ++unresolved;
+      continue;
+    }
+
+    memcpy(word, &value, sizeof(value));
+    elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
+    if (is_weak)
+      ++weak_zero;
+    else
+      ++prelinked;
   }
 
-  const void* dynamics_data = &dynamics[0];
-  const size_t dynamics_bytes = dynamics.size() * sizeof(dynamics[0]);
-  ResizeSection(elf_, dynamic_section_, dynamics_bytes);
-  SetSectionData(dynamic_section_, dynamics_data, dynamics_bytes);
+  LOG(INFO) << "Prelinked        : " << prelinked << " of " << count
+            << " relocations, " << weak_zero
+            << " to undefined weak symbols as zero, " << unresolved
+            << " left to the loader";
+}
+
+// Bytes of the file that |section_header| occupies.
+template <typename ELF>
+static uint64_t SectionFileSize(const typename ELF::Shdr* section_header) {
+  return section_header->sh_type == SHT_NOBITS ? 0 : section_header->sh_size;
+}
+
+// Helper for StripDebugSections().  True for the names of sections that
+// hold debug information, which no loader reads.
+static bool IsDebugSectionName(const std::string& name) {
+  return name.compare(0, 7, ".debug_") == 0 ||
+         name.compare(0, 8, ".zdebug_") == 0 ||
+         name == ".symtab" || name == ".strtab";
+}
+
+template <typename ELF>
+bool ElfFile<ELF>::StripDebugSections() {
+  if (debug_sections_ == KEEP_DEBUG_SECTIONS)
+    return true;
+
+  typename ELF::Ehdr* elf_header = ELF::getehdr(elf_);
+  const typename ELF::Phdr* elf_program_header = ELF::getphdr(elf_);
+  size_t string_index;
+  elf_getshdrstrndx(elf_, &string_index);
+
+  // Flag the debug sections, and find the end of the content a loader
+  // maps, which does not move.
+  typename ELF::Off content_end = std::max(
+      static_cast<typename ELF::Off>(sizeof(typename ELF::Ehdr)),
+      static_cast<typename ELF::Off>(
+          elf_header->e_phoff +
+          elf_header->e_phnum * sizeof(typename ELF::Phdr)));
+  for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+    if (elf_program_header[i].p_type == PT_LOAD) {
+      content_end = std::max(content_end, static_cast<typename ELF::Off>(
+          elf_program_header[i].p_offset + elf_program_header[i].p_filesz));
+    }
+  }
+
+  std::vector<bool> is_debug(1, false);
+  size_t debug_count = 0;
+  uint64_t debug_bytes = 0;
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    const std::string name =
+        elf_strptr(elf_, string_index, section_header->sh_name);
+    if (section_header->sh_flags & SHF_ALLOC) {
+      content_end = std::max(content_end, static_cast<typename ELF::Off>(
+          section_header->sh_offset + SectionFileSize<ELF>(section_header)));
+      is_debug.push_back(false);
+      continue;
+    }
+    is_debug.push_back(elf_ndxscn(section) != string_index &&
+                       IsDebugSectionName(name));
+    if (is_debug.back()) {
+      ++debug_count;
+      debug_bytes += SectionFileSize<ELF>(section_header);
+    }
+  }
+  if (!debug_count) {
+    LOG(INFO) << "Debug sections   : none";
+    return true;
+  }
+
+  // Write the debug file while its sections are intact, and describe it
+  // for .gnu_debuglink: the file name, padded to four bytes, then its
+  // CRC-32.  A dry run leaves the CRC-32 zero.
+  std::vector<uint8_t> debuglink;
+  if (debug_sections_ == SPLIT_DEBUG_SECTIONS) {
+    uint32_t crc = 0;
+    if (!layout_report_ && !WriteDebugFile(is_debug, &crc))
+      return false;
+    const size_t last_slash = debug_path_.find_last_of("/");
+    const std::string base = last_slash == std::string::npos
+        ? debug_path_ : debug_path_.substr(last_slash + 1);
+    debuglink.assign(base.begin(), base.end());
+    debuglink.resize(RoundUp(base.size() + 1, 4), 0);
+    for (size_t i = 0; i < 4; ++i)
+      debuglink.push_back(crc >> (8 * i));
+  }
+
+  // Empty the debug sections, leaving null section headers so that the
+  // indices of the rest are unchanged, and unlink anything linked to them.
+  section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    typename ELF::Shdr* section_header = ELF::getshdr(section);
+    if (is_debug[elf_ndxscn(section)]) {
+      Elf_Data* data = NULL;
+      while ((data = elf_getdata(section, data)) != NULL) {
+        data->d_size = 0;
+        data->d_align = 1;
+      }
+      memset(section_header, 0, sizeof(*section_header));
+    } else if (section_header->sh_link < is_debug.size() &&
+               is_debug[section_header->sh_link]) {
+      section_header->sh_link = 0;
+    }
+  }
+
+  // Add .gnu_debuglink, naming it as InjectRelocationStub() names its
+  // section.
+  Elf_Scn* debuglink_section = NULL;
+  if (!debuglink.empty()) {
+    static const char kDebuglinkSectionName[] = ".gnu_debuglink";
+    Elf_Scn* string_section = elf_getscn(elf_, string_index);
+    CHECK(string_section);
+    typename ELF::Shdr* string_header = ELF::getshdr(string_section);
+    Elf_Data* string_data = GetSectionData(string_section);
+    const uint8_t* string_base = static_cast<uint8_t*>(string_data->d_buf);
+    std::vector<uint8_t> strings(string_base,
+                                 string_base + string_data->d_size);
+    const size_t name_offset = strings.size();
+    strings.insert(strings.end(), kDebuglinkSectionName,
+                   kDebuglinkSectionName + sizeof(kDebuglinkSectionName));
+    string_data->d_size = strings.size();
+    string_header->sh_size = strings.size();
+    SetSectionData(string_section, &strings[0], strings.size());
+
+    debuglink_section = elf_newscn(elf_);
+    CHECK(debuglink_section);
+    typename ELF::Shdr* debuglink_header = ELF::getshdr(debuglink_section);
+    debuglink_header->sh_name = name_offset;
+    debuglink_header->sh_type = SHT_PROGBITS;
+    debuglink_header->sh_size = debuglink.size();
+    debuglink_header->sh_addralign = 4;
+
+    Elf_Data* debuglink_data = elf_newdata(debuglink_section);
+    CHECK(debuglink_data);
+    uint8_t* area = new uint8_t[debuglink.size()];
+    memcpy(area, &debuglink[0], debuglink.size());
+    debuglink_data->d_buf = area;
+    debuglink_data->d_size = debuglink.size();
+    debuglink_data->d_type = ELF_T_BYTE;
+    debuglink_data->d_off = 0;
+    debuglink_data->d_align = 4;
+    debuglink_data->d_version = EV_CURRENT;
+  }
+
+  // Pack the remaining unallocated sections after the mapped content in
+  // their current order, .gnu_debuglink last, then the section headers.
+  std::vector<std::pair<typename ELF::Off, Elf_Scn*> > unallocated;
+  section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    if (section != debuglink_section &&
+        (section_header->sh_flags & SHF_ALLOC) == 0 &&
+        section_header->sh_type != SHT_NULL &&
+        section_header->sh_type != SHT_NOBITS) {
+      unallocated.push_back(std::make_pair(section_header->sh_offset,
+                                           section));
+    }
+  }
+  std::sort(unallocated.begin(), unallocated.end());
+  if (debuglink_section)
+    unallocated.push_back(std::make_pair(0, debuglink_section));
+
+  typename ELF::Off offset = content_end;
+  for (size_t i = 0; i < unallocated.size(); ++i) {
+    typename ELF::Shdr* section_header = ELF::getshdr(unallocated[i].second);
+    offset = RoundUp(offset, std::max(static_cast<size_t>(1),
+        static_cast<size_t>(section_header->sh_addralign)));
+    section_header->sh_offset = offset;
+    offset += section_header->sh_size;
+  }
+
+  // libelf zero-fills from a section's offset, even an empty one, so place
+  // the nulled headers where there is nothing to overwrite.
+  section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    if (is_debug[elf_ndxscn(section)])
+      ELF::getshdr(section)->sh_offset = offset;
+  }
+  elf_header->e_shoff = RoundUp(offset, sizeof(typename ELF::Off));
+  VLOG(1) << "e_shoff adjusted to " << elf_header->e_shoff;
+
+  LOG(INFO) << "Debug sections   : " << debug_count << " sections, "
+            << debug_bytes << " bytes "
+            << (debuglink_section ? "split to " + debug_path_ : "stripped");
+  return true;
+}
+
+template <typename ELF>
+bool ElfFile<ELF>::WriteDebugFile(const std::vector<bool>& is_debug,
+                                  uint32_t* crc) {
+  std::string temporary = debug_path_ + ".XXXXXX";
+  const int fd = mkostemp(&temporary[0], O_CLOEXEC);
+  struct stat file_stat;
+  if (fd == -1 || fstat(fd_, &file_stat) != 0 ||
+      fchmod(fd, file_stat.st_mode & 0666) != 0) {
+    LOG(ERROR) << debug_path_ << ": " << strerror(errno);
+    if (fd != -1) {
+      close(fd);
+      unlink(temporary.c_str());
+    }
+    return false;
+  }
+
+  // Let libelf lay the file out.  It has no program headers, and the
+  // section headers match the original's index for index.
+  Elf* debug_elf = elf_begin(fd, ELF_C_WRITE, NULL);
+  CHECK(debug_elf);
+  typename ELF::Ehdr* debug_header = ELF::newehdr(debug_elf);
+  CHECK(debug_header);
+  *debug_header = *ELF::getehdr(elf_);
+  debug_header->e_phoff = 0;
+  debug_header->e_phnum = 0;
+
+  size_t string_index;
+  elf_getshdrstrndx(elf_, &string_index);
+
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    Elf_Scn* debug_section = elf_newscn(debug_elf);
+    CHECK(debug_section);
+    typename ELF::Shdr* debug_section_header = ELF::getshdr(debug_section);
+    *debug_section_header = *section_header;
+
+    // Keep the contents of the debug sections, the section names, and
+    // notes such as the build ID that debuggers match against the stripped
+    // file.  The rest keep only their addresses and sizes.
+    const size_t index = elf_ndxscn(section);
+    if (section_header->sh_type == SHT_NOBITS ||
+        (!is_debug[index] && index != string_index &&
+         section_header->sh_type != SHT_NOTE)) {
+      debug_section_header->sh_type = SHT_NOBITS;
+      continue;
+    }
+
+    const Elf_Data* data = GetSectionData(section);
+    Elf_Data* debug_data = elf_newdata(debug_section);
+    CHECK(debug_data);
+    debug_data->d_buf = data->d_buf;
+    debug_data->d_size = data->d_size;
+    debug_data->d_type = ELF_T_BYTE;
+    debug_data->d_off = 0;
+    debug_data->d_align = std::max(static_cast<size_t>(1),
+        static_cast<size_t>(section_header->sh_addralign));
+    debug_data->d_version = EV_CURRENT;
+  }
+
+  const off_t file_bytes = elf_update(debug_elf, ELF_C_WRITE);
+  if (file_bytes == -1) {
+    LOG(ERROR) << debug_path_ << ": elf_update failed: "
+               << elf_errmsg(elf_errno());
+  }
+  elf_end(debug_elf);
+
+  std::vector<uint8_t> contents;
+  bool status = file_bytes != -1 && fsync(fd) == 0 &&
+                ReadWholeFile(fd, &contents);
+  status = close(fd) == 0 && status;
+  if (!status) {
+    LOG(ERROR) << debug_path_ << ": failed to write debug file: "
+               << strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  debug_temporary_ = temporary;
 
-  Flush();
+  *crc = Crc32(0, contents.data(), contents.size());
+  VLOG(1) << "debug file " << debug_path_ << ": " << contents.size()
+          << " bytes, CRC-32 " << std::hex << *crc;
   return true;
 }
 
 // Flush rewritten shared object file data.
 template <typename ELF>
-void ElfFile<ELF>::Flush() {
+bool ElfFile<ELF>::Flush() {
   // Flag all ELF data held in memory as needing to be written back to the
   // file, and tell libelf that we have controlled the file layout.
   elf_flagelf(elf_, ELF_C_SET, ELF_F_DIRTY);
   elf_flagelf(elf_, ELF_C_SET, ELF_F_LAYOUT);
 
-  // Write ELF data back to disk.
-  const off_t file_bytes = elf_update(elf_, ELF_C_WRITE);
-  if (file_bytes == -1) {
-    LOG(ERROR) << "elf_update failed: " << elf_errmsg(elf_errno());
+  if (layout_report_) {
+    if (block_size_)
+      CountChangedBlocks();
+    RecordLayout();
+    elf_end(elf_);
+    elf_ = NULL;
+    return true;
   }
 
-  CHECK(file_bytes > 0);
+  // Write ELF data back to disk.  libelf fills the gaps between sections
+  // as it writes, so a program header table moved into one is written here.
+  off_t file_bytes;
+  if (write_threads_ != 1 || is_program_header_table_moved_) {
+    file_bytes = WriteInParallel();
+  } else {
+    file_bytes = elf_update(elf_, ELF_C_WRITE);
+    if (file_bytes == -1) {
+      LOG(ERROR) << "elf_update failed: " << elf_errmsg(elf_errno());
+    }
+  }
+
+  if (file_bytes <= 0)
+    return false;
   VLOG(1) << "elf_update returned: " << file_bytes;
 
+  // Count from libelf's data, which elf_end() frees.
+  if (block_size_)
+    CountChangedBlocks();
+
   // Clean up libelf, and truncate the output file to the number of bytes
   // written by elf_update().
   elf_end(elf_);
   elf_ = NULL;
-  const int truncate = ftruncate(fd_, file_bytes);
-  CHECK(truncate == 0);
+  if (ftruncate(fd_, file_bytes) != 0) {
+    LOG(ERROR) << "ftruncate failed: " << strerror(errno);
+    return false;
+  }
+  EndPhase(PHASE_WRITE);
+
+  // The debug file goes into place only once the output naming it is
+  // written.
+  if (!debug_temporary_.empty()) {
+    if (rename(debug_temporary_.c_str(), debug_path_.c_str()) != 0) {
+      LOG(ERROR) << debug_path_ << ": " << strerror(errno);
+      return false;
+    }
+    debug_temporary_.clear();
+  }
+  return true;
+}
+
+// Helper for CollectWriteExtents().  True if the file's byte order is the
+// host's, so that libelf's in-memory structures are also the file's bytes.
+static bool IsHostByteOrder(const unsigned char* identification) {
+  const uint16_t probe = 1;
+  const bool is_little_endian = *reinterpret_cast<const uint8_t*>(&probe);
+  return identification[EI_DATA] ==
+         (is_little_endian ? ELFDATA2LSB : ELFDATA2MSB);
+}
+
+template <typename ELF>
+bool ElfFile<ELF>::CollectWriteExtents(
+    std::vector<WriteExtent>* extents,
+    std::vector<typename ELF::Shdr>* section_headers,
+    off_t* file_bytes) {
+  // Let libelf check the layout and finish the ELF header, as it would
+  // before writing.
+  *file_bytes = elf_update(elf_, ELF_C_NULL);
+  if (*file_bytes == -1) {
+    LOG(ERROR) << "elf_update failed: " << elf_errmsg(elf_errno());
+    return false;
+  }
+
+  typename ELF::Ehdr* elf_header = ELF::getehdr(elf_);
+  CHECK(elf_header);
+  if (!IsHostByteOrder(elf_header->e_ident))
+    return false;
+
+  extents->clear();
+  const WriteExtent header = {0, elf_header, sizeof(*elf_header)};
+  extents->push_back(header);
+
+  size_t program_header_count = 0;
+  CHECK(elf_getphdrnum(elf_, &program_header_count) == 0);
+  if (program_header_count) {
+    const WriteExtent program_headers = {
+        elf_header->e_phoff, ELF::getphdr(elf_),
+        program_header_count * sizeof(typename ELF::Phdr)};
+    extents->push_back(program_headers);
+  }
+
+  // The section header table is assembled here; libelf holds each header
+  // with its section.
+  size_t section_count = 0;
+  CHECK(elf_getshdrnum(elf_, &section_count) == 0);
+  section_headers->resize(section_count);
+  for (size_t i = 0; i < section_count; ++i) {
+    Elf_Scn* section = elf_getscn(elf_, i);
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    CHECK(section_header);
+    section_headers->at(i) = *section_header;
+    if (i == 0 || section_header->sh_type == SHT_NOBITS)
+      continue;
+
+    Elf_Data* data = NULL;
+    while ((data = elf_getdata(section, data)) != NULL) {
+      if (data->d_size && data->d_buf) {
+        const WriteExtent contents = {
+            section_header->sh_offset + static_cast<uint64_t>(data->d_off),
+            data->d_buf, data->d_size};
+        extents->push_back(contents);
+      }
+    }
+  }
+  if (section_count) {
+    const WriteExtent table = {elf_header->e_shoff, section_headers->data(),
+                               section_count * sizeof(typename ELF::Shdr)};
+    extents->push_back(table);
+  }
+  return true;
+}
+
+template <typename ELF>
+off_t ElfFile<ELF>::WriteInParallel() {
+  std::vector<WriteExtent> extents;
+  std::vector<typename ELF::Shdr> section_headers;
+  off_t file_bytes;
+  if (!CollectWriteExtents(&extents, &section_headers, &file_bytes)) {
+    if (file_bytes == -1)
+      return -1;
+    VLOG(1) << "Foreign byte order, writing with libelf";
+    file_bytes = elf_update(elf_, ELF_C_WRITE);
+    LOG_IF(ERROR, file_bytes == -1) << "elf_update failed: "
+                                    << elf_errmsg(elf_errno());
+    return file_bytes;
+  }
+
+  if (!WriteExtents(fd_, extents, file_bytes, write_threads_)) {
+    LOG(ERROR) << "parallel write failed: " << strerror(errno);
+    return -1;
+  }
+  VLOG(1) << "Wrote " << extents.size() << " extents, " << file_bytes
+          << " bytes";
+  return file_bytes;
+}
+
+template <typename ELF>
+void ElfFile<ELF>::CountChangedBlocks() {
+  std::vector<WriteExtent> extents;
+  std::vector<typename ELF::Shdr> section_headers;
+  off_t file_bytes;
+  if (!CollectWriteExtents(&extents, &section_headers, &file_bytes)) {
+    LOG_IF(WARNING, file_bytes != -1)
+        << "Foreign byte order, not counting changed blocks";
+    return;
+  }
+
+  // A block moved by whole blocks is found again by block-level deltas
+  // and deduplication, so only blocks whose contents the original lacks
+  // anywhere count as changed.
+  std::vector<uint32_t> block_crcs;
+  ComputeBlockCrcs(extents, file_bytes, block_size_, &block_crcs);
+  std::vector<uint32_t> original_crcs(original_block_crcs_);
+  std::sort(original_crcs.begin(), original_crcs.end());
+  size_t changed_blocks = 0;
+  for (size_t i = 0; i < block_crcs.size(); ++i) {
+    if (!std::binary_search(original_crcs.begin(), original_crcs.end(),
+                            block_crcs[i]))
+      ++changed_blocks;
+  }
+
+  LOG(INFO) << "Changed blocks   : " << changed_blocks << " of "
+            << block_crcs.size() << " " << block_size_ << " byte blocks";
+  if (layout_report_) {
+    layout_report_->block_size = block_size_;
+    layout_report_->block_count = block_crcs.size();
+    layout_report_->changed_blocks = changed_blocks;
+  }
+}
+
+// Helpers for RecordOriginalLayout() and RecordLayout().  Describe the
+// section header table and program header table as layout entries.
+template <typename ELF>
+static void GetHeaderTableLayout(const typename ELF::Ehdr* elf_header,
+                                 size_t section_count,
+                                 LayoutEntry* section_headers,
+                                 LayoutEntry* program_headers) {
+  section_headers->name = "(section headers)";
+  section_headers->new_offset = elf_header->e_shoff;
+  section_headers->new_size = section_count * elf_header->e_shentsize;
+  program_headers->name = "(program headers)";
+  program_headers->new_offset = elf_header->e_phoff;
+  program_headers->new_size = elf_header->e_phnum * elf_header->e_phentsize;
+}
+
+// Note the layout of the file as loaded.  Placements are stored as new and
+// moved to old by RecordLayout().
+template <typename ELF>
+void ElfFile<ELF>::RecordOriginalLayout() {
+  LayoutReport* report = layout_report_;
+
+  struct stat file_stat;
+  CHECK(fstat(fd_, &file_stat) == 0);
+  report->old_file_size = file_stat.st_size;
+
+  size_t string_index;
+  elf_getshdrstrndx(elf_, &string_index);
+
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    LayoutEntry entry;
+    entry.name = elf_strptr(elf_, string_index, section_header->sh_name);
+    entry.address = section_header->sh_addr;
+    entry.new_offset = section_header->sh_offset;
+    entry.new_size = SectionFileSize<ELF>(section_header);
+    report->sections.push_back(entry);
+  }
+
+  const typename ELF::Ehdr* elf_header = ELF::getehdr(elf_);
+  const typename ELF::Phdr* elf_program_header = ELF::getphdr(elf_);
+  for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+    const typename ELF::Phdr* program_header = &elf_program_header[i];
+    LayoutEntry entry;
+    entry.name = ProgramHeaderTypeName(program_header->p_type);
+    entry.address = program_header->p_vaddr;
+    entry.new_offset = program_header->p_offset;
+    entry.new_size = program_header->p_filesz;
+    report->segments.push_back(entry);
+  }
+
+  LayoutEntry tables[2];
+  GetHeaderTableLayout<ELF>(elf_header, report->sections.size() + 1,
+                            &tables[0], &tables[1]);
+  report->sections.insert(report->sections.end(), tables, tables + 2);
+}
+
+// Complete the report started by RecordOriginalLayout() from the layout
+// held in libelf, as Flush() would write it.
+template <typename ELF>
+void ElfFile<ELF>::RecordLayout() {
+  LayoutReport* report = layout_report_;
+  const typename ELF::Ehdr* elf_header = ELF::getehdr(elf_);
+  const typename ELF::Phdr* elf_program_header = ELF::getphdr(elf_);
+
+  // Sections keep their indices, and any added follow the existing ones.
+  // The header tables were noted after the sections, so set them aside.
+  std::vector<LayoutEntry> sections;
+  sections.swap(report->sections);
+  LayoutEntry tables[2] = {sections[sections.size() - 2], sections.back()};
+  sections.resize(sections.size() - 2);
+
+  size_t string_index;
+  elf_getshdrstrndx(elf_, &string_index);
+
+  size_t index = 0;
+  Elf_Scn* section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    LayoutEntry entry;
+    if (index < sections.size()) {
+      entry = sections[index];
+      entry.old_offset = entry.new_offset;
+      entry.old_size = entry.new_size;
+      // StripDebugSections() nulls the headers of sections it drops.
+      entry.removed = section_header->sh_type == SHT_NULL &&
+                      !entry.name.empty();
+    } else {
+      entry.name = elf_strptr(elf_, string_index, section_header->sh_name);
+      entry.address = section_header->sh_addr;
+      entry.added = true;
+    }
+    entry.new_offset = section_header->sh_offset;
+    entry.new_size = SectionFileSize<ELF>(section_header);
+    report->sections.push_back(entry);
+    ++index;
+  }
+
+  for (size_t i = 0; i < 2; ++i) {
+    tables[i].old_offset = tables[i].new_offset;
+    tables[i].old_size = tables[i].new_size;
+  }
+  GetHeaderTableLayout<ELF>(elf_header, index + 1, &tables[0], &tables[1]);
+  report->sections.insert(report->sections.end(), tables, tables + 2);
+
+  // Segments may be overwritten or reordered, so match them by type and
+  // address, which conversion never changes.
+  std::vector<LayoutEntry> segments;
+  segments.swap(report->segments);
+  std::vector<bool> matched(segments.size(), false);
+  for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+    const typename ELF::Phdr* program_header = &elf_program_header[i];
+    LayoutEntry entry;
+    entry.name = ProgramHeaderTypeName(program_header->p_type);
+    entry.address = program_header->p_vaddr;
+    entry.added = true;
+    for (size_t j = 0; j < segments.size(); ++j) {
+      if (!matched[j] && segments[j].name == entry.name &&
+          segments[j].address == entry.address) {
+        matched[j] = true;
+        entry.added = false;
+        entry.old_offset = segments[j].new_offset;
+        entry.old_size = segments[j].new_size;
+        break;
+      }
+    }
+    entry.new_offset = program_header->p_offset;
+    entry.new_size = program_header->p_filesz;
+    report->segments.push_back(entry);
+  }
+  for (size_t j = 0; j < segments.size(); ++j) {
+    if (!matched[j]) {
+      LayoutEntry entry = segments[j];
+      entry.old_offset = entry.new_offset;
+      entry.old_size = entry.new_size;
+      entry.new_offset = entry.new_size = 0;
+      entry.removed = true;
+      report->segments.push_back(entry);
+    }
+  }
+
+  // The file ends with its last section or header table, as libelf writes
+  // it with ELF_F_LAYOUT; content that stays put is not counted as moved.
+  report->new_file_size = 0;
+  report->moved_bytes = 0;
+  for (size_t i = 0; i < report->sections.size(); ++i) {
+    const LayoutEntry& entry = report->sections[i];
+    report->new_file_size = std::max(report->new_file_size,
+                                     entry.new_offset + entry.new_size);
+    if (!entry.added && entry.new_offset != entry.old_offset)
+      report->moved_bytes += std::min(entry.old_size, entry.new_size);
+  }
+
+  // Check that the result still maps: each LOAD congruent to its alignment,
+  // each allocated section at its address's offset within its LOAD, and
+  // each section at its own alignment.
+  for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+    const typename ELF::Phdr* program_header = &elf_program_header[i];
+    if (program_header->p_type == PT_LOAD && program_header->p_align > 1 &&
+        ((program_header->p_offset ^ program_header->p_vaddr) &
+         (program_header->p_align - 1)) != 0) {
+      std::ostringstream violation;
+      violation << "phdr[" << i << "] LOAD: p_offset 0x" << std::hex
+                << program_header->p_offset << " and p_vaddr 0x"
+                << program_header->p_vaddr << " differ modulo p_align 0x"
+                << program_header->p_align;
+      report->violations.push_back(violation.str());
+    }
+  }
+
+  index = 0;
+  section = NULL;
+  while ((section = elf_nextscn(elf_, section)) != NULL) {
+    const typename ELF::Shdr* section_header = ELF::getshdr(section);
+    const std::string& name = report->sections[index++].name;
+    if (section_header->sh_type == SHT_NOBITS || section_header->sh_size == 0)
+      continue;
+
+    std::ostringstream violation;
+    violation << "section " << name << ": " << std::hex;
+
+    if (section_header->sh_addralign > 1 &&
+        section_header->sh_offset % section_header->sh_addralign != 0) {
+      violation << "sh_offset 0x" << section_header->sh_offset
+                << " is not aligned to 0x" << section_header->sh_addralign;
+      report->violations.push_back(violation.str());
+      continue;
+    }
+
+    if ((section_header->sh_flags & SHF_ALLOC) == 0)
+      continue;
+    const typename ELF::Phdr* load = NULL;
+    for (size_t i = 0; i < elf_header->e_phnum; ++i) {
+      const typename ELF::Phdr* program_header = &elf_program_header[i];
+      if (program_header->p_type == PT_LOAD &&
+          section_header->sh_addr >= program_header->p_vaddr &&
+          section_header->sh_addr <
+              program_header->p_vaddr + program_header->p_memsz) {
+        load = program_header;
+        break;
+      }
+    }
+    if (!load) {
+      violation << "sh_addr 0x" << section_header->sh_addr
+                << " is in no LOAD segment";
+      report->violations.push_back(violation.str());
+    } else if (section_header->sh_offset - load->p_offset !=
+               section_header->sh_addr - load->p_vaddr) {
+      violation << "sh_offset 0x" << section_header->sh_offset
+                << " does not map to sh_addr 0x" << section_header->sh_addr
+                << " in the LOAD segment at 0x" << load->p_vaddr;
+      report->violations.push_back(violation.str());
+    }
+  }
 }
 
 template <typename ELF>
@@ -14,19 +14,191 @@
 //
 // A packed shared object file is shorter than its non-packed original.
 // Unpacking a packed file restores the file to its non-packed state.
+//
+// SetOutputFormat(RELOCATION_STUB) leaves .relr.dyn in place and instead
+// appends a self-relocating stub in a new executable LOAD segment, installed
+// as DT_INIT.  The segment takes a PT_NULL program header if there is one,
+// else the program header table moves into it with an entry added.  See
+// relr_stub.h.  EXPAND_RELATIVE_FIRST expands with the
+// relative relocations ahead of the rest and counted by DT_RELCOUNT or
+// DT_RELACOUNT, and ANDROID_PACKED_RELOCATIONS rewrites .rel.dyn or
+// .rela.dyn, with the expansion, in Android's APS2 format.
+//
+// Packed input may be SHT_RELR, Android's APS2 (.rel.dyn or .rela.dyn of
+// type SHT_ANDROID_REL or SHT_ANDROID_RELA, described by DT_ANDROID_REL or
+// DT_ANDROID_RELA), or both.  Whatever the input, UnpackRelocations()
+// decodes .rel.dyn or .rela.dyn to a vector of Rela, appends the expansion
+// of .relr.dyn, and writes every output format from that vector.  An APS2
+// section expanded in place becomes plain SHT_REL or SHT_RELA again, with
+// the standard dynamic tags.  The two input formats are fixed:
+// CountExistingRelocations() and DecodeExistingRelocations() choose the APS2
+// or table decoder by is_android_packed_, and .relr.dyn is always decoded by
+// RelocationPacker; there is no interface for adding others.
+//
+// SetDecodedRelocations() shares the decoded relocations between several
+// ElfFiles converting copies of one file to different formats, so that only
+// the first of them decodes .relr.dyn.  Each still loads and parses its own
+// copy.
+//
+// SetDebugSections() drops .debug_*, .symtab and .strtab as part of the same
+// relayout and write, or moves them to a separate debug file that the
+// output names in a new .gnu_debuglink section.  libelf cannot delete a
+// section, so each dropped one leaves an empty SHT_NULL section header.
+//
+// SetLimits() bounds the resources one conversion may use.  Expansion is
+// sized by counting .relr.dyn before anything is allocated, so a corrupt or
+// hostile file is rejected without being expanded.
+//
+// SetWriteThreads() writes a large output with several threads, each
+// placing whole aligned chunks of the file at their final offsets, instead
+// of through libelf's single sequential write.  See extent_writer.h.
+//
+// SetBlockSize() lays a conversion out for storage that compresses or
+// deduplicates files in fixed-size blocks.  Holes opened for regenerated
+// data are rounded up to whole blocks, so that the content after them keeps
+// its offset within a block, and moves not at all when a rebuild changes
+// the hole by less than a block.  The number of blocks that differ from the
+// original file is logged.
+//
+// SetPrelink() writes the value each .rela.dyn relocation will have, with
+// the file and its dependencies loaded at fixed bases, into the word it
+// targets, relative relocations expanded from .relr.dyn included.  The
+// relocations are kept, as the fallback for a loader that maps anything
+// elsewhere, and DT_GNU_PRELINKED records the base assumed.  See prelink.h.
+//
+// SetDryRun() runs the whole conversion against libelf's private in-memory
+// copy of the file, which need only be open for reading, and records the
+// layout it would write in a LayoutReport instead of writing it.
 
 #ifndef TOOLS_RELOCATION_PACKER_SRC_ELF_FILE_H_
 #define TOOLS_RELOCATION_PACKER_SRC_ELF_FILE_H_
 
+#include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
 #include <vector>
 
 #include "elf.h"
+#include "extent_writer.h"
 #include "libelf.h"
+#include "metrics.h"
 #include "packer.h"
+#include "prelink.h"
 
 namespace relocation_packer {
 
+// How UnpackRelocations() makes SHT_RELR relocations visible to a loader
+// that does not support them.
+enum output_format_t {
+  // Expand into .rel.dyn or .rela.dyn.
+  EXPAND_RELOCATIONS = 0,
+  // Keep .relr.dyn and apply it from a DT_INIT stub.
+  RELOCATION_STUB,
+  // Expand, placing relative relocations first and setting DT_RELCOUNT or
+  // DT_RELACOUNT to their number.
+  EXPAND_RELATIVE_FIRST,
+  // Expand, then pack all of .rel.dyn or .rela.dyn as APS2, described by
+  // DT_ANDROID_REL or DT_ANDROID_RELA.
+  ANDROID_PACKED_RELOCATIONS
+};
+
+// What UnpackRelocations() does with debug information: non-allocated
+// .debug_* and .zdebug_* sections, .symtab and .strtab.
+enum debug_sections_t {
+  // Leave it in place.
+  KEEP_DEBUG_SECTIONS = 0,
+  // Drop it.
+  STRIP_DEBUG_SECTIONS,
+  // Move it to a separate file, named by .gnu_debuglink.
+  SPLIT_DEBUG_SECTIONS
+};
+
+// Resource limits for one conversion; zero means unlimited.  A conversion
+// that would exceed one fails before the file is written.
+struct ConversionLimits {
+  ConversionLimits()
+      : max_relocations(0), max_output_bytes(0), max_time_ms(0),
+        max_memory_bytes(0) {}
+
+  // Entries in the expanded .rel.dyn or .rela.dyn.
+  uint64_t max_relocations;
+
+  // Size of the converted file.
+  uint64_t max_output_bytes;
+
+  // Wall time from the start of the conversion until the file is written.
+  uint64_t max_time_ms;
+
+  // Memory held by the conversion, estimated from the file size and the
+  // expanded relocation count.
+  uint64_t max_memory_bytes;
+};
+
+// Relocations decoded from one file, for reuse by further conversions of
+// copies of it.  See ElfFile::SetDecodedRelocations().
+template <typename ELF>
+struct DecodedRelocations {
+  DecodedRelocations() : is_decoded(false), existing_count(0) {}
+
+  bool is_decoded;
+
+  // The entries of .rel.dyn or .rela.dyn, as Rela, followed by those
+  // expanded from .relr.dyn in address order.
+  std::vector<typename ELF::Rela> relocations;
+  size_t existing_count;
+};
+
+// Placement of one section, segment or header table in a LayoutReport.
+struct LayoutEntry {
+  LayoutEntry()
+      : added(false), removed(false), address(0), old_offset(0), old_size(0),
+        new_offset(0), new_size(0) {}
+
+  // Section name, or segment type.
+  std::string name;
+
+  // Set if the conversion creates or drops this entry; only the new or the
+  // old placement is then meaningful.
+  bool added;
+  bool removed;
+
+  // sh_addr or p_vaddr, which conversion never changes.
+  uint64_t address;
+
+  uint64_t old_offset;
+  uint64_t old_size;
+  uint64_t new_offset;
+  uint64_t new_size;
+};
+
+// The file layout a conversion would produce, filled in by a dry run.
+struct LayoutReport {
+  LayoutReport()
+      : old_file_size(0), new_file_size(0), moved_bytes(0), block_size(0),
+        block_count(0), changed_blocks(0) {}
+
+  uint64_t old_file_size;
+  uint64_t new_file_size;
+
+  // Bytes of existing content that would be written at a new file offset.
+  uint64_t moved_bytes;
+
+  // With ElfFile::SetBlockSize(), the block size, the number of blocks in
+  // the new file, and how many of them differ from the original's.
+  uint64_t block_size;
+  uint64_t block_count;
+  uint64_t changed_blocks;
+
+  // Sections in section header order, followed by the header tables.
+  std::vector<LayoutEntry> sections;
+  std::vector<LayoutEntry> segments;
+
+  // Placements that a loader or other ELF tools would reject.
+  std::vector<std::string> violations;
+};
+
 // An ElfFile reads shared objects, and shuttles relative relocations
 // between .rel.dyn or .rela.dyn and .android.rel.dyn or .android.rela.dyn
 // sections.
@@ -36,12 +208,62 @@ class ElfFile {
   explicit ElfFile(int fd)
       : fd_(fd), elf_(NULL),
         relocations_section_(NULL), relr_section_(NULL), dynamic_section_(NULL),
-        relocations_type_(NONE) {}
-  ~ElfFile() {}
+        relocations_type_(NONE), is_android_packed_(false),
+        output_format_(EXPAND_RELOCATIONS),
+        debug_sections_(KEEP_DEBUG_SECTIONS),
+        write_threads_(1), is_program_header_table_moved_(false),
+        block_size_(0), prelink_scope_(NULL),
+        prelink_base_(0), layout_report_(NULL), decoded_(NULL), file_size_(0),
+        deadline_ms_(0), phase_start_(0) {}
+  // Removes a debug file written for a conversion that did not finish.
+  ~ElfFile() {
+    if (!debug_temporary_.empty())
+      unlink(debug_temporary_.c_str());
+  }
+
+  // Set the output format.  Expands relocations by default.
+  // |format| is the output format to use.
+  void SetOutputFormat(output_format_t format) { output_format_ = format; }
+
+  // Set what to do with debug information.  Kept by default.  For
+  // SPLIT_DEBUG_SECTIONS, |debug_path| is the file to write it to, replaced
+  // atomically; it is not written on a dry run.
+  void SetDebugSections(debug_sections_t mode, const std::string& debug_path) {
+    debug_sections_ = mode;
+    debug_path_ = debug_path;
+  }
+
+  // Set resource limits.  Unlimited by default.
+  void SetLimits(const ConversionLimits& limits) { limits_ = limits; }
+
+  // Write the file with |threads| threads; zero selects one per CPU.  One,
+  // the default, leaves writing to libelf.
+  void SetWriteThreads(size_t threads) { write_threads_ = threads; }
+
+  // Align holes to |block_size|, a power of two, and report changed
+  // blocks of that size.  Zero, the default, leaves holes unaligned.
+  void SetBlockSize(size_t block_size) { block_size_ = block_size; }
+
+  // Prelink against |scope|, with this file loaded at |base|.  Off by
+  // default.
+  void SetPrelink(const PrelinkScope* scope, uint64_t base) {
+    prelink_scope_ = scope;
+    prelink_base_ = base;
+  }
+
+  // Convert in memory only, and fill |report| with the resulting layout
+  // rather than writing the file.  The file may be open read-only.
+  void SetDryRun(LayoutReport* report) { layout_report_ = report; }
 
-  // Transfer relative relocations from a packed representation in
-  // .android.rel.dyn or .android.rela.dyn to .rel.dyn or .rela.dyn.  Returns
-  // true on success.
+  // Take relocations from |decoded| if it is filled in, else decode them
+  // and fill it in.  |decoded| must come from a conversion of the same file.
+  void SetDecodedRelocations(DecodedRelocations<ELF>* decoded) {
+    decoded_ = decoded;
+  }
+
+  // Transfer relocations from their packed representation in .relr.dyn, or
+  // APS2 in .rel.dyn or .rela.dyn, to .rel.dyn or .rela.dyn in the output
+  // format set.  Returns true on success.
   bool UnpackRelocations();
 
  private:
@@ -54,14 +276,97 @@ class ElfFile {
   // |fd| is an open file descriptor for the shared object.
   bool Load();
 
+  // Helper for UnpackRelocations().  Set |count| to the number of entries
+  // in .rel.dyn or .rela.dyn, reading only the header if APS2 packed.
+  // Returns false if the APS2 header is malformed, or counts more
+  // relocations than the words of the loadable segments.
+  bool CountExistingRelocations(uint64_t* count);
+
+  // Helper for UnpackTypedRelocations().  Append the entries of .rel.dyn or
+  // .rela.dyn, as Rela, to |relocations|, decoding APS2 if packed.  Returns
+  // false if the APS2 encoding is malformed.
+  bool DecodeExistingRelocations(std::vector<typename ELF::Rela>* relocations);
+
   // Templated unpacker, helper for UnpackRelocations().  Rel type is one of
-  // ELF::Rel or ELF::Rela.
-  bool UnpackTypedRelocations(const std::vector<typename ELF::Relr>& packed);
+  // ELF::Rel or ELF::Rela.  |expanded_count| is the number of relocations
+  // the result will hold.
+  bool UnpackTypedRelocations(const std::vector<typename ELF::Relr>& packed,
+                              size_t expanded_count);
+
+  // Helpers for UnpackRelocations().  Return false, logging which limit,
+  // if the file, an expansion to |expanded_count| relocations, or the time
+  // taken so far exceeds the limits.  |stage| names the work done.
+  bool CheckFileLimits();
+  bool CheckExpansionLimits(uint64_t expanded_count);
+  bool CheckTimeLimit(const char* stage);
+
+  // Record the time since the last phase ended against |phase| in Metrics,
+  // unless this is a dry run.
+  void EndPhase(conversion_phase_t phase);
+
+  // Helper for UnpackRelocations().  Append the relocation stub and install
+  // it as DT_INIT, leaving .relr.dyn unchanged.
+  bool InjectRelocationStub();
+
+  // Helper for UnpackRelocations().  Write the prelinked value of each of
+  // the |count| entries of .rela.dyn at |relocations| that SetPrelink()'s
+  // scope resolves into its target word.  Entries from |relr_first| on
+  // were expanded from .relr.dyn: relative, with the addend the word at
+  // their target.  Others are left to the loader.
+  void PrelinkRelocations(const typename ELF::Rela* relocations,
+                          size_t count,
+                          size_t relr_first);
+
+  // Helper for PrelinkRelocations().  Log each DT_NEEDED library that the
+  // prelink scope does not list.  Returns false if any is missing.
+  bool CheckPrelinkNeeded();
+
+  // Drop or split out debug information as SetDebugSections() directs,
+  // moving the remaining non-allocated sections and the section header
+  // table down to close the gap.  Returns false if the debug file cannot
+  // be written.
+  bool StripDebugSections();
 
-  // Write ELF file changes.
-  void Flush();
+  // Helper for StripDebugSections().  Write the sections flagged in
+  // |is_debug|, indexed by section number, to a temporary file beside
+  // |debug_path_|, with the rest as SHT_NOBITS placeholders so that section
+  // indices are unchanged.  Flush() renames it into place once the output
+  // is written.  On success sets |crc| to the CRC-32 of the file written.
+  bool WriteDebugFile(const std::vector<bool>& is_debug, uint32_t* crc);
 
-  static void ResizeSection(Elf* elf, Elf_Scn* section, size_t new_size);
+  // Write ELF file changes, then publish any debug file, or for a dry run
+  // record them with RecordLayout().  Returns false if the output or the
+  // debug file cannot be written.
+  bool Flush();
+
+  // Helper for Flush().  Have libelf finalize the layout without writing,
+  // then write the headers and every section's data with WriteExtents().
+  // Returns the file size, or -1 on error.
+  off_t WriteInParallel();
+
+  // Helper for WriteInParallel() and CountChangedBlocks().  Describe the
+  // file as libelf would write it as extents pointing into libelf's data,
+  // or into |section_headers| for the section header table, and set
+  // |file_bytes| to its size.  Returns false if libelf cannot lay it out or
+  // its byte order is not the host's.
+  bool CollectWriteExtents(std::vector<WriteExtent>* extents,
+                           std::vector<typename ELF::Shdr>* section_headers,
+                           off_t* file_bytes);
+
+  // Helper for Flush().  Compare the file about to be written with
+  // |original_block_crcs_| and log, and for a dry run record, the number
+  // of blocks that differ.
+  void CountChangedBlocks();
+
+  // Helpers for a dry run.  Note the original layout when loading, and the
+  // new layout, moved bytes and misplacements when flushing.
+  void RecordOriginalLayout();
+  void RecordLayout();
+
+  static void ResizeSection(Elf* elf,
+                            Elf_Scn* section,
+                            size_t new_size,
+                            size_t hole_alignment);
 
   static void AdjustDynamicSectionForHole(Elf_Scn* dynamic_section,
                                           typename ELF::Off hole_start,
@@ -87,6 +392,53 @@ class ElfFile {
 
   // Relocation type found, assigned by Load().
   relocations_type_t relocations_type_;
+
+  // True if .rel.dyn or .rela.dyn is APS2 packed, assigned by Load().
+  bool is_android_packed_;
+
+  // Output format, assigned by SetOutputFormat().
+  output_format_t output_format_;
+
+  // Debug information handling, assigned by SetDebugSections().
+  debug_sections_t debug_sections_;
+  std::string debug_path_;
+
+  // Debug file written by WriteDebugFile() and not yet renamed to
+  // |debug_path_|, or empty.
+  std::string debug_temporary_;
+
+  // Threads writing the file, assigned by SetWriteThreads().
+  size_t write_threads_;
+
+  // Set when InjectRelocationStub() moves the program header table between
+  // sections, where libelf's writer would overwrite it with gap fill.
+  bool is_program_header_table_moved_;
+
+  // Hole alignment, assigned by SetBlockSize(), and the CRC-32 of each
+  // block of the file as loaded.
+  size_t block_size_;
+  std::vector<uint32_t> original_block_crcs_;
+
+  // Prelink scope and load base, assigned by SetPrelink(); NULL not to
+  // prelink.
+  const PrelinkScope* prelink_scope_;
+  uint64_t prelink_base_;
+
+  // Dry run report, assigned by SetDryRun(); NULL to write the file.
+  LayoutReport* layout_report_;
+
+  // Shared decoded relocations, assigned by SetDecodedRelocations(); NULL
+  // to decode privately.
+  DecodedRelocations<ELF>* decoded_;
+
+  // Resource limits, assigned by SetLimits().  The file size and the
+  // monotonic time limit are noted by CheckFileLimits().
+  ConversionLimits limits_;
+  uint64_t file_size_;
+  uint64_t deadline_ms_;
+
+  // When the current conversion phase started, for EndPhase().
+  double phase_start_;
 };
 
 }  // namespace relocation_packer
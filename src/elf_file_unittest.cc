@@ -0,0 +1,277 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "elf_file.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf.h"
+#include "elf_traits.h"
+#include "file_util.h"
+#include "unpack.h"
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+// Enough pointers for .relr.dyn to matter, and a symbolic relocation.
+const char kLibrarySource[] =
+    "static int a, b, c, d[64];\n"
+    "int *pointers[] = {&a, &b, &c, &d[0], &d[1], &d[5], &d[63], &a};\n"
+    "extern int external;\n"
+    "int *external_pointer = &external;\n"
+    "int sum(void) {\n"
+    "  int s = 0;\n"
+    "  for (unsigned i = 0; i < 8; ++i) s += *pointers[i];\n"
+    "  return s;\n"
+    "}\n";
+
+class ElfFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_NE(EV_NONE, elf_version(EV_CURRENT));
+    Logger::SetStreams(&log_, &log_);
+    char directory[] = "/tmp/elf_file_unittest.XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory) != NULL);
+    directory_ = directory;
+  }
+
+  void TearDown() override {
+    const std::string command = "rm -rf " + directory_;
+    EXPECT_EQ(0, system(command.c_str()));
+    Logger::Reset();
+  }
+
+  // Compile kLibrarySource into a 64-bit shared library with packed
+  // relative relocations, linked with |flags|, into |image|.  Returns false
+  // if there is no compiler and linker able to, so that the caller can
+  // skip.
+  bool BuildLibrary(const std::string& flags, std::vector<uint8_t>* image) {
+    const std::string source = directory_ + "/library.c";
+    const std::string library = directory_ + "/library.so";
+    const int source_fd =
+        open(source.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (source_fd == -1 ||
+        !WriteFully(source_fd, kLibrarySource, strlen(kLibrarySource))) {
+      return false;
+    }
+    close(source_fd);
+    const std::string command =
+        "cc -shared -fPIC -Wl,-z,pack-relative-relocs " + flags + " -o " +
+        library + " " + source + " > /dev/null 2>&1";
+    if (system(command.c_str()) != 0)
+      return false;
+    const int fd = open(library.c_str(), O_RDONLY);
+    const bool is_read = fd != -1 && ReadWholeFile(fd, image);
+    if (fd != -1)
+      close(fd);
+    return is_read && image->size() >= sizeof(Elf64_Ehdr) &&
+           (*image)[EI_CLASS] == ELFCLASS64;
+  }
+
+  static const Elf64_Ehdr* Header(const std::vector<uint8_t>& image) {
+    return reinterpret_cast<const Elf64_Ehdr*>(image.data());
+  }
+
+  static const Elf64_Phdr* Segments(const std::vector<uint8_t>& image) {
+    return reinterpret_cast<const Elf64_Phdr*>(image.data() +
+                                               Header(image)->e_phoff);
+  }
+
+  // Index of the first program header of |type|, or e_phnum.
+  static size_t FindSegment(const std::vector<uint8_t>& image,
+                            uint32_t type) {
+    size_t i = 0;
+    while (i < Header(image)->e_phnum && Segments(image)[i].p_type != type)
+      ++i;
+    return i;
+  }
+
+  static const Elf64_Shdr* Sections(const std::vector<uint8_t>& image) {
+    return reinterpret_cast<const Elf64_Shdr*>(image.data() +
+                                               Header(image)->e_shoff);
+  }
+
+  // The word at |vaddr| in the file, found through the PT_LOAD segments.
+  static bool ReadWord(const std::vector<uint8_t>& image,
+                       uint64_t vaddr,
+                       uint64_t* word) {
+    for (size_t i = 0; i < Header(image)->e_phnum; ++i) {
+      const Elf64_Phdr& load = Segments(image)[i];
+      if (load.p_type == PT_LOAD && vaddr >= load.p_vaddr &&
+          vaddr + sizeof(*word) <= load.p_vaddr + load.p_filesz) {
+        memcpy(word, &image[load.p_offset + (vaddr - load.p_vaddr)],
+               sizeof(*word));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::ostringstream log_;
+  std::string directory_;
+};
+
+}  // namespace
+
+TEST_F(ElfFileTest, BlockSizeMovesLaterSectionsByWholeBlocks) {
+  std::vector<uint8_t> image;
+  if (!BuildLibrary("", &image))
+    GTEST_SKIP() << "no compiler with -z pack-relative-relocs";
+  const std::vector<uint8_t> original(image);
+
+  static const size_t kBlockSize = 4096;
+  UnpackOptions options;
+  options.block_size = kBlockSize;
+  ASSERT_TRUE(UnpackImage(&image, "library.so", options)) << log_.str();
+
+  // .rela.dyn grows and .dynamic loses its DT_RELR tags; neither may leave
+  // what follows at a different offset within its block.
+  ASSERT_EQ(Header(original)->e_shnum, Header(image)->e_shnum);
+  EXPECT_EQ(0u, (Header(image)->e_shoff - Header(original)->e_shoff) %
+                    kBlockSize);
+  const Elf64_Shdr* before = Sections(original);
+  const Elf64_Shdr* after = Sections(image);
+  for (size_t i = 0; i < Header(image)->e_shnum; ++i) {
+    EXPECT_EQ(0u, (after[i].sh_offset - before[i].sh_offset) % kBlockSize)
+        << "section " << i;
+  }
+}
+
+TEST_F(ElfFileTest, StubKeepsRelroWithoutSpareProgramHeader) {
+  std::vector<uint8_t> image;
+  if (!BuildLibrary("-Wl,-z,relro", &image) ||
+      Header(image)->e_machine != EM_X86_64) {
+    GTEST_SKIP() << "no x86-64 compiler with -z pack-relative-relocs";
+  }
+  const std::vector<uint8_t> original(image);
+  ASSERT_EQ(Header(original)->e_phnum, FindSegment(original, PT_NULL));
+  ASSERT_NE(Header(original)->e_phnum, FindSegment(original, PT_GNU_RELRO));
+
+  UnpackOptions options;
+  options.output_format = RELOCATION_STUB;
+  ASSERT_TRUE(UnpackImage(&image, "library.so", options)) << log_.str();
+
+  // The table grows by the stub's LOAD, which maps the table too.
+  ASSERT_EQ(Header(original)->e_phnum + 1, Header(image)->e_phnum);
+  EXPECT_NE(Header(image)->e_phnum, FindSegment(image, PT_GNU_RELRO));
+  const Elf64_Phdr& stub = Segments(image)[Header(image)->e_phnum - 1];
+  EXPECT_EQ(static_cast<uint32_t>(PT_LOAD), stub.p_type);
+  EXPECT_EQ(static_cast<uint32_t>(PF_R | PF_X), stub.p_flags);
+  EXPECT_LE(stub.p_offset, Header(image)->e_phoff);
+  EXPECT_GE(stub.p_offset + stub.p_filesz,
+            Header(image)->e_phoff +
+                Header(image)->e_phnum * sizeof(Elf64_Phdr));
+  for (size_t i = 0; i < Header(original)->e_phnum; ++i) {
+    EXPECT_EQ(0, memcmp(&Segments(original)[i], &Segments(image)[i],
+                        sizeof(Elf64_Phdr)))
+        << "segment " << i;
+  }
+}
+
+TEST_F(ElfFileTest, ExpandedRelativeRelocationsUseMachineTypeAndAddend) {
+  std::vector<uint8_t> image;
+  if (!BuildLibrary("", &image) || Header(image)->e_machine != EM_X86_64)
+    GTEST_SKIP() << "no x86-64 compiler with -z pack-relative-relocs";
+  const std::vector<uint8_t> original(image);
+
+  UnpackOptions options;
+  options.output_format = EXPAND_RELATIVE_FIRST;
+  ASSERT_TRUE(UnpackImage(&image, "library.so", options)) << log_.str();
+
+  // .rela.dyn, the RELA section not applying to another one.
+  const Elf64_Shdr* sections = Sections(image);
+  size_t index = 0;
+  while (index < Header(image)->e_shnum &&
+         (sections[index].sh_type != SHT_RELA || sections[index].sh_info))
+    ++index;
+  ASSERT_NE(Header(image)->e_shnum, index);
+  const Elf64_Rela* relocations = reinterpret_cast<const Elf64_Rela*>(
+      image.data() + sections[index].sh_offset);
+  const size_t count = sections[index].sh_size / sizeof(relocations[0]);
+
+  // Every .relr.dyn address is here as R_X86_64_RELATIVE, with the word the
+  // loader would have found in place as its addend.
+  size_t relative_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const uint32_t type = ELF64_R_TYPE(relocations[i].r_info);
+    EXPECT_NE(static_cast<uint32_t>(R_ARM_RELATIVE), type) << i;
+    if (type != R_X86_64_RELATIVE)
+      continue;
+    ++relative_count;
+    EXPECT_EQ(0u, ELF64_R_SYM(relocations[i].r_info)) << i;
+    uint64_t word = 0;
+    ASSERT_TRUE(ReadWord(original, relocations[i].r_offset, &word)) << i;
+    EXPECT_EQ(word, static_cast<uint64_t>(relocations[i].r_addend)) << i;
+  }
+  EXPECT_LE(8u, relative_count);
+}
+
+TEST_F(ElfFileTest, RejectsUnsupportedInputWithoutAborting) {
+  std::vector<uint8_t> image;
+  if (!BuildLibrary("", &image))
+    GTEST_SKIP() << "no compiler with -z pack-relative-relocs";
+
+  // A section aligned to more than a page, and a second PT_DYNAMIC.
+  std::vector<uint8_t> aligned(image);
+  Elf64_Shdr* sections = const_cast<Elf64_Shdr*>(Sections(aligned));
+  sections[Header(aligned)->e_shnum - 1].sh_addralign = 65536;
+  std::vector<uint8_t> two_dynamic(image);
+  const size_t dynamic = FindSegment(two_dynamic, PT_DYNAMIC);
+  const size_t note = FindSegment(two_dynamic, PT_NOTE);
+  ASSERT_NE(Header(two_dynamic)->e_phnum, dynamic);
+  ASSERT_NE(Header(two_dynamic)->e_phnum, note);
+  Elf64_Phdr* segments = const_cast<Elf64_Phdr*>(Segments(two_dynamic));
+  segments[note] = segments[dynamic];
+
+  const std::vector<uint8_t>* inputs[] = {&aligned, &two_dynamic};
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+    std::vector<uint8_t> converted(*inputs[i]);
+    EXPECT_FALSE(UnpackImage(&converted, "library.so", UnpackOptions()))
+        << i;
+    EXPECT_TRUE(converted == *inputs[i]) << i;
+  }
+}
+
+TEST_F(ElfFileTest, DebugFileOnlyFollowsWrittenOutput) {
+  std::vector<uint8_t> image;
+  if (!BuildLibrary("-g", &image))
+    GTEST_SKIP() << "no compiler with -z pack-relative-relocs";
+  const std::string debug_path = directory_ + "/library.so.debug";
+
+  // Sealed against writes, the output cannot be written after the debug
+  // file has been.
+  for (int is_sealed = 0; is_sealed <= 1; ++is_sealed) {
+    const int fd = memfd_create("library.so", MFD_ALLOW_SEALING);
+    ASSERT_NE(-1, fd);
+    ASSERT_TRUE(WriteFully(fd, image.data(), image.size()));
+    if (is_sealed) {
+      ASSERT_EQ(0, fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW));
+    }
+    {
+      ElfFile<ELF64_traits> elf_file(fd);
+      elf_file.SetDebugSections(SPLIT_DEBUG_SECTIONS, debug_path);
+      EXPECT_EQ(!is_sealed, elf_file.UnpackRelocations()) << log_.str();
+    }
+    close(fd);
+
+    struct stat debug_stat;
+    EXPECT_EQ(!is_sealed, stat(debug_path.c_str(), &debug_stat) == 0);
+    unlink(debug_path.c_str());
+    const std::string command = "ls " + directory_ + " | grep -q debug";
+    EXPECT_NE(0, system(command.c_str())) << "temporary debug file left";
+  }
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,175 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "elf_probe.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_traits.h"
+
+namespace relocation_packer {
+
+namespace {
+
+// Source of file bytes for the probe: either an image or a descriptor.
+class ProbeSource {
+ public:
+  ProbeSource(const uint8_t* image, size_t size)
+      : image_(image), size_(size), fd_(-1) {}
+  explicit ProbeSource(int fd) : image_(NULL), size_(0), fd_(fd) {}
+
+  // Read |size| bytes at |offset|.  Returns false if short.
+  bool Read(uint64_t offset, size_t size, void* out) const {
+    if (image_) {
+      if (offset > size_ || size > size_ - offset)
+        return false;
+      memcpy(out, image_ + offset, size);
+      return true;
+    }
+    uint8_t* cursor = static_cast<uint8_t*>(out);
+    while (size > 0) {
+      const ssize_t bytes =
+          TEMP_FAILURE_RETRY(pread(fd_, cursor, size, offset));
+      if (bytes <= 0)
+        return false;
+      cursor += bytes;
+      offset += bytes;
+      size -= bytes;
+    }
+    return true;
+  }
+
+ private:
+  const uint8_t* image_;
+  size_t size_;
+  int fd_;
+};
+
+template <typename ELF>
+bool ProbeTyped(const ProbeSource& source, ElfProbe* probe) {
+  typename ELF::Ehdr elf_header;
+  if (!source.Read(0, sizeof(elf_header), &elf_header))
+    return false;
+
+  probe->machine = elf_header.e_machine;
+  probe->type = elf_header.e_type;
+  if (elf_header.e_shentsize != sizeof(typename ELF::Shdr) ||
+      elf_header.e_shnum == 0) {
+    return true;
+  }
+
+  std::vector<typename ELF::Shdr> section_headers(elf_header.e_shnum);
+  if (!source.Read(elf_header.e_shoff,
+                   section_headers.size() * sizeof(section_headers[0]),
+                   &section_headers[0])) {
+    return false;
+  }
+
+  // Section names are needed only to tell .rel(a).dyn from .rel(a).plt.
+  std::string names;
+  if (elf_header.e_shstrndx < section_headers.size()) {
+    const typename ELF::Shdr& strings =
+        section_headers[elf_header.e_shstrndx];
+    names.resize(strings.sh_size);
+    if (!names.empty() &&
+        !source.Read(strings.sh_offset, names.size(), &names[0])) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < section_headers.size(); ++i) {
+    const typename ELF::Shdr& section_header = section_headers[i];
+    const char* name = section_header.sh_name < names.size()
+        ? names.c_str() + section_header.sh_name : "";
+
+    if (section_header.sh_type == SHT_RELR) {
+      probe->relr_offset = section_header.sh_offset;
+      probe->relr_size = section_header.sh_size;
+      probe->relr_vaddr = section_header.sh_addr;
+    }
+    if ((section_header.sh_type == SHT_REL ||
+         section_header.sh_type == SHT_RELA ||
+         section_header.sh_type == SHT_ANDROID_REL ||
+         section_header.sh_type == SHT_ANDROID_RELA) &&
+        (strcmp(name, ".rel.dyn") == 0 || strcmp(name, ".rela.dyn") == 0)) {
+      probe->relocations_offset = section_header.sh_offset;
+      probe->relocations_size = section_header.sh_size;
+      probe->relocations_type = section_header.sh_type;
+    }
+    if (section_header.sh_type == SHT_DYNAMIC) {
+      probe->dynamic_offset = section_header.sh_offset;
+      probe->dynamic_size = section_header.sh_size;
+    }
+  }
+
+  if (probe->dynamic_size == 0)
+    return true;
+
+  std::vector<typename ELF::Dyn> dynamics(
+      probe->dynamic_size / sizeof(typename ELF::Dyn));
+  if (dynamics.empty())
+    return true;
+  if (!source.Read(probe->dynamic_offset,
+                   dynamics.size() * sizeof(dynamics[0]), &dynamics[0])) {
+    return false;
+  }
+  for (size_t i = 0; i < dynamics.size(); ++i) {
+    if (dynamics[i].d_tag == DT_NULL)
+      break;
+    if (dynamics[i].d_tag == DT_RELR)
+      probe->has_dt_relr = true;
+    if (dynamics[i].d_tag == DT_ANDROID_REL ||
+        dynamics[i].d_tag == DT_ANDROID_RELA)
+      probe->has_dt_android_packed = true;
+  }
+  return true;
+}
+
+bool Probe(const ProbeSource& source, ElfProbe* probe) {
+  memset(probe, 0, sizeof(*probe));
+
+  uint8_t e_ident[EI_NIDENT];
+  if (!source.Read(0, sizeof(e_ident), e_ident))
+    return false;
+  if (memcmp(e_ident, ELFMAG, SELFMAG) != 0 ||
+      e_ident[EI_DATA] != ELFDATA2LSB) {
+    return false;
+  }
+
+  probe->file_class = e_ident[EI_CLASS];
+  if (probe->file_class == ELFCLASS32)
+    return ProbeTyped<ELF32_traits>(source, probe);
+  if (probe->file_class == ELFCLASS64)
+    return ProbeTyped<ELF64_traits>(source, probe);
+  return false;
+}
+
+}  // namespace
+
+bool ProbeElfImage(const uint8_t* image, size_t size, ElfProbe* probe) {
+  return Probe(ProbeSource(image, size), probe);
+}
+
+bool ProbeElfFile(int fd, ElfProbe* probe) {
+  return Probe(ProbeSource(fd), probe);
+}
+
+bool HasPackedRelocations(const ElfProbe& probe) {
+  if (probe.type != ET_DYN)
+    return false;
+  const bool is_android_packed =
+      probe.relocations_type == SHT_ANDROID_REL ||
+      probe.relocations_type == SHT_ANDROID_RELA;
+  return (probe.relr_size > 0 && probe.has_dt_relr) ||
+         (is_android_packed && probe.relocations_size > 0 &&
+          probe.has_dt_android_packed);
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,65 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Cheap ELF header probe.
+//
+// Reads only the ELF header, the section header table and .dynamic, without
+// libelf, to decide whether a file carries SHT_RELR or APS2 packed
+// relocations that ElfFile::UnpackRelocations() would act on.  Works on an
+// in-memory image or on a file descriptor with a handful of preads.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_ELF_PROBE_H_
+#define TOOLS_RELOCATION_PACKER_SRC_ELF_PROBE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace relocation_packer {
+
+struct ElfProbe {
+  // From the ELF header.
+  unsigned file_class;
+  unsigned machine;
+  unsigned type;
+
+  // File offset and size of .relr.dyn, zero if absent.
+  uint64_t relr_offset;
+  uint64_t relr_size;
+  uint64_t relr_vaddr;
+
+  // File offset, size and type (SHT_REL, SHT_RELA, SHT_ANDROID_REL or
+  // SHT_ANDROID_RELA) of .rel.dyn or .rela.dyn, zero if absent.
+  uint64_t relocations_offset;
+  uint64_t relocations_size;
+  unsigned relocations_type;
+
+  // File offset and size of .dynamic, zero if absent.
+  uint64_t dynamic_offset;
+  uint64_t dynamic_size;
+
+  // True if .dynamic holds DT_RELR, that is, the file has not already been
+  // unpacked.
+  bool has_dt_relr;
+
+  // True if .dynamic holds DT_ANDROID_REL or DT_ANDROID_RELA, that is, the
+  // APS2 relocations have not already been unpacked.
+  bool has_dt_android_packed;
+};
+
+// Probe an in-memory ELF image.  Returns false if |image| is not a
+// little-endian ELF file, or is truncated.
+bool ProbeElfImage(const uint8_t* image, size_t size, ElfProbe* probe);
+
+// Probe the ELF file open on |fd|, using pread.  Returns false as for
+// ProbeElfImage(), or on read error.
+bool ProbeElfFile(int fd, ElfProbe* probe);
+
+// True if the probed file is a shared object that UnpackRelocations() would
+// convert: it has .relr.dyn and DT_RELR, or APS2 .rel.dyn or .rela.dyn and
+// DT_ANDROID_REL or DT_ANDROID_RELA.
+bool HasPackedRelocations(const ElfProbe& probe);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_ELF_PROBE_H_
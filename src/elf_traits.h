@@ -14,6 +14,47 @@
 #define DT_MIPS_RLD_MAP_REL 0x70000035
 #endif
 
+// Dynamic tags and section type for SHT_RELR packed relative relocations.
+// Older elf.h headers lack these.
+#if !defined(DT_RELRSZ)
+#define DT_RELRSZ 35
+#endif
+#if !defined(DT_RELR)
+#define DT_RELR 36
+#endif
+#if !defined(DT_RELRENT)
+#define DT_RELRENT 37
+#endif
+#if !defined(SHT_RELR)
+#define SHT_RELR 19
+#endif
+
+// Section types and dynamic tags for Android's APS2 packed relocations.
+#if !defined(SHT_ANDROID_REL)
+#define SHT_ANDROID_REL 0x60000001
+#endif
+#if !defined(SHT_ANDROID_RELA)
+#define SHT_ANDROID_RELA 0x60000002
+#endif
+#if !defined(DT_ANDROID_REL)
+#define DT_ANDROID_REL 0x6000000f
+#endif
+#if !defined(DT_ANDROID_RELSZ)
+#define DT_ANDROID_RELSZ 0x60000010
+#endif
+#if !defined(DT_ANDROID_RELA)
+#define DT_ANDROID_RELA 0x60000011
+#endif
+#if !defined(DT_ANDROID_RELASZ)
+#define DT_ANDROID_RELASZ 0x60000012
+#endif
+
+// Dynamic tag marking a prelinked file.  The prelink tool stores a
+// timestamp in it; --prelink stores the load base it assumed.
+#if !defined(DT_GNU_PRELINKED)
+#define DT_GNU_PRELINKED 0x6ffffdf5
+#endif
+
 // ELF is a traits structure used to provide convenient aliases for
 // 32/64 bit Elf types and functions, depending on the target file.
 
@@ -35,11 +76,18 @@ struct ELF32_traits {
   typedef Elf32_Addr Relr;
 
   static inline Ehdr* getehdr(Elf* elf) { return elf32_getehdr(elf); }
+  static inline Ehdr* newehdr(Elf* elf) { return elf32_newehdr(elf); }
   static inline Phdr* getphdr(Elf* elf) { return elf32_getphdr(elf); }
+  static inline Phdr* newphdr(Elf* elf, size_t count) {
+    return elf32_newphdr(elf, count);
+  }
   static inline Shdr* getshdr(Elf_Scn* scn) { return elf32_getshdr(scn); }
   static inline Word elf_r_type(Word info) { return ELF32_R_TYPE(info); }
   static inline int elf_st_type(uint8_t info) { return ELF32_ST_TYPE(info); }
   static inline Word elf_r_sym(Word info) { return ELF32_R_SYM(info); }
+  static inline Word elf_r_info(Word sym, Word type) {
+    return ELF32_R_INFO(sym, type);
+  }
 };
 
 struct ELF64_traits {
@@ -60,11 +108,18 @@ struct ELF64_traits {
   typedef Elf64_Addr Relr;
 
   static inline Ehdr* getehdr(Elf* elf) { return elf64_getehdr(elf); }
+  static inline Ehdr* newehdr(Elf* elf) { return elf64_newehdr(elf); }
   static inline Phdr* getphdr(Elf* elf) { return elf64_getphdr(elf); }
+  static inline Phdr* newphdr(Elf* elf, size_t count) {
+    return elf64_newphdr(elf, count);
+  }
   static inline Shdr* getshdr(Elf_Scn* scn) { return elf64_getshdr(scn); }
   static inline Xword elf_r_type(Xword info) { return ELF64_R_TYPE(info); }
   static inline int elf_st_type(uint8_t info) { return ELF64_ST_TYPE(info); }
   static inline Word elf_r_sym(Xword info) { return ELF64_R_SYM(info); }
+  static inline Xword elf_r_info(Xword sym, Xword type) {
+    return ELF64_R_INFO(sym, type);
+  }
 };
 
 #endif  // TOOLS_RELOCATION_PACKER_SRC_ELF_TRAITS_H_
@@ -0,0 +1,123 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "extent_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "crc32.h"
+#include "debug.h"
+#include "file_util.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+bool ExtentLess(const WriteExtent& left, const WriteExtent& right) {
+  return left.offset < right.offset;
+}
+
+// Assemble the range [|start|, |end|) of the file from the sorted
+// |extents|, beginning at |first|, into |chunk|.  Bytes no extent covers
+// are zero.
+void AssembleChunk(const std::vector<WriteExtent>& extents,
+                   size_t first,
+                   uint64_t start,
+                   uint64_t end,
+                   std::vector<uint8_t>* chunk) {
+  chunk->assign(end - start, 0);
+  for (size_t i = first; i < extents.size() && extents[i].offset < end; ++i) {
+    const WriteExtent& extent = extents[i];
+    const uint64_t from = std::max(extent.offset, start);
+    const uint64_t to = std::min(extent.offset + extent.size, end);
+    if (from < to) {
+      memcpy(&chunk->at(from - start),
+             static_cast<const uint8_t*>(extent.data) + (from - extent.offset),
+             to - from);
+    }
+  }
+}
+
+// Assemble the chunk [|start|, |end|) and write it to |fd|.
+bool WriteChunk(int fd,
+                const std::vector<WriteExtent>& extents,
+                size_t first,
+                uint64_t start,
+                uint64_t end) {
+  std::vector<uint8_t> chunk;
+  AssembleChunk(extents, first, start, end, &chunk);
+  return PwriteFully(fd, chunk.data(), chunk.size(), start);
+}
+
+// Advance |first| past the sorted |extents| that end by |start|.
+void SkipExtents(const std::vector<WriteExtent>& extents,
+                 uint64_t start,
+                 size_t* first) {
+  while (*first < extents.size() &&
+         extents[*first].offset + extents[*first].size <= start)
+    ++*first;
+}
+
+}  // namespace
+
+bool WriteExtents(int fd,
+                  std::vector<WriteExtent> extents,
+                  uint64_t file_size,
+                  size_t threads) {
+  std::stable_sort(extents.begin(), extents.end(), ExtentLess);
+  for (size_t i = 0; i < extents.size(); ++i)
+    CHECK(extents[i].offset + extents[i].size <= file_size);
+
+  std::atomic<int> first_error(0);
+  size_t thread_count;
+  {
+    WorkerPool pool(threads);
+    thread_count = pool.size();
+    size_t first = 0;
+    for (uint64_t start = 0; start < file_size; start += kWriteChunkSize) {
+      const uint64_t end = std::min(start + kWriteChunkSize, file_size);
+      SkipExtents(extents, start, &first);
+      pool.Post([fd, &extents, first, start, end, &first_error]() {
+        if (!WriteChunk(fd, extents, first, start, end)) {
+          int expected = 0;
+          first_error.compare_exchange_strong(expected, errno ? errno : EIO);
+        }
+      });
+    }
+    pool.Wait();
+  }
+
+  VLOG(1) << "Wrote " << file_size << " bytes in "
+          << (file_size + kWriteChunkSize - 1) / kWriteChunkSize
+          << " chunks on " << thread_count << " threads";
+  if (first_error) {
+    errno = first_error;
+    return false;
+  }
+  return ftruncate(fd, file_size) == 0 && fsync(fd) == 0;
+}
+
+void ComputeBlockCrcs(std::vector<WriteExtent> extents,
+                      uint64_t file_size,
+                      uint64_t block_size,
+                      std::vector<uint32_t>* crcs) {
+  std::stable_sort(extents.begin(), extents.end(), ExtentLess);
+  crcs->clear();
+  std::vector<uint8_t> block;
+  size_t first = 0;
+  for (uint64_t start = 0; start < file_size; start += block_size) {
+    const uint64_t end = std::min(start + block_size, file_size);
+    SkipExtents(extents, start, &first);
+    AssembleChunk(extents, first, start, end, &block);
+    crcs->push_back(Crc32(0, block.data(), block.size()));
+  }
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,58 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Parallel writer for the contents of a large output file.
+//
+// The caller describes the file as extents, each a buffer to be written at
+// its final offset.  WriteExtents() fills the gaps between them with zeros,
+// cuts the whole file into chunks aligned to kWriteChunkSize, and writes
+// the chunks concurrently with pwrite from a WorkerPool.  A single fsync
+// follows once every chunk is written, so a failure leaves the file
+// incomplete but never reports it durable.
+//
+// ComputeBlockCrcs() checksums the same description block by block, to
+// find the blocks a conversion changes without writing anything.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_EXTENT_WRITER_H_
+#define TOOLS_RELOCATION_PACKER_SRC_EXTENT_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace relocation_packer {
+
+// Chunks are cut at multiples of this file offset, large enough that each
+// pwrite amortizes its syscall and small enough to spread a file of tens of
+// megabytes across several threads.
+const uint64_t kWriteChunkSize = 4 << 20;
+
+// Bytes to place at one offset of the output.
+struct WriteExtent {
+  uint64_t offset;
+  const void* data;
+  uint64_t size;
+};
+
+// Write |extents| to |fd| with |threads| threads, zero-filling gaps, then
+// truncate |fd| to |file_size| and fsync it.  Where extents overlap, the
+// one starting later wins.  No extent may end beyond |file_size|.  Zero
+// |threads| selects one per CPU.  Returns false on error, with errno
+// set from the first failure.
+bool WriteExtents(int fd,
+                  std::vector<WriteExtent> extents,
+                  uint64_t file_size,
+                  size_t threads);
+
+// Set |crcs| to the CRC-32 of each |block_size| block of the file of
+// |file_size| bytes that |extents| describe, zero-filling gaps as
+// WriteExtents() would.  The last block may be short.
+void ComputeBlockCrcs(std::vector<WriteExtent> extents,
+                      uint64_t file_size,
+                      uint64_t block_size,
+                      std::vector<uint32_t>* crcs);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_EXTENT_WRITER_H_
@@ -0,0 +1,179 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "file_util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+
+namespace relocation_packer {
+
+ssize_t ReadFully(int fd, void* buffer, size_t size) {
+  uint8_t* cursor = static_cast<uint8_t*>(buffer);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(read(fd, cursor + done,
+                                                  size - done));
+    if (bytes < 0)
+      return -1;
+    if (bytes == 0)
+      break;
+    done += bytes;
+  }
+  return done;
+}
+
+bool WriteFully(int fd, const void* buffer, size_t size) {
+  const uint8_t* cursor = static_cast<const uint8_t*>(buffer);
+  while (size > 0) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(write(fd, cursor, size));
+    if (bytes <= 0)
+      return false;
+    cursor += bytes;
+    size -= bytes;
+  }
+  return true;
+}
+
+bool PwriteFully(int fd, const void* buffer, size_t size, off_t offset) {
+  const uint8_t* cursor = static_cast<const uint8_t*>(buffer);
+  while (size > 0) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(pwrite(fd, cursor, size, offset));
+    if (bytes <= 0)
+      return false;
+    cursor += bytes;
+    offset += bytes;
+    size -= bytes;
+  }
+  return true;
+}
+
+bool CopyFileRange(int in_fd, off_t in_offset,
+                   int out_fd, off_t out_offset,
+                   size_t size) {
+  while (size > 0) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(
+        copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, 0));
+    if (bytes > 0) {
+      size -= bytes;
+      continue;
+    }
+    if (bytes == 0)
+      return false;
+    // Not supported between these files; fall back to a buffered copy.
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP) {
+      return false;
+    }
+    break;
+  }
+
+  static const size_t kChunkSize = 256 * 1024;
+  std::vector<uint8_t> buffer(std::min(size, kChunkSize));
+  while (size > 0) {
+    const size_t chunk = std::min(size, kChunkSize);
+    const ssize_t bytes =
+        TEMP_FAILURE_RETRY(pread(in_fd, buffer.data(), chunk, in_offset));
+    if (bytes <= 0 || !PwriteFully(out_fd, buffer.data(), bytes, out_offset))
+      return false;
+    in_offset += bytes;
+    out_offset += bytes;
+    size -= bytes;
+  }
+  return true;
+}
+
+bool SendFully(int in_fd, off_t in_offset, int out_fd, size_t size) {
+  while (size > 0) {
+    const ssize_t bytes =
+        TEMP_FAILURE_RETRY(sendfile(out_fd, in_fd, &in_offset, size));
+    if (bytes > 0) {
+      size -= bytes;
+      continue;
+    }
+    if (bytes == 0)
+      return false;
+    // Not supported for this output; fall back to a buffered copy.
+    if (errno != EINVAL && errno != ENOSYS)
+      return false;
+    break;
+  }
+
+  static const size_t kChunkSize = 256 * 1024;
+  std::vector<uint8_t> buffer(std::min(size, kChunkSize));
+  while (size > 0) {
+    const size_t chunk = std::min(size, kChunkSize);
+    const ssize_t bytes =
+        TEMP_FAILURE_RETRY(pread(in_fd, buffer.data(), chunk, in_offset));
+    if (bytes <= 0 || !WriteFully(out_fd, buffer.data(), bytes))
+      return false;
+    in_offset += bytes;
+    size -= bytes;
+  }
+  return true;
+}
+
+bool ReadToEnd(int fd, std::vector<uint8_t>* contents) {
+  static const size_t kChunkSize = 64 * 1024;
+  for (;;) {
+    const size_t used = contents->size();
+    contents->resize(used + kChunkSize);
+    const ssize_t bytes = ReadFully(fd, &contents->at(used), kChunkSize);
+    if (bytes < 0) {
+      contents->resize(used);
+      return false;
+    }
+    contents->resize(used + bytes);
+    if (static_cast<size_t>(bytes) < kChunkSize)
+      return true;
+  }
+}
+
+bool ReadWholeFile(int fd, std::vector<uint8_t>* contents) {
+  struct stat status;
+  if (fstat(fd, &status) != 0)
+    return false;
+
+  contents->resize(status.st_size);
+  size_t done = 0;
+  while (done < contents->size()) {
+    const ssize_t bytes = TEMP_FAILURE_RETRY(
+        pread(fd, &contents->at(done), contents->size() - done, done));
+    if (bytes <= 0)
+      return false;
+    done += bytes;
+  }
+  return true;
+}
+
+bool WriteFileAtomically(const std::string& path,
+                         const std::string& contents) {
+  std::string temporary = path + ".XXXXXX";
+  const int fd = mkstemp(&temporary[0]);
+  if (fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+  bool status = fchmod(fd, 0644) == 0 &&
+                WriteFully(fd, contents.data(), contents.size());
+  status = close(fd) == 0 && status;
+  if (!status || rename(temporary.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,58 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Small blocking I/O helpers that retry on EINTR and short transfers.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_FILE_UTIL_H_
+#define TOOLS_RELOCATION_PACKER_SRC_FILE_UTIL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+namespace relocation_packer {
+
+// Read up to |size| bytes, stopping early only at end of file.  Returns the
+// number of bytes read, or -1 on error.
+ssize_t ReadFully(int fd, void* buffer, size_t size);
+
+// Write all |size| bytes.  Returns false on error.
+bool WriteFully(int fd, const void* buffer, size_t size);
+
+// Write all |size| bytes at |offset|, leaving the file position unchanged.
+// Returns false on error.
+bool PwriteFully(int fd, const void* buffer, size_t size, off_t offset);
+
+// Copy |size| bytes from |in_offset| in |in_fd| to |out_offset| in
+// |out_fd|, in the kernel with copy_file_range where possible (sharing
+// extents on filesystems that support reflinks), else through a buffer.
+// File positions are unchanged.  Returns false on error or short input.
+bool CopyFileRange(int in_fd, off_t in_offset,
+                   int out_fd, off_t out_offset,
+                   size_t size);
+
+// Write |size| bytes from |in_offset| in |in_fd| to the current position of
+// |out_fd|, which may be a pipe or socket.  Uses sendfile where possible,
+// else a buffer.  Returns false on error or short input.
+bool SendFully(int in_fd, off_t in_offset, int out_fd, size_t size);
+
+// Read from |fd| until end of file, appending to |contents|.  Works on pipes
+// and other non-seekable descriptors.  Returns false on error.
+bool ReadToEnd(int fd, std::vector<uint8_t>* contents);
+
+// Read the whole file open on |fd| from offset zero with pread, replacing
+// |contents|.  Returns false on error.
+bool ReadWholeFile(int fd, std::vector<uint8_t>* contents);
+
+// Write |contents| to |path| through a temporary file in the same
+// directory and rename, so that readers never see a partial file.  Returns
+// false, logging the error, on failure.
+bool WriteFileAtomically(const std::string& path,
+                         const std::string& contents);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_FILE_UTIL_H_
@@ -5,6 +5,39 @@
 // Tool to pack and unpack relative relocations in a shared library.
 //
 // Invoke with -v to trace actions taken when packing or unpacking.
+// Invoke with -s to keep .relr.dyn and apply it from a startup stub instead
+// of expanding it.
+// Invoke with --tar to convert shared objects inside a tar stream, reading
+// the named archive or stdin and writing to stdout.
+// Invoke with file '-' to read a shared library from stdin and write the
+// converted library to stdout.
+// Invoke with --zip to convert stored shared objects inside a ZIP or APK
+// archive in place.
+// Invoke with --watch to convert new shared objects in a directory tree as
+// they are written.
+// Invoke with --analyze to report RELR statistics for a set of files.
+// Invoke with --max-relocations, --max-output, --max-time or --max-memory to
+// bound what any one conversion may use.
+// Invoke with --metrics to write conversion metrics for node_exporter's
+// textfile collector.
+// Invoke with --dry-run to report the layout a conversion would produce
+// without writing the file.
+// Invoke with --emit, once per output, to convert a file to several output
+// formats in one run.
+// Invoke with --patch to write a binary patch from a file to its converted
+// form, and with --apply-patch to rebuild the converted file from one.
+// Invoke with several files, --manifest or --directory to convert a batch of
+// files in place, optionally only one shard of it with --shard-index and
+// --shard-count.
+// Invoke with --strip-debug to drop debug sections and the symbol table while
+// converting, or --split-debug to move them to file.debug, linked from the
+// converted file by .gnu_debuglink.
+// Invoke with --prelink to write prelinked values for .rela.dyn relocations
+// of libraries loaded at the fixed bases a map gives.
+// Invoke with --block-size to align holes for block-compressed or
+// deduplicated storage and report the blocks a conversion changes.
+// Invoke with --write-threads to write each large output with several
+// threads.
 // Invoke with -p to pad removed relocations with R_*_NONE.  Suppresses
 // shrinking of .rel.dyn.
 // See PrintUsage() below for full usage details.
@@ -16,14 +49,43 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "analyze.h"
+#include "batch.h"
 #include "debug.h"
 #include "elf_file.h"
-#include "elf_traits.h"
 #include "libelf.h"
+#include "metrics.h"
+#include "patch.h"
+#include "prelink.h"
+#include "tar_stream.h"
+#include "unpack.h"
+#include "watch.h"
+#include "zip_archive.h"
+
+// Parse a byte count with an optional K, M or G suffix.  Returns false if
+// |text| is not one.
+static bool ParseByteCount(const char* text, uint64_t* bytes) {
+  char* end;
+  errno = 0;
+  uint64_t value = strtoull(text, &end, 10);
+  if (errno || end == text)
+    return false;
+  switch (*end) {
+    case 'G': value <<= 10;  // Fall through.
+    case 'M': value <<= 10;  // Fall through.
+    case 'K': value <<= 10; ++end;
+  }
+  *bytes = value;
+  return *end == '\0';
+}
 
 static void PrintUsage(const char* argv0) {
   std::string temporary = argv0;
@@ -34,29 +96,329 @@ static void PrintUsage(const char* argv0) {
   const char* basename = temporary.c_str();
 
   printf(
-      "Usage: %s [-u] [-v] [-p] file\n\n"
-      "Unpack relative relocations in a shared library.\n\n"
-      "  -v, --verbose  trace object file modifications (for debugging)\n\n",
-      basename);
+      "Usage: %s [-u] [-v] [-p] [-s] [--dry-run] file\n"
+      "       %s [-v] --emit FORMAT:OUTPUT [--emit FORMAT:OUTPUT...] file\n"
+      "       %s [-v] [-s] --patch P file\n"
+      "       %s [-v] --apply-patch P original output\n"
+      "       %s [-j N] [-v] [-s] [--manifest F] [--directory D]\n"
+      "           [--shard-index I --shard-count N] [--stats F]\n"
+      "           [--journal F] [file...]\n"
+      "       %s --watch D [-j N] [-v] [-s]\n"
+      "       %s --analyze csv|json [-j N] [--manifest F] [--directory D]\n"
+      "           [file...]\n"
+      "       %s --tar [-j N] [-v] [-s] [archive]\n"
+      "       %s --zip [-j N] [-v] [-s] archive\n\n"
+      "Unpack relative relocations in a shared library.  A file of '-' reads\n"
+      "the library from stdin and writes the result to stdout.  Input may be\n"
+      "packed as SHT_RELR, Android APS2, or both.\n\n"
+      "  -v, --verbose  trace object file modifications (for debugging)\n"
+      "  -s, --stub     keep .relr.dyn and apply it from a self-relocating\n"
+      "                 DT_INIT stub (x86_64 only)\n"
+      "  --strip-debug  drop .debug_*, .symtab and .strtab while converting\n"
+      "  --split-debug  move .debug_*, .symtab and .strtab to OUTPUT.debug,\n"
+      "                 adding .gnu_debuglink to the output; files only, not\n"
+      "                 archives, streams or patches\n"
+      "  --dry-run      open file read-only, convert it in memory, and write\n"
+      "                 the new section and segment layout, file growth,\n"
+      "                 moved bytes and any misplacements to stdout\n"
+      "  --emit FORMAT:OUTPUT\n"
+      "                 write file converted to FORMAT to OUTPUT, leaving file\n"
+      "                 unchanged; repeat to write several formats from one\n"
+      "                 read and decode.  FORMAT is rela (expanded), relacount\n"
+      "                 (expanded, relative relocations first and counted by\n"
+      "                 DT_RELACOUNT), aps2 (Android packed) or stub\n"
+      "  --patch P      open file read-only and write a patch converting it\n"
+      "                 to P, or to stdout if P is '-'\n"
+      "  --apply-patch P\n"
+      "                 apply patch P, or stdin if '-', to original, writing\n"
+      "                 the converted file to output atomically\n"
+      "  --tar          convert shared objects inside a tar stream read from\n"
+      "                 archive, or stdin if absent or '-', writing the\n"
+      "                 converted stream to stdout\n"
+      "  --zip          convert stored lib/<abi>/*.so entries inside a ZIP or\n"
+      "                 APK archive, rewriting it in place (APKs must be\n"
+      "                 re-signed afterwards)\n"
+      "  --manifest F   convert the files listed in F, one path per line,\n"
+      "                 optionally followed by a tab and the size in bytes\n"
+      "  --directory D  convert every shared object under D\n"
+      "  --shard-index I, --shard-count N\n"
+      "                 convert only shard I of N of the batch; shards are\n"
+      "                 balanced by size and need no coordination\n"
+      "  --watch D      convert shared objects written under D as they\n"
+      "                 appear, until interrupted\n"
+      "  --stats F      write per-file batch results to F\n"
+      "  --analyze FMT  write RELR statistics and projected relocation sizes\n"
+      "                 for the given files to stdout as csv or json,\n"
+      "                 without converting anything\n"
+      "  --journal F    record finished files in F and skip those already\n"
+      "                 recorded, so an interrupted batch can be rerun;\n"
+      "                 files are replaced atomically\n"
+      "  -j, --jobs N   conversion threads (default: one per CPU)\n"
+      "  --probe-jobs N threads probing batch inputs and reading ahead the\n"
+      "                 ones to convert (default: four per conversion thread)\n"
+      "  --prefetch B   bytes of batch inputs read ahead and waiting for a\n"
+      "                 conversion thread (default: 256M)\n"
+      "  --prelink MAP  write the final value of each .rela.dyn relocation\n"
+      "                 into its target, for libraries loaded at fixed bases;\n"
+      "                 MAP lists every library, one path and hex base per\n"
+      "                 line, in symbol lookup order.  Relocations are kept.\n"
+      "  --block-size B align holes opened for regenerated data to B bytes,\n"
+      "                 a power of two (may end in K, M or G), so that later\n"
+      "                 content keeps its offset within a block, and log how\n"
+      "                 many blocks change\n"
+      "  --write-threads N\n"
+      "                 write each output in aligned chunks from N threads,\n"
+      "                 0 for one per CPU (default: 1, a single sequential\n"
+      "                 write)\n"
+      "  --max-relocations N\n"
+      "                 fail a conversion expanding to more than N\n"
+      "                 relocations, checked before expanding\n"
+      "  --max-output B fail a conversion whose result exceeds B bytes\n"
+      "  --max-time MS  fail a conversion not ready to write after MS\n"
+      "                 milliseconds; the file is left unchanged\n"
+      "  --max-memory B fail a conversion estimated to need more than B\n"
+      "                 bytes of memory (B may end in K, M or G)\n"
+      "  --metrics F    write conversion metrics to F in the Prometheus text\n"
+      "                 format, replacing it atomically while running and\n"
+      "                 on exit\n"
+      "  --metrics-interval S\n"
+      "                 seconds between metrics writes (default: 15)\n\n",
+      basename, basename, basename, basename, basename, basename, basename,
+      basename, basename);
 
   printf(
-      "Debug sections are not handled, so packing should not be used on\n"
-      "shared libraries compiled for debugging or otherwise unstripped.\n");
+      "Debug sections are kept, unmodified, unless --strip-debug or\n"
+      "--split-debug is given.\n");
 }
 
 int main(int argc, char* argv[]) {
   bool is_verbose = false;
+  bool is_tar = false;
+  bool is_zip = false;
+  bool is_batch = false;
+  bool is_analyze = false;
+  bool is_dry_run = false;
+  relocation_packer::analysis_format_t analysis_format =
+      relocation_packer::ANALYSIS_CSV;
+  size_t jobs = 0;
+  std::vector<std::string> manifests;
+  std::vector<std::string> directories;
+  std::string watch_directory;
+  relocation_packer::UnpackOptions unpack_options;
+  relocation_packer::BatchOptions batch_options;
+  std::string metrics_path;
+  std::vector<relocation_packer::OutputVariant> variants;
+  std::string patch_path;
+  std::string apply_patch_path;
+  std::string prelink_path;
+  relocation_packer::PrelinkScope prelink_scope;
+  unsigned metrics_interval = 15;
 
+  enum {
+    OPTION_TAR = 256,
+    OPTION_ZIP,
+    OPTION_MANIFEST,
+    OPTION_DIRECTORY,
+    OPTION_SHARD_INDEX,
+    OPTION_SHARD_COUNT,
+    OPTION_STATS,
+    OPTION_JOURNAL,
+    OPTION_WATCH,
+    OPTION_ANALYZE,
+    OPTION_DRY_RUN,
+    OPTION_MAX_RELOCATIONS,
+    OPTION_MAX_OUTPUT,
+    OPTION_MAX_TIME,
+    OPTION_MAX_MEMORY,
+    OPTION_METRICS,
+    OPTION_METRICS_INTERVAL,
+    OPTION_STRIP_DEBUG,
+    OPTION_SPLIT_DEBUG,
+    OPTION_EMIT,
+    OPTION_PATCH,
+    OPTION_APPLY_PATCH,
+    OPTION_WRITE_THREADS,
+    OPTION_BLOCK_SIZE,
+    OPTION_PRELINK,
+    OPTION_PROBE_JOBS,
+    OPTION_PREFETCH
+  };
   static const option options[] = {
-    {"verbose", 0, 0, 'v'}, {"help", 0, 0, 'h'}, {NULL, 0, 0, 0}
+    {"verbose", 0, 0, 'v'},
+    {"stub", 0, 0, 's'},
+    {"tar", 0, 0, OPTION_TAR},
+    {"zip", 0, 0, OPTION_ZIP},
+    {"manifest", 1, 0, OPTION_MANIFEST},
+    {"directory", 1, 0, OPTION_DIRECTORY},
+    {"shard-index", 1, 0, OPTION_SHARD_INDEX},
+    {"shard-count", 1, 0, OPTION_SHARD_COUNT},
+    {"stats", 1, 0, OPTION_STATS},
+    {"journal", 1, 0, OPTION_JOURNAL},
+    {"watch", 1, 0, OPTION_WATCH},
+    {"analyze", 1, 0, OPTION_ANALYZE},
+    {"dry-run", 0, 0, OPTION_DRY_RUN},
+    {"max-relocations", 1, 0, OPTION_MAX_RELOCATIONS},
+    {"max-output", 1, 0, OPTION_MAX_OUTPUT},
+    {"max-time", 1, 0, OPTION_MAX_TIME},
+    {"max-memory", 1, 0, OPTION_MAX_MEMORY},
+    {"metrics", 1, 0, OPTION_METRICS},
+    {"metrics-interval", 1, 0, OPTION_METRICS_INTERVAL},
+    {"strip-debug", 0, 0, OPTION_STRIP_DEBUG},
+    {"split-debug", 0, 0, OPTION_SPLIT_DEBUG},
+    {"emit", 1, 0, OPTION_EMIT},
+    {"patch", 1, 0, OPTION_PATCH},
+    {"apply-patch", 1, 0, OPTION_APPLY_PATCH},
+    {"write-threads", 1, 0, OPTION_WRITE_THREADS},
+    {"block-size", 1, 0, OPTION_BLOCK_SIZE},
+    {"prelink", 1, 0, OPTION_PRELINK},
+    {"probe-jobs", 1, 0, OPTION_PROBE_JOBS},
+    {"prefetch", 1, 0, OPTION_PREFETCH},
+    {"jobs", 1, 0, 'j'},
+    {"help", 0, 0, 'h'},
+    {NULL, 0, 0, 0}
   };
   bool has_options = true;
   while (has_options) {
-    int c = getopt_long(argc, argv, "uvph", options, NULL);
+    int c = getopt_long(argc, argv, "uvpsj:h", options, NULL);
     switch (c) {
       case 'v':
         is_verbose = true;
         break;
+      case 's':
+        unpack_options.output_format = relocation_packer::RELOCATION_STUB;
+        break;
+      case OPTION_TAR:
+        is_tar = true;
+        break;
+      case OPTION_ZIP:
+        is_zip = true;
+        break;
+      case OPTION_MANIFEST:
+        manifests.push_back(optarg);
+        is_batch = true;
+        break;
+      case OPTION_DIRECTORY:
+        directories.push_back(optarg);
+        is_batch = true;
+        break;
+      case OPTION_SHARD_INDEX:
+        batch_options.shard_index = strtoul(optarg, NULL, 10);
+        is_batch = true;
+        break;
+      case OPTION_SHARD_COUNT:
+        batch_options.shard_count = strtoul(optarg, NULL, 10);
+        is_batch = true;
+        break;
+      case OPTION_STATS:
+        batch_options.stats_path = optarg;
+        is_batch = true;
+        break;
+      case OPTION_JOURNAL:
+        batch_options.journal_path = optarg;
+        is_batch = true;
+        break;
+      case OPTION_WATCH:
+        watch_directory = optarg;
+        break;
+      case OPTION_ANALYZE:
+        is_analyze = true;
+        if (strcmp(optarg, "json") == 0) {
+          analysis_format = relocation_packer::ANALYSIS_JSON;
+        } else if (strcmp(optarg, "csv") != 0) {
+          LOG(ERROR) << "unknown analysis format: " << optarg;
+          return 1;
+        }
+        break;
+      case OPTION_DRY_RUN:
+        is_dry_run = true;
+        break;
+      case OPTION_MAX_RELOCATIONS:
+        unpack_options.limits.max_relocations = strtoull(optarg, NULL, 10);
+        break;
+      case OPTION_MAX_OUTPUT:
+        if (!ParseByteCount(optarg,
+                            &unpack_options.limits.max_output_bytes)) {
+          LOG(ERROR) << "invalid byte count: " << optarg;
+          return 1;
+        }
+        break;
+      case OPTION_MAX_TIME:
+        unpack_options.limits.max_time_ms = strtoull(optarg, NULL, 10);
+        break;
+      case OPTION_MAX_MEMORY:
+        if (!ParseByteCount(optarg,
+                            &unpack_options.limits.max_memory_bytes)) {
+          LOG(ERROR) << "invalid byte count: " << optarg;
+          return 1;
+        }
+        break;
+      case OPTION_METRICS:
+        metrics_path = optarg;
+        break;
+      case OPTION_METRICS_INTERVAL:
+        metrics_interval = strtoul(optarg, NULL, 10);
+        if (metrics_interval == 0) {
+          LOG(ERROR) << "--metrics-interval must be at least one second";
+          return 1;
+        }
+        break;
+      case OPTION_STRIP_DEBUG:
+        unpack_options.debug_sections =
+            relocation_packer::STRIP_DEBUG_SECTIONS;
+        break;
+      case OPTION_SPLIT_DEBUG:
+        unpack_options.debug_sections =
+            relocation_packer::SPLIT_DEBUG_SECTIONS;
+        break;
+      case OPTION_EMIT: {
+        const char* separator = strchr(optarg, ':');
+        relocation_packer::OutputVariant variant;
+        if (!separator || !separator[1] ||
+            !relocation_packer::ParseOutputFormat(
+                std::string(optarg, separator - optarg), &variant.format)) {
+          LOG(ERROR) << "invalid --emit, expected FORMAT:OUTPUT: " << optarg;
+          return 1;
+        }
+        variant.path = separator + 1;
+        variants.push_back(variant);
+        break;
+      }
+      case OPTION_PATCH:
+        patch_path = optarg;
+        break;
+      case OPTION_APPLY_PATCH:
+        apply_patch_path = optarg;
+        break;
+      case OPTION_BLOCK_SIZE: {
+        uint64_t block_size;
+        if (!ParseByteCount(optarg, &block_size) || block_size == 0 ||
+            (block_size & (block_size - 1)) != 0) {
+          LOG(ERROR) << "--block-size must be a power of two: " << optarg;
+          return 1;
+        }
+        unpack_options.block_size = block_size;
+        break;
+      }
+      case OPTION_PRELINK:
+        prelink_path = optarg;
+        break;
+      case OPTION_WRITE_THREADS:
+        unpack_options.write_threads = strtoul(optarg, NULL, 10);
+        break;
+      case OPTION_PROBE_JOBS:
+        batch_options.probe_jobs = strtoul(optarg, NULL, 10);
+        is_batch = true;
+        break;
+      case OPTION_PREFETCH:
+        if (!ParseByteCount(optarg, &batch_options.prefetch_bytes)) {
+          LOG(ERROR) << "invalid byte count: " << optarg;
+          return 1;
+        }
+        is_batch = true;
+        break;
+      case 'j':
+        jobs = strtoul(optarg, NULL, 10);
+        break;
       case 'h':
         PrintUsage(argv[0]);
         return 0;
@@ -71,57 +433,213 @@ int main(int argc, char* argv[]) {
         return 1;
     }
   }
-  if (optind != argc - 1) {
-    LOG(INFO) << "Try '" << argv[0] << " --help' for more information.";
-    return 1;
-  }
 
   if (elf_version(EV_CURRENT) == EV_NONE) {
     LOG(WARNING) << "Elf Library is out of date!";
   }
 
-  const char* file = argv[argc - 1];
-  const int fd = open(file, O_RDWR);
-  if (fd == -1) {
-    LOG(ERROR) << file << ": " << strerror(errno);
-    return 1;
-  }
-
   if (is_verbose)
     relocation_packer::Logger::SetVerbose(1);
 
-  // We need to detect elf class in order to create
-  // correct implementation
-  uint8_t e_ident[EI_NIDENT];
-  if (TEMP_FAILURE_RETRY(read(fd, e_ident, EI_NIDENT)) != EI_NIDENT) {
-    LOG(ERROR) << file << ": failed to read elf header:" << strerror(errno);
-    return 1;
+  if (!prelink_path.empty()) {
+    if (!prelink_scope.Load(prelink_path))
+      return 1;
+    unpack_options.prelink = &prelink_scope;
+  }
+
+  // Written periodically from now on, and finally on return from main.
+  std::unique_ptr<relocation_packer::MetricsExporter> metrics_exporter;
+  if (!metrics_path.empty()) {
+    metrics_exporter.reset(
+        new relocation_packer::MetricsExporter(metrics_path,
+                                               metrics_interval));
   }
 
-  if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) != 0) {
-    LOG(ERROR) << file << ": lseek to 0 failed:" << strerror(errno);
+  const bool is_other_mode = is_tar || is_zip || is_batch || is_analyze ||
+                            !watch_directory.empty();
+
+  if (unpack_options.debug_sections ==
+          relocation_packer::SPLIT_DEBUG_SECTIONS &&
+      (is_tar || is_zip || !patch_path.empty() ||
+       (optind < argc && strcmp(argv[argc - 1], "-") == 0))) {
+    LOG(ERROR) << "--split-debug needs files converted in place";
     return 1;
   }
 
-  bool status = false;
+  if (!variants.empty()) {
+    if (is_other_mode || is_dry_run || !patch_path.empty() ||
+        !apply_patch_path.empty() || optind != argc - 1 ||
+        strcmp(argv[optind], "-") == 0) {
+      LOG(ERROR) << "--emit takes a single file and no other mode";
+      return 1;
+    }
+    return relocation_packer::UnpackVariants(argv[optind], variants,
+                                             unpack_options) ? 0 : 1;
+  }
+
+  if (!apply_patch_path.empty()) {
+    if (is_other_mode || is_dry_run || !patch_path.empty() ||
+        optind != argc - 2) {
+      LOG(ERROR) << "--apply-patch takes an original and an output file and "
+                 << "no other mode";
+      return 1;
+    }
+    int fd = STDIN_FILENO;
+    if (apply_patch_path != "-") {
+      fd = open(apply_patch_path.c_str(), O_RDONLY);
+      if (fd == -1) {
+        LOG(ERROR) << apply_patch_path << ": " << strerror(errno);
+        return 1;
+      }
+    }
+    return relocation_packer::ApplyPatch(fd, argv[optind],
+                                         argv[optind + 1]) ? 0 : 1;
+  }
+
+  if (!patch_path.empty()) {
+    if (is_other_mode || is_dry_run || optind != argc - 1 ||
+        strcmp(argv[optind], "-") == 0) {
+      LOG(ERROR) << "--patch takes a single file and no other mode";
+      return 1;
+    }
+    int fd = STDOUT_FILENO;
+    if (patch_path == "-") {
+      // The patch goes to stdout, so keep log messages off it.
+      relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+    } else {
+      fd = open(patch_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1) {
+        LOG(ERROR) << patch_path << ": " << strerror(errno);
+        return 1;
+      }
+    }
+    bool status = relocation_packer::CreatePatch(argv[optind],
+                                                 unpack_options, fd);
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+      LOG(ERROR) << patch_path << ": " << strerror(errno);
+      status = false;
+    }
+    return status ? 0 : 1;
+  }
+
+  if (is_dry_run) {
+    if (is_other_mode || optind != argc - 1 ||
+        strcmp(argv[optind], "-") == 0) {
+      LOG(ERROR) << "--dry-run takes a single file and no other mode";
+      return 1;
+    }
+
+    // The report goes to stdout, so keep log messages off it.
+    relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+
+    const char* file = argv[optind];
+    const int fd = open(file, O_RDONLY);
+    if (fd == -1) {
+      LOG(ERROR) << file << ": " << strerror(errno);
+      return 1;
+    }
+    relocation_packer::LayoutReport report;
+    return relocation_packer::DryRunFile(fd, file, unpack_options,
+                                         &report) &&
+           relocation_packer::WriteLayoutReport(file, report,
+                                                STDOUT_FILENO) ? 0 : 1;
+  }
+
+  if (is_tar) {
+    if (argc - optind > 1) {
+      LOG(INFO) << "Try '" << argv[0] << " --help' for more information.";
+      return 1;
+    }
+
+    // The archive goes to stdout, so keep log messages off it.
+    relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+
+    int in_fd = STDIN_FILENO;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+      in_fd = open(argv[optind], O_RDONLY);
+      if (in_fd == -1) {
+        LOG(ERROR) << argv[optind] << ": " << strerror(errno);
+        return 1;
+      }
+    }
+    return relocation_packer::UnpackTarStream(in_fd, STDOUT_FILENO,
+                                              unpack_options, jobs) ? 0 : 1;
+  }
+
+  if (!watch_directory.empty()) {
+    if (optind != argc) {
+      LOG(INFO) << "Try '" << argv[0] << " --help' for more information.";
+      return 1;
+    }
+    return relocation_packer::WatchDirectory(watch_directory, unpack_options,
+                                             jobs) ? 0 : 1;
+  }
 
-  if (e_ident[EI_CLASS] == ELFCLASS32) {
-    relocation_packer::ElfFile<ELF32_traits> elf_file(fd);
+  if (is_analyze || is_batch || argc - optind > 1) {
+    if (batch_options.shard_count == 0 ||
+        batch_options.shard_index >= batch_options.shard_count) {
+      LOG(ERROR) << "--shard-index must be less than --shard-count";
+      return 1;
+    }
+    batch_options.jobs = jobs;
 
-    status = elf_file.UnpackRelocations();
-  } else if (e_ident[EI_CLASS] == ELFCLASS64) {
-    relocation_packer::ElfFile<ELF64_traits> elf_file(fd);
+    std::vector<relocation_packer::BatchInput> inputs;
+    bool status = relocation_packer::AddBatchFiles(
+        std::vector<std::string>(argv + optind, argv + argc), &inputs);
+    for (size_t i = 0; i < manifests.size(); ++i) {
+      int fd = STDIN_FILENO;
+      if (manifests[i] != "-") {
+        fd = open(manifests[i].c_str(), O_RDONLY);
+        if (fd == -1) {
+          LOG(ERROR) << manifests[i] << ": " << strerror(errno);
+          return 1;
+        }
+      }
+      status = relocation_packer::AddBatchManifest(fd, manifests[i],
+                                                   &inputs) && status;
+      if (fd != STDIN_FILENO)
+        close(fd);
+    }
+    for (size_t i = 0; i < directories.size(); ++i) {
+      status = relocation_packer::AddBatchDirectory(directories[i],
+                                                    &inputs) && status;
+    }
+    if (!status)
+      return 1;
 
-    status = elf_file.UnpackRelocations();
-  } else {
-    LOG(ERROR) << file << ": unknown ELFCLASS: " << e_ident[EI_CLASS];
+    if (is_analyze) {
+      // Results go to stdout, so keep log messages off it.
+      relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+      return relocation_packer::AnalyzeCorpus(inputs, jobs, analysis_format,
+                                              STDOUT_FILENO) ? 0 : 1;
+    }
+    return relocation_packer::UnpackBatch(inputs, unpack_options,
+                                          batch_options) ? 0 : 1;
+  }
+
+  if (optind != argc - 1) {
+    LOG(INFO) << "Try '" << argv[0] << " --help' for more information.";
     return 1;
   }
 
-  if (!status) {
-    LOG(ERROR) << file << ": failed to pack/unpack file";
+  if (is_zip) {
+    return relocation_packer::UnpackZipArchive(argv[optind], unpack_options,
+                                               jobs) ? 0 : 1;
+  }
+
+  const char* file = argv[argc - 1];
+  if (strcmp(file, "-") == 0) {
+    // The library goes to stdout, so keep log messages off it.
+    relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+    return relocation_packer::UnpackStream(STDIN_FILENO, STDOUT_FILENO,
+                                           "<stdin>", unpack_options) ? 0 : 1;
+  }
+
+  const int fd = open(file, O_RDWR);
+  if (fd == -1) {
+    LOG(ERROR) << file << ": " << strerror(errno);
     return 1;
   }
 
-  return 0;
+  return relocation_packer::UnpackFile(fd, file, unpack_options) ? 0 : 1;
 }
@@ -0,0 +1,240 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "metrics.h"
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "debug.h"
+#include "file_util.h"
+
+namespace relocation_packer {
+
+namespace {
+
+const double kPhaseBuckets[kPhaseBucketCount] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+  0.025, 0.05, 0.1, 0.25, 0.5, 1, 5
+};
+
+const char* const kPhaseNames[PHASE_COUNT] = {
+  "load", "decode", "relayout", "write"
+};
+
+std::mutex g_mutex;
+MetricsSnapshot g_metrics;
+
+// Time up to which the worker integrals are complete.
+double g_integrated_until = MonotonicSeconds();
+
+// Bring the worker integrals up to now.  Called with |g_mutex| held, before
+// any change to the gauges they integrate.
+void Integrate() {
+  const double now = MonotonicSeconds();
+  const double elapsed = now - g_integrated_until;
+  g_metrics.worker_seconds += g_metrics.workers * elapsed;
+  g_metrics.worker_busy_seconds += g_metrics.workers_busy * elapsed;
+  g_integrated_until = now;
+}
+
+void AddToGauge(uint64_t* gauge, int delta) {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  Integrate();
+  *gauge += delta;
+}
+
+void FormatHeader(const char* name,
+                  const char* type,
+                  const char* help,
+                  std::ostream* out) {
+  *out << "# HELP relr_unpack_" << name << " " << help << "\n"
+       << "# TYPE relr_unpack_" << name << " " << type << "\n";
+}
+
+template <typename T>
+void FormatValue(const char* name,
+                 const char* type,
+                 const char* help,
+                 T value,
+                 std::ostream* out) {
+  FormatHeader(name, type, help, out);
+  *out << "relr_unpack_" << name << " " << value << "\n";
+}
+
+}  // namespace
+
+double MonotonicSeconds() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+MetricsSnapshot::MetricsSnapshot() {
+  memset(this, 0, sizeof(*this));
+}
+
+void Metrics::AddConversion(bool converted,
+                            uint64_t bytes_read,
+                            uint64_t bytes_written) {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  ++(converted ? g_metrics.files_converted : g_metrics.files_failed);
+  g_metrics.bytes_read += bytes_read;
+  g_metrics.bytes_written += bytes_written;
+}
+
+void Metrics::AddRelocations(uint64_t count) {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  g_metrics.relocations_expanded += count;
+}
+
+void Metrics::ObservePhase(conversion_phase_t phase, double seconds) {
+  size_t bucket = 0;
+  while (bucket < kPhaseBucketCount && seconds > kPhaseBuckets[bucket])
+    ++bucket;
+
+  std::lock_guard<std::mutex> lock(g_mutex);
+  ++g_metrics.phase_buckets[phase][bucket];
+  ++g_metrics.phase_count[phase];
+  g_metrics.phase_seconds[phase] += seconds;
+}
+
+void Metrics::AddWorkers(int delta) {
+  AddToGauge(&g_metrics.workers, delta);
+}
+
+void Metrics::AddQueued(int delta) {
+  AddToGauge(&g_metrics.queue_depth, delta);
+}
+
+void Metrics::AddBusy(int delta) {
+  AddToGauge(&g_metrics.workers_busy, delta);
+}
+
+MetricsSnapshot Metrics::GetSnapshot() {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  Integrate();
+  return g_metrics;
+}
+
+std::string FormatMetrics(const MetricsSnapshot& current,
+                          const MetricsSnapshot& previous) {
+  std::ostringstream out;
+  out << std::setprecision(9);
+
+  FormatValue("files_converted_total", "counter",
+              "Shared objects converted.", current.files_converted, &out);
+  FormatValue("files_failed_total", "counter",
+              "Shared objects that failed to convert.", current.files_failed,
+              &out);
+  FormatValue("bytes_read_total", "counter",
+              "Bytes of shared objects read for conversion.",
+              current.bytes_read, &out);
+  FormatValue("bytes_written_total", "counter",
+              "Bytes of converted shared objects written.",
+              current.bytes_written, &out);
+  FormatValue("relocations_expanded_total", "counter",
+              "Relative relocations expanded from SHT_RELR.",
+              current.relocations_expanded, &out);
+
+  FormatHeader("phase_duration_seconds", "histogram",
+               "Time spent in each phase of a conversion.", &out);
+  for (size_t phase = 0; phase < PHASE_COUNT; ++phase) {
+    uint64_t cumulative = 0;
+    for (size_t bucket = 0; bucket <= kPhaseBucketCount; ++bucket) {
+      cumulative += current.phase_buckets[phase][bucket];
+      out << "relr_unpack_phase_duration_seconds_bucket{phase=\""
+          << kPhaseNames[phase] << "\",le=\"";
+      if (bucket < kPhaseBucketCount)
+        out << kPhaseBuckets[bucket];
+      else
+        out << "+Inf";
+      out << "\"} " << cumulative << "\n";
+    }
+    out << "relr_unpack_phase_duration_seconds_sum{phase=\""
+        << kPhaseNames[phase] << "\"} " << current.phase_seconds[phase]
+        << "\n";
+    out << "relr_unpack_phase_duration_seconds_count{phase=\""
+        << kPhaseNames[phase] << "\"} " << current.phase_count[phase]
+        << "\n";
+  }
+
+  FormatValue("queue_depth", "gauge",
+              "Tasks waiting for a worker thread.", current.queue_depth,
+              &out);
+  FormatValue("workers", "gauge", "Worker threads.", current.workers, &out);
+  FormatValue("workers_busy", "gauge", "Worker threads running a task.",
+              current.workers_busy, &out);
+  FormatValue("worker_seconds_total", "counter",
+              "Worker thread lifetime, summed over threads.",
+              current.worker_seconds, &out);
+  FormatValue("worker_busy_seconds_total", "counter",
+              "Worker thread time spent running tasks.",
+              current.worker_busy_seconds, &out);
+
+  double worker_seconds = current.worker_seconds - previous.worker_seconds;
+  double busy_seconds =
+      current.worker_busy_seconds - previous.worker_busy_seconds;
+  if (worker_seconds <= 0) {
+    worker_seconds = current.worker_seconds;
+    busy_seconds = current.worker_busy_seconds;
+  }
+  FormatValue("worker_utilization", "gauge",
+              "Fraction of worker thread time spent running tasks since "
+              "the last export.",
+              worker_seconds > 0 ? busy_seconds / worker_seconds : 0.0, &out);
+  return out.str();
+}
+
+MetricsExporter::MetricsExporter(const std::string& path,
+                                 unsigned interval_seconds)
+    : path_(path), interval_seconds_(interval_seconds), stopping_(false) {
+  Write();
+  thread_ = std::thread(&MetricsExporter::Run, this);
+}
+
+MetricsExporter::~MetricsExporter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stop_.notify_one();
+  thread_.join();
+  Write();
+}
+
+void MetricsExporter::Run() {
+  // Leave signals to the threads that handle them; watch mode takes
+  // SIGINT and SIGTERM through a signalfd.
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    stop_.wait_for(lock, std::chrono::seconds(interval_seconds_),
+                   [this] { return stopping_; });
+    if (stopping_)
+      return;
+    lock.unlock();
+    Write();
+    lock.lock();
+  }
+}
+
+void MetricsExporter::Write() {
+  const MetricsSnapshot current = Metrics::GetSnapshot();
+  if (!WriteFileAtomically(path_, FormatMetrics(current, previous_)))
+    LOG(WARNING) << path_ << ": failed to write metrics";
+  previous_ = current;
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,119 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Conversion metrics, exported in the Prometheus text format.
+//
+// Metrics is a process-wide registry, updated from any thread by the
+// conversion code and by WorkerPool.  It counts files converted and failed,
+// bytes read and written and relocations expanded, keeps a latency
+// histogram for each conversion phase, and integrates queue and worker
+// gauges over time so that utilization can be derived.
+//
+// MetricsExporter writes a snapshot to a file every few seconds, replacing
+// it atomically, for node_exporter's textfile collector; it writes once
+// more when destroyed, so a finished batch leaves its final counts behind.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_METRICS_H_
+#define TOOLS_RELOCATION_PACKER_SRC_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace relocation_packer {
+
+enum conversion_phase_t {
+  PHASE_LOAD = 0,
+  PHASE_DECODE,
+  PHASE_RELAYOUT,
+  PHASE_WRITE,
+  PHASE_COUNT
+};
+
+// Phase latency histogram buckets with a finite bound; +Inf is implicit.
+static const size_t kPhaseBucketCount = 14;
+
+// Seconds on the monotonic clock.
+double MonotonicSeconds();
+
+struct MetricsSnapshot {
+  MetricsSnapshot();
+
+  uint64_t files_converted;
+  uint64_t files_failed;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t relocations_expanded;
+
+  // Non-cumulative bucket counts; the last is +Inf.
+  uint64_t phase_buckets[PHASE_COUNT][kPhaseBucketCount + 1];
+  uint64_t phase_count[PHASE_COUNT];
+  double phase_seconds[PHASE_COUNT];
+
+  uint64_t queue_depth;
+  uint64_t workers;
+  uint64_t workers_busy;
+
+  // Integrals of |workers| and |workers_busy| over time.
+  double worker_seconds;
+  double worker_busy_seconds;
+};
+
+class Metrics {
+ public:
+  // Record a file converted from |bytes_read| to |bytes_written| bytes, or
+  // a failed conversion if not |converted|.
+  static void AddConversion(bool converted,
+                            uint64_t bytes_read,
+                            uint64_t bytes_written);
+
+  // Record |count| relocations expanded from a packed form.
+  static void AddRelocations(uint64_t count);
+
+  // Record |seconds| spent in |phase| of one conversion.
+  static void ObservePhase(conversion_phase_t phase, double seconds);
+
+  // Adjust the worker pool gauges by |delta|.
+  static void AddWorkers(int delta);
+  static void AddQueued(int delta);
+  static void AddBusy(int delta);
+
+  // Return the current values.
+  static MetricsSnapshot GetSnapshot();
+};
+
+// Render |current| in the Prometheus text format.  Worker utilization is
+// measured since |previous|, or since start if no worker time has passed
+// between them.
+std::string FormatMetrics(const MetricsSnapshot& current,
+                          const MetricsSnapshot& previous);
+
+class MetricsExporter {
+ public:
+  // Write metrics to |path| now and every |interval_seconds| after.
+  MetricsExporter(const std::string& path, unsigned interval_seconds);
+
+  // Stop, writing the final values.
+  ~MetricsExporter();
+
+ private:
+  void Run();
+  void Write();
+
+  std::string path_;
+  unsigned interval_seconds_;
+  MetricsSnapshot previous_;
+
+  std::mutex mutex_;
+  std::condition_variable stop_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_METRICS_H_
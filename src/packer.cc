@@ -4,6 +4,8 @@
 
 #include "packer.h"
 
+#include <string.h>
+#include <algorithm>
 #include <vector>
 
 #include "debug.h"
@@ -11,43 +13,365 @@
 
 namespace relocation_packer {
 
+// APS2 group flags, from Android's bionic linker.
+static const int64_t kGroupedByInfo = 1;
+static const int64_t kGroupedByOffsetDelta = 2;
+static const int64_t kGroupedByAddend = 4;
+static const int64_t kGroupHasAddend = 8;
+
+// Non-relative relocations sharing an r_info are grouped from this many.
+static const size_t kAps2MinInfoGroupSize = 3;
+
+unsigned RelativeRelocationType(unsigned machine) {
+  switch (machine) {
+    case EM_386:
+      return R_386_RELATIVE;
+    case EM_X86_64:
+      return R_X86_64_RELATIVE;
+    case EM_ARM:
+      return R_ARM_RELATIVE;
+    case EM_AARCH64:
+      return R_AARCH64_RELATIVE;
+#if defined(EM_RISCV) && defined(R_RISCV_RELATIVE)
+    case EM_RISCV:
+      return R_RISCV_RELATIVE;
+#endif
+    default:
+      return 0;
+  }
+}
+
+unsigned IrelativeRelocationType(unsigned machine) {
+  switch (machine) {
+    case EM_386:
+      return R_386_IRELATIVE;
+    case EM_X86_64:
+      return R_X86_64_IRELATIVE;
+    case EM_ARM:
+      return R_ARM_IRELATIVE;
+    case EM_AARCH64:
+      return R_AARCH64_IRELATIVE;
+#if defined(EM_RISCV) && defined(R_RISCV_IRELATIVE)
+    case EM_RISCV:
+      return R_RISCV_IRELATIVE;
+#endif
+    default:
+      return 0;
+  }
+}
+
 // Unpack relative relocations from a run-length encoded packed
 // representation.
 template <typename ELF>
 void RelocationPacker<ELF>::UnpackRelocations(
     const std::vector<typename ELF::Relr>& packed,
     std::vector<typename ELF::Rela>* relocations) {
+  DecodeRelr(packed.data(), packed.size(),
+             [relocations](typename ELF::Addr offset) {
+    typename ELF::Rela relocation;
+    relocation.r_offset = offset;
+    relocation.r_info = R_ARM_RELATIVE;
+    relocation.r_addend = 0;
+    relocations->push_back(relocation);
+  });
+}
+
+template <typename ELF>
+Aps2Encoder<ELF>::Aps2Encoder(typename ELF::Xword relative_info,
+                              typename ELF::Xword irelative_info,
+                              bool has_addends)
+    : relative_info_(relative_info), irelative_info_(irelative_info),
+      has_addends_(has_addends), count_(0), offset_(0), addend_(0),
+      ungrouped_count_(0) {}
+
+template <typename ELF>
+void Aps2Encoder<ELF>::AddRelative(typename ELF::Addr offset,
+                                   typename ELF::Sxword addend) {
+  if (!run_.empty() &&
+      offset != run_.back().r_offset + sizeof(typename ELF::Addr)) {
+    FlushRun();
+  }
+  typename ELF::Rela relocation;
+  relocation.r_offset = offset;
+  relocation.r_info = relative_info_;
+  relocation.r_addend = addend;
+  run_.push_back(relocation);
+  ++count_;
+}
+
+template <typename ELF>
+void Aps2Encoder<ELF>::AddOther(const typename ELF::Rela& relocation) {
+  others_.push_back(relocation);
+  ++count_;
+}
+
+// Encode the current run, either as an offset-delta group or, if short,
+// into the ungrouped relative relocations.
+template <typename ELF>
+void Aps2Encoder<ELF>::FlushRun() {
+  const int64_t has_addend = has_addends_ ? kGroupHasAddend : 0;
+
+  if (run_.size() < kAps2MinGroupSize) {
+    for (size_t i = 0; i < run_.size(); ++i) {
+      ungrouped_.Enqueue(run_[i].r_offset - offset_);
+      offset_ = run_[i].r_offset;
+      if (has_addends_) {
+        ungrouped_.Enqueue(run_[i].r_addend - addend_);
+        addend_ = run_[i].r_addend;
+      }
+    }
+    ungrouped_count_ += run_.size();
+    run_.clear();
+    return;
+  }
+
+  // Ungrouped relocations were delta-encoded before this run, so they must
+  // be written before it.
+  FlushUngrouped();
+
+  // The first relocation, reached by its distance from the last one.
+  body_.Enqueue(1);
+  body_.Enqueue(kGroupedByOffsetDelta | kGroupedByInfo | has_addend);
+  body_.Enqueue(run_[0].r_offset - offset_);
+  body_.Enqueue(relative_info_);
+  if (has_addends_) {
+    body_.Enqueue(run_[0].r_addend - addend_);
+    addend_ = run_[0].r_addend;
+  }
+
+  // The rest, one word apart.
+  body_.Enqueue(run_.size() - 1);
+  body_.Enqueue(kGroupedByOffsetDelta | kGroupedByInfo | has_addend);
+  body_.Enqueue(sizeof(typename ELF::Addr));
+  body_.Enqueue(relative_info_);
+  if (has_addends_) {
+    for (size_t i = 1; i < run_.size(); ++i) {
+      body_.Enqueue(run_[i].r_addend - addend_);
+      addend_ = run_[i].r_addend;
+    }
+  }
+  offset_ = run_.back().r_offset;
+  run_.clear();
+}
+
+template <typename ELF>
+void Aps2Encoder<ELF>::FlushUngrouped() {
+  if (ungrouped_count_ == 0)
+    return;
+  std::vector<uint8_t> encoded;
+  ungrouped_.GetEncoding(&encoded);
+  body_.Enqueue(ungrouped_count_);
+  body_.Enqueue(kGroupedByInfo | (has_addends_ ? kGroupHasAddend : 0));
+  body_.Enqueue(relative_info_);
+  body_.EnqueueBytes(encoded.data(), encoded.size());
+  ungrouped_count_ = 0;
+}
 
-  typename ELF::Addr base = 0;
-  for (unsigned int i=0; i < packed.size(); i++) {
-    typename ELF::Relr entry = packed.at(i);
-    if ((entry & 1) == 0) {
-      typename ELF::Rela relocation;
-      relocation.r_offset = entry;
-      relocation.r_info = R_ARM_RELATIVE;
-      relocation.r_addend = 0;
-      relocations->push_back(relocation);
-      base = entry + sizeof(typename ELF::Addr);
-      continue;
-    }
-
-    typename ELF::Addr offset = base;
-    while (entry != 0) {
-      entry >>= 1;
-      if ((entry & 1) != 0) {
-        typename ELF::Rela relocation;
-        relocation.r_offset = offset;
-        relocation.r_info = R_ARM_RELATIVE;
-        relocation.r_addend = 0;
-        relocations->push_back(relocation);
+// Encode others_[|begin|, |end|), grouping relocations that share r_info,
+// and an addend of zero, as lld does; a group without an addend resets it
+// to zero.
+template <typename ELF>
+void Aps2Encoder<ELF>::EncodeOthers(size_t begin, size_t end) {
+  std::vector<typename ELF::Rela> ungrouped;
+  for (size_t i = begin; i < end; ) {
+    size_t j = i + 1;
+    while (j < end && others_[j].r_info == others_[i].r_info &&
+           (!has_addends_ || others_[j].r_addend == others_[i].r_addend)) {
+      ++j;
+    }
+    if (j - i < kAps2MinInfoGroupSize ||
+        (has_addends_ && others_[i].r_addend != 0)) {
+      ungrouped.insert(ungrouped.end(), others_.begin() + i,
+                       others_.begin() + j);
+    } else {
+      body_.Enqueue(j - i);
+      body_.Enqueue(kGroupedByInfo);
+      body_.Enqueue(others_[i].r_info);
+      for (size_t k = i; k < j; ++k) {
+        body_.Enqueue(others_[k].r_offset - offset_);
+        offset_ = others_[k].r_offset;
+      }
+      addend_ = 0;
+    }
+    i = j;
+  }
+
+  if (!ungrouped.empty()) {
+    body_.Enqueue(ungrouped.size());
+    body_.Enqueue(has_addends_ ? kGroupHasAddend : 0);
+    for (size_t i = 0; i < ungrouped.size(); ++i) {
+      body_.Enqueue(ungrouped[i].r_offset - offset_);
+      offset_ = ungrouped[i].r_offset;
+      body_.Enqueue(ungrouped[i].r_info);
+      if (has_addends_) {
+        body_.Enqueue(ungrouped[i].r_addend - addend_);
+        addend_ = ungrouped[i].r_addend;
+      }
+    }
+  }
+}
+
+template <typename ELF>
+void Aps2Encoder<ELF>::GetEncoding(std::vector<uint8_t>* packed) {
+  FlushRun();
+  FlushUngrouped();
+
+  // Sort other relocations by r_info, except that IRELATIVE ones stay
+  // last and in order, as lld keeps them: their resolvers may read what
+  // the rest relocate.
+  const auto irelative_first = std::stable_partition(
+      others_.begin(), others_.end(),
+      [this](const typename ELF::Rela& relocation) {
+    return irelative_info_ == 0 || relocation.r_info != irelative_info_;
+  });
+  std::sort(others_.begin(), irelative_first,
+            [](const typename ELF::Rela& a, const typename ELF::Rela& b) {
+    if (a.r_info != b.r_info)
+      return a.r_info < b.r_info;
+    return a.r_offset < b.r_offset;
+  });
+  const size_t irelative_index = irelative_first - others_.begin();
+  EncodeOthers(0, irelative_index);
+  EncodeOthers(irelative_index, others_.size());
+
+  Sleb128Encoder header;
+  static const uint8_t kMagic[] = {'A', 'P', 'S', '2'};
+  header.EnqueueBytes(kMagic, sizeof(kMagic));
+  header.Enqueue(count_);
+  header.Enqueue(0);
+  std::vector<uint8_t> body;
+  body_.GetEncoding(&body);
+  header.EnqueueBytes(body.data(), body.size());
+  header.GetEncoding(packed);
+
+  others_.clear();
+  count_ = 0;
+  offset_ = 0;
+  addend_ = 0;
+}
+
+template <typename ELF>
+Aps2Decoder<ELF>::Aps2Decoder(const uint8_t* packed,
+                              size_t size,
+                              bool has_addends)
+    : decoder_(packed, size), has_addends_(has_addends), has_header_(false),
+      count_(0), initial_offset_(0) {
+  static const uint8_t kMagic[] = {'A', 'P', 'S', '2'};
+  if (size < sizeof(kMagic) || memcmp(packed, kMagic, sizeof(kMagic)) != 0)
+    decoder_ = Sleb128Decoder(packed, 0);
+  else
+    decoder_ = Sleb128Decoder(packed + sizeof(kMagic), size - sizeof(kMagic));
+}
+
+template <typename ELF>
+bool Aps2Decoder<ELF>::ReadHeader() {
+  if (has_header_)
+    return true;
+  int64_t count;
+  if (!decoder_.Dequeue(&count) || count < 0 ||
+      !decoder_.Dequeue(&initial_offset_)) {
+    return false;
+  }
+  count_ = count;
+  has_header_ = true;
+  return true;
+}
+
+template <typename ELF>
+bool Aps2Decoder<ELF>::Decode(std::vector<typename ELF::Rela>* relocations) {
+  if (!ReadHeader())
+    return false;
+
+  // Offset, r_info and addend carry over from one relocation, and one
+  // group, to the next.
+  uint64_t offset = initial_offset_;
+  uint64_t info = 0;
+  int64_t addend = 0;
+  for (uint64_t remaining = count_; remaining > 0; ) {
+    int64_t group_size;
+    int64_t flags;
+    if (!decoder_.Dequeue(&group_size) || !decoder_.Dequeue(&flags) ||
+        group_size <= 0 || static_cast<uint64_t>(group_size) > remaining) {
+      return false;
+    }
+    const bool is_by_offset_delta = flags & kGroupedByOffsetDelta;
+    const bool is_by_info = flags & kGroupedByInfo;
+    const bool is_by_addend = flags & kGroupedByAddend;
+    const bool has_addend = flags & kGroupHasAddend;
+    if (has_addend && !has_addends_)
+      return false;
+
+    // Every relocation of a group stores at least a byte for each field the
+    // group does not share.
+    const bool has_own_fields =
+        !is_by_offset_delta || !is_by_info || (has_addend && !is_by_addend);
+    if (has_own_fields &&
+        static_cast<uint64_t>(group_size) > decoder_.remaining()) {
+      return false;
+    }
+
+    int64_t value;
+    int64_t offset_delta = 0;
+    if (is_by_offset_delta && !decoder_.Dequeue(&offset_delta))
+      return false;
+    if (is_by_info) {
+      if (!decoder_.Dequeue(&value))
+        return false;
+      info = value;
+    }
+    if (has_addend && is_by_addend) {
+      if (!decoder_.Dequeue(&value))
+        return false;
+      addend += value;
+    } else if (!has_addend) {
+      addend = 0;
+    }
+
+    const size_t first = relocations->size();
+    relocations->resize(first + group_size);
+    typename ELF::Rela* relocation = &relocations->at(first);
+    typename ELF::Rela* const end = relocation + group_size;
+    if (is_by_offset_delta && is_by_info && (is_by_addend || !has_addend)) {
+      for (; relocation != end; ++relocation) {
+        offset += offset_delta;
+        relocation->r_offset = offset;
+        relocation->r_info = info;
+        relocation->r_addend = addend;
+      }
+    } else {
+      for (; relocation != end; ++relocation) {
+        if (is_by_offset_delta) {
+          offset += offset_delta;
+        } else {
+          if (!decoder_.Dequeue(&value))
+            return false;
+          offset += value;
+        }
+        if (!is_by_info) {
+          if (!decoder_.Dequeue(&value))
+            return false;
+          info = value;
+        }
+        if (has_addend && !is_by_addend) {
+          if (!decoder_.Dequeue(&value))
+            return false;
+          addend += value;
+        }
+        relocation->r_offset = offset;
+        relocation->r_info = info;
+        relocation->r_addend = addend;
       }
-      offset += sizeof(typename ELF::Addr);
     }
-    base += (8 * sizeof(typename ELF::Addr) - 1) * sizeof(typename ELF::Addr);
+    remaining -= group_size;
   }
+  return true;
 }
 
 template class RelocationPacker<ELF32_traits>;
 template class RelocationPacker<ELF64_traits>;
+template class Aps2Encoder<ELF32_traits>;
+template class Aps2Encoder<ELF64_traits>;
+template class Aps2Decoder<ELF32_traits>;
+template class Aps2Decoder<ELF64_traits>;
 
 }  // namespace relocation_packer
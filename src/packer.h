@@ -3,17 +3,130 @@
 // found in the LICENSE file.
 
 // Pack relative relocations into a more compact form.
+//
+// DecodeRelr() walks SHT_RELR words and reports each relocated address
+// without building a vector, for callers that only count or stream them.
+// RelrIterator does the same a relocation at a time, for callers that
+// interleave decoding with other work.  CountRelr() only counts them.
+//
+// Aps2Encoder writes Android's APS2 packed relocation format.  Relative
+// relocations are streamed in address order, as DecodeRelr() produces them;
+// runs of at least kAps2MinGroupSize word-spaced relocations become a
+// single offset-delta group, as in lld.  Other relocations are buffered and
+// written last, grouped by r_info where that pays.
+//
+// Aps2Decoder reads APS2 back into relocations, from this encoder, lld or
+// Android's relocation packer.  A group that shares its offset delta,
+// r_info and addend needs nothing read per relocation, and is emitted in
+// one pass over storage reserved for the whole group.
 
 #ifndef TOOLS_RELOCATION_PACKER_SRC_PACKER_H_
 #define TOOLS_RELOCATION_PACKER_SRC_PACKER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <vector>
 
 #include "elf.h"
+#include "sleb128.h"
 
 namespace relocation_packer {
 
+// Call |visitor| with the address of each relocation encoded by the
+// |count| SHT_RELR words at |packed|, in ascending order.
+template <typename Word, typename Visitor>
+void DecodeRelr(const Word* packed, size_t count, Visitor visitor) {
+  static const size_t kBitsPerWord = 8 * sizeof(Word);
+  Word base = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Word entry = packed[i];
+    if ((entry & 1) == 0) {
+      visitor(entry);
+      base = entry + sizeof(Word);
+      continue;
+    }
+
+    Word offset = base;
+    while (entry >>= 1) {
+      if (entry & 1)
+        visitor(offset);
+      offset += sizeof(Word);
+    }
+    base += (kBitsPerWord - 1) * sizeof(Word);
+  }
+}
+
+// Return the number of relocations encoded by the |count| SHT_RELR words at
+// |packed|, without visiting them.  Cheap enough to run before allocating
+// for the expansion.
+template <typename Word>
+uint64_t CountRelr(const Word* packed, size_t count) {
+  uint64_t relocations = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const Word entry = packed[i];
+    relocations += (entry & 1) == 0
+        ? 1 : __builtin_popcountll(static_cast<uint64_t>(entry) >> 1);
+  }
+  return relocations;
+}
+
+// Pull-style equivalent of DecodeRelr().
+template <typename Word>
+class RelrIterator {
+ public:
+  RelrIterator(const Word* packed, size_t count)
+      : next_(packed), end_(packed + count), base_(0), offset_(0),
+        bitmap_(0) {}
+
+  // Set |offset| to the next relocated address and return true, or return
+  // false if there are no more.
+  bool Next(Word* offset) {
+    for (;;) {
+      while (bitmap_) {
+        const bool is_set = bitmap_ & 1;
+        const Word current = offset_;
+        bitmap_ >>= 1;
+        offset_ += sizeof(Word);
+        if (is_set) {
+          *offset = current;
+          return true;
+        }
+      }
+
+      if (next_ == end_)
+        return false;
+      const Word entry = *next_++;
+      if ((entry & 1) == 0) {
+        *offset = entry;
+        base_ = entry + sizeof(Word);
+        return true;
+      }
+      offset_ = base_;
+      bitmap_ = entry >> 1;
+      base_ += (8 * sizeof(Word) - 1) * sizeof(Word);
+    }
+  }
+
+ private:
+  const Word* next_;
+  const Word* end_;
+
+  // Address following the last address entry or bitmap.
+  Word base_;
+
+  // Address of the next bit of |bitmap_|, and the bits not yet visited.
+  Word offset_;
+  Word bitmap_;
+};
+
+// Return the relative relocation type for ELF machine |machine|, or zero if
+// not known.
+unsigned RelativeRelocationType(unsigned machine);
+
+// Return the IRELATIVE relocation type for ELF machine |machine|, or zero if
+// not known.
+unsigned IrelativeRelocationType(unsigned machine);
+
 // A RelocationPacker packs vectors of relocations into more
 // compact forms, and unpacks them to reproduce the pre-packed data.
 template <typename ELF>
@@ -26,6 +139,81 @@ class RelocationPacker {
                                 std::vector<typename ELF::Rela>* relocations);
 };
 
+template <typename ELF>
+class Aps2Encoder {
+ public:
+  // |relative_info| is the r_info of a relative relocation, and
+  // |irelative_info| that of an IRELATIVE one, or zero.  Addends are
+  // encoded only if |has_addends|, for .rela.dyn.
+  Aps2Encoder(typename ELF::Xword relative_info,
+              typename ELF::Xword irelative_info,
+              bool has_addends);
+
+  // Add a relative relocation.  Addresses must ascend.
+  void AddRelative(typename ELF::Addr offset, typename ELF::Sxword addend);
+
+  // Add any other relocation.  IRELATIVE ones keep their order, after the
+  // rest.
+  void AddOther(const typename ELF::Rela& relocation);
+
+  // Return the packed section contents, starting "APS2", and reset.
+  void GetEncoding(std::vector<uint8_t>* packed);
+
+ private:
+  static const size_t kAps2MinGroupSize = 8;
+
+  void FlushRun();
+  void FlushUngrouped();
+  void EncodeOthers(size_t begin, size_t end);
+
+  typename ELF::Xword relative_info_;
+  typename ELF::Xword irelative_info_;
+  bool has_addends_;
+  size_t count_;
+
+  // Offset and addend of the last relocation encoded.
+  int64_t offset_;
+  int64_t addend_;
+
+  // Current run of word-spaced relative relocations.
+  std::vector<typename ELF::Rela> run_;
+
+  // Relative relocations too few to group, already delta-encoded against
+  // each other, waiting for their group header.
+  Sleb128Encoder ungrouped_;
+  size_t ungrouped_count_;
+
+  std::vector<typename ELF::Rela> others_;
+  Sleb128Encoder body_;
+};
+
+template <typename ELF>
+class Aps2Decoder {
+ public:
+  // |packed| is the section contents, starting "APS2".  Addends are read
+  // only if |has_addends|, for .rela.dyn.
+  Aps2Decoder(const uint8_t* packed, size_t size, bool has_addends);
+
+  // Read the header.  Returns false if this is not APS2.
+  bool ReadHeader();
+
+  // Number of relocations encoded, once the header is read.
+  uint64_t count() const { return count_; }
+
+  // Append every relocation, in encoded order, to |relocations|.  Returns
+  // false if the encoding is malformed, with some relocations possibly
+  // appended.  A group sharing all its fields takes a few bytes whatever
+  // its size, so check count() before decoding untrusted input.
+  bool Decode(std::vector<typename ELF::Rela>* relocations);
+
+ private:
+  Sleb128Decoder decoder_;
+  bool has_addends_;
+  bool has_header_;
+  uint64_t count_;
+  int64_t initial_offset_;
+};
+
 }  // namespace relocation_packer
 
 #endif  // TOOLS_RELOCATION_PACKER_SRC_PACKER_H_
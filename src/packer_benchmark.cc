@@ -0,0 +1,453 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmark for SHT_RELR decoding.  Build with 'make benchmark'.
+//
+// Generates synthetic RELR streams and times each decode kernel feeding
+// each output sink, reporting nanoseconds per relocation and gigabytes per
+// second of packed input.  Streams vary in:
+//
+//   - word size, 32 or 64 bits (-w);
+//   - packed size in bytes (-s), from a few KB up to hundreds of MB;
+//   - bitmap fill, the percentage of bitmap bits set (-f);
+//   - address frequency, the percentage of words that are addresses (-a).
+//
+// Each option may be repeated, and every combination is run.  Kernels are
+// 'shift', DecodeRelr() as used by the unpacker, and 'ctz', a candidate
+// that skips clear bits with count-trailing-zeros.  Sinks are:
+//
+//   - count: count relocations only;
+//   - iterator: pull relocations from RelrIterator (shift kernel only);
+//   - rela_vector: append to a std::vector of Rela as UnpackRelocations()
+//     does, which it is for the shift kernel;
+//   - rel_buffer, rela_buffer: store into a preallocated array of Rel or
+//     Rela, as a writer that counted first could.
+//
+// Results go to stdout as tab-separated lines after a '#' header line,
+// one per case, in a fixed column order.  Each time is the fastest of at
+// least three runs, repeated until the case has taken -t milliseconds.
+// Sinks whose output would exceed -m megabytes are skipped.  Every sink
+// must agree on the relocation count and an address checksum.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_traits.h"
+#include "packer.h"
+
+namespace relocation_packer {
+namespace {
+
+// Bitmaps are drawn from a pool generated per stream, which keeps
+// generation fast for streams of hundreds of megabytes.
+const size_t kBitmapPoolSize = 4096;
+
+struct StreamParams {
+  unsigned bits;
+  size_t bytes;
+  unsigned fill_percent;
+  unsigned address_percent;
+};
+
+struct BenchmarkParams {
+  double min_time_ns;
+  uint64_t max_output_bytes;
+};
+
+// Deterministic xorshift64* generator, so streams are the same every run.
+class Random {
+ public:
+  Random() : state_(0x9e3779b97f4a7c15ULL) {}
+
+  uint64_t Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 0x2545f4914f6cdd1dULL;
+  }
+
+  // True with probability |percent| / 100.
+  bool Chance(unsigned percent) { return Next() % 100 < percent; }
+
+ private:
+  uint64_t state_;
+};
+
+// Generate |params.bytes| of RELR words.  Addresses wrap for large 32-bit
+// streams, which decoding does not care about.
+template <typename Word>
+void GenerateStream(const StreamParams& params, std::vector<Word>* packed) {
+  static const size_t kBitsPerWord = 8 * sizeof(Word);
+  Random random;
+
+  std::vector<Word> bitmaps(kBitmapPoolSize);
+  for (size_t i = 0; i < bitmaps.size(); ++i) {
+    Word bitmap = 1;
+    for (size_t bit = 1; bit < kBitsPerWord; ++bit) {
+      if (random.Chance(params.fill_percent))
+        bitmap |= static_cast<Word>(1) << bit;
+    }
+    bitmaps[i] = bitmap;
+  }
+
+  const size_t count = params.bytes / sizeof(Word);
+  packed->clear();
+  packed->reserve(count);
+
+  Word base = 0x10000;
+  for (size_t i = 0; i < count; ++i) {
+    if (i == 0 || random.Chance(params.address_percent)) {
+      const Word address = base + (random.Next() % 64) * sizeof(Word);
+      packed->push_back(address);
+      base = address + sizeof(Word);
+    } else {
+      packed->push_back(bitmaps[random.Next() % bitmaps.size()]);
+      base += (kBitsPerWord - 1) * sizeof(Word);
+    }
+  }
+}
+
+// Candidate kernel: as DecodeRelr(), but visit only the set bits.
+template <typename Word, typename Visitor>
+void DecodeRelrCtz(const Word* packed, size_t count, Visitor visitor) {
+  static const size_t kBitsPerWord = 8 * sizeof(Word);
+  Word base = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Word entry = packed[i];
+    if ((entry & 1) == 0) {
+      visitor(entry);
+      base = entry + sizeof(Word);
+      continue;
+    }
+
+    uint64_t bits = static_cast<uint64_t>(entry) >> 1;
+    while (bits) {
+      visitor(base + __builtin_ctzll(bits) * sizeof(Word));
+      bits &= bits - 1;
+    }
+    base += (kBitsPerWord - 1) * sizeof(Word);
+  }
+}
+
+struct ShiftKernel {
+  static const char* Name() { return "shift"; }
+  static const bool kIsUnpacker = true;
+
+  template <typename Word, typename Visitor>
+  static void Decode(const Word* packed, size_t count, Visitor visitor) {
+    DecodeRelr(packed, count, visitor);
+  }
+};
+
+struct CtzKernel {
+  static const char* Name() { return "ctz"; }
+  static const bool kIsUnpacker = false;
+
+  template <typename Word, typename Visitor>
+  static void Decode(const Word* packed, size_t count, Visitor visitor) {
+    DecodeRelrCtz(packed, count, visitor);
+  }
+};
+
+// What a sink produced, to check sinks against each other.  The checksum
+// is the sum of the first and last addresses, which is cheap enough to
+// compute inside the timing; zero for counting sinks.
+struct SinkResult {
+  SinkResult() : relocations(0), checksum(0) {}
+
+  uint64_t relocations;
+  uint64_t checksum;
+};
+
+double NowNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// Time |run|, returning the fastest run in nanoseconds and its result.
+template <typename Run>
+double TimeRuns(const BenchmarkParams& params, Run run, SinkResult* result) {
+  double best = 0;
+  double total = 0;
+  for (size_t runs = 0; runs < 3 || total < params.min_time_ns; ++runs) {
+    const double start = NowNs();
+    *result = run();
+    const double elapsed = NowNs() - start;
+    if (runs == 0 || elapsed < best)
+      best = elapsed;
+    total += elapsed;
+  }
+  return best;
+}
+
+template <typename ELF>
+class Benchmark {
+ public:
+  typedef typename ELF::Addr Word;
+
+  Benchmark(const StreamParams& stream, const BenchmarkParams& params)
+      : stream_(stream), params_(params) {
+    GenerateStream(stream_, &packed_);
+
+    uint64_t first = 0;
+    uint64_t last = 0;
+    DecodeRelr(packed_.data(), packed_.size(), [&](Word offset) {
+      if (!expected_.relocations++)
+        first = offset;
+      last = offset;
+    });
+    expected_.checksum = first + last;
+  }
+
+  void Run() {
+    RunCount<ShiftKernel>();
+    RunCount<CtzKernel>();
+    RunIterator();
+    RunRelaVector<ShiftKernel>();
+    RunRelaVector<CtzKernel>();
+    RunBuffer<ShiftKernel, typename ELF::Rel>("rel_buffer");
+    RunBuffer<CtzKernel, typename ELF::Rel>("rel_buffer");
+    RunBuffer<ShiftKernel, typename ELF::Rela>("rela_buffer");
+    RunBuffer<CtzKernel, typename ELF::Rela>("rela_buffer");
+  }
+
+ private:
+  template <typename Kernel>
+  void RunCount() {
+    SinkResult result;
+    const double ns = TimeRuns(params_, [this]() {
+      SinkResult counted;
+      Kernel::Decode(packed_.data(), packed_.size(), [&counted](Word) {
+        ++counted.relocations;
+      });
+      return counted;
+    }, &result);
+    Report(Kernel::Name(), "count", result, ns);
+  }
+
+  void RunIterator() {
+    SinkResult result;
+    const double ns = TimeRuns(params_, [this]() {
+      SinkResult pulled;
+      RelrIterator<Word> iterator(packed_.data(), packed_.size());
+      Word offset;
+      Word first = 0;
+      Word last = 0;
+      while (iterator.Next(&offset)) {
+        if (!pulled.relocations++)
+          first = offset;
+        last = offset;
+      }
+      pulled.checksum = static_cast<uint64_t>(first) + last;
+      return pulled;
+    }, &result);
+    Report(ShiftKernel::Name(), "iterator", result, ns);
+  }
+
+  template <typename Kernel>
+  void RunRelaVector() {
+    if (!FitsOutput(sizeof(typename ELF::Rela), "rela_vector"))
+      return;
+    SinkResult result;
+    const double ns = TimeRuns(params_, [this]() {
+      std::vector<typename ELF::Rela> relocations;
+      if (Kernel::kIsUnpacker) {
+        RelocationPacker<ELF>::UnpackRelocations(packed_, &relocations);
+      } else {
+        Kernel::Decode(packed_.data(), packed_.size(),
+                       [&relocations](Word offset) {
+          typename ELF::Rela relocation;
+          relocation.r_offset = offset;
+          relocation.r_info = R_ARM_RELATIVE;
+          relocation.r_addend = 0;
+          relocations.push_back(relocation);
+        });
+      }
+      return Summarize(relocations.data(), relocations.size());
+    }, &result);
+    Report(Kernel::Name(), "rela_vector", result, ns);
+  }
+
+  template <typename Kernel, typename Rel>
+  void RunBuffer(const char* sink) {
+    if (!FitsOutput(sizeof(Rel), sink))
+      return;
+    std::vector<Rel> buffer(expected_.relocations);
+    SinkResult result;
+    const double ns = TimeRuns(params_, [this, &buffer]() {
+      Rel* next = buffer.data();
+      Kernel::Decode(packed_.data(), packed_.size(), [&next](Word offset) {
+        next->r_offset = offset;
+        next->r_info = R_ARM_RELATIVE;
+        ++next;
+      });
+      return Summarize(buffer.data(), next - buffer.data());
+    }, &result);
+    Report(Kernel::Name(), sink, result, ns);
+  }
+
+  template <typename Rel>
+  SinkResult Summarize(const Rel* relocations, size_t count) {
+    SinkResult result;
+    result.relocations = count;
+    if (count) {
+      result.checksum = static_cast<uint64_t>(relocations[0].r_offset) +
+                        relocations[count - 1].r_offset;
+    }
+    return result;
+  }
+
+  bool FitsOutput(size_t entry_size, const char* sink) {
+    if (expected_.relocations * entry_size <= params_.max_output_bytes)
+      return true;
+    LOG(INFO) << "skipping " << sink << ": output would be "
+              << (expected_.relocations * entry_size >> 20) << " MB";
+    return false;
+  }
+
+  void Report(const char* kernel,
+              const char* sink,
+              const SinkResult& result,
+              double ns) {
+    CHECK(result.relocations == expected_.relocations);
+    CHECK(result.checksum == 0 || result.checksum == expected_.checksum);
+    const double packed_bytes = packed_.size() * sizeof(Word);
+    printf("%u\t%zu\t%u\t%u\t%llu\t%s\t%s\t%.3f\t%.3f\n",
+           stream_.bits, packed_.size() * sizeof(Word), stream_.fill_percent,
+           stream_.address_percent,
+           static_cast<unsigned long long>(result.relocations), kernel, sink,
+           result.relocations ? ns / result.relocations : 0.0,
+           packed_bytes / ns);
+    fflush(stdout);
+  }
+
+  StreamParams stream_;
+  BenchmarkParams params_;
+  std::vector<Word> packed_;
+  SinkResult expected_;
+};
+
+// Parse a size with an optional K, M or G suffix.
+size_t ParseSize(const char* text) {
+  char* end;
+  size_t size = strtoull(text, &end, 10);
+  switch (*end) {
+    case 'G': case 'g': size <<= 10;  // Fall through.
+    case 'M': case 'm': size <<= 10;  // Fall through.
+    case 'K': case 'k': size <<= 10;
+  }
+  return size;
+}
+
+}  // namespace
+}  // namespace relocation_packer
+
+static void PrintUsage(const char* argv0) {
+  printf(
+      "Usage: %s [-w 32|64]... [-s SIZE]... [-f FILL]... [-a ADDRESS]...\n"
+      "       [-t MS] [-m MB]\n\n"
+      "Time SHT_RELR decoding over synthetic streams.\n\n"
+      "  -w BITS     word size (default: 32 and 64)\n"
+      "  -s SIZE     packed bytes, with optional K, M or G suffix\n"
+      "              (default: 4K, 1M and 64M)\n"
+      "  -f FILL     percentage of bitmap bits set (default: 0, 10, 50, 90\n"
+      "              and 100)\n"
+      "  -a ADDRESS  percentage of words that are addresses (default: 1\n"
+      "              and 20)\n"
+      "  -t MS       minimum time per case (default: 200)\n"
+      "  -m MB       skip sinks producing more output (default: 2048)\n",
+      argv0);
+}
+
+int main(int argc, char* argv[]) {
+  using relocation_packer::StreamParams;
+
+  std::vector<unsigned> word_bits;
+  std::vector<size_t> sizes;
+  std::vector<unsigned> fills;
+  std::vector<unsigned> address_percents;
+  relocation_packer::BenchmarkParams params;
+  params.min_time_ns = 200e6;
+  params.max_output_bytes = 2048ULL << 20;
+
+  int c;
+  while ((c = getopt(argc, argv, "w:s:f:a:t:m:h")) != -1) {
+    switch (c) {
+      case 'w':
+        word_bits.push_back(strtoul(optarg, NULL, 10));
+        if (word_bits.back() != 32 && word_bits.back() != 64) {
+          LOG(ERROR) << "word size must be 32 or 64";
+          return 1;
+        }
+        break;
+      case 's':
+        sizes.push_back(relocation_packer::ParseSize(optarg));
+        break;
+      case 'f':
+        fills.push_back(strtoul(optarg, NULL, 10));
+        break;
+      case 'a':
+        address_percents.push_back(strtoul(optarg, NULL, 10));
+        break;
+      case 't':
+        params.min_time_ns = strtoul(optarg, NULL, 10) * 1e6;
+        break;
+      case 'm':
+        params.max_output_bytes = strtoull(optarg, NULL, 10) << 20;
+        break;
+      case 'h':
+        PrintUsage(argv[0]);
+        return 0;
+      default:
+        PrintUsage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  if (word_bits.empty())
+    word_bits = {32, 64};
+  if (sizes.empty())
+    sizes = {4 << 10, 1 << 20, 64 << 20};
+  if (fills.empty())
+    fills = {0, 10, 50, 90, 100};
+  if (address_percents.empty())
+    address_percents = {1, 20};
+
+  // Results go to stdout, so keep log messages off it.
+  relocation_packer::Logger::SetStreams(&std::cerr, &std::cerr);
+
+  printf("# bits\tpacked_bytes\tfill_pct\taddress_pct\trelocations"
+         "\tkernel\tsink\tns_per_reloc\tgb_per_s\n");
+  for (size_t w = 0; w < word_bits.size(); ++w) {
+    for (size_t s = 0; s < sizes.size(); ++s) {
+      for (size_t f = 0; f < fills.size(); ++f) {
+        for (size_t a = 0; a < address_percents.size(); ++a) {
+          StreamParams stream;
+          stream.bits = word_bits[w];
+          stream.bytes = sizes[s];
+          stream.fill_percent = fills[f];
+          stream.address_percent = address_percents[a];
+          if (stream.bits == 32) {
+            relocation_packer::Benchmark<ELF32_traits>(stream, params).Run();
+          } else {
+            relocation_packer::Benchmark<ELF64_traits>(stream, params).Run();
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
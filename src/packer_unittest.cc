@@ -0,0 +1,337 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "packer.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "elf_traits.h"
+#include "sleb128.h"
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+const int64_t kGroupedByInfo = 1;
+const int64_t kGroupedByOffsetDelta = 2;
+const int64_t kGroupedByAddend = 4;
+const int64_t kGroupHasAddend = 8;
+
+template <typename ELF>
+typename ELF::Rela MakeRela(uint64_t offset, uint64_t info, int64_t addend) {
+  typename ELF::Rela relocation;
+  relocation.r_offset = offset;
+  relocation.r_info = info;
+  relocation.r_addend = addend;
+  return relocation;
+}
+
+template <typename ELF>
+void ExpectSameRelocations(std::vector<typename ELF::Rela> expected,
+                           std::vector<typename ELF::Rela> actual) {
+  const auto by_offset = [](const typename ELF::Rela& a,
+                            const typename ELF::Rela& b) {
+    return a.r_offset < b.r_offset;
+  };
+  std::sort(expected.begin(), expected.end(), by_offset);
+  std::sort(actual.begin(), actual.end(), by_offset);
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected[i].r_offset, actual[i].r_offset) << i;
+    EXPECT_EQ(expected[i].r_info, actual[i].r_info) << i;
+    EXPECT_EQ(expected[i].r_addend, actual[i].r_addend) << i;
+  }
+}
+
+// "APS2", then |count| and |initial_offset|, then |body|.
+std::vector<uint8_t> MakeAps2(int64_t count,
+                              int64_t initial_offset,
+                              const std::vector<uint8_t>& body) {
+  static const uint8_t kMagic[] = {'A', 'P', 'S', '2'};
+  Sleb128Encoder encoder;
+  encoder.EnqueueBytes(kMagic, sizeof(kMagic));
+  encoder.Enqueue(count);
+  encoder.Enqueue(initial_offset);
+  encoder.EnqueueBytes(body.data(), body.size());
+  std::vector<uint8_t> packed;
+  encoder.GetEncoding(&packed);
+  return packed;
+}
+
+std::vector<uint8_t> Encode(const std::vector<int64_t>& values) {
+  Sleb128Encoder encoder;
+  for (size_t i = 0; i < values.size(); ++i)
+    encoder.Enqueue(values[i]);
+  std::vector<uint8_t> encoding;
+  encoder.GetEncoding(&encoding);
+  return encoding;
+}
+
+// Encode |relocations| into |encoder| as one group with |flags|, the
+// fields it shares taken from the first, against the offset and addend
+// the previous group left.
+template <typename ELF>
+void EncodeGroup(int64_t flags,
+                 const std::vector<typename ELF::Rela>& relocations,
+                 uint64_t* offset,
+                 int64_t* addend,
+                 Sleb128Encoder* encoder) {
+  const bool is_by_offset_delta = flags & kGroupedByOffsetDelta;
+  const bool is_by_info = flags & kGroupedByInfo;
+  const bool is_by_addend = flags & kGroupedByAddend;
+  const bool has_addend = flags & kGroupHasAddend;
+  encoder->Enqueue(relocations.size());
+  encoder->Enqueue(flags);
+  if (is_by_offset_delta)
+    encoder->Enqueue(relocations[0].r_offset - *offset);
+  if (is_by_info)
+    encoder->Enqueue(relocations[0].r_info);
+  if (has_addend && is_by_addend) {
+    encoder->Enqueue(relocations[0].r_addend - *addend);
+    *addend = relocations[0].r_addend;
+  }
+  for (size_t i = 0; i < relocations.size(); ++i) {
+    if (!is_by_offset_delta)
+      encoder->Enqueue(relocations[i].r_offset - *offset);
+    *offset = relocations[i].r_offset;
+    if (!is_by_info)
+      encoder->Enqueue(relocations[i].r_info);
+    if (has_addend && !is_by_addend) {
+      encoder->Enqueue(relocations[i].r_addend - *addend);
+      *addend = relocations[i].r_addend;
+    }
+  }
+  if (!has_addend)
+    *addend = 0;
+}
+
+}  // namespace
+
+TEST(Aps2, EncoderRoundTripsRela) {
+  typedef ELF64_traits ELF;
+  const uint64_t kRelative = 8;
+  Aps2Encoder<ELF> encoder(kRelative, 37, true);
+  std::vector<ELF::Rela> expected;
+
+  // A run long enough to group, a short one, and a lone relocation.
+  for (uint64_t i = 0; i < 12; ++i)
+    expected.push_back(MakeRela<ELF>(0x2000 + 8 * i, kRelative, 0x100 + 16 * i));
+  for (uint64_t i = 0; i < 3; ++i)
+    expected.push_back(MakeRela<ELF>(0x3000 + 8 * i, kRelative, -8));
+  expected.push_back(MakeRela<ELF>(0x3100, kRelative, 0));
+  for (size_t i = 0; i < expected.size(); ++i)
+    encoder.AddRelative(expected[i].r_offset, expected[i].r_addend);
+
+  // Symbol relocations: enough sharing r_info to group, and others with
+  // addends.
+  std::vector<ELF::Rela> others;
+  for (uint64_t i = 0; i < 4; ++i)
+    others.push_back(MakeRela<ELF>(0x4000 + 8 * i, (5ULL << 32) | 6, 0));
+  others.push_back(MakeRela<ELF>(0x4100, (7ULL << 32) | 1, 24));
+  others.push_back(MakeRela<ELF>(0x4108, (7ULL << 32) | 1, -4));
+  for (size_t i = 0; i < others.size(); ++i) {
+    encoder.AddOther(others[i]);
+    expected.push_back(others[i]);
+  }
+
+  std::vector<uint8_t> packed;
+  encoder.GetEncoding(&packed);
+  Aps2Decoder<ELF> decoder(packed.data(), packed.size(), true);
+  ASSERT_TRUE(decoder.ReadHeader());
+  EXPECT_EQ(expected.size(), decoder.count());
+  std::vector<ELF::Rela> decoded;
+  ASSERT_TRUE(decoder.Decode(&decoded));
+  ExpectSameRelocations<ELF>(expected, decoded);
+}
+
+TEST(Aps2, EncoderRoundTripsRel) {
+  typedef ELF32_traits ELF;
+  const uint32_t kRelative = 23;
+  Aps2Encoder<ELF> encoder(kRelative, 42, false);
+  std::vector<ELF::Rela> expected;
+  for (uint32_t i = 0; i < 9; ++i)
+    expected.push_back(MakeRela<ELF>(0x1000 + 4 * i, kRelative, 0));
+  for (uint32_t i = 0; i < 2; ++i)
+    expected.push_back(MakeRela<ELF>(0x1800 + 12 * i, kRelative, 0));
+  for (size_t i = 0; i < expected.size(); ++i)
+    encoder.AddRelative(expected[i].r_offset, 0);
+  for (uint32_t i = 0; i < 3; ++i) {
+    const ELF::Rela other = MakeRela<ELF>(0x2000 + 4 * i, (3 << 8) | 21, 0);
+    encoder.AddOther(other);
+    expected.push_back(other);
+  }
+
+  std::vector<uint8_t> packed;
+  encoder.GetEncoding(&packed);
+  Aps2Decoder<ELF> decoder(packed.data(), packed.size(), false);
+  std::vector<ELF::Rela> decoded;
+  ASSERT_TRUE(decoder.Decode(&decoded));
+  ExpectSameRelocations<ELF>(expected, decoded);
+}
+
+TEST(Aps2, EncoderKeepsIrelativeLastAndInOrder) {
+  typedef ELF64_traits ELF;
+  const uint64_t kRelative = 8;
+  const uint64_t kIrelative = 37;
+  for (int has_addends = 0; has_addends <= 1; ++has_addends) {
+    Aps2Encoder<ELF> encoder(kRelative, kIrelative, has_addends);
+    encoder.AddRelative(0x1000, 0);
+
+    // IRELATIVE has the smallest r_info, and would sort first; its
+    // offsets descend, and would sort backwards.
+    std::vector<ELF::Rela> irelatives;
+    for (uint64_t i = 0; i < 4; ++i) {
+      irelatives.push_back(MakeRela<ELF>(0x5000 - 8 * i, kIrelative,
+                                         has_addends ? 0x700 + i : 0));
+    }
+    std::vector<ELF::Rela> others;
+    for (uint64_t i = 0; i < 4; ++i)
+      others.push_back(MakeRela<ELF>(0x4000 + 8 * i, (5ULL << 32) | 6, 0));
+    others.push_back(MakeRela<ELF>(0x4100, (7ULL << 32) | 1, 0));
+    encoder.AddOther(irelatives[0]);
+    encoder.AddOther(others[0]);
+    encoder.AddOther(irelatives[1]);
+    for (size_t i = 1; i < others.size(); ++i)
+      encoder.AddOther(others[i]);
+    encoder.AddOther(irelatives[2]);
+    encoder.AddOther(irelatives[3]);
+
+    std::vector<uint8_t> packed;
+    encoder.GetEncoding(&packed);
+    Aps2Decoder<ELF> decoder(packed.data(), packed.size(), has_addends);
+    std::vector<ELF::Rela> decoded;
+    ASSERT_TRUE(decoder.Decode(&decoded));
+    ASSERT_EQ(1 + others.size() + irelatives.size(), decoded.size());
+    const size_t first = decoded.size() - irelatives.size();
+    for (size_t i = 0; i < first; ++i)
+      EXPECT_NE(kIrelative, decoded[i].r_info) << i;
+    for (size_t i = 0; i < irelatives.size(); ++i) {
+      EXPECT_EQ(irelatives[i].r_offset, decoded[first + i].r_offset) << i;
+      EXPECT_EQ(kIrelative, decoded[first + i].r_info) << i;
+      EXPECT_EQ(irelatives[i].r_addend, decoded[first + i].r_addend) << i;
+    }
+  }
+}
+
+TEST(Aps2, DecodesEveryGroupFlagCombination) {
+  typedef ELF64_traits ELF;
+  for (int has_addends = 0; has_addends <= 1; ++has_addends) {
+    for (int64_t flags = 0; flags < 16; ++flags) {
+      const bool is_by_offset_delta = flags & kGroupedByOffsetDelta;
+      const bool is_by_info = flags & kGroupedByInfo;
+      const bool is_by_addend = flags & kGroupedByAddend;
+      const bool has_addend = flags & kGroupHasAddend;
+
+      // A first group leaves an addend for the second to carry on from,
+      // or to reset, and an offset 16 bytes short of the second's.
+      std::vector<ELF::Rela> first;
+      first.push_back(MakeRela<ELF>(0x1000, 8, has_addends ? 40 : 0));
+      std::vector<ELF::Rela> group;
+      for (uint64_t i = 0; i < 4; ++i) {
+        const uint64_t offset =
+            is_by_offset_delta ? 0x1010 + 16 * i : 0x1010 + 8 * i * i;
+        const uint64_t info = is_by_info ? 8 : ((i + 1) << 32) | 1;
+        int64_t addend = 0;
+        if (has_addend)
+          addend = is_by_addend ? -12 : 100 + 5 * static_cast<int64_t>(i);
+        group.push_back(MakeRela<ELF>(offset, info, addend));
+      }
+
+      Sleb128Encoder body;
+      uint64_t offset = 0x1000;
+      int64_t addend = 0;
+      EncodeGroup<ELF>(has_addends ? kGroupHasAddend : 0, first, &offset,
+                       &addend, &body);
+      EncodeGroup<ELF>(flags, group, &offset, &addend, &body);
+      std::vector<uint8_t> encoded;
+      body.GetEncoding(&encoded);
+      const std::vector<uint8_t> packed = MakeAps2(5, 0x1000, encoded);
+
+      Aps2Decoder<ELF> decoder(packed.data(), packed.size(), has_addends);
+      std::vector<ELF::Rela> decoded;
+      const bool is_decoded = decoder.Decode(&decoded);
+      if (has_addend && !has_addends) {
+        EXPECT_FALSE(is_decoded) << flags;
+        continue;
+      }
+      ASSERT_TRUE(is_decoded) << flags << " " << has_addends;
+      std::vector<ELF::Rela> expected(first);
+      expected.insert(expected.end(), group.begin(), group.end());
+      ASSERT_EQ(expected.size(), decoded.size());
+      for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected[i].r_offset, decoded[i].r_offset) << flags;
+        EXPECT_EQ(expected[i].r_info, decoded[i].r_info) << flags;
+        EXPECT_EQ(expected[i].r_addend, decoded[i].r_addend) << flags;
+      }
+    }
+  }
+}
+
+TEST(Aps2, RejectsBadHeader) {
+  typedef ELF64_traits ELF;
+  std::vector<uint8_t> packed = MakeAps2(0, 0, std::vector<uint8_t>());
+  packed[3] = '1';
+  Aps2Decoder<ELF> not_aps2(packed.data(), packed.size(), true);
+  EXPECT_FALSE(not_aps2.ReadHeader());
+
+  packed = MakeAps2(-1, 0, std::vector<uint8_t>());
+  Aps2Decoder<ELF> negative(packed.data(), packed.size(), true);
+  EXPECT_FALSE(negative.ReadHeader());
+
+  packed = MakeAps2(0, 0, std::vector<uint8_t>());
+  Aps2Decoder<ELF> empty(packed.data(), packed.size(), true);
+  std::vector<ELF::Rela> decoded;
+  EXPECT_TRUE(empty.Decode(&decoded));
+  EXPECT_TRUE(decoded.empty());
+}
+
+TEST(Aps2, RejectsBadGroupSizes) {
+  typedef ELF64_traits ELF;
+  const int64_t kPerEntry = kGroupedByInfo;
+  const int64_t kShared = kGroupedByInfo | kGroupedByOffsetDelta;
+  const struct {
+    int64_t count;
+    std::vector<int64_t> body;
+  } cases[] = {
+    // Negative and zero group sizes.
+    {2, {-1, kShared, 8, 8}},
+    {2, {0, kShared, 8, 8}},
+    // A group larger than the count.
+    {2, {3, kShared, 8, 8}},
+    // A group larger than the bytes left for its relocations.
+    {1LL << 34, {1LL << 34, kPerEntry, 8, 8, 8}},
+    // A group smaller than the count, and nothing after it.
+    {3, {2, kShared, 8, 8}},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    const std::vector<uint8_t> packed =
+        MakeAps2(cases[i].count, 0, Encode(cases[i].body));
+    Aps2Decoder<ELF> decoder(packed.data(), packed.size(), true);
+    std::vector<ELF::Rela> decoded;
+    EXPECT_FALSE(decoder.Decode(&decoded)) << i;
+    EXPECT_LE(decoded.size(), 3u) << i;
+  }
+}
+
+TEST(Aps2, RejectsTruncatedInput) {
+  typedef ELF64_traits ELF;
+  Aps2Encoder<ELF> encoder(8, 37, true);
+  for (uint64_t i = 0; i < 10; ++i)
+    encoder.AddRelative(0x2000 + 8 * i, i);
+  encoder.AddRelative(0x3000, 0);
+  encoder.AddOther(MakeRela<ELF>(0x4000, (2ULL << 32) | 1, 16));
+  std::vector<uint8_t> packed;
+  encoder.GetEncoding(&packed);
+
+  for (size_t size = 0; size < packed.size(); ++size) {
+    Aps2Decoder<ELF> decoder(packed.data(), size, true);
+    std::vector<ELF::Rela> decoded;
+    EXPECT_FALSE(decoder.Decode(&decoded)) << size;
+  }
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,320 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "patch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "batch_journal.h"
+#include "crc32.h"
+#include "debug.h"
+#include "elf_file.h"
+#include "file_util.h"
+#include "unpack.h"
+
+namespace relocation_packer {
+
+namespace {
+
+const char kPatchMagic[8] = {'R', 'E', 'L', 'R', 'P', 'T', 'C', 'H'};
+const size_t kPatchHeaderSize = 8 + 4 + 8 + 4 + 8 + 4 + 4;
+
+enum patch_operation_t { PATCH_COPY = 0, PATCH_INSERT };
+
+// A copy costs 17 bytes and splits an insert, whose header is 9 bytes, so
+// shorter matches are cheaper inserted.
+const size_t kMinCopyLength = 32;
+
+void PutLE(uint64_t value, size_t size, std::vector<uint8_t>* out) {
+  for (size_t i = 0; i < size; ++i)
+    out->push_back(value >> (8 * i));
+}
+
+uint64_t GetLE(const uint8_t* p, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i)
+    value |= static_cast<uint64_t>(p[i]) << (8 * i);
+  return value;
+}
+
+// Where an output range came from in the original, per the layout model.
+struct Mapping {
+  uint64_t new_offset;
+  int64_t delta;
+
+  bool operator<(const Mapping& other) const {
+    return new_offset < other.new_offset;
+  }
+};
+
+// Length of the run of equal bytes at |output_offset| in |output| and
+// |original_offset| in |original|.
+size_t MatchLength(const std::vector<uint8_t>& original,
+                   uint64_t original_offset,
+                   const std::vector<uint8_t>& output,
+                   uint64_t output_offset) {
+  size_t length = 0;
+  const size_t limit = std::min(original.size() - original_offset,
+                                output.size() - output_offset);
+  while (length < limit &&
+         original[original_offset + length] == output[output_offset + length])
+    ++length;
+  return length;
+}
+
+// Helper for ApplyPatch().  Apply the operations in |patch| to
+// |original_fd|, writing to |output_fd|.
+bool ApplyOperations(const std::vector<uint8_t>& patch,
+                     int original_fd,
+                     uint64_t original_size,
+                     int output_fd,
+                     uint64_t output_size) {
+  const uint32_t count = GetLE(&patch[kPatchHeaderSize - 4], 4);
+  size_t cursor = kPatchHeaderSize;
+  uint64_t position = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (cursor == patch.size())
+      return false;
+    const uint8_t operation = patch[cursor];
+    if (operation == PATCH_COPY) {
+      if (patch.size() - cursor < 17)
+        return false;
+      const uint64_t offset = GetLE(&patch[cursor + 1], 8);
+      const uint64_t length = GetLE(&patch[cursor + 9], 8);
+      cursor += 17;
+      if (offset > original_size || length > original_size - offset ||
+          length > output_size - position ||
+          !CopyFileRange(original_fd, offset, output_fd, position, length))
+        return false;
+      position += length;
+    } else if (operation == PATCH_INSERT) {
+      if (patch.size() - cursor < 9)
+        return false;
+      const uint64_t length = GetLE(&patch[cursor + 1], 8);
+      cursor += 9;
+      if (length > patch.size() - cursor ||
+          length > output_size - position ||
+          !PwriteFully(output_fd, &patch[cursor], length, position))
+        return false;
+      cursor += length;
+      position += length;
+    } else {
+      return false;
+    }
+  }
+  return cursor == patch.size() && position == output_size &&
+         ftruncate(output_fd, output_size) == 0;
+}
+
+}  // namespace
+
+void PatchWriter::Copy(uint64_t offset, uint64_t length) {
+  EndInsert();
+  if (copy_length_ && copy_offset_ + copy_length_ == offset) {
+    copy_length_ += length;
+    return;
+  }
+  EndCopy();
+  copy_offset_ = offset;
+  copy_length_ = length;
+}
+
+void PatchWriter::Insert(uint8_t byte) {
+  EndCopy();
+  if (!insert_length_) {
+    operations_.push_back(PATCH_INSERT);
+    insert_length_offset_ = operations_.size();
+    PutLE(0, 8, &operations_);
+    ++count_;
+  }
+  operations_.push_back(byte);
+  ++insert_length_;
+}
+
+void PatchWriter::Finish(std::vector<uint8_t>* operations, uint32_t* count) {
+  EndInsert();
+  EndCopy();
+  operations->swap(operations_);
+  *count = count_;
+}
+
+void PatchWriter::EndInsert() {
+  if (!insert_length_)
+    return;
+  for (size_t i = 0; i < 8; ++i)
+    operations_[insert_length_offset_ + i] = insert_length_ >> (8 * i);
+  insert_length_ = 0;
+}
+
+void PatchWriter::EndCopy() {
+  if (!copy_length_)
+    return;
+  operations_.push_back(PATCH_COPY);
+  PutLE(copy_offset_, 8, &operations_);
+  PutLE(copy_length_, 8, &operations_);
+  ++count_;
+  copy_length_ = 0;
+}
+
+void DiffImages(const std::vector<uint8_t>& original,
+                const std::vector<uint8_t>& output,
+                const LayoutReport& report,
+                PatchWriter* writer) {
+  std::vector<Mapping> mappings;
+  for (size_t i = 0; i < report.sections.size(); ++i) {
+    const LayoutEntry& entry = report.sections[i];
+    if (!entry.added && !entry.removed) {
+      Mapping mapping;
+      mapping.new_offset = entry.new_offset;
+      mapping.delta = entry.new_offset - entry.old_offset;
+      mappings.push_back(mapping);
+    }
+  }
+  std::stable_sort(mappings.begin(), mappings.end());
+
+  size_t next_mapping = 0;
+  int64_t delta = 0;
+  uint64_t position = 0;
+  while (position < output.size()) {
+    while (next_mapping < mappings.size() &&
+           mappings[next_mapping].new_offset <= position) {
+      delta = mappings[next_mapping++].delta;
+    }
+
+    const int64_t candidates[] = {delta, 0};
+    bool copied = false;
+    for (size_t i = 0; i < 2 && !copied; ++i) {
+      const int64_t source = position - candidates[i];
+      if (source < 0 || static_cast<uint64_t>(source) >= original.size())
+        continue;
+      const size_t length = MatchLength(original, source, output, position);
+      if (length >= kMinCopyLength) {
+        writer->Copy(source, length);
+        position += length;
+        copied = true;
+      }
+    }
+    if (!copied)
+      writer->Insert(output[position++]);
+  }
+}
+
+bool CreatePatch(const std::string& path,
+                 const UnpackOptions& options,
+                 int patch_fd) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    return false;
+  }
+
+  std::vector<uint8_t> original;
+  LayoutReport report;
+  bool status = ReadWholeFile(fd, &original);
+  if (!status)
+    LOG(ERROR) << path << ": read failed: " << strerror(errno);
+  status = status && DryRunFile(fd, path, options, &report);
+  close(fd);
+
+  std::vector<uint8_t> output(original);
+  if (!status || !UnpackImage(&output, path, options))
+    return false;
+
+  PatchWriter writer;
+  DiffImages(original, output, report, &writer);
+  std::vector<uint8_t> operations;
+  uint32_t count;
+  writer.Finish(&operations, &count);
+
+  std::vector<uint8_t> patch(kPatchMagic, kPatchMagic + sizeof(kPatchMagic));
+  PutLE(kPatchVersion, 4, &patch);
+  PutLE(original.size(), 8, &patch);
+  PutLE(Crc32(0, original.data(), original.size()), 4, &patch);
+  PutLE(output.size(), 8, &patch);
+  PutLE(Crc32(0, output.data(), output.size()), 4, &patch);
+  PutLE(count, 4, &patch);
+  patch.insert(patch.end(), operations.begin(), operations.end());
+
+  LOG(INFO) << "Patch            : " << patch.size() << " bytes, " << count
+            << " operations, for " << output.size() << " byte output";
+  if (!WriteFully(patch_fd, patch.data(), patch.size())) {
+    LOG(ERROR) << path << ": failed to write patch: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool ApplyPatch(int patch_fd,
+                const std::string& original_path,
+                const std::string& output_path) {
+  std::vector<uint8_t> patch;
+  if (!ReadToEnd(patch_fd, &patch)) {
+    LOG(ERROR) << "failed to read patch: " << strerror(errno);
+    return false;
+  }
+  if (patch.size() < kPatchHeaderSize ||
+      memcmp(patch.data(), kPatchMagic, sizeof(kPatchMagic)) != 0 ||
+      GetLE(&patch[8], 4) != kPatchVersion) {
+    LOG(ERROR) << "not a version " << kPatchVersion << " relocation patch";
+    return false;
+  }
+  const uint64_t original_size = GetLE(&patch[12], 8);
+  const uint32_t original_crc = GetLE(&patch[20], 4);
+  const uint64_t output_size = GetLE(&patch[24], 8);
+  const uint32_t output_crc = GetLE(&patch[32], 4);
+
+  const int original_fd = open(original_path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat original;
+  if (original_fd == -1 || fstat(original_fd, &original) != 0) {
+    LOG(ERROR) << original_path << ": " << strerror(errno);
+    if (original_fd != -1)
+      close(original_fd);
+    return false;
+  }
+
+  FileIdentity identity;
+  if (!ComputeFileIdentity(original_fd, &identity) ||
+      identity.size != original_size || identity.crc != original_crc) {
+    LOG(ERROR) << original_path << ": does not match the patch's original";
+    close(original_fd);
+    return false;
+  }
+
+  std::string temporary = output_path + ".XXXXXX";
+  const int fd = mkostemp(&temporary[0], O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << output_path << ": " << strerror(errno);
+    close(original_fd);
+    return false;
+  }
+
+  FileIdentity output;
+  bool status = fchmod(fd, original.st_mode & 07777) == 0 &&
+                ApplyOperations(patch, original_fd, original_size, fd,
+                                output_size) &&
+                ComputeFileIdentity(fd, &output) && output.crc == output_crc;
+  if (!status)
+    LOG(ERROR) << output_path << ": failed to apply patch";
+  status = status && fsync(fd) == 0;
+  status = close(fd) == 0 && status;
+  close(original_fd);
+  if (!status || rename(temporary.c_str(), output_path.c_str()) != 0) {
+    LOG_IF(ERROR, status) << output_path << ": " << strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace relocation_packer
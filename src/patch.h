@@ -0,0 +1,98 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Binary patches from an original shared object to its converted form.
+//
+// A converted library is mostly the original's bytes at new offsets.
+// CreatePatch() plans the conversion with a dry run, which gives the old
+// and new offset of every section and header table, converts a copy in
+// memory, and then describes the result as copies from the original at
+// those offsets, verified byte for byte, and inserts of anything else.
+// ApplyPatch() rebuilds the converted file from the original, copying
+// with copy_file_range so that unchanged data need not pass through user
+// space and may share extents with the original.
+//
+// The patch is a header followed by operations in output order, with all
+// integers little-endian:
+//
+//   "RELRPTCH"                          magic
+//   u32 version                         kPatchVersion
+//   u64 size, u32 CRC-32                of the original
+//   u64 size, u32 CRC-32                of the output
+//   u32 count                           of operations
+//   u8 0, u64 offset, u64 length        copy from the original
+//   u8 1, u64 length, bytes             insert
+//
+// A patch applies only to an original of the recorded size and CRC-32, and
+// its result is checked against the recorded output CRC-32.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_PATCH_H_
+#define TOOLS_RELOCATION_PACKER_SRC_PATCH_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "unpack.h"
+
+namespace relocation_packer {
+
+static const uint32_t kPatchVersion = 1;
+
+// Write to |patch_fd| a patch converting the shared object at |path| as
+// |options| direct.  |path| is opened read-only and left unchanged.
+// Returns false on error.
+bool CreatePatch(const std::string& path,
+                 const UnpackOptions& options,
+                 int patch_fd);
+
+// Apply the patch read from |patch_fd| to the file at |original_path|,
+// atomically replacing |output_path| with the result, which takes the
+// original's mode.  |output_path| may be |original_path|.  Returns false,
+// leaving |output_path| untouched, if the patch does not match the
+// original or cannot be applied.
+bool ApplyPatch(int patch_fd,
+                const std::string& original_path,
+                const std::string& output_path);
+
+// Builds the operation list of a patch, merging a copy that continues the
+// previous one and consecutive inserted bytes.  Exposed for testing.
+class PatchWriter {
+ public:
+  PatchWriter() : count_(0), insert_length_offset_(0), insert_length_(0),
+                  copy_offset_(0), copy_length_(0) {}
+
+  // Append a copy of |length| bytes from |offset| in the original.
+  void Copy(uint64_t offset, uint64_t length);
+
+  // Append an inserted byte.
+  void Insert(uint8_t byte);
+
+  // Return the operations and their count.
+  void Finish(std::vector<uint8_t>* operations, uint32_t* count);
+
+ private:
+  void EndInsert();
+  void EndCopy();
+
+  std::vector<uint8_t> operations_;
+  uint32_t count_;
+  size_t insert_length_offset_;
+  uint64_t insert_length_;
+  uint64_t copy_offset_;
+  uint64_t copy_length_;
+};
+
+// Describe |output| to |writer| as operations on |original|.  Each output
+// byte is looked for in the original at the offset of the section or
+// table that contains or last precedes it in |report|, and failing that at
+// its own offset.  Exposed for testing.
+void DiffImages(const std::vector<uint8_t>& original,
+                const std::vector<uint8_t>& output,
+                const LayoutReport& report,
+                PatchWriter* writer);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_PATCH_H_
@@ -0,0 +1,340 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "patch.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "crc32.h"
+#include "debug.h"
+#include "file_util.h"
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+void PutLE(uint64_t value, size_t size, std::vector<uint8_t>* out) {
+  for (size_t i = 0; i < size; ++i)
+    out->push_back(value >> (8 * i));
+}
+
+void PutCopy(uint64_t offset, uint64_t length, std::vector<uint8_t>* out) {
+  out->push_back(0);
+  PutLE(offset, 8, out);
+  PutLE(length, 8, out);
+}
+
+void PutInsert(const std::string& bytes, std::vector<uint8_t>* out) {
+  out->push_back(1);
+  PutLE(bytes.size(), 8, out);
+  out->insert(out->end(), bytes.begin(), bytes.end());
+}
+
+// A patch with the header for |original| and |output| and |count|
+// operations, followed by |operations|.
+std::vector<uint8_t> MakePatch(const std::vector<uint8_t>& original,
+                               const std::vector<uint8_t>& output,
+                               uint32_t count,
+                               const std::vector<uint8_t>& operations) {
+  static const char kMagic[] = "RELRPTCH";
+  std::vector<uint8_t> patch(kMagic, kMagic + 8);
+  PutLE(kPatchVersion, 4, &patch);
+  PutLE(original.size(), 8, &patch);
+  PutLE(Crc32(0, original.data(), original.size()), 4, &patch);
+  PutLE(output.size(), 8, &patch);
+  PutLE(Crc32(0, output.data(), output.size()), 4, &patch);
+  PutLE(count, 4, &patch);
+  patch.insert(patch.end(), operations.begin(), operations.end());
+  return patch;
+}
+
+std::vector<uint8_t> Bytes(const std::string& text) {
+  return std::vector<uint8_t>(text.begin(), text.end());
+}
+
+// 256 distinct bytes, so that no run matches at another offset.
+std::vector<uint8_t> Distinct() {
+  std::vector<uint8_t> bytes;
+  for (size_t i = 0; i < 256; ++i)
+    bytes.push_back(i);
+  return bytes;
+}
+
+class PatchTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Failures are expected; keep their log messages out of the results.
+    Logger::SetStreams(&log_, &log_);
+    char directory[] = "/tmp/patch_unittest.XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory) != NULL);
+    directory_ = directory;
+    original_path_ = directory_ + "/original";
+    output_path_ = directory_ + "/output";
+  }
+
+  void TearDown() override {
+    unlink(original_path_.c_str());
+    unlink(output_path_.c_str());
+    rmdir(directory_.c_str());
+    Logger::Reset();
+  }
+
+  void WriteFile(const std::string& path, const std::vector<uint8_t>& data) {
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    ASSERT_TRUE(WriteFully(fd, data.data(), data.size()));
+    close(fd);
+  }
+
+  std::vector<uint8_t> ReadFile(const std::string& path) {
+    std::vector<uint8_t> data;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+      EXPECT_TRUE(ReadWholeFile(fd, &data));
+      close(fd);
+    }
+    return data;
+  }
+
+  // Apply |patch| to |original|, with the output file holding "untouched"
+  // beforehand.  Returns what ApplyPatch() returns.
+  bool Apply(const std::vector<uint8_t>& original,
+             const std::vector<uint8_t>& patch) {
+    WriteFile(original_path_, original);
+    WriteFile(output_path_, Bytes("untouched"));
+    char patch_path[] = "/tmp/patch_unittest_patch.XXXXXX";
+    const int patch_fd = mkstemp(patch_path);
+    EXPECT_NE(-1, patch_fd);
+    unlink(patch_path);
+    EXPECT_TRUE(WriteFully(patch_fd, patch.data(), patch.size()));
+    lseek(patch_fd, 0, SEEK_SET);
+    const bool status = ApplyPatch(patch_fd, original_path_, output_path_);
+    close(patch_fd);
+    return status;
+  }
+
+  bool IsOutputUntouched() {
+    return ReadFile(output_path_) == Bytes("untouched");
+  }
+
+  std::ostringstream log_;
+  std::string directory_;
+  std::string original_path_;
+  std::string output_path_;
+};
+
+}  // namespace
+
+TEST(PatchWriter, MergesInsertsAndContinuingCopies) {
+  PatchWriter writer;
+  writer.Copy(0, 10);
+  writer.Copy(10, 5);
+  writer.Insert('a');
+  writer.Insert('b');
+  writer.Copy(40, 3);
+  writer.Copy(50, 2);
+
+  std::vector<uint8_t> operations;
+  uint32_t count;
+  writer.Finish(&operations, &count);
+
+  std::vector<uint8_t> expected;
+  PutCopy(0, 15, &expected);
+  PutInsert("ab", &expected);
+  PutCopy(40, 3, &expected);
+  PutCopy(50, 2, &expected);
+  EXPECT_EQ(4u, count);
+  EXPECT_EQ(expected, operations);
+}
+
+TEST(PatchWriter, Empty) {
+  PatchWriter writer;
+  std::vector<uint8_t> operations(1);
+  uint32_t count = 1;
+  writer.Finish(&operations, &count);
+  EXPECT_EQ(0u, count);
+  EXPECT_TRUE(operations.empty());
+}
+
+TEST(DiffImages, IdenticalIsOneCopy) {
+  const std::vector<uint8_t> original = Distinct();
+  PatchWriter writer;
+  DiffImages(original, original, LayoutReport(), &writer);
+  std::vector<uint8_t> operations;
+  uint32_t count;
+  writer.Finish(&operations, &count);
+
+  std::vector<uint8_t> expected;
+  PutCopy(0, original.size(), &expected);
+  EXPECT_EQ(1u, count);
+  EXPECT_EQ(expected, operations);
+}
+
+TEST(DiffImages, FollowsMovedSections) {
+  // The second half moves up by three bytes to make room for an insert.
+  const std::vector<uint8_t> original = Distinct();
+  std::vector<uint8_t> output(original.begin(), original.begin() + 128);
+  output.push_back('x');
+  output.push_back('y');
+  output.push_back('z');
+  output.insert(output.end(), original.begin() + 128, original.end());
+
+  LayoutReport report;
+  LayoutEntry moved;
+  moved.old_offset = 128;
+  moved.new_offset = 131;
+  report.sections.push_back(moved);
+
+  PatchWriter writer;
+  DiffImages(original, output, report, &writer);
+  std::vector<uint8_t> operations;
+  uint32_t count;
+  writer.Finish(&operations, &count);
+
+  std::vector<uint8_t> expected;
+  PutCopy(0, 128, &expected);
+  PutInsert("xyz", &expected);
+  PutCopy(128, 128, &expected);
+  EXPECT_EQ(3u, count);
+  EXPECT_EQ(expected, operations);
+}
+
+TEST(DiffImages, ShortMatchesAreInserted) {
+  const std::vector<uint8_t> original = Distinct();
+  std::vector<uint8_t> output(original.begin(), original.begin() + 8);
+  PatchWriter writer;
+  DiffImages(original, output, LayoutReport(), &writer);
+  std::vector<uint8_t> operations;
+  uint32_t count;
+  writer.Finish(&operations, &count);
+  EXPECT_EQ(1u, count);
+  EXPECT_EQ(1, operations[0]);  // An insert.
+}
+
+TEST_F(PatchTest, Applies) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("234abc789");
+  std::vector<uint8_t> operations;
+  PutCopy(2, 3, &operations);
+  PutInsert("abc", &operations);
+  PutCopy(7, 3, &operations);
+  EXPECT_TRUE(Apply(original, MakePatch(original, output, 3, operations)));
+  EXPECT_EQ(output, ReadFile(output_path_));
+}
+
+TEST_F(PatchTest, RejectsTruncatedOperations) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("0123abc");
+  std::vector<uint8_t> operations;
+  PutCopy(0, 4, &operations);
+  PutInsert("abc", &operations);
+
+  for (size_t size = 0; size < operations.size(); ++size) {
+    const std::vector<uint8_t> truncated(operations.begin(),
+                                         operations.begin() + size);
+    EXPECT_FALSE(Apply(original, MakePatch(original, output, 2, truncated)))
+        << "operations cut to " << size << " bytes";
+    EXPECT_TRUE(IsOutputUntouched());
+  }
+}
+
+TEST_F(PatchTest, RejectsCopyPastOriginal) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("89xx");
+  std::vector<uint8_t> operations;
+  PutCopy(8, 4, &operations);
+  EXPECT_FALSE(Apply(original, MakePatch(original, output, 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+
+  // An offset and length whose sum wraps.
+  operations.clear();
+  PutCopy(8, ~0ULL - 3, &operations);
+  EXPECT_FALSE(Apply(original, MakePatch(original, output, 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+TEST_F(PatchTest, RejectsInsertPastOutput) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("abc");
+  std::vector<uint8_t> operations;
+  PutInsert("abcd", &operations);
+  EXPECT_FALSE(Apply(original, MakePatch(original, output, 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+TEST_F(PatchTest, RejectsWrongCount) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("012abc");
+  std::vector<uint8_t> operations;
+  PutCopy(0, 3, &operations);
+  PutInsert("abc", &operations);
+  EXPECT_FALSE(Apply(original, MakePatch(original, output, 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+  EXPECT_FALSE(Apply(original, MakePatch(original, output, 3, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+TEST_F(PatchTest, RejectsOtherOriginal) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  const std::vector<uint8_t> output = Bytes("0123");
+  std::vector<uint8_t> operations;
+  PutCopy(0, 4, &operations);
+  const std::vector<uint8_t> patch =
+      MakePatch(original, output, 1, operations);
+
+  // Same size, different CRC-32.
+  EXPECT_FALSE(Apply(Bytes("0123456780"), patch));
+  EXPECT_TRUE(IsOutputUntouched());
+
+  // Different size.
+  EXPECT_FALSE(Apply(Bytes("01234567890"), patch));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+TEST_F(PatchTest, RejectsOutputMismatch) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  std::vector<uint8_t> operations;
+  PutCopy(0, 4, &operations);
+
+  // The operations build "0123", but the header promises "0124".
+  EXPECT_FALSE(Apply(original,
+                     MakePatch(original, Bytes("0124"), 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+
+  // Or a longer output than they build.
+  EXPECT_FALSE(Apply(original,
+                     MakePatch(original, Bytes("01234"), 1, operations)));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+TEST_F(PatchTest, RejectsBadHeader) {
+  const std::vector<uint8_t> original = Bytes("0123456789");
+  std::vector<uint8_t> operations;
+  PutCopy(0, 4, &operations);
+  std::vector<uint8_t> patch =
+      MakePatch(original, Bytes("0123"), 1, operations);
+
+  std::vector<uint8_t> bad_magic = patch;
+  bad_magic[0] = 'X';
+  EXPECT_FALSE(Apply(original, bad_magic));
+  EXPECT_TRUE(IsOutputUntouched());
+
+  std::vector<uint8_t> bad_version = patch;
+  bad_version[8] = kPatchVersion + 1;
+  EXPECT_FALSE(Apply(original, bad_version));
+  EXPECT_TRUE(IsOutputUntouched());
+
+  patch.resize(20);
+  EXPECT_FALSE(Apply(original, patch));
+  EXPECT_TRUE(IsOutputUntouched());
+}
+
+}  // namespace relocation_packer
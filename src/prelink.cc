@@ -0,0 +1,425 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "prelink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_traits.h"
+#include "file_util.h"
+
+#if !defined(SHT_GNU_HASH)
+#define SHT_GNU_HASH 0x6ffffff6
+#endif
+#if !defined(STT_GNU_IFUNC)
+#define STT_GNU_IFUNC 10
+#endif
+#if !defined(STB_GNU_UNIQUE)
+#define STB_GNU_UNIQUE 10
+#endif
+
+namespace relocation_packer {
+
+namespace {
+
+// A dynamic symbol, independent of ELF class.
+struct Symbol {
+  uint32_t name;
+  uint64_t value;
+  uint16_t section;
+  uint8_t type;
+  uint8_t binding;
+};
+
+uint32_t GnuHash(const char* name) {
+  uint32_t hash = 5381;
+  for (const uint8_t* c = reinterpret_cast<const uint8_t*>(name); *c; ++c)
+    hash = hash * 33 + *c;
+  return hash;
+}
+
+uint32_t SysvHash(const char* name) {
+  uint32_t hash = 0;
+  for (const uint8_t* c = reinterpret_cast<const uint8_t*>(name); *c; ++c) {
+    hash = (hash << 4) + *c;
+    const uint32_t high = hash & 0xf0000000;
+    if (high)
+      hash ^= high >> 24;
+    hash &= ~high;
+  }
+  return hash;
+}
+
+// Copy |count| values of type T from |offset| in |image| to |out|.
+// Returns false if they lie outside it.
+template <typename T>
+bool ReadArray(const std::vector<uint8_t>& image,
+               uint64_t offset,
+               uint64_t count,
+               std::vector<T>* out) {
+  if (offset > image.size() || count > (image.size() - offset) / sizeof(T))
+    return false;
+  out->resize(count);
+  if (count)
+    memcpy(&out->at(0), &image[offset], count * sizeof(T));
+  return true;
+}
+
+}  // namespace
+
+struct PrelinkLibrary {
+  PrelinkLibrary()
+      : base(0), gnu_symbol_offset(0), gnu_bloom_shift(0),
+        gnu_bloom_bits(0) {}
+
+  std::string path;
+  std::string real_path;
+  uint64_t base;
+
+  std::vector<Symbol> symbols;
+  std::string strings;
+
+  // .gnu.hash, if present.
+  uint32_t gnu_symbol_offset;
+  uint32_t gnu_bloom_shift;
+  unsigned gnu_bloom_bits;
+  std::vector<uint64_t> gnu_bloom;
+  std::vector<uint32_t> gnu_buckets;
+  std::vector<uint32_t> gnu_chain;
+
+  // .hash, used when there is no .gnu.hash.
+  std::vector<uint32_t> sysv_buckets;
+  std::vector<uint32_t> sysv_chain;
+
+  // Return the index of the symbol |name| in |symbols|, or zero if absent.
+  size_t Find(const char* name) const;
+
+  size_t FindGnu(const char* name) const;
+  size_t FindSysv(const char* name) const;
+  bool NameIs(size_t index, const char* name) const;
+};
+
+bool PrelinkLibrary::NameIs(size_t index, const char* name) const {
+  if (index >= symbols.size() || symbols[index].name >= strings.size())
+    return false;
+  return strcmp(strings.c_str() + symbols[index].name, name) == 0;
+}
+
+size_t PrelinkLibrary::FindGnu(const char* name) const {
+  const uint32_t hash = GnuHash(name);
+  const uint64_t word =
+      gnu_bloom[(hash / gnu_bloom_bits) % gnu_bloom.size()];
+  const uint64_t mask = (1ULL << (hash % gnu_bloom_bits)) |
+                        (1ULL << ((hash >> gnu_bloom_shift) % gnu_bloom_bits));
+  if ((word & mask) != mask)
+    return 0;
+
+  for (size_t index = gnu_buckets[hash % gnu_buckets.size()];
+       index >= gnu_symbol_offset &&
+       index - gnu_symbol_offset < gnu_chain.size();
+       ++index) {
+    const uint32_t chain_hash = gnu_chain[index - gnu_symbol_offset];
+    if ((chain_hash | 1) == (hash | 1) && NameIs(index, name))
+      return index;
+    if (chain_hash & 1)
+      break;
+  }
+  return 0;
+}
+
+size_t PrelinkLibrary::FindSysv(const char* name) const {
+  // A corrupt chain may loop; no chain is longer than the table.
+  size_t index = sysv_buckets[SysvHash(name) % sysv_buckets.size()];
+  for (size_t steps = 0; index != 0 && index < sysv_chain.size() &&
+                         steps < sysv_chain.size(); ++steps) {
+    if (NameIs(index, name))
+      return index;
+    index = sysv_chain[index];
+  }
+  return 0;
+}
+
+size_t PrelinkLibrary::Find(const char* name) const {
+  if (!gnu_buckets.empty() && !gnu_bloom.empty())
+    return FindGnu(name);
+  if (!sysv_buckets.empty())
+    return FindSysv(name);
+  return 0;
+}
+
+// Helper for ParseLibrary().  Read the dynamic symbols and string table of
+// |image|, and the raw .gnu.hash and .hash sections that index them.
+template <typename ELF>
+static bool ParseLibraryTyped(const std::vector<uint8_t>& image,
+                              std::vector<Symbol>* symbols,
+                              std::string* strings,
+                              std::vector<uint8_t>* gnu_hash,
+                              std::vector<uint32_t>* sysv_hash) {
+  std::vector<typename ELF::Ehdr> elf_header;
+  if (!ReadArray(image, 0, 1, &elf_header) ||
+      elf_header[0].e_shentsize != sizeof(typename ELF::Shdr))
+    return false;
+  std::vector<typename ELF::Shdr> section_headers;
+  if (!ReadArray(image, elf_header[0].e_shoff, elf_header[0].e_shnum,
+                 &section_headers))
+    return false;
+
+  size_t dynamic_symbols = section_headers.size();
+  for (size_t i = 0; i < section_headers.size(); ++i) {
+    if (section_headers[i].sh_type == SHT_DYNSYM)
+      dynamic_symbols = i;
+  }
+  if (dynamic_symbols == section_headers.size())
+    return false;
+
+  const typename ELF::Shdr& symbol_header = section_headers[dynamic_symbols];
+  std::vector<typename ELF::Sym> raw_symbols;
+  std::vector<char> raw_strings;
+  if (symbol_header.sh_link >= section_headers.size() ||
+      !ReadArray(image, symbol_header.sh_offset,
+                 symbol_header.sh_size / sizeof(typename ELF::Sym),
+                 &raw_symbols) ||
+      !ReadArray(image, section_headers[symbol_header.sh_link].sh_offset,
+                 section_headers[symbol_header.sh_link].sh_size,
+                 &raw_strings))
+    return false;
+  strings->assign(raw_strings.begin(), raw_strings.end());
+
+  symbols->resize(raw_symbols.size());
+  for (size_t i = 0; i < raw_symbols.size(); ++i) {
+    Symbol& symbol = symbols->at(i);
+    symbol.name = raw_symbols[i].st_name;
+    symbol.value = raw_symbols[i].st_value;
+    symbol.section = raw_symbols[i].st_shndx;
+    symbol.type = ELF::elf_st_type(raw_symbols[i].st_info);
+    symbol.binding = raw_symbols[i].st_info >> 4;
+  }
+
+  for (size_t i = 0; i < section_headers.size(); ++i) {
+    const typename ELF::Shdr& section_header = section_headers[i];
+    if (section_header.sh_link != dynamic_symbols)
+      continue;
+    if (section_header.sh_type == SHT_GNU_HASH &&
+        !ReadArray(image, section_header.sh_offset, section_header.sh_size,
+                   gnu_hash))
+      return false;
+    if (section_header.sh_type == SHT_HASH &&
+        !ReadArray(image, section_header.sh_offset,
+                   section_header.sh_size / sizeof(uint32_t), sysv_hash))
+      return false;
+  }
+  return true;
+}
+
+// Read the dynamic symbol table and hash tables of |image| into |library|.
+// Returns false if |image| is truncated or has no usable hash table.
+template <typename ELF>
+static bool ParseLibrary(const std::vector<uint8_t>& image,
+                         PrelinkLibrary* library) {
+  std::vector<uint8_t> gnu_hash;
+  std::vector<uint32_t> sysv_hash;
+  if (!ParseLibraryTyped<ELF>(image, &library->symbols, &library->strings,
+                              &gnu_hash, &sysv_hash))
+    return false;
+
+  // .gnu.hash: bucket count, first hashed symbol, bloom filter words and
+  // shift, then the filter of ELF words, the buckets and the hash chain.
+  const size_t word_size = sizeof(typename ELF::Addr);
+  std::vector<uint32_t> header;
+  if (ReadArray(gnu_hash, 0, 4, &header) && header[0] && header[2]) {
+    std::vector<typename ELF::Addr> bloom;
+    const uint64_t buckets_offset = 16 + header[2] * word_size;
+    const uint64_t chain_offset = buckets_offset + header[0] * 4ULL;
+    if (!ReadArray(gnu_hash, 16, header[2], &bloom) ||
+        !ReadArray(gnu_hash, buckets_offset, header[0],
+                   &library->gnu_buckets) ||
+        chain_offset > gnu_hash.size() ||
+        !ReadArray(gnu_hash, chain_offset,
+                   (gnu_hash.size() - chain_offset) / 4,
+                   &library->gnu_chain))
+      return false;
+    library->gnu_symbol_offset = header[1];
+    library->gnu_bloom_shift = header[3];
+    library->gnu_bloom_bits = 8 * word_size;
+    library->gnu_bloom.assign(bloom.begin(), bloom.end());
+    return true;
+  }
+
+  // .hash: bucket count, chain count, the buckets, then the chain.
+  if (sysv_hash.size() >= 2 && sysv_hash[0] &&
+      sysv_hash.size() - 2 >= static_cast<uint64_t>(sysv_hash[0]) +
+                              sysv_hash[1]) {
+    library->sysv_buckets.assign(sysv_hash.begin() + 2,
+                                 sysv_hash.begin() + 2 + sysv_hash[0]);
+    library->sysv_chain.assign(sysv_hash.begin() + 2 + sysv_hash[0],
+                               sysv_hash.begin() + 2 + sysv_hash[0] +
+                                   sysv_hash[1]);
+    return true;
+  }
+  return false;
+}
+
+prelink_value_t PrelinkValueKind(unsigned machine, unsigned type) {
+  switch (machine) {
+    case EM_X86_64:
+      switch (type) {
+        case R_X86_64_RELATIVE:
+          return PRELINK_RELATIVE;
+        case R_X86_64_64:
+          return PRELINK_SYMBOL;
+        case R_X86_64_GLOB_DAT:
+        case R_X86_64_JUMP_SLOT:
+          return PRELINK_SYMBOL_ONLY;
+      }
+      break;
+    case EM_AARCH64:
+      switch (type) {
+        case R_AARCH64_RELATIVE:
+          return PRELINK_RELATIVE;
+        case R_AARCH64_ABS64:
+        case R_AARCH64_GLOB_DAT:
+        case R_AARCH64_JUMP_SLOT:
+          return PRELINK_SYMBOL;
+      }
+      break;
+  }
+  return PRELINK_NONE;
+}
+
+PrelinkScope::PrelinkScope() {}
+
+PrelinkScope::~PrelinkScope() {}
+
+bool PrelinkScope::Load(const std::string& path) {
+  const int map_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  std::vector<uint8_t> contents;
+  if (map_fd == -1 || !ReadToEnd(map_fd, &contents)) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    if (map_fd != -1)
+      close(map_fd);
+    return false;
+  }
+  close(map_fd);
+
+  std::istringstream stream(std::string(contents.begin(), contents.end()));
+  std::string line;
+  size_t line_number = 0;
+  while (std::getline(stream, line)) {
+    ++line_number;
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    PrelinkLibrary library;
+    const size_t space = line.find_last_of(" \t");
+    char* end = NULL;
+    const char* base = line.c_str() + space + 1;
+    if (space != std::string::npos)
+      library.base = strtoull(base, &end, 16);
+    if (space == std::string::npos || end == base || *end != '\0') {
+      LOG(ERROR) << path << ":" << line_number
+                 << ": expected a path and a hex base address";
+      return false;
+    }
+    library.path = line.substr(0, line.find_last_not_of(" \t", space) + 1);
+
+    char* real_path = realpath(library.path.c_str(), NULL);
+    const int fd = open(library.path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::vector<uint8_t> image;
+    const bool is_read = real_path && fd != -1 && ReadWholeFile(fd, &image);
+    if (!is_read)
+      LOG(ERROR) << library.path << ": " << strerror(errno);
+    if (real_path)
+      library.real_path = real_path;
+    free(real_path);
+    if (fd != -1)
+      close(fd);
+    if (!is_read)
+      return false;
+
+    bool is_parsed = false;
+    if (image.size() >= EI_NIDENT &&
+        memcmp(&image[0], ELFMAG, SELFMAG) == 0 &&
+        image[EI_DATA] == ELFDATA2LSB) {
+      if (image[EI_CLASS] == ELFCLASS32)
+        is_parsed = ParseLibrary<ELF32_traits>(image, &library);
+      else if (image[EI_CLASS] == ELFCLASS64)
+        is_parsed = ParseLibrary<ELF64_traits>(image, &library);
+    }
+    if (!is_parsed) {
+      LOG(ERROR) << library.path
+                 << ": no dynamic symbol table with .gnu.hash or .hash";
+      return false;
+    }
+    VLOG(1) << "Prelink " << library.path << " at 0x" << std::hex
+            << library.base << std::dec << ", "
+            << library.symbols.size() << " symbols";
+    libraries_.push_back(library);
+  }
+  return true;
+}
+
+bool PrelinkScope::FindBase(const std::string& path, uint64_t* base) const {
+  char* real_path = realpath(path.c_str(), NULL);
+  if (!real_path)
+    return false;
+  const std::string real(real_path);
+  free(real_path);
+  for (size_t i = 0; i < libraries_.size(); ++i) {
+    if (libraries_[i].real_path == real) {
+      *base = libraries_[i].base;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The last component of |path|.
+static std::string BaseName(const std::string& path) {
+  const size_t slash = path.find_last_of('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool PrelinkScope::HasLibrary(const std::string& name) const {
+  for (size_t i = 0; i < libraries_.size(); ++i) {
+    if (BaseName(libraries_[i].path) == name ||
+        BaseName(libraries_[i].real_path) == name)
+      return true;
+  }
+  return false;
+}
+
+bool PrelinkScope::Lookup(const char* name, uint64_t* address) const {
+  for (size_t i = 0; i < libraries_.size(); ++i) {
+    const PrelinkLibrary& library = libraries_[i];
+    const size_t index = library.Find(name);
+    if (index == 0)
+      continue;
+
+    const Symbol& symbol = library.symbols[index];
+    if (symbol.section == SHN_UNDEF ||
+        (symbol.binding != STB_GLOBAL && symbol.binding != STB_WEAK &&
+         symbol.binding != STB_GNU_UNIQUE))
+      continue;
+    if (symbol.type == STT_TLS || symbol.type == STT_GNU_IFUNC)
+      return false;
+    *address = symbol.section == SHN_ABS ? symbol.value
+                                         : library.base + symbol.value;
+    return true;
+  }
+  return false;
+}
+
+size_t PrelinkScope::size() const {
+  return libraries_.size();
+}
+
+}  // namespace relocation_packer
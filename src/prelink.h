@@ -0,0 +1,83 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Symbol resolution against a fixed set of libraries, for prelinking.
+//
+// On a closed image where the loader maps every library at a known base,
+// the final value of most .rela.dyn relocations is known when converting.
+// A PrelinkScope loads a map of those libraries and their bases, and looks
+// symbols up through each library's .gnu.hash, or .hash when it has none,
+// in map order, much as a loader searches its global scope.  Symbol
+// versions are not consulted: the first default-visible definition wins.
+//
+// ElfFile::SetPrelink() writes the resolved values into the words the
+// relocations target and keeps the relocations themselves, so a loader that
+// maps a library elsewhere, or resolves a symbol differently, still gets
+// the right result by applying them as usual.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_PRELINK_H_
+#define TOOLS_RELOCATION_PACKER_SRC_PRELINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace relocation_packer {
+
+// How a relocation's prelinked value is computed, for PrelinkValueKind().
+enum prelink_value_t {
+  // Not prelinkable: TLS, IFUNC, copy, or an unknown type.
+  PRELINK_NONE = 0,
+  // Load base plus addend.
+  PRELINK_RELATIVE,
+  // Symbol address plus addend.
+  PRELINK_SYMBOL,
+  // Symbol address alone.
+  PRELINK_SYMBOL_ONLY
+};
+
+// Classify relocation |type| for ELF machine |machine|.  Every prelinkable
+// type writes one ELF word.  Only machines whose dynamic relocations are
+// RELA are supported: x86-64 and AArch64.
+prelink_value_t PrelinkValueKind(unsigned machine, unsigned type);
+
+// A library's base and dynamic symbol tables, defined in prelink.cc.
+struct PrelinkLibrary;
+
+class PrelinkScope {
+ public:
+  PrelinkScope();
+  ~PrelinkScope();
+
+  // Load the map at |path|: one library per line, its path and its base
+  // address in hex, separated by white space, in lookup order.  Blank lines
+  // and lines starting '#' are ignored.  Every library is read and its
+  // symbol tables kept.  Returns false, logging why, on error.
+  bool Load(const std::string& path);
+
+  // Set |base| to the base of the library at |path|, matched by real path.
+  // Returns false if the map does not list it.
+  bool FindBase(const std::string& path, uint64_t* base) const;
+
+  // True if the map lists a library whose path or real path has the file
+  // name |name|, as a DT_NEEDED entry names it.
+  bool HasLibrary(const std::string& name) const;
+
+  // Set |address| to the run-time address of the first definition of
+  // |name| in lookup order.  Returns false if no library defines it, or the
+  // first definition is thread-local or an IFUNC, which only the loader
+  // can resolve.
+  bool Lookup(const char* name, uint64_t* address) const;
+
+  // Number of libraries loaded.
+  size_t size() const;
+
+ private:
+  std::vector<PrelinkLibrary> libraries_;
+};
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_PRELINK_H_
@@ -0,0 +1,137 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "relr_stub.h"
+
+#include <string.h>
+#include <vector>
+
+#include "debug.h"
+#include "elf.h"
+
+namespace relocation_packer {
+
+// x86_64 stub code, assembled from:
+//
+//   endbr64
+//   push rdi                            ; preserve argc, argv, envp for
+//   push rsi                            ; the original DT_INIT
+//   push rdx
+//   lea  r8, [rip + stub]
+//   sub  r8, [rip + stub_vaddr]         ; r8 = load bias
+//   mov  rsi, [rip + relro_size]
+//   test rsi, rsi
+//   jz   1f
+//   mov  rdi, [rip + relro_vaddr]
+//   add  rdi, r8
+//   mov  edx, 3                         ; PROT_READ | PROT_WRITE
+//   mov  eax, 10                        ; __NR_mprotect
+//   syscall
+// 1:
+//   mov  r9, [rip + relr_vaddr]
+//   add  r9, r8                         ; r9 = cursor in .relr.dyn
+//   mov  r10, [rip + relr_size]
+//   add  r10, r9                        ; r10 = end of .relr.dyn
+//   xor  eax, eax                       ; rax = next relocated address
+// 2:
+//   cmp  r9, r10
+//   jae  5f
+//   mov  r11, [r9]
+//   add  r9, 8
+//   test r11b, 1
+//   jnz  3f
+//   lea  rax, [r8 + r11]                ; address entry
+//   add  [rax], r8
+//   add  rax, 8
+//   jmp  2b
+// 3:
+//   mov  rcx, rax                       ; bitmap entry
+//   shr  r11, 1
+// 4:
+//   test r11b, 1
+//   jz   6f
+//   add  [rcx], r8
+// 6:
+//   add  rcx, 8
+//   shr  r11, 1
+//   jnz  4b
+//   add  rax, 63 * 8
+//   jmp  2b
+// 5:
+//   mov  rsi, [rip + relro_protect_size]
+//   test rsi, rsi
+//   jz   7f
+//   mov  rdi, [rip + relro_vaddr]
+//   add  rdi, r8
+//   mov  edx, 1                         ; PROT_READ
+//   mov  eax, 10                        ; __NR_mprotect
+//   syscall
+// 7:
+//   pop  rdx
+//   pop  rsi
+//   pop  rdi
+//   mov  rax, [rip + init]
+//   test rax, rax
+//   jz   8f
+//   add  rax, r8
+//   jmp  rax                            ; tail-call the original DT_INIT
+// 8:
+//   ret
+//   .balign 8
+//
+// followed by the RelrStubParams block.
+static const uint8_t kX86_64Stub[] = {
+    0xf3, 0x0f, 0x1e, 0xfa, 0x57, 0x56, 0x52, 0x4c, 0x8d, 0x05, 0xf2, 0xff,
+    0xff, 0xff, 0x4c, 0x2b, 0x05, 0xb3, 0x00, 0x00, 0x00, 0x48, 0x8b, 0x35,
+    0xcc, 0x00, 0x00, 0x00, 0x48, 0x85, 0xf6, 0x74, 0x16, 0x48, 0x8b, 0x3d,
+    0xb8, 0x00, 0x00, 0x00, 0x4c, 0x01, 0xc7, 0xba, 0x03, 0x00, 0x00, 0x00,
+    0xb8, 0x0a, 0x00, 0x00, 0x00, 0x0f, 0x05, 0x4c, 0x8b, 0x0d, 0x92, 0x00,
+    0x00, 0x00, 0x4d, 0x01, 0xc1, 0x4c, 0x8b, 0x15, 0x90, 0x00, 0x00, 0x00,
+    0x4d, 0x01, 0xca, 0x31, 0xc0, 0x4d, 0x39, 0xd1, 0x73, 0x3a, 0x4d, 0x8b,
+    0x19, 0x49, 0x83, 0xc1, 0x08, 0x41, 0xf6, 0xc3, 0x01, 0x75, 0x0d, 0x4b,
+    0x8d, 0x04, 0x18, 0x4c, 0x01, 0x00, 0x48, 0x83, 0xc0, 0x08, 0xeb, 0xe1,
+    0x48, 0x89, 0xc1, 0x49, 0xd1, 0xeb, 0x41, 0xf6, 0xc3, 0x01, 0x74, 0x03,
+    0x4c, 0x01, 0x01, 0x48, 0x83, 0xc1, 0x08, 0x49, 0xd1, 0xeb, 0x75, 0xee,
+    0x48, 0x05, 0xf8, 0x01, 0x00, 0x00, 0xeb, 0xc1, 0x48, 0x8b, 0x35, 0x5d,
+    0x00, 0x00, 0x00, 0x48, 0x85, 0xf6, 0x74, 0x16, 0x48, 0x8b, 0x3d, 0x41,
+    0x00, 0x00, 0x00, 0x4c, 0x01, 0xc7, 0xba, 0x01, 0x00, 0x00, 0x00, 0xb8,
+    0x0a, 0x00, 0x00, 0x00, 0x0f, 0x05, 0x5a, 0x5e, 0x5f, 0x48, 0x8b, 0x05,
+    0x40, 0x00, 0x00, 0x00, 0x48, 0x85, 0xc0, 0x74, 0x05, 0x4c, 0x01, 0xc0,
+    0xff, 0xe0, 0xc3, 0x0f, 0x1f, 0x44, 0x00, 0x00,
+};
+
+// The code above addresses its parameters rip-relative, so the block must
+// immediately follow the code, which is already padded to 8 bytes.
+static_assert(sizeof(kX86_64Stub) % 8 == 0, "stub code must be 8-aligned");
+
+bool HasRelrStub(unsigned machine, unsigned file_class) {
+  return machine == EM_X86_64 && file_class == ELFCLASS64;
+}
+
+size_t RelrStubAlignment() {
+  return 16;
+}
+
+bool BuildRelrStub(unsigned machine,
+                   const RelrStubParams& params,
+                   std::vector<uint8_t>* stub) {
+  if (machine != EM_X86_64) {
+    LOG(ERROR) << "No relocation stub available for e_machine " << machine;
+    return false;
+  }
+
+  const uint64_t block[] = {
+    params.stub_vaddr, params.relr_vaddr, params.relr_size,
+    params.relro_vaddr, params.relro_size, params.relro_protect_size,
+    params.init,
+  };
+
+  stub->assign(kX86_64Stub, kX86_64Stub + sizeof(kX86_64Stub));
+  const size_t block_offset = stub->size();
+  stub->resize(block_offset + sizeof(block));
+  memcpy(&stub->at(block_offset), block, sizeof(block));
+  return true;
+}
+
+}  // namespace relocation_packer
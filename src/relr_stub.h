@@ -0,0 +1,70 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Self-relocating startup stub for SHT_RELR relocations.
+//
+// Instead of expanding .relr.dyn into .rel.dyn or .rela.dyn, the stub keeps
+// the packed data in place and applies it itself at startup.  The stub is
+// installed as DT_INIT, so it runs after the loader has processed every
+// other relocation but before any DT_INIT_ARRAY constructor.  On return it
+// tail-calls the original DT_INIT, if there was one, with the original
+// arguments.
+//
+// The stub is position independent and carries its parameters in a small
+// block of link-time values appended to the code:
+//
+//   stub_vaddr          link-time address of the stub itself; the stub
+//                       derives the load bias from its run-time address
+//   relr_vaddr          link-time address of .relr.dyn
+//   relr_size           size of .relr.dyn in bytes
+//   relro_vaddr         page-aligned start of PT_GNU_RELRO, or 0
+//   relro_size          bytes to make writable while relocating, or 0
+//   relro_protect_size  bytes to return to read-only afterwards, or 0
+//   init                link-time address of the original DT_INIT, or 0
+//
+// The loader write-protects PT_GNU_RELRO before calling DT_INIT, so the stub
+// makes that range writable for the duration of relocation.
+//
+// Data copied by R_*_COPY relocations in another object is copied before
+// the stub runs, and so holds unrelocated values.  Do not use the stub on
+// libraries whose exported data contains relative pointers and is copied
+// into an executable.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_RELR_STUB_H_
+#define TOOLS_RELOCATION_PACKER_SRC_RELR_STUB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace relocation_packer {
+
+struct RelrStubParams {
+  uint64_t stub_vaddr;
+  uint64_t relr_vaddr;
+  uint64_t relr_size;
+  uint64_t relro_vaddr;
+  uint64_t relro_size;
+  uint64_t relro_protect_size;
+  uint64_t init;
+};
+
+// Return true if a stub is available for the given ELF machine and class.
+bool HasRelrStub(unsigned machine, unsigned file_class);
+
+// Required alignment of the stub, in bytes.
+size_t RelrStubAlignment();
+
+// Build the stub for the given ELF machine.  Returns false if no stub is
+// available for it.
+// |machine| is the ELF e_machine value.
+// |params| supplies the link-time values embedded in the stub.
+// |stub| receives the stub code and parameters.
+bool BuildRelrStub(unsigned machine,
+                   const RelrStubParams& params,
+                   std::vector<uint8_t>* stub);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_RELR_STUB_H_
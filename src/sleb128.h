@@ -0,0 +1,122 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// SLEB128 encoding, as used by Android's APS2 packed relocations.
+//
+// Each value is written seven bits at a time, least significant first, with
+// the top bit of each byte set on all but the last.  The last byte's bit
+// six carries the sign.
+//
+// Sleb128Decoder reads values of up to eight bytes, which covers every
+// offset delta, r_info and addend seen in practice, a word at a time: one
+// unaligned load, the first clear continuation bit found with a count of
+// trailing zeros, and the seven-bit groups gathered by three shift-and-mask
+// steps rather than a branch per byte.  Longer values, and the last few
+// bytes of the input, take a byte-at-a-time path.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_SLEB128_H_
+#define TOOLS_RELOCATION_PACKER_SRC_SLEB128_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+namespace relocation_packer {
+
+class Sleb128Encoder {
+ public:
+  // Append the encoding of |value|.
+  void Enqueue(int64_t value) {
+    for (;;) {
+      const uint8_t byte = value & 0x7f;
+      value >>= 7;
+      const bool done = (value == 0 && (byte & 0x40) == 0) ||
+                        (value == -1 && (byte & 0x40) != 0);
+      encoding_.push_back(done ? byte : byte | 0x80);
+      if (done)
+        return;
+    }
+  }
+
+  // Append bytes verbatim.
+  void EnqueueBytes(const uint8_t* bytes, size_t size) {
+    encoding_.insert(encoding_.end(), bytes, bytes + size);
+  }
+
+  // Number of bytes encoded so far.
+  size_t size() const { return encoding_.size(); }
+
+  // Return the encoding and reset.
+  void GetEncoding(std::vector<uint8_t>* encoding) {
+    encoding->swap(encoding_);
+    encoding_.clear();
+  }
+
+ private:
+  std::vector<uint8_t> encoding_;
+};
+
+class Sleb128Decoder {
+ public:
+  Sleb128Decoder(const uint8_t* data, size_t size)
+      : next_(data), end_(data + size) {}
+
+  // Set |value| to the next value and return true, or return false if the
+  // input ends within a value or the value does not fit in 64 bits.
+  bool Dequeue(int64_t* value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (end_ - next_ >= 8) {
+      uint64_t word;
+      memcpy(&word, next_, sizeof(word));
+      const uint64_t stops = ~word & 0x8080808080808080ULL;
+      if (stops) {
+        const unsigned length = (__builtin_ctzll(stops) >> 3) + 1;
+        if (length < 8)
+          word &= (1ULL << (8 * length)) - 1;
+        word &= 0x7f7f7f7f7f7f7f7fULL;
+        word = ((word & 0x7f007f007f007f00ULL) >> 1) |
+               (word & 0x007f007f007f007fULL);
+        word = ((word & 0x3fff00003fff0000ULL) >> 2) |
+               (word & 0x00003fff00003fffULL);
+        word = ((word & 0x0fffffff00000000ULL) >> 4) |
+               (word & 0x000000000fffffffULL);
+        const unsigned shift = 64 - 7 * length;
+        *value = static_cast<int64_t>(word << shift) >> shift;
+        next_ += length;
+        return true;
+      }
+    }
+#endif
+    return DequeueBytes(value);
+  }
+
+  // Bytes not yet decoded.
+  size_t remaining() const { return end_ - next_; }
+
+ private:
+  bool DequeueBytes(int64_t* value) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      if (next_ == end_ || shift >= 64)
+        return false;
+      byte = *next_++;
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40))
+      result |= ~0ULL << shift;
+    *value = static_cast<int64_t>(result);
+    return true;
+  }
+
+  const uint8_t* next_;
+  const uint8_t* end_;
+};
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_SLEB128_H_
@@ -0,0 +1,119 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sleb128.h"
+
+#include <stdint.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+std::vector<uint8_t> Encode(const std::vector<int64_t>& values) {
+  Sleb128Encoder encoder;
+  for (size_t i = 0; i < values.size(); ++i)
+    encoder.Enqueue(values[i]);
+  std::vector<uint8_t> encoding;
+  encoder.GetEncoding(&encoding);
+  return encoding;
+}
+
+// The smallest and largest values that encode in |length| bytes, and
+// the values just beyond them, which need one more.
+std::vector<int64_t> ValuesOfLength(unsigned length) {
+  std::vector<int64_t> values;
+  if (length >= 10) {
+    values.push_back(INT64_MIN);
+    values.push_back(INT64_MAX);
+    return values;
+  }
+  const int64_t limit = 1LL << (7 * length - 1);
+  values.push_back(-limit);
+  values.push_back(limit - 1);
+  return values;
+}
+
+}  // namespace
+
+TEST(Sleb128, EncodedLengths) {
+  for (unsigned length = 1; length <= 10; ++length) {
+    const std::vector<int64_t> values = ValuesOfLength(length);
+    for (size_t i = 0; i < values.size(); ++i) {
+      EXPECT_EQ(length, Encode(std::vector<int64_t>(1, values[i])).size())
+          << values[i];
+      if (length < 10) {
+        const int64_t beyond = values[i] < 0 ? values[i] - 1 : values[i] + 1;
+        EXPECT_EQ(length + 1, Encode(std::vector<int64_t>(1, beyond)).size())
+            << beyond;
+      }
+    }
+  }
+}
+
+TEST(Sleb128, RoundTripsEveryLength) {
+  for (unsigned length = 1; length <= 10; ++length) {
+    const std::vector<int64_t> values = ValuesOfLength(length);
+    for (size_t i = 0; i < values.size(); ++i) {
+      // Padded, for the word-at-a-time path, then alone in the buffer, so
+      // that it is the last value and read a byte at a time.
+      std::vector<uint8_t> encoding = Encode(std::vector<int64_t>(1, values[i]));
+      const size_t size = encoding.size();
+      encoding.resize(size + 16, 0xff);
+      for (int padded = 1; padded >= 0; --padded) {
+        Sleb128Decoder decoder(encoding.data(), padded ? encoding.size() : size);
+        int64_t value = 0;
+        ASSERT_TRUE(decoder.Dequeue(&value)) << values[i];
+        EXPECT_EQ(values[i], value);
+        EXPECT_EQ(padded ? 16u : 0u, decoder.remaining());
+      }
+    }
+  }
+}
+
+TEST(Sleb128, RoundTripsToEndOfBuffer) {
+  std::vector<int64_t> values;
+  for (int64_t value = -300; value <= 300; value += 7)
+    values.push_back(value);
+  for (unsigned length = 1; length <= 10; ++length) {
+    const std::vector<int64_t> extremes = ValuesOfLength(length);
+    values.insert(values.end(), extremes.begin(), extremes.end());
+  }
+  values.push_back(0);
+  values.push_back(-1);
+  values.push_back(INT64_MIN);
+
+  const std::vector<uint8_t> encoding = Encode(values);
+  Sleb128Decoder decoder(encoding.data(), encoding.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    int64_t value = 0;
+    ASSERT_TRUE(decoder.Dequeue(&value)) << i;
+    EXPECT_EQ(values[i], value) << i;
+  }
+  EXPECT_EQ(0u, decoder.remaining());
+  int64_t value;
+  EXPECT_FALSE(decoder.Dequeue(&value));
+}
+
+TEST(Sleb128, RejectsTruncatedValue) {
+  const std::vector<uint8_t> encoding =
+      Encode(std::vector<int64_t>(1, INT64_MIN));
+  for (size_t size = 0; size < encoding.size(); ++size) {
+    Sleb128Decoder decoder(encoding.data(), size);
+    int64_t value;
+    EXPECT_FALSE(decoder.Dequeue(&value)) << size;
+  }
+}
+
+TEST(Sleb128, RejectsValueOverSixtyFourBits) {
+  std::vector<uint8_t> encoding(10, 0x80);
+  encoding.push_back(0x00);
+  encoding.resize(24, 0x00);
+  Sleb128Decoder decoder(encoding.data(), encoding.size());
+  int64_t value;
+  EXPECT_FALSE(decoder.Dequeue(&value));
+}
+
+}  // namespace relocation_packer
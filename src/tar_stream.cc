@@ -0,0 +1,517 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tar_stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_probe.h"
+#include "file_util.h"
+#include "unpack.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+static const size_t kBlockSize = 512;
+
+// Header field offsets and sizes, common to ustar and GNU formats.
+static const size_t kNameOffset = 0;
+static const size_t kNameSize = 100;
+static const size_t kSizeOffset = 124;
+static const size_t kSizeSize = 12;
+static const size_t kChecksumOffset = 148;
+static const size_t kChecksumSize = 8;
+static const size_t kTypeOffset = 156;
+static const size_t kPrefixOffset = 345;
+static const size_t kPrefixSize = 155;
+
+// Members in flight per worker thread.
+static const size_t kWindowPerJob = 4;
+
+// Members that are not conversion candidates are buffered in the window up
+// to this size; larger ones wait for the window to drain and are streamed.
+static const size_t kMaxBufferedPassThrough = 1024 * 1024;
+
+size_t PaddedSize(size_t size) {
+  return (size + kBlockSize - 1) / kBlockSize * kBlockSize;
+}
+
+bool IsZeroBlock(const uint8_t* block) {
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    if (block[i])
+      return false;
+  }
+  return true;
+}
+
+unsigned HeaderChecksum(const uint8_t* block) {
+  unsigned sum = 0;
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    const bool in_field = i >= kChecksumOffset &&
+                          i < kChecksumOffset + kChecksumSize;
+    sum += in_field ? ' ' : block[i];
+  }
+  return sum;
+}
+
+void SetHeaderChecksum(uint8_t* block) {
+  char field[kChecksumSize + 1];
+  snprintf(field, sizeof(field), "%06o", HeaderChecksum(block));
+  memcpy(block + kChecksumOffset, field, 7);
+  block[kChecksumOffset + 7] = ' ';
+}
+
+// Parse a numeric header field, octal or GNU base-256.
+bool ParseNumber(const uint8_t* field, size_t size, uint64_t* value) {
+  *value = 0;
+  if (field[0] & 0x80) {
+    for (size_t i = 1; i < size; ++i)
+      *value = (*value << 8) | field[i];
+    return true;
+  }
+  size_t i = 0;
+  while (i < size && field[i] == ' ')
+    ++i;
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i)
+    *value = (*value << 3) | (field[i] - '0');
+  return i == size || field[i] == ' ' || field[i] == '\0';
+}
+
+// Write a numeric header field, octal if it fits, else base-256.
+void FormatNumber(uint64_t value, uint8_t* field, size_t size) {
+  if (value < (1ull << (3 * (size - 1)))) {
+    for (size_t i = size - 1; i-- > 0; value >>= 3)
+      field[i] = '0' + (value & 7);
+    field[size - 1] = '\0';
+    return;
+  }
+  memset(field, 0, size);
+  field[0] = 0x80;
+  for (size_t i = size - 1; i > 0 && value; --i, value >>= 8)
+    field[i] = value & 0xff;
+}
+
+std::string HeaderName(const uint8_t* block) {
+  std::string name(reinterpret_cast<const char*>(block + kNameOffset),
+                   strnlen(reinterpret_cast<const char*>(block + kNameOffset),
+                           kNameSize));
+  const char* prefix = reinterpret_cast<const char*>(block + kPrefixOffset);
+  if (memcmp(block + 257, "ustar", 5) == 0 && prefix[0])
+    name = std::string(prefix, strnlen(prefix, kPrefixSize)) + "/" + name;
+  return name;
+}
+
+// A pax extended header is a sequence of "<length> <key>=<value>\n"
+// records, where <length> counts the whole record including itself.
+struct PaxRecord {
+  std::string key;
+  std::string value;
+};
+
+bool ParsePaxRecords(const std::string& data, std::vector<PaxRecord>* records) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    if (data[offset] == '\0')
+      break;
+    const size_t space = data.find(' ', offset);
+    if (space == std::string::npos)
+      return false;
+    const size_t length = strtoul(data.c_str() + offset, NULL, 10);
+    if (length == 0 || offset + length > data.size() ||
+        data[offset + length - 1] != '\n') {
+      return false;
+    }
+    const size_t equals = data.find('=', space);
+    if (equals == std::string::npos || equals >= offset + length)
+      return false;
+    PaxRecord record;
+    record.key = data.substr(space + 1, equals - space - 1);
+    record.value = data.substr(equals + 1, offset + length - equals - 2);
+    records->push_back(record);
+    offset += length;
+  }
+  return true;
+}
+
+std::string FormatPaxRecords(const std::vector<PaxRecord>& records) {
+  std::string data;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const std::string body =
+        " " + records[i].key + "=" + records[i].value + "\n";
+    // The length prefix counts its own digits; settle it by iteration.
+    size_t length = body.size();
+    while (std::to_string(length).size() + body.size() != length)
+      length = std::to_string(length).size() + body.size();
+    data += std::to_string(length) + body;
+  }
+  return data;
+}
+
+// One archive member: its header blocks, including any preceding pax or
+// GNU extension headers, and its data.
+struct TarMember {
+  TarMember() : pax_offset(std::string::npos), done(false) {}
+
+  std::string name;
+  std::vector<uint8_t> headers;
+  size_t pax_offset;
+  std::vector<uint8_t> data;
+  bool done;
+};
+
+class TarConverter {
+ public:
+  TarConverter(int in_fd, int out_fd, const UnpackOptions& options,
+               size_t jobs)
+      : in_fd_(in_fd), out_fd_(out_fd), options_(options),
+        members_(0), converted_(0), failed_(0), pool_(jobs) {}
+
+  bool Run();
+
+ private:
+  bool ReadBlock(uint8_t* block);
+  bool ReadData(size_t size, std::vector<uint8_t>* data);
+  bool SkipPadding(size_t size);
+  bool CopyData(size_t size);
+  void Enqueue(std::shared_ptr<TarMember> member);
+  void Convert(std::shared_ptr<TarMember> member);
+  bool WriteMember(const TarMember& member);
+  bool WriteCompleted(bool drain);
+  static bool ParsePaxHeader(const TarMember& member,
+                             uint64_t* pax_size,
+                             std::vector<PaxRecord>* records);
+  void UpdateSize(TarMember* member);
+
+  int in_fd_;
+  int out_fd_;
+  UnpackOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable completed_;
+  std::deque<std::shared_ptr<TarMember> > window_;
+
+  size_t members_;
+  size_t converted_;
+  size_t failed_;
+
+  // Declared last so that its destructor waits for running conversions
+  // before the state they use is destroyed.
+  WorkerPool pool_;
+};
+
+bool TarConverter::ReadBlock(uint8_t* block) {
+  return ReadFully(in_fd_, block, kBlockSize) ==
+         static_cast<ssize_t>(kBlockSize);
+}
+
+bool TarConverter::ReadData(size_t size, std::vector<uint8_t>* data) {
+  const size_t used = data->size();
+  data->resize(used + size);
+  return ReadFully(in_fd_, data->data() + used, size) ==
+         static_cast<ssize_t>(size);
+}
+
+bool TarConverter::SkipPadding(size_t size) {
+  uint8_t padding[kBlockSize];
+  const size_t bytes = PaddedSize(size) - size;
+  return ReadFully(in_fd_, padding, bytes) == static_cast<ssize_t>(bytes);
+}
+
+// Stream |size| data bytes and their padding from input to output.
+bool TarConverter::CopyData(size_t size) {
+  static const size_t kChunkSize = 256 * 1024;
+  std::vector<uint8_t> buffer(kChunkSize);
+  size_t remaining = PaddedSize(size);
+  while (remaining > 0) {
+    const size_t chunk = std::min(remaining, kChunkSize);
+    if (ReadFully(in_fd_, buffer.data(), chunk) !=
+        static_cast<ssize_t>(chunk)) {
+      return false;
+    }
+    if (!WriteFully(out_fd_, buffer.data(), chunk))
+      return false;
+    remaining -= chunk;
+  }
+  return true;
+}
+
+void TarConverter::Enqueue(std::shared_ptr<TarMember> member) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  window_.push_back(member);
+}
+
+void TarConverter::Convert(std::shared_ptr<TarMember> member) {
+  // Check first that any pax header can be rewritten, so that a member is
+  // either converted with every size updated or left exactly as it was.
+  uint64_t pax_size;
+  std::vector<PaxRecord> records;
+  const bool has_valid_pax =
+      member->pax_offset == std::string::npos ||
+      ParsePaxHeader(*member, &pax_size, &records);
+  LOG_IF(ERROR, !has_valid_pax) << member->name << ": malformed pax header";
+  const bool status = has_valid_pax &&
+                      UnpackImage(&member->data, member->name, options_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (status) {
+      UpdateSize(member.get());
+      ++converted_;
+    } else {
+      LOG(ERROR) << member->name << ": passed through unconverted";
+      ++failed_;
+    }
+    member->done = true;
+  }
+  completed_.notify_all();
+}
+
+// Set |pax_size| and |records| from the pax header of |member|, which
+// must have one.  Returns false if it is malformed.
+bool TarConverter::ParsePaxHeader(const TarMember& member,
+                                  uint64_t* pax_size,
+                                  std::vector<PaxRecord>* records) {
+  const uint8_t* pax_header = &member.headers[member.pax_offset];
+  if (!ParseNumber(pax_header + kSizeOffset, kSizeSize, pax_size) ||
+      member.pax_offset + kBlockSize + *pax_size > member.headers.size()) {
+    return false;
+  }
+  const std::string pax_data(
+      reinterpret_cast<const char*>(pax_header + kBlockSize), *pax_size);
+  return ParsePaxRecords(pax_data, records);
+}
+
+// Rewrite the size in the member's headers after conversion.  A pax "size"
+// record, if present, takes precedence and is rewritten too.  Any pax
+// header must already have been checked with ParsePaxHeader().
+void TarConverter::UpdateSize(TarMember* member) {
+  const uint64_t size = member->data.size();
+  uint8_t* header = &member->headers[member->headers.size() - kBlockSize];
+  FormatNumber(size, header + kSizeOffset, kSizeSize);
+  SetHeaderChecksum(header);
+
+  if (member->pax_offset == std::string::npos)
+    return;
+
+  uint64_t pax_size;
+  std::vector<PaxRecord> records;
+  CHECK(ParsePaxHeader(*member, &pax_size, &records));
+  uint8_t* pax_header = &member->headers[member->pax_offset];
+
+  bool has_size = false;
+  for (size_t i = 0; i < records.size(); ++i) {
+    if (records[i].key == "size") {
+      records[i].value = std::to_string(size);
+      has_size = true;
+    }
+  }
+  if (!has_size)
+    return;
+
+  // Splice in the rewritten pax data, which may change length.
+  const std::string new_pax_data = FormatPaxRecords(records);
+  std::vector<uint8_t> new_block(pax_header, pax_header + kBlockSize);
+  FormatNumber(new_pax_data.size(), &new_block[kSizeOffset], kSizeSize);
+  SetHeaderChecksum(&new_block[0]);
+  new_block.insert(new_block.end(), new_pax_data.begin(), new_pax_data.end());
+  new_block.resize(kBlockSize + PaddedSize(new_pax_data.size()));
+
+  std::vector<uint8_t>& headers = member->headers;
+  const size_t old_end =
+      member->pax_offset + kBlockSize + PaddedSize(pax_size);
+  headers.erase(headers.begin() + member->pax_offset,
+                headers.begin() + old_end);
+  headers.insert(headers.begin() + member->pax_offset,
+                 new_block.begin(), new_block.end());
+}
+
+bool TarConverter::WriteMember(const TarMember& member) {
+  static const uint8_t kPadding[kBlockSize] = {};
+  return WriteFully(out_fd_, member.headers.data(), member.headers.size()) &&
+         WriteFully(out_fd_, member.data.data(), member.data.size()) &&
+         WriteFully(out_fd_, kPadding,
+                    PaddedSize(member.data.size()) - member.data.size());
+}
+
+// Write members from the front of the window that have completed.  If
+// |drain|, wait for and write every member.
+bool TarConverter::WriteCompleted(bool drain) {
+  for (;;) {
+    std::shared_ptr<TarMember> member;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (window_.empty())
+        return true;
+      if (drain)
+        completed_.wait(lock, [this] { return window_.front()->done; });
+      if (!window_.front()->done)
+        return true;
+      member = window_.front();
+      window_.pop_front();
+    }
+    if (!WriteMember(*member)) {
+      LOG(ERROR) << "Failed to write tar output";
+      return false;
+    }
+  }
+}
+
+bool TarConverter::Run() {
+  const size_t window_limit = kWindowPerJob * pool_.size();
+  std::shared_ptr<TarMember> member(new TarMember);
+  uint8_t block[kBlockSize];
+
+  for (;;) {
+    if (!ReadBlock(block)) {
+      LOG(ERROR) << "Truncated tar stream";
+      return false;
+    }
+
+    if (IsZeroBlock(block)) {
+      // End of archive.  Copy the end marker and any trailing padding.
+      if (!WriteCompleted(true) || !WriteFully(out_fd_, block, kBlockSize))
+        return false;
+      std::vector<uint8_t> trailer;
+      if (!ReadToEnd(in_fd_, &trailer) ||
+          !WriteFully(out_fd_, trailer.data(), trailer.size())) {
+        return false;
+      }
+      break;
+    }
+
+    const unsigned stored_checksum = strtoul(
+        reinterpret_cast<char*>(block + kChecksumOffset), NULL, 8);
+    uint64_t size;
+    if (stored_checksum != HeaderChecksum(block) ||
+        !ParseNumber(block + kSizeOffset, kSizeSize, &size)) {
+      LOG(ERROR) << "Invalid tar header";
+      return false;
+    }
+
+    const char type = block[kTypeOffset];
+    member->headers.insert(member->headers.end(), block, block + kBlockSize);
+
+    // Extension headers describe the next member; keep them with it.
+    if (type == 'x' || type == 'L' || type == 'K') {
+      const size_t data_offset = member->headers.size();
+      if (!ReadData(PaddedSize(size), &member->headers)) {
+        LOG(ERROR) << "Truncated tar stream";
+        return false;
+      }
+      const char* data =
+          reinterpret_cast<char*>(&member->headers[data_offset]);
+      if (type == 'x') {
+        member->pax_offset = data_offset - kBlockSize;
+        std::vector<PaxRecord> records;
+        if (ParsePaxRecords(std::string(data, size), &records)) {
+          for (size_t i = 0; i < records.size(); ++i) {
+            if (records[i].key == "path")
+              member->name = records[i].value;
+          }
+        }
+      } else if (type == 'L') {
+        member->name = std::string(data, strnlen(data, size));
+      }
+      continue;
+    }
+
+    // A pax "size" record overrides the ustar size of the next member.
+    if (member->pax_offset != std::string::npos) {
+      const uint8_t* pax_header = &member->headers[member->pax_offset];
+      uint64_t pax_size;
+      ParseNumber(pax_header + kSizeOffset, kSizeSize, &pax_size);
+      std::vector<PaxRecord> records;
+      ParsePaxRecords(std::string(reinterpret_cast<const char*>(
+                          pax_header + kBlockSize), pax_size), &records);
+      for (size_t i = 0; i < records.size(); ++i) {
+        if (records[i].key == "size")
+          size = strtoull(records[i].value.c_str(), NULL, 10);
+      }
+    }
+
+    if (member->name.empty())
+      member->name = HeaderName(block);
+    ++members_;
+
+    // Candidates are regular files starting with the ELF magic.  Read the
+    // first block to find out.
+    const bool is_regular = type == '0' || type == '\0' || type == '7';
+    const size_t peek = is_regular ? std::min<uint64_t>(size, kBlockSize) : 0;
+    if (!ReadData(peek, &member->data)) {
+      LOG(ERROR) << "Truncated tar stream";
+      return false;
+    }
+    const bool is_elf = peek >= SELFMAG &&
+                        memcmp(member->data.data(), ELFMAG, SELFMAG) == 0;
+
+    if (!is_elf && size > kMaxBufferedPassThrough) {
+      // Large pass-through member: drain, then stream the rest.
+      if (!WriteCompleted(true) ||
+          !WriteFully(out_fd_, member->headers.data(),
+                      member->headers.size()) ||
+          !WriteFully(out_fd_, member->data.data(), member->data.size()) ||
+          !CopyData(size - peek)) {
+        LOG(ERROR) << member->name << ": failed to copy tar member";
+        return false;
+      }
+      member.reset(new TarMember);
+      continue;
+    }
+
+    if (!ReadData(size - peek, &member->data) || !SkipPadding(size)) {
+      LOG(ERROR) << "Truncated tar stream";
+      return false;
+    }
+
+    ElfProbe probe;
+    const bool convert = is_elf &&
+        ProbeElfImage(member->data.data(), member->data.size(), &probe) &&
+        HasPackedRelocations(probe);
+    VLOG(1) << member->name << (convert ? ": converting" : ": passing");
+
+    // Bound the reorder window before adding to it.
+    for (;;) {
+      if (!WriteCompleted(false))
+        return false;
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (window_.size() < window_limit)
+        break;
+      completed_.wait(lock, [this] { return window_.front()->done; });
+    }
+
+    member->done = !convert;
+    Enqueue(member);
+    if (convert)
+      pool_.Post([this, member] { Convert(member); });
+    member.reset(new TarMember);
+  }
+
+  LOG(INFO) << "Members          : " << members_;
+  LOG(INFO) << "Converted        : " << converted_;
+  LOG_IF(INFO, failed_ > 0) << "Failed           : " << failed_;
+  return failed_ == 0;
+}
+
+}  // namespace
+
+bool UnpackTarStream(int in_fd,
+                     int out_fd,
+                     const UnpackOptions& options,
+                     size_t jobs) {
+  TarConverter converter(in_fd, out_fd, options, jobs);
+  return converter.Run();
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,41 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Streaming conversion of shared objects inside a tar archive.
+//
+// Reads a ustar, GNU or pax tar stream sequentially and writes a tar stream
+// with the same members in the same order.  Regular file members that are
+// shared objects with SHT_RELR relocations are converted in memory on a
+// worker pool; everything else, including extension headers and the
+// end-of-archive padding, is copied byte for byte.  Converted members get
+// updated size fields (ustar, base-256 or pax "size" record) and header
+// checksums.
+//
+// Conversions complete out of order but are written in order through a
+// bounded reorder window, so memory use is limited to a few members per
+// worker.  Large members that are not candidates are streamed straight
+// through once the window drains, rather than buffered.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_TAR_STREAM_H_
+#define TOOLS_RELOCATION_PACKER_SRC_TAR_STREAM_H_
+
+#include <stddef.h>
+
+#include "unpack.h"
+
+namespace relocation_packer {
+
+// Convert the tar stream read from |in_fd|, writing the result to |out_fd|.
+// Neither descriptor needs to be seekable.  Returns false if the input is
+// not a valid tar stream, on I/O error, or if any member failed to convert;
+// members that fail are passed through unchanged.
+// |jobs| is the number of conversion threads, zero for one per CPU.
+bool UnpackTarStream(int in_fd,
+                     int out_fd,
+                     const UnpackOptions& options,
+                     size_t jobs);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_TAR_STREAM_H_
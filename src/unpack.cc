@@ -0,0 +1,356 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "unpack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf_file.h"
+#include "elf_probe.h"
+#include "elf_traits.h"
+#include "file_util.h"
+#include "metrics.h"
+
+namespace relocation_packer {
+
+// Prelink |elf_file| as |options| direct, at the base the prelink map gives
+// |path|.  Returns false if the map does not list it.
+template <typename ELF>
+static bool SetUpPrelink(const std::string& path,
+                         const UnpackOptions& options,
+                         ElfFile<ELF>* elf_file) {
+  if (!options.prelink)
+    return true;
+  uint64_t base;
+  if (!options.prelink->FindBase(path, &base)) {
+    LOG(ERROR) << path << ": not in the prelink map";
+    return false;
+  }
+  elf_file->SetPrelink(options.prelink, base);
+  return true;
+}
+
+template <typename ELF>
+static bool UnpackTyped(int fd,
+                        const std::string& name,
+                        const UnpackOptions& options,
+                        LayoutReport* report) {
+  ElfFile<ELF> elf_file(fd);
+  elf_file.SetOutputFormat(options.output_format);
+  elf_file.SetDebugSections(options.debug_sections, name + ".debug");
+  elf_file.SetLimits(options.limits);
+  elf_file.SetWriteThreads(options.write_threads);
+  elf_file.SetBlockSize(options.block_size);
+  if (!SetUpPrelink(name, options, &elf_file))
+    return false;
+  if (report)
+    elf_file.SetDryRun(report);
+  return elf_file.UnpackRelocations();
+}
+
+// Helper for UnpackFile() and DryRunFile().  Convert, or if |report| is
+// not NULL only plan the conversion.
+static bool UnpackOrDryRun(int fd,
+                           const std::string& name,
+                           const UnpackOptions& options,
+                           LayoutReport* report) {
+  // We need to detect elf class in order to create
+  // correct implementation
+  uint8_t e_ident[EI_NIDENT];
+  if (TEMP_FAILURE_RETRY(pread(fd, e_ident, EI_NIDENT, 0)) != EI_NIDENT) {
+    LOG(ERROR) << name << ": failed to read elf header:" << strerror(errno);
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) != 0) {
+    LOG(ERROR) << name << ": lseek to 0 failed:" << strerror(errno);
+    return false;
+  }
+
+  bool status = false;
+
+  if (e_ident[EI_CLASS] == ELFCLASS32) {
+    status = UnpackTyped<ELF32_traits>(fd, name, options, report);
+  } else if (e_ident[EI_CLASS] == ELFCLASS64) {
+    status = UnpackTyped<ELF64_traits>(fd, name, options, report);
+  } else {
+    LOG(ERROR) << name << ": unknown ELFCLASS: " << e_ident[EI_CLASS];
+    return false;
+  }
+
+  if (!status) {
+    LOG(ERROR) << name << ": failed to pack/unpack file";
+    return false;
+  }
+  return true;
+}
+
+bool UnpackFile(int fd, const std::string& name, const UnpackOptions& options) {
+  struct stat before;
+  struct stat after;
+  const uint64_t bytes_read = fstat(fd, &before) == 0 ? before.st_size : 0;
+  const bool status = UnpackOrDryRun(fd, name, options, NULL);
+  const uint64_t bytes_written =
+      status && fstat(fd, &after) == 0 ? after.st_size : 0;
+  Metrics::AddConversion(status, bytes_read, bytes_written);
+  return status;
+}
+
+bool DryRunFile(int fd,
+                const std::string& name,
+                const UnpackOptions& options,
+                LayoutReport* report) {
+  return UnpackOrDryRun(fd, name, options, report);
+}
+
+bool ParseOutputFormat(const std::string& name, output_format_t* format) {
+  static const struct {
+    const char* name;
+    output_format_t format;
+  } kFormats[] = {
+    {"rela", EXPAND_RELOCATIONS},
+    {"relacount", EXPAND_RELATIVE_FIRST},
+    {"aps2", ANDROID_PACKED_RELOCATIONS},
+    {"stub", RELOCATION_STUB},
+  };
+  for (size_t i = 0; i < sizeof(kFormats) / sizeof(kFormats[0]); ++i) {
+    if (name == kFormats[i].name) {
+      *format = kFormats[i].format;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Helper for UnpackVariantsTyped().  Write one variant of the file |path|
+// open on |in_fd|, whose status is |input|, taking or leaving relocations
+// in |decoded|.
+template <typename ELF>
+static bool UnpackVariant(const std::string& path,
+                          int in_fd,
+                          const struct stat& input,
+                          const OutputVariant& variant,
+                          const UnpackOptions& options,
+                          DecodedRelocations<ELF>* decoded) {
+  std::string temporary = variant.path + ".XXXXXX";
+  const int fd = mkostemp(&temporary[0], O_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << variant.path << ": " << strerror(errno);
+    return false;
+  }
+
+  bool status = fchmod(fd, input.st_mode & 07777) == 0 &&
+                CopyFileRange(in_fd, 0, fd, 0, input.st_size);
+  if (!status)
+    LOG(ERROR) << variant.path << ": copy failed: " << strerror(errno);
+
+  if (status) {
+    ElfFile<ELF> elf_file(fd);
+    elf_file.SetOutputFormat(variant.format);
+    elf_file.SetDebugSections(options.debug_sections,
+                              variant.path + ".debug");
+    elf_file.SetLimits(options.limits);
+    elf_file.SetWriteThreads(options.write_threads);
+    elf_file.SetBlockSize(options.block_size);
+    elf_file.SetDecodedRelocations(decoded);
+    status = SetUpPrelink(path, options, &elf_file) &&
+             elf_file.UnpackRelocations();
+    if (!status)
+      LOG(ERROR) << variant.path << ": failed to pack/unpack file";
+  }
+
+  struct stat output;
+  status = status && fstat(fd, &output) == 0 && fsync(fd) == 0;
+  status = close(fd) == 0 && status;
+  if (status && rename(temporary.c_str(), variant.path.c_str()) != 0) {
+    LOG(ERROR) << variant.path << ": " << strerror(errno);
+    status = false;
+  }
+  if (!status)
+    unlink(temporary.c_str());
+  Metrics::AddConversion(status, input.st_size, status ? output.st_size : 0);
+  return status;
+}
+
+template <typename ELF>
+static bool UnpackVariantsTyped(const std::string& path,
+                                int in_fd,
+                                const struct stat& input,
+                                const std::vector<OutputVariant>& variants,
+                                const UnpackOptions& options) {
+  DecodedRelocations<ELF> decoded;
+  bool status = true;
+  for (size_t i = 0; i < variants.size(); ++i) {
+    status = UnpackVariant<ELF>(path, in_fd, input, variants[i], options,
+                                &decoded) && status;
+  }
+  return status;
+}
+
+bool UnpackVariants(const std::string& path,
+                    const std::vector<OutputVariant>& variants,
+                    const UnpackOptions& options) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat input;
+  if (fd == -1 || fstat(fd, &input) != 0) {
+    LOG(ERROR) << path << ": " << strerror(errno);
+    if (fd != -1)
+      close(fd);
+    return false;
+  }
+
+  // Every variant starts from this file, so check once that there is
+  // something to convert.
+  ElfProbe probe;
+  bool status = false;
+  if (!ProbeElfFile(fd, &probe) || !HasPackedRelocations(probe)) {
+    LOG(ERROR) << path << ": not a shared object with packed relocations";
+  } else if (probe.file_class == ELFCLASS32) {
+    status = UnpackVariantsTyped<ELF32_traits>(path, fd, input, variants,
+                                                options);
+  } else if (probe.file_class == ELFCLASS64) {
+    status = UnpackVariantsTyped<ELF64_traits>(path, fd, input, variants,
+                                                options);
+  } else {
+    LOG(ERROR) << path << ": unknown ELFCLASS: " << probe.file_class;
+  }
+  close(fd);
+  return status;
+}
+
+// Helper for WriteLayoutReport().  Format one section or segment line.
+static void FormatLayoutEntry(const LayoutEntry& entry, std::ostream* out) {
+  char line[160];
+  if (entry.added) {
+    snprintf(line, sizeof(line), "  %-24s %10s %10s -> 0x%08" PRIx64
+             " 0x%08" PRIx64 "  added\n", entry.name.c_str(), "", "",
+             entry.new_offset, entry.new_size);
+  } else if (entry.removed) {
+    snprintf(line, sizeof(line), "  %-24s 0x%08" PRIx64 " 0x%08" PRIx64
+             " -> %10s %10s  removed\n", entry.name.c_str(), entry.old_offset,
+             entry.old_size, "", "");
+  } else {
+    const bool moved = entry.new_offset != entry.old_offset;
+    const bool resized = entry.new_size != entry.old_size;
+    snprintf(line, sizeof(line), "  %-24s 0x%08" PRIx64 " 0x%08" PRIx64
+             " -> 0x%08" PRIx64 " 0x%08" PRIx64 "%s%s\n", entry.name.c_str(),
+             entry.old_offset, entry.old_size, entry.new_offset,
+             entry.new_size, moved ? "  moved" : "",
+             resized ? "  resized" : "");
+  }
+  *out << line;
+}
+
+bool WriteLayoutReport(const std::string& name,
+                       const LayoutReport& report,
+                       int fd) {
+  std::ostringstream out;
+  out << name << ": "
+      << (report.violations.empty() ? "ok" : "INVALID") << "\n";
+  out << "  file size " << report.old_file_size << " -> "
+      << report.new_file_size << " ("
+      << (report.new_file_size >= report.old_file_size ? "+" : "-")
+      << (report.new_file_size >= report.old_file_size
+              ? report.new_file_size - report.old_file_size
+              : report.old_file_size - report.new_file_size)
+      << " bytes), " << report.moved_bytes << " bytes moved\n";
+  if (report.block_size) {
+    out << "  " << report.changed_blocks << " of " << report.block_count
+        << " " << report.block_size << " byte blocks changed\n";
+  }
+
+  out << "sections:                    offset       size ->     offset"
+         "       size\n";
+  for (size_t i = 0; i < report.sections.size(); ++i)
+    FormatLayoutEntry(report.sections[i], &out);
+  out << "segments:                    offset     filesz ->     offset"
+         "     filesz\n";
+  for (size_t i = 0; i < report.segments.size(); ++i)
+    FormatLayoutEntry(report.segments[i], &out);
+
+  for (size_t i = 0; i < report.violations.size(); ++i)
+    out << "violation: " << report.violations[i] << "\n";
+
+  const std::string text = out.str();
+  return WriteFully(fd, text.data(), text.size());
+}
+
+bool UnpackImage(std::vector<uint8_t>* image,
+                 const std::string& name,
+                 const UnpackOptions& options) {
+  const int fd = memfd_create("relr-unpack", MFD_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << name << ": memfd_create failed: " << strerror(errno);
+    return false;
+  }
+
+  std::vector<uint8_t> converted;
+  const bool status =
+      WriteFully(fd, image->data(), image->size()) &&
+      UnpackFile(fd, name, options) &&
+      ReadWholeFile(fd, &converted);
+  close(fd);
+
+  if (status)
+    image->swap(converted);
+  return status;
+}
+
+bool UnpackStream(int in_fd,
+                  int out_fd,
+                  const std::string& name,
+                  const UnpackOptions& options) {
+  std::vector<uint8_t> image;
+  if (!ReadToEnd(in_fd, &image)) {
+    LOG(ERROR) << name << ": read failed: " << strerror(errno);
+    return false;
+  }
+
+  ElfProbe probe;
+  if (!ProbeElfImage(image.data(), image.size(), &probe) ||
+      !HasPackedRelocations(probe)) {
+    LOG(INFO) << name << ": no packed relocations, copying unchanged";
+    if (!WriteFully(out_fd, image.data(), image.size())) {
+      LOG(ERROR) << name << ": write failed: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  const int fd = memfd_create("relr-unpack", MFD_CLOEXEC);
+  if (fd == -1) {
+    LOG(ERROR) << name << ": memfd_create failed: " << strerror(errno);
+    return false;
+  }
+
+  // Release the input buffer before libelf loads its own copy, and send
+  // the result from the memory file without another copy in user space.
+  bool status = WriteFully(fd, image.data(), image.size());
+  std::vector<uint8_t>().swap(image);
+  status = status && UnpackFile(fd, name, options);
+
+  struct stat converted;
+  if (status && (fstat(fd, &converted) != 0 ||
+                 !SendFully(fd, 0, out_fd, converted.st_size))) {
+    LOG(ERROR) << name << ": write failed: " << strerror(errno);
+    status = false;
+  }
+  close(fd);
+  return status;
+}
+
+}  // namespace relocation_packer
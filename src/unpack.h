@@ -0,0 +1,118 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Conversion entry points shared by the command line modes.
+//
+// UnpackFile() converts a shared object open for read/write, choosing the
+// 32 or 64 bit ElfFile from the ELF class.  UnpackImage() converts an
+// in-memory image; libelf can only write through a file descriptor, so the
+// image is staged in an anonymous memory file rather than on disk.
+// UnpackStream() does the same for a file read from one descriptor and
+// written to another, neither of which need be seekable.
+// DryRunFile() converts only in memory and reports the layout that
+// UnpackFile() would write, for a file that may be open read-only.
+// UnpackVariants() converts one file to several output formats, decoding
+// its relocations once for all of them.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_UNPACK_H_
+#define TOOLS_RELOCATION_PACKER_SRC_UNPACK_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "elf_file.h"
+
+namespace relocation_packer {
+
+// Options applied to every ElfFile a conversion creates.
+struct UnpackOptions {
+  UnpackOptions()
+      : output_format(EXPAND_RELOCATIONS),
+        debug_sections(KEEP_DEBUG_SECTIONS),
+        write_threads(1),
+        block_size(0),
+        prelink(NULL) {}
+
+  output_format_t output_format;
+  ConversionLimits limits;
+
+  // Split debug information goes to the output's path with ".debug"
+  // appended, so SPLIT_DEBUG_SECTIONS suits only conversions of named
+  // files, not of archive members or streams.
+  debug_sections_t debug_sections;
+
+  // Threads writing each output; see ElfFile::SetWriteThreads().
+  size_t write_threads;
+
+  // Storage block size to align holes to; see ElfFile::SetBlockSize().
+  size_t block_size;
+
+  // Libraries to prelink against, or NULL.  Each file converted must be in
+  // the map, looked up by its own path, so prelinking suits only
+  // conversions of named files.  See ElfFile::SetPrelink().
+  const PrelinkScope* prelink;
+};
+
+// One output of UnpackVariants(): the file to write and its format.
+struct OutputVariant {
+  std::string path;
+  output_format_t format;
+};
+
+// Parse an output format name: rela, relacount, aps2 or stub.  Returns
+// false if |name| is none of these.
+bool ParseOutputFormat(const std::string& name, output_format_t* format);
+
+// Unpack relocations in the shared object open on |fd|, which must be open
+// for read/write and positioned anywhere.  Returns true on success.
+// |name| is used only for log messages.
+bool UnpackFile(int fd, const std::string& name, const UnpackOptions& options);
+
+// Plan the conversion of the shared object open on |fd| without writing
+// to it; |fd| need only be open for reading.  On success |report| holds
+// the layout UnpackFile() would produce and true is returned.
+bool DryRunFile(int fd,
+                const std::string& name,
+                const UnpackOptions& options,
+                LayoutReport* report);
+
+// Convert the shared object at |path| to each of |variants|, which is left
+// unchanged.  Each output starts as a copy of |path| made with
+// copy_file_range, so that unchanged ranges may share extents with it, is
+// converted in place, and atomically replaces the variant's path with the
+// input's mode.  Each variant parses its own copy, since libelf converts a
+// copy in place; only the decode of .rel(a).dyn and .relr.dyn is shared,
+// done by the first variant that expands it and reused by the rest.
+// |options.output_format| is ignored.  Returns true if every variant was
+// written.
+bool UnpackVariants(const std::string& path,
+                    const std::vector<OutputVariant>& variants,
+                    const UnpackOptions& options);
+
+// Write |report| for the file |name| to |fd| as text.  Returns false on
+// write error.
+bool WriteLayoutReport(const std::string& name,
+                       const LayoutReport& report,
+                       int fd);
+
+// Unpack relocations in an in-memory shared object.  On success |image| is
+// replaced with the converted file and true is returned.  On failure
+// |image| is unchanged.
+bool UnpackImage(std::vector<uint8_t>* image,
+                 const std::string& name,
+                 const UnpackOptions& options);
+
+// Read a shared object from |in_fd| to end of file, convert it in memory,
+// and write the result sequentially to |out_fd|.  Input that is not a
+// shared object with packed relocations is copied through unchanged.
+// Returns true on success; on failure nothing has been written.
+bool UnpackStream(int in_fd,
+                  int out_fd,
+                  const std::string& name,
+                  const UnpackOptions& options);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_UNPACK_H_
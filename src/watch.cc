@@ -0,0 +1,289 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "debug.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+// Quiet period after the last event for a path before it is converted.
+static const int kWatchDebounceMs = 20;
+
+static const uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                   IN_DONT_FOLLOW | IN_EXCL_UNLINK |
+                                   IN_ONLYDIR;
+
+typedef std::chrono::steady_clock Clock;
+
+class Watcher {
+ public:
+  Watcher(const UnpackOptions& options, size_t jobs)
+      : options_(options), jobs_(jobs), inotify_fd_(-1), signal_fd_(-1),
+        converted_(0), failed_(0) {}
+  ~Watcher() {
+    pool_.reset();
+    if (inotify_fd_ != -1)
+      close(inotify_fd_);
+    if (signal_fd_ != -1)
+      close(signal_fd_);
+  }
+
+  bool Run(const std::string& directory);
+
+ private:
+  bool AddWatch(const std::string& directory, bool queue_files);
+  void HandleEvents(const uint8_t* buffer, size_t size);
+  void Queue(const std::string& path);
+  int Dispatch();
+  void Convert(const std::string& path, Clock::time_point queued);
+
+  UnpackOptions options_;
+  size_t jobs_;
+  int inotify_fd_;
+  int signal_fd_;
+
+  // Watched directories by watch descriptor.
+  std::map<int, std::string> directories_;
+
+  // Paths waiting for their quiet period to end, with the time of their
+  // first and latest events.
+  struct Pending {
+    Clock::time_point first;
+    Clock::time_point last;
+  };
+  std::map<std::string, Pending> pending_;
+
+  // Shared with the worker threads.
+  std::mutex mutex_;
+  std::set<std::string> in_flight_;
+  size_t converted_;
+  size_t failed_;
+
+  std::unique_ptr<WorkerPool> pool_;
+};
+
+bool Watcher::AddWatch(const std::string& directory, bool queue_files) {
+  const int wd = inotify_add_watch(inotify_fd_, directory.c_str(),
+                                   kWatchMask);
+  if (wd == -1) {
+    LOG(ERROR) << directory << ": " << strerror(errno);
+    return false;
+  }
+  directories_[wd] = directory;
+  VLOG(1) << directory << ": watching";
+
+  // Watch subdirectories too.  Files in a directory that appeared after
+  // watching started may have been written before its watch was added, so
+  // queue those.
+  DIR* dir = opendir(directory.c_str());
+  if (!dir) {
+    LOG(ERROR) << directory << ": " << strerror(errno);
+    return false;
+  }
+  std::vector<std::string> subdirectories;
+  while (const dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    struct stat status;
+    if (fstatat(dirfd(dir), entry->d_name, &status,
+                AT_SYMLINK_NOFOLLOW) != 0) {
+      continue;
+    }
+    const std::string path = directory + "/" + entry->d_name;
+    if (S_ISDIR(status.st_mode))
+      subdirectories.push_back(path);
+    else if (queue_files && S_ISREG(status.st_mode))
+      Queue(path);
+  }
+  closedir(dir);
+
+  bool status = true;
+  for (size_t i = 0; i < subdirectories.size(); ++i)
+    status = AddWatch(subdirectories[i], queue_files) && status;
+  return status;
+}
+
+void Watcher::Queue(const std::string& path) {
+  const Clock::time_point now = Clock::now();
+  std::map<std::string, Pending>::iterator it = pending_.find(path);
+  if (it == pending_.end()) {
+    Pending pending = {now, now};
+    pending_[path] = pending;
+  } else {
+    it->second.last = now;
+  }
+}
+
+void Watcher::HandleEvents(const uint8_t* buffer, size_t size) {
+  size_t offset = 0;
+  while (offset + sizeof(inotify_event) <= size) {
+    const inotify_event* event =
+        reinterpret_cast<const inotify_event*>(buffer + offset);
+    offset += sizeof(inotify_event) + event->len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      LOG(WARNING) << "Event queue overflowed; some files may have been "
+                   << "missed, run a batch to catch up";
+      continue;
+    }
+    if (event->mask & IN_IGNORED) {
+      directories_.erase(event->wd);
+      continue;
+    }
+
+    std::map<int, std::string>::const_iterator it =
+        directories_.find(event->wd);
+    if (it == directories_.end() || event->len == 0)
+      continue;
+    const std::string path = it->second + "/" + event->name;
+
+    if (event->mask & IN_ISDIR) {
+      if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        AddWatch(path, true);
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+      Queue(path);
+    }
+  }
+}
+
+// Post every path whose quiet period has ended, and return the time in
+// milliseconds until the next one will, or -1 if none are pending.
+int Watcher::Dispatch() {
+  const Clock::time_point now = Clock::now();
+  const Clock::duration debounce =
+      std::chrono::milliseconds(kWatchDebounceMs);
+  Clock::duration next = Clock::duration::max();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::string, Pending>::iterator it = pending_.begin();
+  while (it != pending_.end()) {
+    const Clock::time_point due = it->second.last + debounce;
+    if (due > now || in_flight_.count(it->first)) {
+      // Not quiet yet, or still being converted after an earlier event;
+      // convert again once that finishes.
+      next = std::min(next, due > now ? due - now : debounce);
+      ++it;
+      continue;
+    }
+
+    const std::string path = it->first;
+    const Clock::time_point queued = it->second.first;
+    in_flight_.insert(path);
+    pool_->Post([this, path, queued] { Convert(path, queued); });
+    pending_.erase(it++);
+  }
+
+  if (next == Clock::duration::max())
+    return -1;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(next).count() +
+         1;
+}
+
+void Watcher::Convert(const std::string& path, Clock::time_point queued) {
+  // Temporary files, including our own, are gone by the time they are
+  // quiet; so are files deleted straight after writing.
+  struct stat status;
+  BatchResult result;
+  result.status = BATCH_SKIPPED;
+  if (lstat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+    result = UnpackBatchFile(path, options_, NULL, true);
+
+  if (result.status == BATCH_CONVERTED) {
+    const long latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - queued).count();
+    LOG(INFO) << path << ": converted, " << latency << " ms after write";
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  in_flight_.erase(path);
+  converted_ += result.status == BATCH_CONVERTED;
+  failed_ += result.status == BATCH_FAILED;
+}
+
+bool Watcher::Run(const std::string& directory) {
+  // Block the signals before starting worker threads, so that they are
+  // delivered only through the signal descriptor.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0 ||
+      (signal_fd_ = signalfd(-1, &signals, SFD_CLOEXEC)) == -1 ||
+      (inotify_fd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+    LOG(ERROR) << "watch setup failed: " << strerror(errno);
+    return false;
+  }
+  pool_.reset(new WorkerPool(jobs_));
+
+  if (!AddWatch(directory, false))
+    return false;
+  LOG(INFO) << "Watching         : " << directory << ", "
+            << directories_.size() << " directories";
+
+  // Room for many events; each is at most NAME_MAX bytes of name.
+  alignas(inotify_event) uint8_t buffer[64 * (sizeof(inotify_event) +
+                                              NAME_MAX + 1)];
+  int timeout = -1;
+  bool status = true;
+  for (;;) {
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {signal_fd_, POLLIN, 0}};
+    if (poll(fds, 2, timeout) == -1 && errno != EINTR) {
+      LOG(ERROR) << "poll failed: " << strerror(errno);
+      status = false;
+      break;
+    }
+    if (fds[1].revents & POLLIN)
+      break;
+
+    for (;;) {
+      const ssize_t bytes = read(inotify_fd_, buffer, sizeof(buffer));
+      if (bytes <= 0)
+        break;
+      HandleEvents(buffer, bytes);
+    }
+    timeout = Dispatch();
+  }
+
+  LOG(INFO) << "Stopping, waiting for conversions in progress";
+  pool_->Wait();
+  LOG(INFO) << "Converted        : " << converted_;
+  LOG_IF(ERROR, failed_ > 0) << "Failed           : " << failed_;
+  return status && failed_ == 0;
+}
+
+}  // namespace
+
+bool WatchDirectory(const std::string& directory,
+                    const UnpackOptions& options,
+                    size_t jobs) {
+  Watcher watcher(options, jobs);
+  return watcher.Run(directory);
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,38 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Continuous conversion of files as they appear in a directory tree.
+//
+// Watches the tree with inotify for files closed after writing or moved
+// into place, including in subdirectories created later.  Events for the
+// same path are coalesced until it has been quiet for kWatchDebounceMs, so
+// a file written in several steps is converted once.  Each new file is
+// probed for packed relocations and converted on a worker pool, in a
+// temporary copy renamed over the original so that readers never see a
+// partly converted file.  The same path is never converted twice at once.
+//
+// Files already in the tree when watching starts are left alone; convert
+// them with a batch first.  Runs until SIGINT or SIGTERM, then waits for
+// conversions in progress.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_WATCH_H_
+#define TOOLS_RELOCATION_PACKER_SRC_WATCH_H_
+
+#include <stddef.h>
+#include <string>
+
+#include "unpack.h"
+
+namespace relocation_packer {
+
+// Watch |directory| and convert new files until interrupted.  |jobs| is
+// the number of conversion threads, zero for one per CPU.  Returns false
+// if the watch could not be set up or any conversion failed.
+bool WatchDirectory(const std::string& directory,
+                    const UnpackOptions& options,
+                    size_t jobs);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_WATCH_H_
@@ -0,0 +1,76 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "worker_pool.h"
+
+#include <unistd.h>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "metrics.h"
+
+namespace relocation_packer {
+
+WorkerPool::WorkerPool(size_t threads) : running_(0), stopping_(false) {
+  if (threads == 0)
+    threads = DefaultThreadCount();
+  for (size_t i = 0; i < threads; ++i)
+    threads_.push_back(std::thread(&WorkerPool::Run, this));
+  Metrics::AddWorkers(threads);
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_ready_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i)
+    threads_[i].join();
+  Metrics::AddWorkers(-static_cast<int>(threads_.size()));
+}
+
+void WorkerPool::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(task);
+  }
+  Metrics::AddQueued(1);
+  task_ready_.notify_one();
+}
+
+void WorkerPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+}
+
+size_t WorkerPool::DefaultThreadCount() {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? cpus : 1;
+}
+
+void WorkerPool::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    task_ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+    if (tasks_.empty())
+      return;
+
+    std::function<void()> task = tasks_.front();
+    tasks_.pop_front();
+    ++running_;
+    lock.unlock();
+    Metrics::AddQueued(-1);
+    Metrics::AddBusy(1);
+    task();
+    Metrics::AddBusy(-1);
+    lock.lock();
+    --running_;
+    if (tasks_.empty() && running_ == 0)
+      idle_.notify_all();
+  }
+}
+
+}  // namespace relocation_packer
@@ -0,0 +1,55 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Fixed-size pool of worker threads running posted tasks in FIFO order.
+//
+// Tasks must not throw.  The destructor waits for all posted tasks to run.
+// Queue depth and worker activity are reported to Metrics.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_WORKER_POOL_H_
+#define TOOLS_RELOCATION_PACKER_SRC_WORKER_POOL_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace relocation_packer {
+
+class WorkerPool {
+ public:
+  // Start |threads| workers.  Zero selects one per online CPU.
+  explicit WorkerPool(size_t threads);
+  ~WorkerPool();
+
+  // Queue |task| to run on a worker thread.
+  void Post(std::function<void()> task);
+
+  // Block until every task posted so far has run.
+  void Wait();
+
+  // Number of worker threads.
+  size_t size() const { return threads_.size(); }
+
+  // Number of CPUs available to this process, at least one.
+  static size_t DefaultThreadCount();
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable task_ready_;
+  std::condition_variable idle_;
+  std::deque<std::function<void()> > tasks_;
+  size_t running_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_WORKER_POOL_H_
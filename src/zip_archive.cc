@@ -0,0 +1,542 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zip_archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "crc32.h"
+#include "debug.h"
+#include "elf_probe.h"
+#include "file_util.h"
+#include "unpack.h"
+#include "worker_pool.h"
+
+namespace relocation_packer {
+
+namespace {
+
+static const uint32_t kLocalHeaderSignature = 0x04034b50;
+static const uint32_t kCentralHeaderSignature = 0x02014b50;
+static const uint32_t kEndOfCentralDirectorySignature = 0x06054b50;
+static const uint32_t kZip64LocatorSignature = 0x07064b50;
+static const uint32_t kDataDescriptorSignature = 0x08074b50;
+
+static const size_t kLocalHeaderSize = 30;
+static const size_t kCentralHeaderSize = 46;
+static const size_t kEndOfCentralDirectorySize = 22;
+static const size_t kMaxCommentSize = 0xffff;
+
+// General purpose flag: sizes and CRC follow the data in a descriptor.
+static const uint16_t kDataDescriptorFlag = 1 << 3;
+
+// Extra field used by Android's zipalign to pad local headers.
+static const uint16_t kAlignmentExtraId = 0xd935;
+
+static const size_t kLibraryAlignment = 4096;
+static const size_t kStoredAlignment = 4;
+
+static const char kApkSigningBlockMagic[] = "APK Sig Block 42";
+
+uint16_t Get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t Get32(const uint8_t* p) {
+  return Get16(p) | (static_cast<uint32_t>(Get16(p + 2)) << 16);
+}
+
+void Put16(uint8_t* p, uint16_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+}
+
+void Put32(uint8_t* p, uint32_t value) {
+  Put16(p, value);
+  Put16(p + 2, value >> 16);
+}
+
+struct ZipEntry {
+  ZipEntry()
+      : central_offset(0), method(0), flags(0), crc(0),
+        compressed_size(0), uncompressed_size(0), local_offset(0),
+        data_offset(0), end_offset(0), convert(false),
+        converted(false), new_local_offset(0) {}
+
+  std::string name;
+
+  // Offset of this entry's record in the central directory buffer.
+  size_t central_offset;
+
+  // From the central directory.
+  uint16_t method;
+  uint16_t flags;
+  uint32_t crc;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+  uint32_t local_offset;
+
+  // Raw local header, including name and extra field, and the extent of
+  // the entry in the input, including any data descriptor.
+  std::vector<uint8_t> local_header;
+  uint64_t data_offset;
+  uint64_t end_offset;
+
+  // Conversion state and result.
+  bool convert;
+  bool converted;
+  std::vector<uint8_t> data;
+
+  // Assigned while writing.
+  uint64_t new_local_offset;
+};
+
+// True for lib/<abi>/<name>.so.
+bool IsLibraryName(const std::string& name) {
+  if (name.compare(0, 4, "lib/") != 0)
+    return false;
+  const size_t slash = name.find('/', 4);
+  if (slash == std::string::npos || slash == 4 ||
+      name.find('/', slash + 1) != std::string::npos) {
+    return false;
+  }
+  return name.size() > slash + 4 &&
+         name.compare(name.size() - 3, 3, ".so") == 0;
+}
+
+// Data alignment to preserve for |entry|, judged from its current offset.
+size_t EntryAlignment(const ZipEntry& entry) {
+  if (entry.method != 0)
+    return 1;
+  if (IsLibraryName(entry.name) && entry.data_offset % kLibraryAlignment == 0)
+    return kLibraryAlignment;
+  if (entry.data_offset % kStoredAlignment == 0)
+    return kStoredAlignment;
+  return 1;
+}
+
+// Build a local header for |entry| placed at |local_offset|, padding the
+// extra field so that data starts on |alignment|.  Existing alignment
+// records, and any trailing bytes that do not form a valid extra record
+// (old zipalign padding), are dropped first.  For converted entries the
+// CRC and sizes are filled in and the data descriptor flag is cleared.
+std::vector<uint8_t> BuildLocalHeader(const ZipEntry& entry,
+                                      uint64_t local_offset,
+                                      size_t alignment) {
+  const uint8_t* original = entry.local_header.data();
+  const size_t name_size = Get16(original + 26);
+  const size_t extra_size = Get16(original + 28);
+  const uint8_t* extra = original + kLocalHeaderSize + name_size;
+
+  std::vector<uint8_t> header(original,
+                              original + kLocalHeaderSize + name_size);
+  size_t offset = 0;
+  while (offset + 4 <= extra_size) {
+    const uint16_t id = Get16(extra + offset);
+    const size_t size = Get16(extra + offset + 2);
+    if (offset + 4 + size > extra_size)
+      break;
+    if (id != kAlignmentExtraId)
+      header.insert(header.end(), extra + offset, extra + offset + 4 + size);
+    offset += 4 + size;
+  }
+
+  const uint64_t data_offset = local_offset + header.size();
+  if (alignment > 1 && data_offset % alignment != 0) {
+    const size_t padding = (alignment - (data_offset + 6) % alignment) %
+                           alignment;
+    uint8_t record[6];
+    Put16(record, kAlignmentExtraId);
+    Put16(record + 2, 2 + padding);
+    Put16(record + 4, alignment);
+    header.insert(header.end(), record, record + sizeof(record));
+    header.resize(header.size() + padding, 0);
+  }
+  Put16(&header[28], header.size() - kLocalHeaderSize - name_size);
+
+  if (entry.converted) {
+    Put16(&header[6], Get16(&header[6]) & ~kDataDescriptorFlag);
+    Put32(&header[14], entry.crc);
+    Put32(&header[18], entry.compressed_size);
+    Put32(&header[22], entry.uncompressed_size);
+  }
+  return header;
+}
+
+class ZipConverter {
+ public:
+  ZipConverter(const std::string& path, const UnpackOptions& options,
+               size_t jobs)
+      : path_(path), options_(options), jobs_(jobs), fd_(-1),
+        file_size_(0), central_offset_(0), end_offset_(0) {}
+  ~ZipConverter() {
+    if (fd_ != -1)
+      close(fd_);
+  }
+
+  bool Run();
+
+ private:
+  bool ReadCentralDirectory();
+  bool ReadLocalHeaders();
+  bool ConvertEntries(size_t* converted);
+  bool WriteArchive(int out_fd);
+
+  std::string path_;
+  UnpackOptions options_;
+  size_t jobs_;
+  int fd_;
+  uint64_t file_size_;
+
+  std::vector<uint8_t> central_directory_;
+  uint64_t central_offset_;
+  std::vector<uint8_t> end_record_;
+  uint64_t end_offset_;
+
+  // Entries in local header order.
+  std::vector<ZipEntry> entries_;
+};
+
+bool ZipConverter::ReadCentralDirectory() {
+  struct stat status;
+  if (fstat(fd_, &status) != 0)
+    return false;
+  file_size_ = status.st_size;
+
+  // The end record is the last thing in the file, followed only by the
+  // archive comment.  Search backwards for it.
+  const size_t tail_size = std::min<uint64_t>(
+      file_size_, kEndOfCentralDirectorySize + kMaxCommentSize);
+  std::vector<uint8_t> tail(tail_size);
+  if (TEMP_FAILURE_RETRY(pread(fd_, tail.data(), tail_size,
+                               file_size_ - tail_size)) !=
+      static_cast<ssize_t>(tail_size)) {
+    return false;
+  }
+
+  size_t end = tail_size;
+  if (tail_size >= kEndOfCentralDirectorySize) {
+    for (size_t i = tail_size - kEndOfCentralDirectorySize + 1; i-- > 0; ) {
+      if (Get32(&tail[i]) == kEndOfCentralDirectorySignature &&
+          i + kEndOfCentralDirectorySize + Get16(&tail[i + 20]) ==
+              tail_size) {
+        end = i;
+        break;
+      }
+    }
+  }
+  if (end == tail_size) {
+    LOG(ERROR) << path_ << ": not a ZIP archive";
+    return false;
+  }
+
+  end_record_.assign(tail.begin() + end, tail.end());
+  end_offset_ = file_size_ - tail_size + end;
+  const uint8_t* record = end_record_.data();
+  if (Get16(record + 4) != 0 || Get16(record + 6) != 0 ||
+      Get16(record + 10) == 0xffff || Get32(record + 12) == 0xffffffff ||
+      Get32(record + 16) == 0xffffffff ||
+      (end >= 20 && Get32(&tail[end - 20]) == kZip64LocatorSignature)) {
+    LOG(ERROR) << path_ << ": multi-disk and ZIP64 archives are not supported";
+    return false;
+  }
+
+  const size_t count = Get16(record + 10);
+  const uint32_t central_size = Get32(record + 12);
+  central_offset_ = Get32(record + 16);
+  if (central_offset_ + central_size > end_offset_) {
+    LOG(ERROR) << path_ << ": invalid central directory";
+    return false;
+  }
+
+  central_directory_.resize(central_size);
+  if (central_size &&
+      TEMP_FAILURE_RETRY(pread(fd_, central_directory_.data(), central_size,
+                               central_offset_)) !=
+          static_cast<ssize_t>(central_size)) {
+    return false;
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t* header = &central_directory_[offset];
+    if (offset + kCentralHeaderSize > central_size ||
+        Get32(header) != kCentralHeaderSignature) {
+      LOG(ERROR) << path_ << ": invalid central directory";
+      return false;
+    }
+    const size_t name_size = Get16(header + 28);
+    const size_t record_size = kCentralHeaderSize + name_size +
+                               Get16(header + 30) + Get16(header + 32);
+    if (offset + record_size > central_size) {
+      LOG(ERROR) << path_ << ": invalid central directory";
+      return false;
+    }
+
+    ZipEntry entry;
+    entry.name.assign(reinterpret_cast<const char*>(header) +
+                      kCentralHeaderSize, name_size);
+    entry.central_offset = offset;
+    entry.flags = Get16(header + 8);
+    entry.method = Get16(header + 10);
+    entry.crc = Get32(header + 16);
+    entry.compressed_size = Get32(header + 20);
+    entry.uncompressed_size = Get32(header + 24);
+    entry.local_offset = Get32(header + 42);
+    entries_.push_back(entry);
+    offset += record_size;
+  }
+
+  std::sort(entries_.begin(), entries_.end(),
+            [](const ZipEntry& a, const ZipEntry& b) {
+              return a.local_offset < b.local_offset;
+            });
+  return true;
+}
+
+bool ZipConverter::ReadLocalHeaders() {
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    ZipEntry& entry = entries_[i];
+    uint8_t fixed[kLocalHeaderSize];
+    if (TEMP_FAILURE_RETRY(pread(fd_, fixed, sizeof(fixed),
+                                 entry.local_offset)) != sizeof(fixed) ||
+        Get32(fixed) != kLocalHeaderSignature) {
+      LOG(ERROR) << path_ << ": " << entry.name << ": invalid local header";
+      return false;
+    }
+
+    const size_t header_size =
+        kLocalHeaderSize + Get16(fixed + 26) + Get16(fixed + 28);
+    entry.local_header.resize(header_size);
+    if (TEMP_FAILURE_RETRY(pread(fd_, entry.local_header.data(), header_size,
+                                 entry.local_offset)) !=
+        static_cast<ssize_t>(header_size)) {
+      return false;
+    }
+    entry.data_offset = entry.local_offset + header_size;
+
+    entry.end_offset = entry.data_offset + entry.compressed_size;
+    if (Get16(fixed + 6) & kDataDescriptorFlag) {
+      // The descriptor signature is optional.
+      uint8_t signature[4];
+      entry.end_offset += 12;
+      if (TEMP_FAILURE_RETRY(pread(fd_, signature, 4,
+                                   entry.end_offset - 12)) == 4 &&
+          Get32(signature) == kDataDescriptorSignature) {
+        entry.end_offset += 4;
+      }
+    }
+
+    const uint64_t limit =
+        i + 1 < entries_.size() ? entries_[i + 1].local_offset
+                                : central_offset_;
+    if (entry.end_offset > limit) {
+      LOG(ERROR) << path_ << ": " << entry.name << ": overlapping entries";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ZipConverter::ConvertEntries(size_t* converted) {
+  WorkerPool pool(jobs_);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    ZipEntry& entry = entries_[i];
+    if (entry.method != 0 || !IsLibraryName(entry.name))
+      continue;
+
+    entry.data.resize(entry.compressed_size);
+    if (TEMP_FAILURE_RETRY(pread(fd_, entry.data.data(), entry.data.size(),
+                                 entry.data_offset)) !=
+        static_cast<ssize_t>(entry.data.size())) {
+      return false;
+    }
+
+    ElfProbe probe;
+    if (!ProbeElfImage(entry.data.data(), entry.data.size(), &probe) ||
+        !HasPackedRelocations(probe)) {
+      entry.data.clear();
+      continue;
+    }
+
+    entry.convert = true;
+    ZipEntry* target = &entry;
+    const std::string name = path_ + "!" + entry.name;
+    pool.Post([this, target, name] {
+      target->converted = UnpackImage(&target->data, name, options_);
+      if (target->converted) {
+        target->crc = Crc32(0, target->data.data(), target->data.size());
+        target->compressed_size = target->data.size();
+        target->uncompressed_size = target->data.size();
+      }
+    });
+  }
+  pool.Wait();
+
+  *converted = 0;
+  bool status = true;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (entries_[i].convert && !entries_[i].converted)
+      status = false;
+    if (entries_[i].converted)
+      ++*converted;
+  }
+  return status;
+}
+
+bool ZipConverter::WriteArchive(int out_fd) {
+  uint64_t in_offset = 0;
+  uint64_t out_offset = 0;
+
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    ZipEntry& entry = entries_[i];
+
+    // Copy anything between entries unchanged.
+    const uint64_t gap = entry.local_offset - in_offset;
+    if (gap && !CopyFileRange(fd_, in_offset, out_fd, out_offset, gap))
+      return false;
+    out_offset += gap;
+    entry.new_local_offset = out_offset;
+
+    const size_t alignment = EntryAlignment(entry);
+    const uint64_t shifted_data_offset =
+        entry.data_offset - entry.local_offset + out_offset;
+
+    if (!entry.converted && shifted_data_offset % alignment == 0) {
+      // Unchanged and still aligned: copy header, data and descriptor.
+      const uint64_t size = entry.end_offset - entry.local_offset;
+      if (!CopyFileRange(fd_, entry.local_offset, out_fd, out_offset, size))
+        return false;
+      out_offset += size;
+      in_offset = entry.end_offset;
+      continue;
+    }
+
+    const std::vector<uint8_t> header =
+        BuildLocalHeader(entry, out_offset, alignment);
+    if (!PwriteFully(out_fd, header.data(), header.size(), out_offset))
+      return false;
+    out_offset += header.size();
+    VLOG(1) << entry.name << ": local header rewritten at " << out_offset;
+
+    if (entry.converted) {
+      if (!PwriteFully(out_fd, entry.data.data(), entry.data.size(),
+                       out_offset)) {
+        return false;
+      }
+      out_offset += entry.data.size();
+    } else {
+      const uint64_t size = entry.end_offset - entry.data_offset;
+      if (!CopyFileRange(fd_, entry.data_offset, out_fd, out_offset, size))
+        return false;
+      out_offset += size;
+    }
+    in_offset = entry.end_offset;
+  }
+
+  // Copy whatever precedes the central directory, such as an APK signing
+  // block, unchanged.
+  const uint64_t gap = central_offset_ - in_offset;
+  if (gap >= sizeof(kApkSigningBlockMagic) - 1) {
+    char magic[sizeof(kApkSigningBlockMagic) - 1];
+    if (TEMP_FAILURE_RETRY(pread(fd_, magic, sizeof(magic),
+                                 central_offset_ - sizeof(magic))) ==
+            sizeof(magic) &&
+        memcmp(magic, kApkSigningBlockMagic, sizeof(magic)) == 0) {
+      LOG(WARNING) << path_ << ": APK signature is now invalid, re-sign";
+    }
+  }
+  if (gap && !CopyFileRange(fd_, in_offset, out_fd, out_offset, gap))
+    return false;
+  out_offset += gap;
+
+  // Rewrite the central directory with new offsets, and new flags, CRC and
+  // sizes for converted entries.
+  std::vector<uint8_t> central_directory = central_directory_;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    const ZipEntry& entry = entries_[i];
+    uint8_t* header = &central_directory[entry.central_offset];
+    Put32(header + 42, entry.new_local_offset);
+    if (entry.converted) {
+      Put16(header + 8, entry.flags & ~kDataDescriptorFlag);
+      Put32(header + 16, entry.crc);
+      Put32(header + 20, entry.compressed_size);
+      Put32(header + 24, entry.uncompressed_size);
+    }
+    if (entry.new_local_offset > 0xffffffff) {
+      LOG(ERROR) << path_ << ": archive would need ZIP64";
+      return false;
+    }
+  }
+
+  std::vector<uint8_t> end_record = end_record_;
+  Put32(&end_record[16], out_offset);
+  return PwriteFully(out_fd, central_directory.data(),
+                     central_directory.size(), out_offset) &&
+         PwriteFully(out_fd, end_record.data(), end_record.size(),
+                     out_offset + central_directory.size());
+}
+
+bool ZipConverter::Run() {
+  fd_ = open(path_.c_str(), O_RDONLY);
+  if (fd_ == -1) {
+    LOG(ERROR) << path_ << ": " << strerror(errno);
+    return false;
+  }
+
+  if (!ReadCentralDirectory() || !ReadLocalHeaders())
+    return false;
+
+  size_t converted = 0;
+  const bool status = ConvertEntries(&converted);
+  LOG(INFO) << "Entries          : " << entries_.size();
+  LOG(INFO) << "Converted        : " << converted;
+  if (!status) {
+    LOG(ERROR) << path_ << ": some libraries failed to convert";
+    return false;
+  }
+  if (converted == 0)
+    return true;
+
+  // Write alongside the archive and rename over it, so that a failure
+  // leaves the original intact.
+  std::string temporary = path_ + ".XXXXXX";
+  const int out_fd = mkstemp(&temporary[0]);
+  if (out_fd == -1) {
+    LOG(ERROR) << path_ << ": " << strerror(errno);
+    return false;
+  }
+
+  struct stat status_buffer;
+  bool written = fstat(fd_, &status_buffer) == 0 &&
+                 fchmod(out_fd, status_buffer.st_mode & 07777) == 0 &&
+                 WriteArchive(out_fd) && fsync(out_fd) == 0;
+  written = close(out_fd) == 0 && written;
+  if (!written || rename(temporary.c_str(), path_.c_str()) != 0) {
+    LOG(ERROR) << path_ << ": failed to write archive: " << strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool UnpackZipArchive(const std::string& path,
+                      const UnpackOptions& options,
+                      size_t jobs) {
+  ZipConverter converter(path, options, jobs);
+  return converter.Run();
+}
+
+}  // namespace relocation_packer
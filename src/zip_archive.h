@@ -0,0 +1,42 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Conversion of shared libraries stored inside ZIP and APK archives.
+//
+// Locates stored (uncompressed) lib/<abi>/<name>.so entries through the
+// central directory and converts those with SHT_RELR relocations in memory.
+// The archive is then rewritten around them: unchanged entries are copied
+// in the kernel with copy_file_range, only the local headers of converted
+// entries and of entries whose alignment the shift would break are
+// regenerated, and the central directory is rewritten with new offsets,
+// sizes and CRC-32 values.  Stored entries keep their data alignment (page
+// alignment for libraries, as zipalign -p produces, else four bytes) using
+// an Android alignment extra field.  The result replaces the archive
+// atomically.
+//
+// Compressed libraries are left alone.  ZIP64 archives are not supported.
+// Converting entries invalidates any APK signature, so the archive must be
+// re-signed afterwards.
+
+#ifndef TOOLS_RELOCATION_PACKER_SRC_ZIP_ARCHIVE_H_
+#define TOOLS_RELOCATION_PACKER_SRC_ZIP_ARCHIVE_H_
+
+#include <stddef.h>
+#include <string>
+
+#include "unpack.h"
+
+namespace relocation_packer {
+
+// Convert stored libraries in the archive at |path|.  Returns false if the
+// archive is invalid or unsupported, on I/O error, or if any library failed
+// to convert; the archive is unchanged on failure.
+// |jobs| is the number of conversion threads, zero for one per CPU.
+bool UnpackZipArchive(const std::string& path,
+                      const UnpackOptions& options,
+                      size_t jobs);
+
+}  // namespace relocation_packer
+
+#endif  // TOOLS_RELOCATION_PACKER_SRC_ZIP_ARCHIVE_H_
@@ -0,0 +1,114 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "zip_archive.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "debug.h"
+#include "elf.h"
+#include "file_util.h"
+#include "unpack.h"
+#include "gtest/gtest.h"
+
+namespace relocation_packer {
+
+namespace {
+
+const char kLibrarySource[] =
+    "static int a, b, c;\n"
+    "int *pointers[] = {&a, &b, &c, &a, &b, &c, &a, &b};\n";
+
+const char kText[] = "Not a library, and compressed to show it is copied.\n";
+
+class ZipArchiveTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_NE(EV_NONE, elf_version(EV_CURRENT));
+    Logger::SetStreams(&log_, &log_);
+    char directory[] = "/tmp/zip_archive_unittest.XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory) != NULL);
+    directory_ = directory;
+  }
+
+  void TearDown() override {
+    const std::string command = "rm -rf " + directory_;
+    EXPECT_EQ(0, system(command.c_str()));
+    Logger::Reset();
+  }
+
+  // Run |command| in the test directory, quietly.  Returns true if it
+  // exits with status zero.
+  bool Run(const std::string& command) {
+    const std::string quiet =
+        "cd " + directory_ + " && " + command + " > /dev/null 2>&1";
+    return system(quiet.c_str()) == 0;
+  }
+
+  bool WriteFile(const std::string& name, const void* data, size_t size) {
+    const std::string path = directory_ + "/" + name;
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+      return false;
+    const bool status = WriteFully(fd, data, size);
+    return close(fd) == 0 && status;
+  }
+
+  bool ReadFile(const std::string& name, std::vector<uint8_t>* data) {
+    const std::string path = directory_ + "/" + name;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    const bool status = ReadWholeFile(fd, data);
+    close(fd);
+    return status;
+  }
+
+  std::ostringstream log_;
+  std::string directory_;
+};
+
+}  // namespace
+
+TEST_F(ZipArchiveTest, RewritesStoredLibraryIntoValidArchive) {
+  if (!WriteFile("library.c", kLibrarySource, strlen(kLibrarySource)) ||
+      !Run("mkdir -p lib/abi && cc -shared -fPIC "
+           "-Wl,-z,pack-relative-relocs -o lib/abi/libtest.so library.c")) {
+    GTEST_SKIP() << "no compiler with -z pack-relative-relocs";
+  }
+  ASSERT_TRUE(WriteFile("notes.txt", kText, strlen(kText)));
+  if (!Run("zip -q -0 test.zip lib/abi/libtest.so && "
+           "zip -q -9 test.zip notes.txt")) {
+    GTEST_SKIP() << "no zip";
+  }
+  std::vector<uint8_t> library;
+  ASSERT_TRUE(ReadFile("lib/abi/libtest.so", &library));
+  std::vector<uint8_t> expected(library);
+  ASSERT_TRUE(UnpackImage(&expected, "libtest.so", UnpackOptions()))
+      << log_.str();
+  ASSERT_NE(library, expected);
+
+  ASSERT_TRUE(UnpackZipArchive(directory_ + "/test.zip", UnpackOptions(), 1))
+      << log_.str();
+
+  // unzip checks every CRC-32 and size against the central directory.
+  if (!Run("unzip -v > /dev/null"))
+    GTEST_SKIP() << "no unzip";
+  EXPECT_TRUE(Run("unzip -tq test.zip"));
+  ASSERT_TRUE(Run("mkdir out && cd out && unzip -q ../test.zip"));
+  std::vector<uint8_t> converted;
+  ASSERT_TRUE(ReadFile("out/lib/abi/libtest.so", &converted));
+  EXPECT_TRUE(converted == expected);
+  std::vector<uint8_t> text;
+  ASSERT_TRUE(ReadFile("out/notes.txt", &text));
+  EXPECT_EQ(std::string(kText), std::string(text.begin(), text.end()));
+}
+
+}  // namespace relocation_packer